@@ -0,0 +1,70 @@
+#include "analog.h"
+
+#include <string.h>
+
+
+//axis units per raw count between the deadzone edge and the end of travel
+static uint32_t analog_scale(int span) {
+    if (span <= 0)
+        return 0;
+    return (((uint32_t) ANALOG_AXIS_MAX << ANALOG_SCALE_SHIFT) + span - 1) / span; //full travel reaches the end
+}
+
+void analog_axis_init(AnalogAxis_t *axis, const AnalogCalibration_t *calibration, uint8_t shift) {
+    memset(axis, 0, sizeof(AnalogAxis_t));
+    axis->shift = shift;
+    analog_axis_calibrate(axis, calibration);
+}
+
+/*The divisions are done here once, the per report path only multiplies*/
+void analog_axis_calibrate(AnalogAxis_t *axis, const AnalogCalibration_t *calibration) {
+    axis->calibration = *calibration;
+    axis->scale_low = analog_scale(calibration->center - calibration->deadzone - calibration->min);
+    axis->scale_high = analog_scale(calibration->max - calibration->center - calibration->deadzone);
+}
+
+void analog_axis_filter(AnalogAxis_t *axis, const uint16_t *samples, size_t count) {
+    uint32_t state = axis->state;
+    uint8_t shift = axis->shift;
+
+    if (!count)
+        return;
+
+    //start from the first sample instead of ramping up from 0
+    if (!axis->primed) {
+        state = (uint32_t) samples[0] << ANALOG_FRACTION;
+        axis->primed = true;
+    }
+
+    //single pole IIR: state += (sample - state) / 2^shift
+    for (size_t i = 0; i < count; i++) {
+        int32_t error = (int32_t) ((uint32_t) samples[i] << ANALOG_FRACTION) - (int32_t) state;
+        state += error >> shift;
+    }
+
+    axis->state = state;
+    axis->samples += count;
+}
+
+uint16_t analog_axis_raw(const AnalogAxis_t *axis) {
+    return (axis->state + (1 << (ANALOG_FRACTION - 1))) >> ANALOG_FRACTION;
+}
+
+int16_t analog_axis_value(const AnalogAxis_t *axis) {
+    const AnalogCalibration_t *calibration = &axis->calibration;
+    int32_t offset = (int32_t) analog_axis_raw(axis) - calibration->center;
+    int32_t value;
+
+    if (offset > calibration->deadzone)
+        value = ((uint64_t) (offset - calibration->deadzone) * axis->scale_high) >> ANALOG_SCALE_SHIFT;
+    else if (offset < -calibration->deadzone)
+        value = -(int32_t) (((uint64_t) (-offset - calibration->deadzone) * axis->scale_low) >> ANALOG_SCALE_SHIFT);
+    else
+        return 0;
+
+    if (value > ANALOG_AXIS_MAX)
+        return ANALOG_AXIS_MAX;
+    if (value < -ANALOG_AXIS_MAX)
+        return -ANALOG_AXIS_MAX;
+    return value;
+}
@@ -0,0 +1,38 @@
+
+
+#ifndef ANALOG_H_
+#define ANALOG_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*Conditioning of one analog axis: fixed point low-pass filter, then
+calibration and deadzone to a signed axis value. No platform code here, the
+filter runs the same on the host against recorded sample streams*/
+
+#define ANALOG_FRACTION 8 //fractional bits of the filter state
+#define ANALOG_SCALE_SHIFT 16
+#define ANALOG_AXIS_MAX 2047 //matches the 12 bit gamepad axes
+
+typedef struct {
+    uint16_t min, center, max; //raw counts
+    uint16_t deadzone; //raw counts each side of the center reported as 0
+} AnalogCalibration_t;
+
+typedef struct {
+    AnalogCalibration_t calibration;
+    uint8_t shift; //filter time constant, each sample moves 1/2^shift of the way
+    bool primed;
+    uint32_t state; //raw << ANALOG_FRACTION
+    uint32_t scale_low, scale_high; //axis units per raw count << ANALOG_SCALE_SHIFT
+    uint32_t samples;
+} AnalogAxis_t;
+
+void analog_axis_init(AnalogAxis_t *axis, const AnalogCalibration_t *calibration, uint8_t shift);
+void analog_axis_calibrate(AnalogAxis_t *axis, const AnalogCalibration_t *calibration);
+void analog_axis_filter(AnalogAxis_t *axis, const uint16_t *samples, size_t count);
+uint16_t analog_axis_raw(const AnalogAxis_t *axis); //filtered, in raw counts
+int16_t analog_axis_value(const AnalogAxis_t *axis); //-ANALOG_AXIS_MAX..ANALOG_AXIS_MAX
+
+#endif
@@ -0,0 +1,100 @@
+#include "analog_adc.h"
+#include "util.h"
+
+#include <string.h>
+
+#define DEBUG_CNTX "analog-adc"
+
+#define ANALOG_SAMPLES (ANALOG_FRAME_SIZE / SOC_ADC_DIGI_RESULT_BYTES)
+
+
+static bool analog_pool_overflow(adc_continuous_handle_t handle, const adc_continuous_evt_data_t *data, void *context) {
+    AnalogInput_t *input = context;
+    input->overflows++;
+    return false;
+}
+
+int analog_input_init(AnalogInput_t *input, const adc_channel_t *channels, uint8_t count, const AnalogCalibration_t *calibration, uint8_t shift, uint32_t sample_hz) {
+    adc_digi_pattern_config_t pattern[ANALOG_CHANNELS] = {0};
+    adc_continuous_handle_cfg_t handle_config = {
+        .max_store_buf_size = ANALOG_POOL_SIZE,
+        .conv_frame_size = ANALOG_FRAME_SIZE,
+    };
+    adc_continuous_config_t config = {
+        .pattern_num = count,
+        .adc_pattern = pattern,
+        .sample_freq_hz = sample_hz,
+        .conv_mode = ADC_CONV_SINGLE_UNIT_1,
+        .format = ADC_DIGI_OUTPUT_FORMAT_TYPE1,
+    };
+    adc_continuous_evt_cbs_t callbacks = {
+        .on_pool_ovf = analog_pool_overflow,
+    };
+
+    ASSERT(count > 0 && count <= ANALOG_CHANNELS);
+    memset(input, 0, sizeof(AnalogInput_t));
+    input->channels = count;
+
+    for (int i = 0; i < count; i++) {
+        input->channel[i] = channels[i];
+        analog_axis_init(&input->axes[i], &calibration[i], shift);
+        pattern[i] = (adc_digi_pattern_config_t){
+            .atten = ADC_ATTEN_DB_11,
+            .channel = channels[i],
+            .unit = ADC_UNIT_1,
+            .bit_width = SOC_ADC_DIGI_MAX_BITWIDTH,
+        };
+    }
+
+    if (adc_continuous_new_handle(&handle_config, &input->handle) != ESP_OK) {
+        DEBUG("Failed to create the ADC handle");
+        return -1;
+    }
+    if (adc_continuous_config(input->handle, &config) != ESP_OK ||
+        adc_continuous_register_event_callbacks(input->handle, &callbacks, input) != ESP_OK ||
+        adc_continuous_start(input->handle) != ESP_OK) {
+        DEBUG("Failed to start the ADC");
+        adc_continuous_deinit(input->handle);
+        return -1;
+    }
+
+    DEBUG("Sampling %u channels at %u Hz", count, (unsigned) sample_hz);
+    return 0;
+}
+
+/*Takes whatever frames are ready, samples are split by channel so each
+filter runs over a contiguous run*/
+void analog_input_service(AnalogInput_t *input) {
+    uint8_t frame[ANALOG_FRAME_SIZE];
+    uint16_t samples[ANALOG_CHANNELS][ANALOG_SAMPLES];
+    uint16_t used[ANALOG_CHANNELS];
+    uint32_t length;
+
+    while (adc_continuous_read(input->handle, frame, sizeof(frame), &length, 0) == ESP_OK) {
+        memset(used, 0, sizeof(used));
+
+        for (uint32_t i = 0; i + SOC_ADC_DIGI_RESULT_BYTES <= length; i += SOC_ADC_DIGI_RESULT_BYTES) {
+            adc_digi_output_data_t *result = (adc_digi_output_data_t *) &frame[i];
+            int axis = 0;
+
+            while (axis < input->channels && input->channel[axis] != result->type1.channel)
+                axis++;
+            if (axis == input->channels) {
+                input->foreign++;
+                continue;
+            }
+            samples[axis][used[axis]++] = result->type1.data;
+        }
+
+        for (int i = 0; i < input->channels; i++)
+            analog_axis_filter(&input->axes[i], samples[i], used[i]);
+        input->frames++;
+    }
+}
+
+void analog_input_print_stats(AnalogInput_t *input) {
+    DEBUG("%u frames, %u overflows, %u foreign results", (unsigned) input->frames, (unsigned) input->overflows, (unsigned) input->foreign);
+    for (int i = 0; i < input->channels; i++)
+        DEBUG("Channel %i: %u samples, raw %u, axis %i", input->channel[i], (unsigned) input->axes[i].samples,
+              analog_axis_raw(&input->axes[i]), analog_axis_value(&input->axes[i]));
+}
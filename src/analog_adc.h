@@ -0,0 +1,33 @@
+
+
+#ifndef ANALOG_ADC_H_
+#define ANALOG_ADC_H_
+
+#include <stdint.h>
+
+#include "esp_adc/adc_continuous.h"
+#include "analog.h"
+
+#define ANALOG_CHANNELS 4
+#define ANALOG_FRAME_SIZE 256 //bytes per DMA conversion frame
+#define ANALOG_POOL_SIZE 1024 //driver ring the DMA frames land in
+
+/*ADC1 channels sampled back to back by the DMA driven continuous mode, the
+task drains the driver ring without blocking and feeds each axis filter*/
+typedef struct {
+    adc_continuous_handle_t handle;
+    uint8_t channels;
+    adc_channel_t channel[ANALOG_CHANNELS];
+    AnalogAxis_t axes[ANALOG_CHANNELS];
+
+    uint32_t frames;
+    uint32_t overflows; //driver ring full, oldest frames lost
+    uint32_t foreign; //results from channels not in the list
+} AnalogInput_t;
+
+/*sample_hz is the total conversion rate, split between the channels*/
+int analog_input_init(AnalogInput_t *input, const adc_channel_t *channels, uint8_t count, const AnalogCalibration_t *calibration, uint8_t shift, uint32_t sample_hz);
+void analog_input_service(AnalogInput_t *input);
+void analog_input_print_stats(AnalogInput_t *input);
+
+#endif
@@ -0,0 +1,52 @@
+#include "dfu_ota.h"
+#include "util.h"
+
+#define DEBUG_CNTX "dfu-ota"
+
+
+static int dfu_ota_begin(void *context) {
+    DFUOta_t *ota = context;
+
+    //a download started over drops the previous attempt
+    if (ota->open)
+        esp_ota_abort(ota->handle);
+    ota->open = false;
+
+    ota->partition = esp_ota_get_next_update_partition(NULL);
+    if (!ota->partition) {
+        DEBUG("No update partition");
+        return -1;
+    }
+    //erased block by block as the image is written, no long erase up front while the host polls
+    if (esp_ota_begin(ota->partition, OTA_WITH_SEQUENTIAL_WRITES, &ota->handle) != ESP_OK)
+        return -1;
+    ota->open = true;
+    DEBUG("Writing image to %s", ota->partition->label);
+    return 0;
+}
+
+static int dfu_ota_write(void *context, uint32_t offset, const uint8_t *data, size_t length) {
+    DFUOta_t *ota = context;
+
+    if (!ota->open)
+        return -1;
+    return esp_ota_write(ota->handle, data, length) == ESP_OK ? 0 : -1;
+}
+
+static int dfu_ota_end(void *context) {
+    DFUOta_t *ota = context;
+
+    if (!ota->open)
+        return -1;
+    ota->open = false;
+    //validates the image before it can be selected
+    if (esp_ota_end(ota->handle) != ESP_OK)
+        return -1;
+    return esp_ota_set_boot_partition(ota->partition) == ESP_OK ? 0 : -1;
+}
+
+const DFUFlashOps_t dfu_ota_ops = {
+    .begin = dfu_ota_begin,
+    .write = dfu_ota_write,
+    .end = dfu_ota_end,
+};
@@ -0,0 +1,18 @@
+
+
+#ifndef DFU_OTA_H_
+#define DFU_OTA_H_
+
+#include "esp_ota_ops.h"
+#include "usb_dfu.h"
+
+/*DFU image storage on the next OTA app partition*/
+typedef struct {
+    const esp_partition_t *partition;
+    esp_ota_handle_t handle;
+    bool open;
+} DFUOta_t;
+
+extern const DFUFlashOps_t dfu_ota_ops;
+
+#endif
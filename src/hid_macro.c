@@ -0,0 +1,219 @@
+#include "hid_macro.h"
+#include "usb_port.h"
+#include "util.h"
+
+#include <string.h>
+
+#define DEBUG_CNTX "hid-macro"
+
+const HIDLayout_t g_hid_layout_us = {
+    .name = "us",
+    .ascii = {
+        ['\b'] = {0x2a, 0},
+        ['\t'] = {0x2b, 0},
+        ['\n'] = {0x28, 0},
+        [0x1b] = {0x29, 0},
+        [' '] = {0x2c, 0},
+        ['!'] = {0x1e, kHIDModLeftShift},
+        ['"'] = {0x34, kHIDModLeftShift},
+        ['#'] = {0x20, kHIDModLeftShift},
+        ['$'] = {0x21, kHIDModLeftShift},
+        ['%'] = {0x22, kHIDModLeftShift},
+        ['&'] = {0x24, kHIDModLeftShift},
+        ['\''] = {0x34, 0},
+        ['('] = {0x26, kHIDModLeftShift},
+        [')'] = {0x27, kHIDModLeftShift},
+        ['*'] = {0x25, kHIDModLeftShift},
+        ['+'] = {0x2e, kHIDModLeftShift},
+        [','] = {0x36, 0},
+        ['-'] = {0x2d, 0},
+        ['.'] = {0x37, 0},
+        ['/'] = {0x38, 0},
+        ['0'] = {0x27, 0},
+        ['1'] = {0x1e, 0},
+        ['2'] = {0x1f, 0},
+        ['3'] = {0x20, 0},
+        ['4'] = {0x21, 0},
+        ['5'] = {0x22, 0},
+        ['6'] = {0x23, 0},
+        ['7'] = {0x24, 0},
+        ['8'] = {0x25, 0},
+        ['9'] = {0x26, 0},
+        [':'] = {0x33, kHIDModLeftShift},
+        [';'] = {0x33, 0},
+        ['<'] = {0x36, kHIDModLeftShift},
+        ['='] = {0x2e, 0},
+        ['>'] = {0x37, kHIDModLeftShift},
+        ['?'] = {0x38, kHIDModLeftShift},
+        ['@'] = {0x1f, kHIDModLeftShift},
+        ['A'] = {0x04, kHIDModLeftShift},
+        ['B'] = {0x05, kHIDModLeftShift},
+        ['C'] = {0x06, kHIDModLeftShift},
+        ['D'] = {0x07, kHIDModLeftShift},
+        ['E'] = {0x08, kHIDModLeftShift},
+        ['F'] = {0x09, kHIDModLeftShift},
+        ['G'] = {0x0a, kHIDModLeftShift},
+        ['H'] = {0x0b, kHIDModLeftShift},
+        ['I'] = {0x0c, kHIDModLeftShift},
+        ['J'] = {0x0d, kHIDModLeftShift},
+        ['K'] = {0x0e, kHIDModLeftShift},
+        ['L'] = {0x0f, kHIDModLeftShift},
+        ['M'] = {0x10, kHIDModLeftShift},
+        ['N'] = {0x11, kHIDModLeftShift},
+        ['O'] = {0x12, kHIDModLeftShift},
+        ['P'] = {0x13, kHIDModLeftShift},
+        ['Q'] = {0x14, kHIDModLeftShift},
+        ['R'] = {0x15, kHIDModLeftShift},
+        ['S'] = {0x16, kHIDModLeftShift},
+        ['T'] = {0x17, kHIDModLeftShift},
+        ['U'] = {0x18, kHIDModLeftShift},
+        ['V'] = {0x19, kHIDModLeftShift},
+        ['W'] = {0x1a, kHIDModLeftShift},
+        ['X'] = {0x1b, kHIDModLeftShift},
+        ['Y'] = {0x1c, kHIDModLeftShift},
+        ['Z'] = {0x1d, kHIDModLeftShift},
+        ['['] = {0x2f, 0},
+        ['\\'] = {0x31, 0},
+        [']'] = {0x30, 0},
+        ['^'] = {0x23, kHIDModLeftShift},
+        ['_'] = {0x2d, kHIDModLeftShift},
+        ['`'] = {0x35, 0},
+        ['a'] = {0x04, 0},
+        ['b'] = {0x05, 0},
+        ['c'] = {0x06, 0},
+        ['d'] = {0x07, 0},
+        ['e'] = {0x08, 0},
+        ['f'] = {0x09, 0},
+        ['g'] = {0x0a, 0},
+        ['h'] = {0x0b, 0},
+        ['i'] = {0x0c, 0},
+        ['j'] = {0x0d, 0},
+        ['k'] = {0x0e, 0},
+        ['l'] = {0x0f, 0},
+        ['m'] = {0x10, 0},
+        ['n'] = {0x11, 0},
+        ['o'] = {0x12, 0},
+        ['p'] = {0x13, 0},
+        ['q'] = {0x14, 0},
+        ['r'] = {0x15, 0},
+        ['s'] = {0x16, 0},
+        ['t'] = {0x17, 0},
+        ['u'] = {0x18, 0},
+        ['v'] = {0x19, 0},
+        ['w'] = {0x1a, 0},
+        ['x'] = {0x1b, 0},
+        ['y'] = {0x1c, 0},
+        ['z'] = {0x1d, 0},
+        ['{'] = {0x2f, kHIDModLeftShift},
+        ['|'] = {0x31, kHIDModLeftShift},
+        ['}'] = {0x30, kHIDModLeftShift},
+        ['~'] = {0x35, kHIDModLeftShift},
+    }
+};
+
+
+void hid_macro_init(HIDMacro_t *macro, const HIDLayout_t *layout) {
+    memset(macro, 0, sizeof(HIDMacro_t));
+    macro->layout = layout;
+}
+
+bool hid_macro_busy(HIDMacro_t *macro) {
+    return macro->position < macro->length || macro->pressed.usage;
+}
+
+static void hid_macro_start(HIDMacro_t *macro, const char *text, const HIDKey_t *keys, size_t length) {
+    macro->text = text;
+    macro->keys = keys;
+    macro->length = length;
+    macro->position = 0;
+    macro->reports = 0;
+    macro->start = usb_port_time_us();
+}
+
+int hid_macro_type_string(HIDMacro_t *macro, const char *text) {
+    size_t length = strlen(text);
+
+    if (hid_macro_busy(macro))
+        return -1;
+
+    for (size_t i = 0; i < length; i++) {
+        if ((text[i] & 0x80) || !macro->layout->ascii[(uint8_t) text[i]].usage) {
+            DEBUG("Character 0x%02x is not in the %s layout", (uint8_t) text[i], macro->layout->name);
+            return -1;
+        }
+    }
+
+    hid_macro_start(macro, text, NULL, length);
+    return 0;
+}
+
+int hid_macro_type_keys(HIDMacro_t *macro, const HIDKey_t *keys, size_t count) {
+    if (hid_macro_busy(macro))
+        return -1;
+
+    for (size_t i = 0; i < count; i++) {
+        if (!keys[i].usage) {
+            DEBUG("Key %u has no usage", (unsigned) i);
+            return -1;
+        }
+    }
+
+    hid_macro_start(macro, NULL, keys, count);
+    return 0;
+}
+
+static HIDKey_t hid_macro_key(HIDMacro_t *macro) {
+    if (macro->text)
+        return macro->layout->ascii[(uint8_t) macro->text[macro->position]];
+    return macro->keys[macro->position];
+}
+
+/*A different key can replace the held one in the same report, saving the
+release. The host only sees a new keystroke when a usage appears, so repeated
+keys need a release in between, and a modifier change gets one too so the
+host never applies it to the previous key*/
+static bool hid_macro_needs_release(HIDMacro_t *macro) {
+    HIDKey_t next;
+
+    if (!macro->pressed.usage)
+        return false;
+    if (macro->position >= macro->length)
+        return true;
+
+    next = hid_macro_key(macro);
+    return next.usage == macro->pressed.usage || next.modifier != macro->pressed.modifier;
+}
+
+bool hid_macro_peek(HIDMacro_t *macro, HIDKey_t *report) {
+    if (!hid_macro_busy(macro))
+        return false;
+
+    if (hid_macro_needs_release(macro))
+        *report = (HIDKey_t) {0, 0};
+    else
+        *report = hid_macro_key(macro);
+    return true;
+}
+
+void hid_macro_advance(HIDMacro_t *macro) {
+    uint64_t elapsed;
+
+    if (!hid_macro_busy(macro))
+        return;
+
+    macro->reports++;
+    if (hid_macro_needs_release(macro)) {
+        macro->pressed = (HIDKey_t) {0, 0};
+    } else {
+        macro->pressed = hid_macro_key(macro);
+        macro->position++;
+    }
+
+    if (hid_macro_busy(macro))
+        return;
+
+    elapsed = usb_port_time_us() - macro->start;
+    macro->chars_per_second = elapsed ? macro->length * 1000000ULL / elapsed : 0;
+    DEBUG("Typed %u chars in %u us with %u reports, %u chars/s", (unsigned) macro->length, (unsigned) elapsed,
+          (unsigned) macro->reports, (unsigned) macro->chars_per_second);
+}
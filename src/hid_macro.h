@@ -0,0 +1,60 @@
+
+
+#ifndef HID_MACRO_H_
+#define HID_MACRO_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+/*Keyboard report modifier bits*/
+enum {
+    kHIDModLeftCtrl = 0x01,
+    kHIDModLeftShift = 0x02,
+    kHIDModLeftAlt = 0x04,
+    kHIDModLeftGUI = 0x08,
+    kHIDModRightCtrl = 0x10,
+    kHIDModRightShift = 0x20,
+    kHIDModRightAlt = 0x40,
+    kHIDModRightGUI = 0x80
+};
+
+typedef struct {
+    uint8_t usage; //keyboard page usage, 0 if the character can't be typed
+    uint8_t modifier;
+} HIDKey_t;
+
+/*Host keyboard layout, indexed by 7 bit ascii*/
+typedef struct {
+    const char *name;
+    HIDKey_t ascii[128];
+} HIDLayout_t;
+
+extern const HIDLayout_t g_hid_layout_us;
+
+/*Types a string or a key sequence one report at a time. The caller asks for
+the next report with hid_macro_peek and only calls hid_macro_advance once the
+fpga accepted it, so a busy endpoint just retries the same report*/
+typedef struct {
+    const HIDLayout_t *layout;
+    const char *text;
+    const HIDKey_t *keys;
+    size_t length;
+    size_t position;
+    HIDKey_t pressed; //key held by the last report sent, usage 0 if released
+    uint32_t reports;
+    uint64_t start; //us
+    uint32_t chars_per_second; //throughput of the last finished macro
+} HIDMacro_t;
+
+void hid_macro_init(HIDMacro_t *macro, const HIDLayout_t *layout);
+/*Both return -1 if a macro is already running, the text has characters
+missing from the layout or a key has no usage. Each key is a tap, buffers
+must stay valid until the macro is done*/
+int hid_macro_type_string(HIDMacro_t *macro, const char *text);
+int hid_macro_type_keys(HIDMacro_t *macro, const HIDKey_t *keys, size_t count);
+bool hid_macro_busy(HIDMacro_t *macro);
+bool hid_macro_peek(HIDMacro_t *macro, HIDKey_t *report);
+void hid_macro_advance(HIDMacro_t *macro);
+
+#endif
@@ -0,0 +1,122 @@
+/*Generated by tools/hidgen.py from hid_reports.spec, do not edit*/
+
+#include "hid_reports.h"
+
+const uint8_t hid_report_descriptor[HID_REPORT_DESCRIPTOR_SIZE] = {
+    0x05, 0x01,                    // USAGE_PAGE (1)
+    0x09, 0x06,                    // USAGE (0x06)
+    0xa1, 0x01,                    // COLLECTION (Application)
+    0x85, 0x01,                    // REPORT_ID (1)
+    0x05, 0x07,                    // USAGE_PAGE (7)
+    0x15, 0x00,                    // LOGICAL_MINIMUM (0)
+    0x25, 0x01,                    // LOGICAL_MAXIMUM (1)
+    0x75, 0x01,                    // REPORT_SIZE (1)
+    0x95, 0x08,                    // REPORT_COUNT (8)
+    0x19, 0xe0,                    //   USAGE_MINIMUM (0xe0)
+    0x29, 0xe7,                    //   USAGE_MAXIMUM (0xe7)
+    0x81, 0x02,                    // INPUT (0x02) modifier
+    0x26, 0xff, 0x00,              // LOGICAL_MAXIMUM (255)
+    0x75, 0x08,                    // REPORT_SIZE (8)
+    0x95, 0x06,                    // REPORT_COUNT (6)
+    0x19, 0x00,                    //   USAGE_MINIMUM (0x00)
+    0x29, 0xff,                    //   USAGE_MAXIMUM (0xff)
+    0x81, 0x00,                    // INPUT (0x00) keycode
+    0xc0,                          // END_COLLECTION
+#if HID_GAMEPAD
+    0x05, 0x01,                    // USAGE_PAGE (1)
+    0x09, 0x05,                    // USAGE (0x05)
+    0xa1, 0x01,                    // COLLECTION (Application)
+    0x85, 0x02,                    // REPORT_ID (2)
+    0x16, 0x01, 0xf8,              // LOGICAL_MINIMUM (-2047)
+    0x26, 0xff, 0x07,              // LOGICAL_MAXIMUM (2047)
+    0x75, 0x0c,                    // REPORT_SIZE (12)
+    0x95, 0x04,                    // REPORT_COUNT (4)
+    0x09, 0x30,                    //   USAGE (0x30) axis
+    0x09, 0x31,                    //   USAGE (0x31) axis
+    0x09, 0x32,                    //   USAGE (0x32) axis
+    0x09, 0x35,                    //   USAGE (0x35) axis
+    0x81, 0x02,                    // INPUT (0x02) axis
+    0xc0,                          // END_COLLECTION
+#endif
+#if HID_MOUSE
+    0x05, 0x01,                    // USAGE_PAGE (1)
+    0x09, 0x02,                    // USAGE (0x02)
+    0xa1, 0x01,                    // COLLECTION (Application)
+    0x85, 0x03,                    // REPORT_ID (3)
+    0x05, 0x09,                    // USAGE_PAGE (9)
+    0x15, 0x00,                    // LOGICAL_MINIMUM (0)
+    0x25, 0x01,                    // LOGICAL_MAXIMUM (1)
+    0x75, 0x01,                    // REPORT_SIZE (1)
+    0x95, 0x03,                    // REPORT_COUNT (3)
+    0x19, 0x01,                    //   USAGE_MINIMUM (0x01)
+    0x29, 0x03,                    //   USAGE_MAXIMUM (0x03)
+    0x81, 0x02,                    // INPUT (0x02) buttons
+    0x75, 0x05,                    // REPORT_SIZE (5)
+    0x95, 0x01,                    // REPORT_COUNT (1)
+    0x81, 0x01,                    // INPUT (0x01) padding
+    0x05, 0x01,                    // USAGE_PAGE (1)
+    0x15, 0x81,                    // LOGICAL_MINIMUM (-127)
+    0x25, 0x7f,                    // LOGICAL_MAXIMUM (127)
+    0x75, 0x08,                    // REPORT_SIZE (8)
+    0x09, 0x30,                    //   USAGE (0x30) x
+    0x81, 0x06,                    // INPUT (0x06) x
+    0x09, 0x31,                    //   USAGE (0x31) y
+    0x81, 0x06,                    // INPUT (0x06) y
+    0x09, 0x38,                    //   USAGE (0x38) wheel
+    0x81, 0x06,                    // INPUT (0x06) wheel
+    0xc0,                          // END_COLLECTION
+#endif
+};
+
+void hid_keyboard_pack(const HIDKeyboardReport_t *report, uint8_t buffer[HID_KEYBOARD_REPORT_SIZE]) {
+    buffer[0] = HID_KEYBOARD_REPORT_ID;
+    buffer[1] = (uint8_t) ((uint32_t) report->modifier);
+    buffer[2] = (uint8_t) ((uint32_t) report->keycode[0]);
+    buffer[3] = (uint8_t) ((uint32_t) report->keycode[1]);
+    buffer[4] = (uint8_t) ((uint32_t) report->keycode[2]);
+    buffer[5] = (uint8_t) ((uint32_t) report->keycode[3]);
+    buffer[6] = (uint8_t) ((uint32_t) report->keycode[4]);
+    buffer[7] = (uint8_t) ((uint32_t) report->keycode[5]);
+}
+
+void hid_keyboard_unpack(HIDKeyboardReport_t *report, const uint8_t buffer[HID_KEYBOARD_REPORT_SIZE]) {
+    report->modifier = (uint8_t) ((uint32_t) buffer[1]);
+    report->keycode[0] = (uint8_t) ((uint32_t) buffer[2]);
+    report->keycode[1] = (uint8_t) ((uint32_t) buffer[3]);
+    report->keycode[2] = (uint8_t) ((uint32_t) buffer[4]);
+    report->keycode[3] = (uint8_t) ((uint32_t) buffer[5]);
+    report->keycode[4] = (uint8_t) ((uint32_t) buffer[6]);
+    report->keycode[5] = (uint8_t) ((uint32_t) buffer[7]);
+}
+
+void hid_gamepad_pack(const HIDGamepadReport_t *report, uint8_t buffer[HID_GAMEPAD_REPORT_SIZE]) {
+    buffer[0] = HID_GAMEPAD_REPORT_ID;
+    buffer[1] = (uint8_t) (((uint32_t) report->axis[0] & 0xfff));
+    buffer[2] = (uint8_t) ((((uint32_t) report->axis[0] & 0xfff) >> 8) | (((uint32_t) report->axis[1] & 0xfff) << 4));
+    buffer[3] = (uint8_t) ((((uint32_t) report->axis[1] & 0xfff) >> 4));
+    buffer[4] = (uint8_t) (((uint32_t) report->axis[2] & 0xfff));
+    buffer[5] = (uint8_t) ((((uint32_t) report->axis[2] & 0xfff) >> 8) | (((uint32_t) report->axis[3] & 0xfff) << 4));
+    buffer[6] = (uint8_t) ((((uint32_t) report->axis[3] & 0xfff) >> 4));
+}
+
+void hid_gamepad_unpack(HIDGamepadReport_t *report, const uint8_t buffer[HID_GAMEPAD_REPORT_SIZE]) {
+    report->axis[0] = (int16_t) ((int32_t) ((((uint32_t) buffer[1] | ((uint32_t) buffer[2] << 8)) & 0xfff) ^ 0x800) - 0x800);
+    report->axis[1] = (int16_t) ((int32_t) (((((uint32_t) buffer[2] >> 4) | ((uint32_t) buffer[3] << 4)) & 0xfff) ^ 0x800) - 0x800);
+    report->axis[2] = (int16_t) ((int32_t) ((((uint32_t) buffer[4] | ((uint32_t) buffer[5] << 8)) & 0xfff) ^ 0x800) - 0x800);
+    report->axis[3] = (int16_t) ((int32_t) (((((uint32_t) buffer[5] >> 4) | ((uint32_t) buffer[6] << 4)) & 0xfff) ^ 0x800) - 0x800);
+}
+
+void hid_mouse_pack(const HIDMouseReport_t *report, uint8_t buffer[HID_MOUSE_REPORT_SIZE]) {
+    buffer[0] = HID_MOUSE_REPORT_ID;
+    buffer[1] = (uint8_t) (((uint32_t) report->buttons & 0x7));
+    buffer[2] = (uint8_t) (((uint32_t) report->x & 0xff));
+    buffer[3] = (uint8_t) (((uint32_t) report->y & 0xff));
+    buffer[4] = (uint8_t) (((uint32_t) report->wheel & 0xff));
+}
+
+void hid_mouse_unpack(HIDMouseReport_t *report, const uint8_t buffer[HID_MOUSE_REPORT_SIZE]) {
+    report->buttons = (uint8_t) (((uint32_t) buffer[1]) & 0x7);
+    report->x = (int8_t) ((int32_t) (((uint32_t) buffer[2]) ^ 0x80) - 0x80);
+    report->y = (int8_t) ((int32_t) (((uint32_t) buffer[3]) ^ 0x80) - 0x80);
+    report->wheel = (int8_t) ((int32_t) (((uint32_t) buffer[4]) ^ 0x80) - 0x80);
+}
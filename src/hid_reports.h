@@ -0,0 +1,55 @@
+/*Generated by tools/hidgen.py from hid_reports.spec, do not edit*/
+
+#ifndef HID_REPORTS_H_
+#define HID_REPORTS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef HID_GAMEPAD
+#define HID_GAMEPAD 0
+#endif
+
+#ifndef HID_MOUSE
+#define HID_MOUSE 0
+#endif
+
+#define HID_REPORT_DESCRIPTOR_SIZE (38 + (HID_GAMEPAD ? 29 : 0) + (HID_MOUSE ? 51 : 0))
+extern const uint8_t hid_report_descriptor[HID_REPORT_DESCRIPTOR_SIZE];
+
+/*keyboard input report, 8 bytes*/
+#define HID_KEYBOARD_REPORT_ID 1
+#define HID_KEYBOARD_REPORT_SIZE 8
+typedef struct {
+    uint8_t modifier;
+    uint8_t keycode[6];
+} HIDKeyboardReport_t;
+
+void hid_keyboard_pack(const HIDKeyboardReport_t *report, uint8_t buffer[HID_KEYBOARD_REPORT_SIZE]);
+void hid_keyboard_unpack(HIDKeyboardReport_t *report, const uint8_t buffer[HID_KEYBOARD_REPORT_SIZE]);
+
+/*gamepad input report, 7 bytes*/
+#define HID_GAMEPAD_REPORT_ID 2
+#define HID_GAMEPAD_REPORT_SIZE 7
+typedef struct {
+    int16_t axis[4];
+} HIDGamepadReport_t;
+
+void hid_gamepad_pack(const HIDGamepadReport_t *report, uint8_t buffer[HID_GAMEPAD_REPORT_SIZE]);
+void hid_gamepad_unpack(HIDGamepadReport_t *report, const uint8_t buffer[HID_GAMEPAD_REPORT_SIZE]);
+
+/*mouse input report, 5 bytes*/
+#define HID_MOUSE_REPORT_ID 3
+#define HID_MOUSE_REPORT_SIZE 5
+typedef struct {
+    uint8_t buttons;
+    int8_t x;
+    int8_t y;
+    int8_t wheel;
+} HIDMouseReport_t;
+
+void hid_mouse_pack(const HIDMouseReport_t *report, uint8_t buffer[HID_MOUSE_REPORT_SIZE]);
+void hid_mouse_unpack(HIDMouseReport_t *report, const uint8_t buffer[HID_MOUSE_REPORT_SIZE]);
+
+#endif
@@ -0,0 +1,145 @@
+#include "keymap.h"
+#include "util.h"
+
+#include <string.h>
+
+#define DEBUG_CNTX "keymap"
+
+
+/*Top active layer wins, transparent keys look at the layers below it. Only
+runs when the active layers change, a key press is then a table read*/
+static void keymap_resolve(KeymapState_t *state) {
+    const KeyAction_t *action;
+    uint32_t active;
+
+    for (int key = 0; key < state->map->keys; key++) {
+        state->resolved[key] = (KeyAction_t) KEY_NO;
+        active = state->active;
+        while (active) {
+            int layer = 31 - __builtin_clz(active);
+            action = &state->map->actions[layer * state->map->keys + key];
+            if (action->type != kKeyTransparent) {
+                state->resolved[key] = *action;
+                break;
+            }
+            active &= ~(1u << layer);
+        }
+    }
+}
+
+void keymap_init(KeymapState_t *state, const Keymap_t *map) {
+    ASSERT(map->keys <= KEYMAP_MAX_KEYS);
+    ASSERT(map->layers <= KEYMAP_MAX_LAYERS);
+
+    memset(state, 0, sizeof(KeymapState_t));
+    state->map = map;
+    state->active = 1;
+    keymap_resolve(state);
+}
+
+static bool keymap_holding_layer(KeyAction_t *action, bool hold) {
+    return action->type == kKeyMomentary || (action->type == kKeyLayerTap && hold);
+}
+
+static void keymap_update_layers(KeymapState_t *state) {
+    uint32_t active = 1 | state->toggled;
+
+    for (uint32_t keys = state->pressed; keys; keys &= keys - 1) {
+        int i = __builtin_ctz(keys);
+        if (keymap_holding_layer(&state->keys[i].action, state->keys[i].hold) &&
+            state->keys[i].action.param < state->map->layers)
+            active |= 1u << state->keys[i].action.param;
+    }
+
+    if (active != state->active) {
+        state->active = active;
+        keymap_resolve(state);
+    }
+}
+
+static bool keymap_is_tap_hold(KeyAction_t *action) {
+    return action->type == kKeyLayerTap || action->type == kKeyModTap;
+}
+
+static void keymap_decide_hold(KeymapState_t *state, uint32_t keys) {
+    state->undecided &= ~keys;
+    for (; keys; keys &= keys - 1)
+        state->keys[__builtin_ctz(keys)].hold = true;
+}
+
+void keymap_event(KeymapState_t *state, uint8_t key, bool pressed, uint64_t now) {
+    KeyAction_t *action;
+
+    if (key >= state->map->keys)
+        return;
+    action = &state->keys[key].action;
+
+    if (pressed) {
+        //another key going down while a tap/hold key is undecided makes it a hold
+        if (state->undecided) {
+            keymap_decide_hold(state, state->undecided);
+            keymap_update_layers(state);
+        }
+
+        *action = state->resolved[key];
+        state->keys[key].hold = false;
+        state->keys[key].time = now;
+        if (action->type != kKeyNone)
+            state->pressed |= 1u << key;
+        if (keymap_is_tap_hold(action))
+            state->undecided |= 1u << key;
+
+        if (action->type == kKeyToggle && action->param < state->map->layers)
+            state->toggled ^= 1u << action->param;
+    } else {
+        if (state->undecided & (1u << key))
+            state->tap = action->usage;
+        *action = (KeyAction_t) KEY_NO;
+        state->pressed &= ~(1u << key);
+        state->undecided &= ~(1u << key);
+    }
+
+    keymap_update_layers(state);
+}
+
+void keymap_tick(KeymapState_t *state, uint64_t now) {
+    uint32_t expired = 0;
+
+    for (uint32_t keys = state->undecided; keys; keys &= keys - 1) {
+        int i = __builtin_ctz(keys);
+        if (now - state->keys[i].time >= state->map->tapping_term)
+            expired |= 1u << i;
+    }
+
+    if (expired) {
+        keymap_decide_hold(state, expired);
+        keymap_update_layers(state);
+    }
+}
+
+void keymap_report(KeymapState_t *state, uint8_t *modifier, uint8_t keycode[6]) {
+    int used = 0;
+
+    *modifier = 0;
+    memset(keycode, 0, 6);
+
+    for (uint32_t keys = state->pressed; keys; keys &= keys - 1) {
+        int i = __builtin_ctz(keys);
+        KeyAction_t *action = &state->keys[i].action;
+
+        if (action->type == kKeyUsage) {
+            *modifier |= action->param;
+            if (action->usage && used < 6)
+                keycode[used++] = action->usage;
+        } else if (action->type == kKeyModTap && state->keys[i].hold) {
+            *modifier |= action->param;
+        }
+    }
+
+    if (state->tap && used < 6)
+        keycode[used++] = state->tap;
+}
+
+void keymap_report_sent(KeymapState_t *state) {
+    state->tap = 0;
+}
@@ -0,0 +1,73 @@
+
+
+#ifndef KEYMAP_H_
+#define KEYMAP_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define KEYMAP_MAX_KEYS 32
+#define KEYMAP_MAX_LAYERS 32 //one bit each in the active layer mask
+
+#define KEYMAP_TAPPING_TERM (200 * 1000) //us, tap/hold keys held longer act as hold
+
+typedef enum {
+    kKeyNone,
+    kKeyTransparent, //falls through to the next active layer below
+    kKeyUsage,
+    kKeyMomentary, //layer active while held
+    kKeyToggle,
+    kKeyLayerTap, //usage on tap, momentary layer on hold
+    kKeyModTap //usage on tap, modifier on hold
+} KeyType_t;
+
+typedef struct {
+    uint8_t type;
+    uint8_t usage;
+    uint8_t param; //modifier for usage and mod-tap keys, layer otherwise
+} KeyAction_t;
+
+/*Helpers to write the const keymap tables*/
+#define KEY_NO {kKeyNone, 0, 0}
+#define KEY_TRNS {kKeyTransparent, 0, 0}
+#define KEY(usage) {kKeyUsage, usage, 0}
+#define KEY_MOD(mod, usage) {kKeyUsage, usage, mod}
+#define KEY_MO(layer) {kKeyMomentary, 0, layer}
+#define KEY_TG(layer) {kKeyToggle, 0, layer}
+#define KEY_LT(layer, usage) {kKeyLayerTap, usage, layer}
+#define KEY_MT(mod, usage) {kKeyModTap, usage, mod}
+
+/*actions is a flat [layers][keys] table, layer 0 is the base layer*/
+typedef struct {
+    const KeyAction_t *actions;
+    uint8_t layers;
+    uint8_t keys;
+    uint32_t tapping_term; //us
+} Keymap_t;
+
+typedef struct {
+    const Keymap_t *map;
+    uint32_t toggled; //layer masks
+    uint32_t active;
+    uint32_t pressed; //key masks, keys with an action and tap/hold keys not decided yet
+    uint32_t undecided;
+    KeyAction_t resolved[KEYMAP_MAX_KEYS]; //what each key does under the active layers
+    struct {
+        KeyAction_t action; //resolved on press, kKeyNone while released
+        bool hold; //tap/hold key decided as hold
+        uint64_t time;
+    } keys[KEYMAP_MAX_KEYS];
+    uint8_t tap; //usage tapped since the last report sent
+} KeymapState_t;
+
+void keymap_init(KeymapState_t *state, const Keymap_t *map);
+/*Feed key edges, key is the column in the keymap table*/
+void keymap_event(KeymapState_t *state, uint8_t key, bool pressed, uint64_t now);
+/*Resolves tap/hold keys held past the tapping term*/
+void keymap_tick(KeymapState_t *state, uint64_t now);
+/*Builds the boot keyboard report, call keymap_report_sent once it went out
+so pending taps are released in the next one*/
+void keymap_report(KeymapState_t *state, uint8_t *modifier, uint8_t keycode[6]);
+void keymap_report_sent(KeymapState_t *state);
+
+#endif
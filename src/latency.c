@@ -0,0 +1,75 @@
+#include "latency.h"
+#include "util.h"
+
+#include <string.h>
+
+#define DEBUG_CNTX "latency"
+
+
+static int latency_bucket(uint32_t us) {
+    int exp;
+
+    if (us < LATENCY_LINEAR)
+        return us;
+
+    exp = 31 - __builtin_clz(us);
+    if (exp > LATENCY_MAX_EXP)
+        return LATENCY_BUCKETS - 1;
+
+    return LATENCY_LINEAR + (exp - 5) * LATENCY_SUB_BUCKETS + ((us >> (exp - 4)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+//upper bound of the values stored in a bucket
+static uint32_t latency_bucket_limit(int bucket) {
+    int exp, mantissa;
+
+    if (bucket < LATENCY_LINEAR)
+        return bucket;
+
+    exp = (bucket - LATENCY_LINEAR) / LATENCY_SUB_BUCKETS + 5;
+    mantissa = (bucket - LATENCY_LINEAR) % LATENCY_SUB_BUCKETS;
+    return ((LATENCY_SUB_BUCKETS + mantissa + 1) << (exp - 4)) - 1;
+}
+
+void latency_init(LatencyStats_t *stats, const char *name) {
+    memset(stats, 0, sizeof(LatencyStats_t));
+    stats->name = name;
+    stats->min = UINT32_MAX;
+}
+
+void latency_record(LatencyStats_t *stats, uint32_t us) {
+    stats->count++;
+    stats->sum += us;
+    if (us < stats->min) stats->min = us;
+    if (us > stats->max) stats->max = us;
+    stats->buckets[latency_bucket(us)]++;
+}
+
+uint32_t latency_percentile(LatencyStats_t *stats, uint8_t percent) {
+    uint64_t target = ((uint64_t) stats->count * percent + 99) / 100;
+    uint64_t seen = 0;
+
+    if (!stats->count)
+        return 0;
+
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += stats->buckets[i];
+        if (seen >= target) {
+            uint32_t limit = latency_bucket_limit(i);
+            return limit > stats->max ? stats->max : limit;
+        }
+    }
+    return stats->max;
+}
+
+void latency_print(LatencyStats_t *stats) {
+    if (!stats->count) {
+        DEBUG("%s: no samples", stats->name);
+        return;
+    }
+
+    DEBUG("%s: n=%u min=%uus mean=%uus p50=%uus p99=%uus max=%uus", stats->name,
+        (unsigned) stats->count, (unsigned) stats->min, (unsigned) (stats->sum / stats->count),
+        (unsigned) latency_percentile(stats, 50), (unsigned) latency_percentile(stats, 99),
+        (unsigned) stats->max);
+}
@@ -0,0 +1,29 @@
+
+
+#ifndef LATENCY_H_
+#define LATENCY_H_
+
+#include <stdint.h>
+
+/*log-linear buckets: 1us resolution below 32us, then 16 buckets per power of two
+(~6% error) up to 2^LATENCY_MAX_EXP us*/
+#define LATENCY_LINEAR 32
+#define LATENCY_SUB_BUCKETS 16
+#define LATENCY_MAX_EXP 22
+#define LATENCY_BUCKETS (LATENCY_LINEAR + (LATENCY_MAX_EXP - 5 + 1) * LATENCY_SUB_BUCKETS)
+
+typedef struct {
+    const char *name;
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
+    uint32_t buckets[LATENCY_BUCKETS];
+} LatencyStats_t;
+
+void latency_init(LatencyStats_t *stats, const char *name);
+void latency_record(LatencyStats_t *stats, uint32_t us);
+uint32_t latency_percentile(LatencyStats_t *stats, uint8_t percent);
+void latency_print(LatencyStats_t *stats);
+
+#endif
@@ -1,3 +1,4 @@
+#include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "driver/spi_master.h"
@@ -6,11 +7,45 @@
 #include "util.h"
 #include "usb_fpga.h"
 #include "usb.h"
+#include "usb_capture.h"
+#include "latency.h"
+#include "profiler.h"
+#include "hid_macro.h"
+#include "keymap.h"
+#include "timeline.h"
+#include "usb_cdc.h"
+#include "hid_reports.h" // generado por tools/hidgen.py desde tools/hid_reports.spec
+#if HID_GAMEPAD
+#include "analog_adc.h"
+#endif
+#if HID_MOUSE
+#include "motion_pcnt.h"
+#endif
+#if USB_MSC
+#include "usb_msc.h"
+#include "msc_flash.h"
+#endif
+#if USB_DFU
+#include "esp_system.h"
+#include "usb_dfu.h"
+#include "dfu_ota.h"
+#endif
+#include <sys/reent.h>
 
 #define PIN_NUM_MISO 12
 #define PIN_NUM_MOSI 15
 #define PIN_NUM_CLK 13
 #define PIN_NUM_CS 2
+
+// Enlace quad con el FPGA: -DUSB_QUAD=1 usa WP y HD como lineas de datos extra, el comando sigue
+// en una sola linea y si el FPGA no lo ofrece o las lineas no llegan se queda en modo de 1 bit
+#if USB_QUAD
+#define PIN_NUM_WP 4
+#define PIN_NUM_HD 14
+#else
+#define PIN_NUM_WP -1
+#define PIN_NUM_HD -1
+#endif
 #define PIN_BUTTON_UP GPIO_NUM_32    // Asigna el pin adecuado para el boton Up
 #define PIN_BUTTON_LEFT GPIO_NUM_25  // Asigna el pin adecuado para el boton Left
 #define PIN_BUTTON_RIGHT GPIO_NUM_26 // Asigna el pin adecuado para el boton Right
@@ -19,42 +54,232 @@
 
 #define ENDPOINTS 5
 
+#define KEYBOARD_TASK_STACK 4096
+
 #define DEBUG_CNTX "main"
 
-// Descriptor HID para un teclado
-uint8_t hid_report_descriptor[] = {
-  0x05, 0x01, // USAGE_PAGE (Generic Desktop)
-    0x09, 0x06, // USAGE (Keyboard)
-    0xa1, 0x01, // COLLECTION (Application)
-    0x05, 0x07, //   USAGE_PAGE (Key Codes)
-    0x19, 0xE0, //   USAGE_MINIMUM (Left Control)
-    0x29, 0xE7, //   USAGE_MAXIMUM (Right GUI)
-    0x15, 0x00, //   LOGICAL_MINIMUM (0)
-    0x25, 0x01, //   LOGICAL_MAXIMUM (1)
-    0x75, 0x01, //   REPORT_SIZE (1)
-    0x95, 0x08, //   REPORT_COUNT (8)
-    0x81, 0x02, //   INPUT (Data,Var,Abs)
-    0x75, 0x08, //   REPORT_SIZE (8)
-    0x95, 0x06, //   REPORT_COUNT (6)
-    0x15, 0x00, //   LOGICAL_MINIMUM (0)
-    0x25, 0xFF, //   LOGICAL_MAXIMUM (255)
-    0x05, 0x07, //   USAGE_PAGE (Key Codes)
-    0x19, 0x00, //   USAGE_MINIMUM (No Event)
-    0x29, 0xFF, //   USAGE_MAXIMUM (Max Event)
-    0x81, 0x00, //   INPUT (Data,Ary,Abs)
-    0xC0,       // END_COLLECTION
- };
+// Modo de alta tasa: el host consulta el endpoint cada 1 ms y el reporte se genera cada 1 ms
+#ifndef HID_HIGH_RATE
+#define HID_HIGH_RATE 0
+#endif
+
+// Reporte siempre en espera: el ultimo estado queda cargado en el buffer del FPGA y cada consulta del host
+// se responde al instante sin SPI de por medio, usb_poll lo repone en cuanto el host se lo lleva.
+// Los botones se revisan cada 1 ms y el reporte solo se reemplaza cuando cambia
+#ifndef HID_LATEST_STATE
+#define HID_LATEST_STATE 0
+#endif
+
+#if HID_HIGH_RATE
+#define HID_INTERVAL 1 // bInterval del endpoint de reportes (ms)
+#else
+#define HID_INTERVAL 10
+#endif
+
+#if HID_HIGH_RATE || HID_LATEST_STATE
+#define HID_REPORT_PERIOD 1000 // us
+#else
+#define HID_REPORT_PERIOD (100 * 1000)
+#endif
+
+#if HID_HIGH_RATE && USB_DEBUG
+#warning "Packet dumps on the console take longer than a 1 ms frame, build with -DUSB_DEBUG=0"
+#endif
+
+// Perfilador de latencia tecla-cable: ISR en los botones y marcas en cada etapa
+#ifndef HID_PROFILE
+#define HID_PROFILE 0
+#endif
+
+#define LATENCY_REPORT_PERIOD (10 * 1000 * 1000) // us
+
+// Arranque rapido: las tareas USB arrancan antes de configurar los GPIO para atender el primer SETUP
+// cuanto antes, ver el entorno fastboot de platformio.ini
+#ifndef FAST_BOOT
+#define FAST_BOOT 0
+#endif
+
+// Puerto serie CDC-ACM junto al HID: los logs salen por USB en lugar de la UART a 115200
+// y se acepta una consola de ordenes
+#ifndef USB_CDC
+#define USB_CDC 0
+#endif
+
+#define CDC_NOTIFY_ENDP 3
+#define CDC_DATA_ENDP 4 // bulk IN y OUT sobre el mismo endpoint del FPGA
+#define CONSOLE_LINE 64
+
+// Disco USB (mass storage) sobre la particion "msc" de la flash, para sacar configuracion y logs
+// sin herramientas. Solo el primer teclado lo expone, sin la particion queda un disco en RAM
+#ifndef USB_MSC
+#define USB_MSC 0
+#endif
+
+#define MSC_ENDP 4 // bulk IN y OUT, el mismo endpoint del FPGA que el CDC
+#define MSC_PARTITION "msc"
+#define MSC_RAM_SECTORS 128 // 64 KiB
+
+#if USB_MSC && USB_CDC
+#error "USB_MSC and USB_CDC both need fpga endpoint 4"
+#endif
+
+// Actualizacion del firmware por USB (dfu-util -D firmware.bin) a la particion OTA libre.
+// Solo el primer teclado tiene la interfaz, al terminar arranca la imagen nueva
+#ifndef USB_DFU
+#define USB_DFU 0
+#endif
+
+#define DFU_INTERFACE (1 + 2 * USB_CDC + USB_MSC) // despues de las demas interfaces
+#define DFU_TASK_STACK 4096
+#define DFU_RESTART_DELAY (500 * 1000) // us, el host alcanza a leer el estado final
+
+#if FAST_BOOT && USB_DEBUG
+#warning "Packet dumps on the console delay every control transfer, build with -DUSB_DEBUG=0"
+#endif
+
+// Gamepad analogico: -DHID_GAMEPAD=1 agrega la coleccion del gamepad al descriptor (ver hid_reports.h)
+// y muestrea los ejes con el ADC en modo continuo por DMA, solo el primer teclado lo reporta
+#define ANALOG_SAMPLE_HZ 20000 // total entre todos los canales, minimo del modo continuo
+#define ANALOG_FILTER_SHIFT 6  // a 10 kHz por canal, constante de tiempo de ~6 ms
+
+// Raton/trackball: -DHID_MOUSE=1 agrega la coleccion del raton, los encoders en cuadratura los cuenta el PCNT
+// y el movimiento se acumula entre consultas del host, un reporte por consulta sin importar la tasa de muestreo
+#if HID_MOUSE && HID_LATEST_STATE
+#error "Relative mouse reports can't be repeated by the latest-state stage"
+#endif
+
+// Texto que se escribe al enumerar, p.ej. -DHID_MACRO_TEXT='"hola\n"' para medir caracteres por segundo
+// #define HID_MACRO_TEXT "..."
 
 typedef enum
 {
     kHIDRequestSetIdle = 0xa
 } HIDRequest_t;
 
-bool g_hid_running = false;
+// Descriptor de clase HID
+typedef struct
+{
+    uint8_t length;
+    uint8_t type;
+    uint16_t hid_version;
+    uint8_t country_code;
+    uint8_t class_descriptors;
+    uint8_t class_descriptor_type;
+    uint16_t class_descriptor_length;
+} PACKED HIDClassDescriptor_t;
+
+// Un teclado por cada nucleo USB del FPGA, cada uno con sus propios descriptores
+typedef struct
+{
+    int index;
+    USBFpga_t fpga;
+    USBDevice_t usb;
+    bool hid_running;
+    bool suspended; // el host suspendio el bus, no se envian reportes
+    HIDMacro_t macro;
+    KeymapState_t keymap;
+    uint32_t buttons; // ultimo estado leido, un bit por boton
+
+    DeviceDescriptor_t device_descriptor;
+    ConfigurationDescriptor_t default_config;
+    InterfaceDescriptor_t hid_interface;
+    EndpointDescriptor_t endp1, endp2;
+    HIDClassDescriptor_t hid_class_descriptor;
+
+    // Desglose del presupuesto de latencia de cada reporte
+    LatencyStats_t stats_jitter, stats_scan, stats_transfer, stats_poll;
+
+#if USB_CDC
+    USBCDC_t cdc;
+    char console_line[CONSOLE_LINE];
+    uint8_t console_used;
+#endif
+#if HID_GAMEPAD
+    HIDGamepadReport_t gamepad; // ultimo reporte enviado
+#endif
+#if USB_MSC
+    USBMSC_t msc;
+#endif
+#if USB_DFU
+    USBDFU_t dfu;
+#endif
+#if HID_LATEST_STATE
+    USBStage_t stage; // slot 0 teclado, slot 1 gamepad
+    uint8_t staged[HID_KEYBOARD_REPORT_SIZE];
+    uint32_t staged_seq; // secuencia del ultimo reporte de teclado en espera
+    uint32_t macro_seq; // reporte del macro que el host aun no se llevo, 0 si ninguno
+#endif
+} Keyboard_t;
+
+// Todos los nucleos comparten el bus SPI, uno por chip select
+static const int g_usb_cs_pins[] = {PIN_NUM_CS};
+#define USB_DEVICES (sizeof(g_usb_cs_pins) / sizeof(g_usb_cs_pins[0]))
+
+Keyboard_t g_keyboards[USB_DEVICES];
+
+#if USB_MSC
+MSCDisk_t g_msc_disk;
+MSCFlash_t g_msc_flash;
+MSCRamDisk_t g_msc_ram;
+#endif
+
+#if USB_DFU
+DFUOta_t g_dfu_ota;
+#endif
+
+// Los botones se leen solo cuando app_main termino de configurarlos
+static volatile bool g_inputs_ready = false;
+
+// Botones en el orden de las columnas del keymap
+static const gpio_num_t g_buttons[] = {PIN_BUTTON_UP, PIN_BUTTON_LEFT, PIN_BUTTON_RIGHT};
+#define BUTTONS (sizeof(g_buttons) / sizeof(g_buttons[0]))
+
+// Capa 0: flechas, mantener Right activa la capa 1 (Re Pag, Inicio)
+static const KeyAction_t g_keymap_actions[][BUTTONS] = {
+    {KEY(0x52), KEY(0x50), KEY_LT(1, 0x4F)},
+    {KEY(0x4B), KEY(0x4A), KEY_TRNS},
+};
+
+#if HID_GAMEPAD
+// Joystick en GPIO36 (X) y GPIO39 (Y)
+static const adc_channel_t g_analog_channels[] = {ADC_CHANNEL_0, ADC_CHANNEL_3};
+#define ANALOG_AXES (sizeof(g_analog_channels) / sizeof(g_analog_channels[0]))
+
+static const AnalogCalibration_t g_analog_calibration[ANALOG_AXES] = {
+    {.min = 0, .center = 2048, .max = 4095, .deadzone = 64},
+    {.min = 0, .center = 2048, .max = 4095, .deadzone = 64},
+};
+
+AnalogInput_t g_analog;
+#endif
+
+#if HID_MOUSE
+// Encoder X en GPIO33/27 e Y en GPIO34/35 (solo entrada, con pull-up externo)
+static const MotionPcntPins_t g_motion_pins[] = {{33, 27}, {34, 35}};
+#define MOTION_ENCODERS (sizeof(g_motion_pins) / sizeof(g_motion_pins[0]))
+
+MotionAccumulator_t g_motion;
+MotionPcnt_t g_motion_pcnt;
+#endif
+
+static const Keymap_t g_keymap = {
+    .actions = &g_keymap_actions[0][0],
+    .layers = sizeof(g_keymap_actions) / sizeof(g_keymap_actions[0]),
+    .keys = BUTTONS,
+    .tapping_term = KEYMAP_TAPPING_TERM};
+
+// El perfilador sigue un solo evento a la vez, solo se mide el primer teclado
+#if HID_PROFILE
+#define PROFILE_MARK(kb, stage) if ((kb)->index == 0) profiler_mark(stage)
+#else
+#define PROFILE_MARK(kb, stage)
+#endif
 
 // Manejador de solicitudes de control HID
-void hid_control_handler(USBControlRequest_t *control, uint16_t chunck_size, uint8_t endp)
+void hid_control_handler(USBDevice_t *dev, USBControlRequest_t *control, uint16_t chunck_size, uint8_t endp)
 {
+    Keyboard_t *kb = dev->context;
+
     if (control->request_type.type == kTypeStandard)
     {
         switch (control->request)
@@ -62,12 +287,12 @@ void hid_control_handler(USBControlRequest_t *control, uint16_t chunck_size, uin
         case kRequestGetDescriptor:
             if (control->descriptor.type == 0x22)
             {
-                usb_write_data(hid_report_descriptor, sizeof(hid_report_descriptor), chunck_size, endp);
-                DEBUG("Report descriptor sent");
+                usb_write_data(dev->fpga, (uint8_t *)hid_report_descriptor, sizeof(hid_report_descriptor), chunck_size, endp);
+                USB_TRACE("Report descriptor sent");
             }
             break;
         default:
-            DEBUG("Unsupported standard request %u", control->request);
+            USB_TRACE("Unsupported standard request %u", control->request);
             goto deny_request;
         }
     }
@@ -76,68 +301,282 @@ void hid_control_handler(USBControlRequest_t *control, uint16_t chunck_size, uin
         switch ((HIDRequest_t)control->request)
         {
         case kHIDRequestSetIdle:
-            usb_control_accept_request(endp);
-            g_hid_running = true;
+            usb_control_accept_request(dev, endp);
+            kb->hid_running = true;
             break;
         default:
-            DEBUG("Unsupported HID request %u", control->request);
+            USB_TRACE("Unsupported HID request %u", control->request);
             goto deny_request;
         }
     }
     return;
 
 deny_request:
-    usb_control_deny_request(endp);
+    usb_control_deny_request(dev, endp);
 }
 
-// Funcion para enviar el estado del teclado
-void hid_send_keyboard_state(uint8_t modifier, uint8_t reserved, uint8_t keycode[6])
+// Funcion para enviar el estado del teclado, devuelve 0 si el reporte salio
+int hid_send_keyboard_state(Keyboard_t *kb, uint8_t modifier, uint8_t reserved, uint8_t keycode[6])
 {
-    uint8_t buffer[7] = {modifier, keycode[0], keycode[1], keycode[2], keycode[3], keycode[4], keycode[5]};
+    HIDKeyboardReport_t report = {.modifier = modifier};
+    uint8_t buffer[HID_KEYBOARD_REPORT_SIZE];
+    int ret;
+
+    memcpy(report.keycode, keycode, sizeof(report.keycode));
+    hid_keyboard_pack(&report, buffer);
 
-    if (usb_write_data(buffer, sizeof(buffer), 64, 2))
+#if HID_LATEST_STATE
+    // Solo se reemplaza el reporte en espera, cuenta como enviado cuando el host se lo lleva
+    if (memcmp(buffer, kb->staged, sizeof(buffer)))
+    {
+        PROFILE_MARK(kb, kProfileSPIStart);
+        memcpy(kb->staged, buffer, sizeof(buffer));
+        kb->staged_seq = usb_stage_write(&kb->stage, 0, buffer, sizeof(buffer));
+    }
+    return usb_stage_taken(&kb->stage, 0) >= kb->staged_seq ? 0 : -2;
+#endif
+
+    PROFILE_MARK(kb, kProfileSPIStart);
+#if HID_HIGH_RATE
+    // Nunca esperar: si el host aun no leyo el reporte anterior el siguiente periodo envia uno nuevo
+    ret = usb_try_write_data(&kb->fpga, buffer, sizeof(buffer), 2);
+    if (ret == -2)
+        return ret;
+#else
+    ret = usb_write_data(&kb->fpga, buffer, sizeof(buffer), 64, 2);
+#endif
+    if (!ret)
+        PROFILE_MARK(kb, kProfileSPIEnd);
+
+    if (ret)
     {
         DEBUG("Failed to send keyboard state");
-        g_hid_running = false;
+        kb->hid_running = false;
     }
+    return ret;
 }
 
-void app_main()
+#if HID_GAMEPAD
+// Los ejes se filtran en cada vuelta y el reporte sale solo cuando cambia, por el mismo endpoint que el teclado
+void hid_gamepad_service(Keyboard_t *kb)
 {
-    esp_err_t ret;
-    spi_device_handle_t usb_spi;
-    spi_bus_config_t buscfg = {
-        .miso_io_num = PIN_NUM_MISO,
-        .mosi_io_num = PIN_NUM_MOSI,
-        .sclk_io_num = PIN_NUM_CLK,
-        .quadwp_io_num = -1,
-        .quadhd_io_num = -1,
-        .max_transfer_sz = 128,
-    };
+    HIDGamepadReport_t report = {0};
+    uint8_t buffer[HID_GAMEPAD_REPORT_SIZE];
+    int ret;
 
-    spi_device_interface_config_t devcfg = {
-        .clock_speed_hz = 1 * 1000 * 1000, // Clock speed 1 MHz
-        .mode = 3,                         // SPI Mode 3
-        .spics_io_num = PIN_NUM_CS,        // CS pin
-        .queue_size = 100,
-        .cs_ena_pretrans = 1};
+    analog_input_service(&g_analog);
+    for (int i = 0; i < ANALOG_AXES; i++)
+        report.axis[i] = analog_axis_value(&g_analog.axes[i]);
+    if (!memcmp(&report, &kb->gamepad, sizeof(report)))
+        return;
 
-    // Inicializa el bus SPI
-    ret = spi_bus_initialize(SPI_HOST, &buscfg, SPI_DMA_CH_AUTO);
-    ASSERT(ret == ESP_OK);
+    hid_gamepad_pack(&report, buffer);
+#if HID_LATEST_STATE
+    usb_stage_write(&kb->stage, 1, buffer, sizeof(buffer));
+    ret = 0;
+#else
+    ret = usb_try_write_data(&kb->fpga, buffer, sizeof(buffer), 2);
+#endif
+    if (ret == -2)
+        return; // El host aun no leyo el reporte anterior, se reintenta en la siguiente vuelta
 
-    // Añade el dispositivo SPI
-    ret = spi_bus_add_device(SPI_HOST, &devcfg, &usb_spi);
-    ASSERT(ret == ESP_OK);
+    if (ret)
+    {
+        DEBUG("Failed to send gamepad report");
+        kb->hid_running = false;
+        return;
+    }
+    kb->gamepad = report;
+}
+#endif
+
+#if HID_MOUSE
+// Sale un reporte cada vez que el host se lleva el anterior, lo que no cabe en los 8 bits del reporte
+// queda acumulado para el siguiente
+void hid_mouse_service(Keyboard_t *kb)
+{
+    HIDMouseReport_t report;
+    uint8_t buffer[HID_MOUSE_REPORT_SIZE];
+    int ret;
+
+    motion_pcnt_service(&g_motion_pcnt);
+    if (!motion_peek(&g_motion, &report))
+        return;
+
+    hid_mouse_pack(&report, buffer);
+    ret = usb_try_write_data(&kb->fpga, buffer, sizeof(buffer), 2);
+    if (ret == -2)
+        return; // El host aun no leyo el reporte anterior, el movimiento sigue acumulandose
+
+    if (ret)
+    {
+        DEBUG("Failed to send mouse report");
+        kb->hid_running = false;
+        return;
+    }
+    motion_commit(&g_motion, &report);
+}
+#endif
+
+// Escribe un texto a la tasa de consulta del host, devuelve -1 si ya hay uno en curso
+int keyboard_type(Keyboard_t *kb, const char *text)
+{
+    return hid_macro_type_string(&kb->macro, text);
+}
+
+// Envia el siguiente reporte del macro en cuanto el FPGA tiene el endpoint libre, sin esperar al periodo
+void hid_macro_service(Keyboard_t *kb)
+{
+    HIDKey_t key;
+    int ret;
+
+#if HID_LATEST_STATE
+    // Cada tecla del macro debe llegar: se avanza cuando el host se llevo el reporte anterior
+    if (kb->macro_seq)
+    {
+        if (usb_stage_taken(&kb->stage, 0) < kb->macro_seq)
+            return;
+        hid_macro_advance(&kb->macro);
+        kb->macro_seq = 0;
+    }
+#endif
+
+    if (!hid_macro_peek(&kb->macro, &key))
+        return;
+
+    HIDKeyboardReport_t report = {.modifier = key.modifier, .keycode = {key.usage}};
+    uint8_t buffer[HID_KEYBOARD_REPORT_SIZE];
+
+    hid_keyboard_pack(&report, buffer);
+#if HID_LATEST_STATE
+    memcpy(kb->staged, buffer, sizeof(buffer));
+    kb->macro_seq = kb->staged_seq = usb_stage_write(&kb->stage, 0, buffer, sizeof(buffer));
+    return;
+#endif
+    ret = usb_try_write_data(&kb->fpga, buffer, sizeof(buffer), 2);
+    if (ret == -2)
+        return;
+
+    if (ret)
+    {
+        DEBUG("Failed to send macro report");
+        kb->hid_running = false;
+        return;
+    }
+    hid_macro_advance(&kb->macro);
+}
+
+// Endpoint de control con las marcas del arranque, solo se mide el primer teclado
+void keyboard_control_endp(USBFpga_t *fpga, uint8_t endp, uint8_t *buffer, size_t len)
+{
+    Keyboard_t *kb = ((USBDevice_t *)fpga->context)->context;
+
+    if (kb->index == 0)
+        timeline_mark(kBootFirstSetup);
+    usb_control_endp(fpga, endp, buffer, len);
+    if (kb->index == 0)
+        timeline_mark(kBootFirstResponse);
+}
+
+// Reset del bus: todo vuelve al estado de antes de enumerar, el siguiente SETUP se atiende en la misma consulta
+void keyboard_bus_event(USBFpga_t *fpga, USBBusEvent_t event)
+{
+    Keyboard_t *kb = ((USBDevice_t *)fpga->context)->context;
+
+    switch (event)
+    {
+    case kBusReset:
+        usb_bus_event(fpga, event);
+        kb->hid_running = false;
+        kb->suspended = false;
+        // Un macro a medias no sigue escribiendo en la nueva sesion
+        hid_macro_init(&kb->macro, &g_hid_layout_us);
+#if USB_CDC
+        usb_cdc_reset(&kb->cdc);
+        kb->console_used = 0;
+#endif
+#if USB_MSC
+        if (kb->index == 0)
+            usb_msc_reset(&kb->msc);
+#endif
+#if HID_LATEST_STATE
+        kb->macro_seq = 0;
+#endif
+#if HID_MOUSE
+        // El movimiento de antes del reset no llega al nuevo host
+        if (kb->index == 0 && g_inputs_ready)
+        {
+            motion_pcnt_service(&g_motion_pcnt);
+            motion_clear(&g_motion);
+        }
+#endif
+        break;
+    case kBusSuspend:
+        kb->suspended = true;
+        break;
+    case kBusResume:
+        kb->suspended = false;
+        break;
+    }
+}
+
+// Marca las fases de la enumeracion hasta que sale el primer reporte
+void keyboard_boot_progress(Keyboard_t *kb)
+{
+    timeline_mark(kBootFirstPoll);
+    if (kb->fpga.address)
+        timeline_mark(kBootAddressed);
+    if (kb->hid_running)
+        timeline_mark(kBootConfigured);
+}
+
+void hid_print_latency_budget(Keyboard_t *kb)
+{
+    DEBUG("Keyboard %i latency budget, report period %i us, host poll wait <= %i us", kb->index, HID_REPORT_PERIOD, HID_INTERVAL * 1000);
+    latency_print(&kb->stats_jitter);
+    latency_print(&kb->stats_scan);
+    latency_print(&kb->stats_transfer);
+    latency_print(&kb->stats_poll);
+    usb_print_endp_stats(&kb->fpga);
+#if HID_GAMEPAD
+    if (kb->index == 0)
+        analog_input_print_stats(&g_analog);
+#endif
+#if HID_MOUSE
+    if (kb->index == 0)
+        motion_pcnt_print_stats(&g_motion_pcnt);
+#endif
+#if HID_PROFILE
+    if (kb->index == 0)
+        profiler_print();
+#endif
+}
+
+// Registra los descriptores del teclado en su pila USB
+void keyboard_init(Keyboard_t *kb, int index, spi_device_handle_t spi)
+{
+    kb->index = index;
+    kb->hid_running = false;
+    kb->suspended = false;
+    kb->buttons = 0;
+    hid_macro_init(&kb->macro, &g_hid_layout_us);
+    keymap_init(&kb->keymap, &g_keymap);
 
     // Inicializa el USB
-    usb_init(usb_spi);
+    usb_init(&kb->fpga, spi);
+    usb_device_init(&kb->usb, &kb->fpga, kb);
 
     // Configura el descriptor del dispositivo
-    DeviceDescriptor_t device_descriptor = {
+    kb->device_descriptor = (DeviceDescriptor_t){
+#if USB_CDC
+        .class = 0xEF, // Dispositivo compuesto con Interface Association Descriptors
+        .sub_class = 0x02,
+        .protocol = 0x01,
+#else
         .class = 0x00, // Controlador USB genérico
         .sub_class = 0x00,
         .protocol = 0x00,
+#endif
         .packet_size = 64,
         .vendor_id = 0x16c0,
         .product_id = 0x27da,
@@ -148,41 +587,31 @@ void app_main()
     };
 
     // Configuracion del dispositivo USB
-    ConfigurationDescriptor_t default_config = {
+    kb->default_config = (ConfigurationDescriptor_t){
         .attributes = 0x80, // Configuración de bus de energía
         .max_power = 50,    // 100mA
         .str_index_configuration = 0};
 
     // Descripcion de la interfaz HID
-    InterfaceDescriptor_t hid_interface = {
+    kb->hid_interface = (InterfaceDescriptor_t){
         .interface_id = 0,
         .endpoints_count = 2,
         .class = 0x03, // HID
         .str_index_interface = 0};
 
     // Descripcion de los endpoints
-    EndpointDescriptor_t endp1 = {
+    kb->endp1 = (EndpointDescriptor_t){
         .endp_address = 1 | kEndpointDirectionOut,
         .attributes = kEndpointAttributeInterrupt,
         .max_packet_size = 64,
-        .interval = 10};
-    EndpointDescriptor_t endp2 = {
+        .interval = HID_INTERVAL};
+    kb->endp2 = (EndpointDescriptor_t){
         .endp_address = 2 | kEndpointDirectionIn,
         .attributes = kEndpointAttributeInterrupt,
         .max_packet_size = 64,
-        .interval = 10};
-
-    // Descriptor de clase HID
-    struct
-    {
-        uint8_t length;
-        uint8_t type;
-        uint16_t hid_version;
-        uint8_t country_code;
-        uint8_t class_descriptors;
-        uint8_t class_descriptor_type;
-        uint16_t class_descriptor_length;
-    } PACKED hid_class_descriptor = {
+        .interval = HID_INTERVAL};
+
+    kb->hid_class_descriptor = (HIDClassDescriptor_t){
         .length = 0x9,
         .type = 0x21,                  // HID class descriptor
         .hid_version = 0x0110,         // Version 1.10
@@ -192,59 +621,427 @@ void app_main()
         .class_descriptor_length = sizeof(hid_report_descriptor)};
 
     // Configura los descriptores del USB
-    usb_set_device_descriptor(&device_descriptor);
-    usb_add_configuration_descriptor(&default_config);
-    usb_add_interface_descriptor(&hid_interface);
-    usb_add_endppoint_descriptor(&endp1);
-    usb_add_endppoint_descriptor(&endp2);
-    usb_add_class_descriptor((uint8_t *)&hid_class_descriptor, sizeof(hid_class_descriptor));
-    usb_add_class_control_handler(hid_control_handler);
+    usb_set_device_descriptor(&kb->usb, &kb->device_descriptor);
+    usb_add_configuration_descriptor(&kb->usb, &kb->default_config);
+    usb_add_interface_descriptor(&kb->usb, &kb->hid_interface);
+    usb_add_endppoint_descriptor(&kb->usb, &kb->endp1);
+    usb_add_endppoint_descriptor(&kb->usb, &kb->endp2);
+    usb_add_class_descriptor(&kb->usb, (uint8_t *)&kb->hid_class_descriptor, sizeof(kb->hid_class_descriptor));
+    usb_add_class_control_handler(&kb->usb, hid_control_handler);
+#if USB_CDC
+    // Interfaces 1 (comunicacion) y 2 (datos)
+    usb_cdc_init(&kb->cdc, &kb->usb, 1, CDC_NOTIFY_ENDP, CDC_DATA_ENDP);
+    kb->console_used = 0;
+#endif
+#if USB_MSC
+    // Interfaz 1, con FAST_BOOT el disco llega despues desde storage_init
+    if (index == 0)
+        usb_msc_init(&kb->msc, &kb->usb, 1, MSC_ENDP, FAST_BOOT ? NULL : &g_msc_disk);
+#endif
+#if USB_DFU
+    if (index == 0)
+        usb_dfu_init(&kb->dfu, &kb->usb, DFU_INTERFACE, &dfu_ota_ops, &g_dfu_ota);
+#endif
 
     // Configura el manejador del endpoint de control USB
-    usb_set_endp_handler(usb_control_endp, 0);
+    usb_set_endp_handler(&kb->fpga, keyboard_control_endp, 0);
+    usb_set_bus_handler(&kb->fpga, keyboard_bus_event);
+    usb_set_endp_double_buffer(&kb->fpga, 0, true);
+#if HID_LATEST_STATE
+    usb_stage_init(&kb->stage, &kb->fpga, 2);
+    memset(kb->staged, 0, sizeof(kb->staged));
+    kb->staged_seq = 0;
+    kb->macro_seq = 0;
+#endif
 
-    // Configura los pines de los botones
-    gpio_set_direction(PIN_BUTTON_UP, GPIO_MODE_INPUT);
-    gpio_set_direction(PIN_BUTTON_LEFT, GPIO_MODE_INPUT);
-    gpio_set_direction(PIN_BUTTON_RIGHT, GPIO_MODE_INPUT);
+    latency_init(&kb->stats_jitter, "period jitter");
+    latency_init(&kb->stats_scan, "scan");
+    latency_init(&kb->stats_transfer, "transfer");
+    latency_init(&kb->stats_poll, "poll");
+}
+
+#if USB_CDC
+#if USB_CAPTURE
+// Manda la captura en pcapng por el puerto: una linea "pcapng <bytes>" y luego el archivo,
+// tools/capture_dump.py lo guarda. La captura se detiene mientras tanto y vuelve a empezar vacia
+void keyboard_console_capture(Keyboard_t *kb)
+{
+    char *file = NULL;
+    size_t size = 0;
+    FILE *fd;
+    int ret;
+
+    usb_capture_stop();
+    fd = open_memstream(&file, &size);
+    if (!fd)
+    {
+        DEBUG("Failed to open capture buffer");
+        usb_capture_start();
+        return;
+    }
+    ret = usb_capture_export_pcapng(fd);
+    fclose(fd);
+
+    if (!ret)
+    {
+        // Los mensajes de las otras tareas esperan, no pueden caer en medio del archivo
+        flockfile(stdout);
+        printf("pcapng %u\n", (unsigned) size);
+        fflush(stdout);
+        if (usb_cdc_write_blocking(&kb->cdc, file, size) != size)
+            DEBUG("Capture cut, %u bytes", (unsigned) size);
+        funlockfile(stdout);
+    }
+    free(file);
+    usb_capture_clear();
+    usb_capture_start();
+}
+#endif
+
+void keyboard_console_command(Keyboard_t *kb, char *line)
+{
+    if (!strcmp(line, "stats"))
+    {
+        hid_print_latency_budget(kb);
+        usb_cdc_print_stats(&kb->cdc);
+    }
+    else if (!strcmp(line, "timeline"))
+    {
+        timeline_print();
+    }
+    else if (!strncmp(line, "type ", 5))
+    {
+        if (keyboard_type(kb, line + 5))
+            DEBUG("Keyboard busy");
+    }
+#if USB_CAPTURE
+    else if (!strcmp(line, "capture"))
+    {
+        keyboard_console_capture(kb);
+    }
+#endif
+    else
+    {
+        DEBUG("Commands: stats, timeline, type <text>%s", USB_CAPTURE ? ", capture" : "");
+    }
+}
 
-    gpio_set_pull_mode(PIN_BUTTON_UP, GPIO_PULLUP_ONLY);
-    gpio_set_pull_mode(PIN_BUTTON_LEFT, GPIO_PULLUP_ONLY);
-    gpio_set_pull_mode(PIN_BUTTON_RIGHT, GPIO_PULLUP_ONLY);
+// Consola por el puerto CDC, una orden por linea
+void keyboard_console(Keyboard_t *kb)
+{
+    char c;
 
+    while (usb_cdc_read(&kb->cdc, &c, 1))
+    {
+        if (c == '\r' || c == '\n')
+        {
+            if (!kb->console_used)
+                continue;
+            kb->console_line[kb->console_used] = 0;
+            kb->console_used = 0;
+            keyboard_console_command(kb, kb->console_line);
+        }
+        else if (kb->console_used < CONSOLE_LINE - 1)
+        {
+            kb->console_line[kb->console_used++] = c;
+        }
+    }
+}
+#endif
+
+// Atiende un nucleo USB: cada teclado corre en su propia tarea
+void keyboard_task(void *arg)
+{
+    Keyboard_t *kb = arg;
     uint64_t ref_time = esp_timer_get_time();
-    bool toggle = 0;
+    uint64_t stats_time = ref_time;
+    uint64_t now, scan_end, poll_start;
+    uint8_t last_modifier = 0, last_keycode[6] = {0};
+#ifdef HID_MACRO_TEXT
+    bool typed = false;
+#endif
+#if USB_DFU
+    uint64_t restart_time = 0;
+#endif
+
     while (1)
     {
-        usb_poll();
-        if (!g_hid_running)
+        // La dispersion de la duracion de cada consulta muestra los fallos de cache de la flash
+        poll_start = esp_timer_get_time();
+        usb_poll(&kb->fpga);
+        latency_record(&kb->stats_poll, esp_timer_get_time() - poll_start);
+        if (kb->index == 0 && !timeline_get(kBootFirstReport))
+            keyboard_boot_progress(kb);
+#if USB_DFU
+        // En modo DFU solo se atiende el endpoint de control, el resto espera al reinicio
+        if (kb->index == 0 && kb->dfu.detached)
+        {
+            if (!restart_time && usb_dfu_manifested(&kb->dfu))
+            {
+                usb_dfu_print_stats(&kb->dfu);
+                restart_time = esp_timer_get_time() + DFU_RESTART_DELAY;
+            }
+            if (restart_time && esp_timer_get_time() > restart_time)
+                esp_restart();
+            continue;
+        }
+#endif
+#if USB_CDC
+        usb_cdc_service(&kb->cdc);
+        keyboard_console(kb);
+#endif
+#if USB_MSC
+        if (kb->index == 0)
+            usb_msc_service(&kb->msc);
+#endif
+#if HID_PROFILE
+        // El FPGA vacia el buffer de tx cuando el host recoge el reporte
+        if (kb->index == 0 && profiler_pending() == kProfileConsumed && usb_get_flags(&kb->fpga, 2).tx_empty)
+            profiler_mark(kProfileConsumed);
+#endif
+        if (!kb->hid_running || kb->suspended || !g_inputs_ready)
             continue;
 
-        if (esp_timer_get_time() - ref_time > 100 * 1000)
+#ifdef HID_MACRO_TEXT
+        if (!typed)
+            typed = !keyboard_type(kb, HID_MACRO_TEXT);
+#endif
+
+        now = esp_timer_get_time();
+        // Mientras se escribe un macro los botones esperan, el macro usa cada consulta del host
+        if (hid_macro_busy(&kb->macro))
         {
-            ref_time = esp_timer_get_time();
+            hid_macro_service(kb);
+            ref_time = now;
+            continue;
+        }
+        if (now - ref_time >= HID_REPORT_PERIOD)
+        {
+            // Mantener los reportes alineados al periodo en lugar de acumular el retraso del lazo
+            ref_time += HID_REPORT_PERIOD;
+            if (now - ref_time >= HID_REPORT_PERIOD)
+                ref_time = now; // Se perdieron periodos (p.ej. host sin configurar), resincronizar
+            else
+                latency_record(&kb->stats_jitter, now - ref_time);
 
-            uint8_t keycode[6] = {0};
+            uint8_t modifier, keycode[6];
+            uint32_t buttons = 0;
 
-            // Leer el estado de los botones y asignar teclas
-            if (gpio_get_level(PIN_BUTTON_UP) == 0) // Boton presionado (con pull-up, nivel bajo significa presionado)
-            {
-                 DEBUG("SE PRESIONO DOWN ARROW");
-                keycode[0] = 0x52; // Codigo de tecla para Up Arrow
-            }
-            else if (gpio_get_level(PIN_BUTTON_LEFT) == 0)
+            // Leer el estado de los botones (con pull-up, nivel bajo significa presionado)
+            for (int i = 0; i < BUTTONS; i++)
+                if (gpio_get_level(g_buttons[i]) == 0)
+                    buttons |= 1 << i;
+
+            // Solo los flancos pasan por el keymap, la tecla se resuelve con una busqueda en la tabla
+            uint32_t edges = buttons ^ kb->buttons;
+            for (int i = 0; i < BUTTONS; i++)
+                if (edges & (1 << i))
+                    keymap_event(&kb->keymap, i, buttons & (1 << i), now);
+            kb->buttons = buttons;
+            keymap_tick(&kb->keymap, now);
+            keymap_report(&kb->keymap, &modifier, keycode);
+
+            bool changed = modifier != last_modifier || memcmp(keycode, last_keycode, sizeof(keycode));
+            if (changed)
+                PROFILE_MARK(kb, kProfileReportChange);
+
+            scan_end = esp_timer_get_time();
+            latency_record(&kb->stats_scan, scan_end - now);
+
+            // Enviar el estado del teclado
+            PROFILE_MARK(kb, kProfileEnqueue);
+            if (!hid_send_keyboard_state(kb, modifier, 0, keycode))
             {
-                 DEBUG("SE PRESIONO LEFT ARROW");
-                keycode[0] = 0x50; // Codigo de tecla para Left Arrow
+                keymap_report_sent(&kb->keymap);
+                if (kb->index == 0 && !timeline_get(kBootFirstReport))
+                {
+                    timeline_mark(kBootFirstReport);
+                    timeline_print();
+                }
             }
-            else if (gpio_get_level(PIN_BUTTON_RIGHT) == 0)
+            latency_record(&kb->stats_transfer, esp_timer_get_time() - scan_end);
+
+            // Solo imprimir en los cambios y fuera del camino medido, a 1 kHz la consola no da abasto
+            if (changed)
             {
-                 DEBUG("SE PRESIONO RIGHT ARROW");
-                keycode[0] = 0x4F; // Codigo de tecla para Right Arrow
+                USB_TRACE("Teclado %i modificador 0x%02x tecla 0x%02x", kb->index, modifier, keycode[0]);
+                last_modifier = modifier;
+                memcpy(last_keycode, keycode, sizeof(keycode));
             }
+        }
 
-            // Enviar el estado del teclado
-            hid_send_keyboard_state(0, 0, keycode);
+#if HID_GAMEPAD
+        if (kb->index == 0)
+            hid_gamepad_service(kb);
+#endif
+#if HID_MOUSE
+        if (kb->index == 0)
+            hid_mouse_service(kb);
+#endif
+
+        if (now - stats_time > LATENCY_REPORT_PERIOD)
+        {
+            stats_time = now;
+            hid_print_latency_budget(kb);
+#if USB_MSC
+            if (kb->index == 0)
+                usb_msc_print_stats(&kb->msc);
+#endif
         }
     }
 }
+
+#if USB_DFU
+// Graba los bloques que llegan por el endpoint de control mientras el teclado recibe el siguiente
+void dfu_writer_task(void *arg)
+{
+    USBDFU_t *dfu = arg;
+
+    while (1)
+        usb_dfu_write_next(dfu);
+}
+#endif
+
+#if USB_MSC
+// El disco va en la particion de la flash si existe, si no en RAM y se pierde al apagar
+void storage_init(void)
+{
+    int sectors = msc_flash_open(&g_msc_flash, MSC_PARTITION);
+    if (sectors > 0)
+    {
+        msc_disk_init(&g_msc_disk, &msc_flash_ops, &g_msc_flash, sectors);
+    }
+    else
+    {
+        g_msc_ram.size = MSC_RAM_SECTORS * MSC_SECTOR_SIZE;
+        g_msc_ram.data = calloc(1, g_msc_ram.size);
+        ASSERT(g_msc_ram.data);
+        msc_disk_init(&g_msc_disk, &msc_ram_ops, &g_msc_ram, MSC_RAM_SECTORS);
+    }
+
+#if FAST_BOOT
+    // El host ve el medio insertado en su siguiente TEST UNIT READY
+    usb_msc_insert(&g_keyboards[0].msc, &g_msc_disk);
+#endif
+}
+#endif
+
+// Reparte los teclados entre los dos nucleos del ESP32
+void keyboard_start_tasks(void)
+{
+    for (int i = 0; i < USB_DEVICES; i++)
+    {
+        BaseType_t created = xTaskCreatePinnedToCore(keyboard_task, "keyboard", KEYBOARD_TASK_STACK, &g_keyboards[i], 1, NULL, i % 2);
+        ASSERT(created == pdPASS);
+    }
+#if USB_DFU
+    // En el otro nucleo que el primer teclado, bloqueada hasta que llega un bloque
+    BaseType_t created = xTaskCreatePinnedToCore(dfu_writer_task, "dfu", DFU_TASK_STACK, &g_keyboards[0].dfu, 2, NULL, 1);
+    ASSERT(created == pdPASS);
+#endif
+}
+
+// Todo lo que no hace falta para enumerar: botones y perfilador
+void inputs_init(void)
+{
+    // Configura los pines de los botones
+    for (int i = 0; i < BUTTONS; i++)
+    {
+        gpio_set_direction(g_buttons[i], GPIO_MODE_INPUT);
+        gpio_set_pull_mode(g_buttons[i], GPIO_PULLUP_ONLY);
+    }
+
+#if HID_PROFILE
+    profiler_init();
+    esp_err_t ret = gpio_install_isr_service(0);
+    ASSERT(ret == ESP_OK);
+    for (int i = 0; i < BUTTONS; i++)
+    {
+        gpio_set_intr_type(g_buttons[i], GPIO_INTR_ANYEDGE);
+        gpio_isr_handler_add(g_buttons[i], profiler_edge_isr, NULL);
+    }
+#endif
+
+#if HID_GAMEPAD
+    int analog = analog_input_init(&g_analog, g_analog_channels, ANALOG_AXES, g_analog_calibration, ANALOG_FILTER_SHIFT, ANALOG_SAMPLE_HZ);
+    ASSERT(analog == 0);
+#endif
+
+#if HID_MOUSE
+    motion_init(&g_motion);
+    int motion = motion_pcnt_init(&g_motion_pcnt, &g_motion, g_motion_pins, MOTION_ENCODERS);
+    ASSERT(motion == 0);
+#endif
+
+    g_inputs_ready = true;
+    timeline_mark(kBootInputsReady);
+}
+
+void app_main()
+{
+    esp_err_t ret;
+    spi_device_handle_t usb_spi;
+    spi_bus_config_t buscfg = {
+        .miso_io_num = PIN_NUM_MISO,
+        .mosi_io_num = PIN_NUM_MOSI,
+        .sclk_io_num = PIN_NUM_CLK,
+        .quadwp_io_num = PIN_NUM_WP,
+        .quadhd_io_num = PIN_NUM_HD,
+        .max_transfer_sz = 128,
+    };
+
+    spi_device_interface_config_t devcfg = {
+        .clock_speed_hz = 1 * 1000 * 1000, // Clock speed 1 MHz
+        .mode = 3,                         // SPI Mode 3
+        .queue_size = 100,
+#if USB_QUAD
+        .flags = SPI_DEVICE_HALFDUPLEX, // el driver solo acepta fases de 4 lineas en half duplex
+#endif
+        .cs_ena_pretrans = 1};
+
+    timeline_mark(kBootAppMain);
+
+    // Inicializa el bus SPI
+    ret = spi_bus_initialize(SPI_HOST, &buscfg, SPI_DMA_CH_AUTO);
+    ASSERT(ret == ESP_OK);
+    timeline_mark(kBootSPIReady);
+
+    usb_capture_start();
+
+#if USB_MSC && !FAST_BOOT
+    storage_init();
+#endif
+
+    for (int i = 0; i < USB_DEVICES; i++)
+    {
+        // Añade el dispositivo SPI
+        devcfg.spics_io_num = g_usb_cs_pins[i]; // CS pin
+        ret = spi_bus_add_device(SPI_HOST, &devcfg, &usb_spi);
+        ASSERT(ret == ESP_OK);
+
+        keyboard_init(&g_keyboards[i], i, usb_spi);
+    }
+    timeline_mark(kBootUSBReady);
+
+#if USB_CDC
+    // Los logs de todas las tareas van al puerto CDC del primer teclado, sin bloquear si nadie lee
+    FILE *log = usb_cdc_stream(&g_keyboards[0].cdc);
+    if (log)
+    {
+        _GLOBAL_REENT->_stdout = log;
+        stdout = log;
+    }
+#endif
+
+#if FAST_BOOT
+    // El host puede estar esperando respuesta al primer SETUP, los botones y el disco no hacen falta hasta configurar
+    keyboard_start_tasks();
+#if USB_MSC
+    storage_init();
+#endif
+    inputs_init();
+#else
+    inputs_init();
+    keyboard_start_tasks();
+#endif
+}
@@ -0,0 +1,79 @@
+#include "motion.h"
+
+#include <string.h>
+
+
+static int8_t motion_clamp(int32_t counts) {
+    if (counts > MOTION_DELTA_MAX)
+        return MOTION_DELTA_MAX;
+    if (counts < -MOTION_DELTA_MAX)
+        return -MOTION_DELTA_MAX;
+    return counts;
+}
+
+void motion_init(MotionAccumulator_t *motion) {
+    memset(motion, 0, sizeof(MotionAccumulator_t));
+}
+
+/*Compare and swap so the backlog saturates instead of wrapping, the source
+never waits for the report side*/
+void motion_add(MotionAccumulator_t *motion, MotionAxis_t axis, int32_t counts) {
+    int32_t old = atomic_load_explicit(&motion->pending[axis], memory_order_relaxed);
+    int64_t next, dropped;
+
+    do {
+        next = (int64_t) old + counts;
+        if (next > MOTION_BACKLOG_MAX)
+            next = MOTION_BACKLOG_MAX;
+        else if (next < -MOTION_BACKLOG_MAX)
+            next = -MOTION_BACKLOG_MAX;
+    } while (!atomic_compare_exchange_weak_explicit(&motion->pending[axis], &old, (int32_t) next,
+                                                    memory_order_relaxed, memory_order_relaxed));
+
+    dropped = (int64_t) old + counts - next;
+    if (dropped)
+        atomic_fetch_add_explicit(&motion->saturated, dropped < 0 ? -dropped : dropped, memory_order_relaxed);
+}
+
+void motion_set_buttons(MotionAccumulator_t *motion, uint8_t buttons) {
+    atomic_store_explicit(&motion->buttons, buttons, memory_order_relaxed);
+    atomic_fetch_or_explicit(&motion->clicks, buttons, memory_order_relaxed);
+}
+
+bool motion_peek(MotionAccumulator_t *motion, HIDMouseReport_t *report) {
+    report->buttons = atomic_load_explicit(&motion->buttons, memory_order_relaxed) |
+                      atomic_load_explicit(&motion->clicks, memory_order_relaxed);
+    report->x = motion_clamp(atomic_load_explicit(&motion->pending[kMotionX], memory_order_relaxed));
+    report->y = motion_clamp(atomic_load_explicit(&motion->pending[kMotionY], memory_order_relaxed));
+    report->wheel = motion_clamp(atomic_load_explicit(&motion->pending[kMotionWheel], memory_order_relaxed));
+
+    return report->x || report->y || report->wheel || report->buttons != motion->reported_buttons;
+}
+
+/*Subtracts what was sent, whatever the sources added since the peek stays*/
+void motion_commit(MotionAccumulator_t *motion, const HIDMouseReport_t *report) {
+    const int8_t sent[MOTION_AXES] = {report->x, report->y, report->wheel};
+    bool split = false;
+    int32_t old;
+
+    for (int i = 0; i < MOTION_AXES; i++) {
+        if (!sent[i])
+            continue;
+        old = atomic_fetch_sub_explicit(&motion->pending[i], sent[i], memory_order_relaxed);
+        if (old > MOTION_DELTA_MAX || old < -MOTION_DELTA_MAX)
+            split = true;
+    }
+    atomic_fetch_and_explicit(&motion->clicks, ~(uint32_t) report->buttons, memory_order_relaxed);
+
+    motion->reported_buttons = report->buttons;
+    motion->reports++;
+    if (split)
+        motion->splits++;
+}
+
+void motion_clear(MotionAccumulator_t *motion) {
+    for (int i = 0; i < MOTION_AXES; i++)
+        atomic_store_explicit(&motion->pending[i], 0, memory_order_relaxed);
+    atomic_store_explicit(&motion->clicks, 0, memory_order_relaxed);
+    motion->reported_buttons = 0;
+}
@@ -0,0 +1,51 @@
+
+
+
+#ifndef MOTION_H_
+#define MOTION_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "hid_reports.h"
+
+/*Pointer motion between host polls. Sources add counts from any task or
+interrupt without a lock, the report side takes up to MOTION_DELTA_MAX per
+axis and subtracts only what it sent, so a fast move is split over the next
+reports and nothing is lost. Reports go out once per host poll whatever the
+sample rate. No platform code here, it runs the same on the host*/
+
+#define MOTION_AXES 3
+#define MOTION_DELTA_MAX 127 //matches the 8 bit mouse report fields
+#define MOTION_BACKLOG_MAX (1 << 20) //counts held per axis while the host does not poll
+
+typedef enum {
+    kMotionX,
+    kMotionY,
+    kMotionWheel
+} MotionAxis_t;
+
+typedef struct {
+    _Atomic int32_t pending[MOTION_AXES];
+    _Atomic uint32_t buttons;
+    _Atomic uint32_t clicks; //presses not reported yet, a click shorter than a poll still shows
+    _Atomic uint32_t saturated; //counts dropped at MOTION_BACKLOG_MAX
+
+    //report side only
+    uint8_t reported_buttons;
+    uint32_t reports;
+    uint32_t splits; //reports that left motion for the next one
+} MotionAccumulator_t;
+
+void motion_init(MotionAccumulator_t *motion);
+void motion_add(MotionAccumulator_t *motion, MotionAxis_t axis, int32_t counts);
+void motion_set_buttons(MotionAccumulator_t *motion, uint8_t buttons);
+/*Next report, false when there is neither motion nor a button change.
+Nothing is taken until motion_commit, call it once the report went out*/
+bool motion_peek(MotionAccumulator_t *motion, HIDMouseReport_t *report);
+void motion_commit(MotionAccumulator_t *motion, const HIDMouseReport_t *report);
+/*Drops the motion nobody will report, e.g. after a bus reset*/
+void motion_clear(MotionAccumulator_t *motion);
+
+#endif
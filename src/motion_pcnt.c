@@ -0,0 +1,87 @@
+#include "motion_pcnt.h"
+#include "util.h"
+
+#include <string.h>
+
+#define DEBUG_CNTX "motion-pcnt"
+
+
+static int motion_pcnt_unit(MotionPcnt_t *pcnt, int axis, const MotionPcntPins_t *pins) {
+    pcnt_unit_config_t unit_config = {
+        .low_limit = -MOTION_PCNT_LIMIT,
+        .high_limit = MOTION_PCNT_LIMIT,
+        .flags.accum_count = 1,
+    };
+    pcnt_glitch_filter_config_t filter = {
+        .max_glitch_ns = MOTION_PCNT_GLITCH_NS,
+    };
+    pcnt_chan_config_t a_config = {
+        .edge_gpio_num = pins->a,
+        .level_gpio_num = pins->b,
+    };
+    pcnt_chan_config_t b_config = {
+        .edge_gpio_num = pins->b,
+        .level_gpio_num = pins->a,
+    };
+    pcnt_channel_handle_t a, b;
+    pcnt_unit_handle_t unit;
+
+    if (pcnt_new_unit(&unit_config, &unit) != ESP_OK)
+        return -1;
+    pcnt->unit[axis] = unit;
+
+    //both edges of both phases, the level of the other phase gives the direction
+    if (pcnt_unit_set_glitch_filter(unit, &filter) != ESP_OK ||
+        pcnt_new_channel(unit, &a_config, &a) != ESP_OK ||
+        pcnt_new_channel(unit, &b_config, &b) != ESP_OK ||
+        pcnt_channel_set_edge_action(a, PCNT_CHANNEL_EDGE_ACTION_DECREASE, PCNT_CHANNEL_EDGE_ACTION_INCREASE) != ESP_OK ||
+        pcnt_channel_set_level_action(a, PCNT_CHANNEL_LEVEL_ACTION_KEEP, PCNT_CHANNEL_LEVEL_ACTION_INVERSE) != ESP_OK ||
+        pcnt_channel_set_edge_action(b, PCNT_CHANNEL_EDGE_ACTION_INCREASE, PCNT_CHANNEL_EDGE_ACTION_DECREASE) != ESP_OK ||
+        pcnt_channel_set_level_action(b, PCNT_CHANNEL_LEVEL_ACTION_KEEP, PCNT_CHANNEL_LEVEL_ACTION_INVERSE) != ESP_OK ||
+        pcnt_unit_add_watch_point(unit, -MOTION_PCNT_LIMIT) != ESP_OK ||
+        pcnt_unit_add_watch_point(unit, MOTION_PCNT_LIMIT) != ESP_OK ||
+        pcnt_unit_enable(unit) != ESP_OK ||
+        pcnt_unit_clear_count(unit) != ESP_OK ||
+        pcnt_unit_start(unit) != ESP_OK)
+        return -1;
+    return 0;
+}
+
+int motion_pcnt_init(MotionPcnt_t *pcnt, MotionAccumulator_t *motion, const MotionPcntPins_t *pins, uint8_t axes) {
+    ASSERT(axes > 0 && axes <= MOTION_AXES);
+    memset(pcnt, 0, sizeof(MotionPcnt_t));
+    pcnt->motion = motion;
+    pcnt->axes = axes;
+
+    for (int i = 0; i < axes; i++) {
+        if (motion_pcnt_unit(pcnt, i, &pins[i])) {
+            DEBUG("Failed to start the pulse counter of axis %i", i);
+            return -1;
+        }
+    }
+
+    DEBUG("Counting %u quadrature axes", axes);
+    return 0;
+}
+
+void motion_pcnt_service(MotionPcnt_t *pcnt) {
+    int count;
+
+    pcnt->reads++;
+    for (int i = 0; i < pcnt->axes; i++) {
+        if (pcnt_unit_get_count(pcnt->unit[i], &count) != ESP_OK) {
+            pcnt->errors++;
+            continue;
+        }
+        if (count != pcnt->last[i])
+            motion_add(pcnt->motion, i, count - pcnt->last[i]);
+        pcnt->last[i] = count;
+    }
+}
+
+void motion_pcnt_print_stats(MotionPcnt_t *pcnt) {
+    MotionAccumulator_t *motion = pcnt->motion;
+
+    DEBUG("Motion: %u reads, %u errors, %u reports, %u split, %u counts saturated", (unsigned) pcnt->reads, (unsigned) pcnt->errors,
+          (unsigned) motion->reports, (unsigned) motion->splits, (unsigned) atomic_load(&motion->saturated));
+}
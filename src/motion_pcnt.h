@@ -0,0 +1,36 @@
+
+
+
+#ifndef MOTION_PCNT_H_
+#define MOTION_PCNT_H_
+
+#include <stdint.h>
+
+#include "driver/pulse_cnt.h"
+#include "motion.h"
+
+#define MOTION_PCNT_LIMIT 30000 //watch points, the driver carries the count past the 16 bit hardware
+#define MOTION_PCNT_GLITCH_NS 1000
+
+typedef struct {
+    int a, b; //quadrature phases
+} MotionPcntPins_t;
+
+/*Quadrature encoders on the pulse counter: the hardware counts every edge
+(x4 decoding) so the software only reads the counts once per loop and adds
+what moved since the last read to the accumulator*/
+typedef struct {
+    MotionAccumulator_t *motion;
+    uint8_t axes;
+    pcnt_unit_handle_t unit[MOTION_AXES];
+    int last[MOTION_AXES];
+
+    uint32_t reads, errors;
+} MotionPcnt_t;
+
+/*One pcnt unit per axis, in MotionAxis_t order*/
+int motion_pcnt_init(MotionPcnt_t *pcnt, MotionAccumulator_t *motion, const MotionPcntPins_t *pins, uint8_t axes);
+void motion_pcnt_service(MotionPcnt_t *pcnt);
+void motion_pcnt_print_stats(MotionPcnt_t *pcnt);
+
+#endif
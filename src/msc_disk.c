@@ -0,0 +1,214 @@
+#include "msc_disk.h"
+#include "util.h"
+
+#include <string.h>
+
+#define DEBUG_CNTX "msc-disk"
+
+#define MSC_BLOCK_FULL ((uint32_t) ((1ULL << MSC_BLOCK_SECTORS) - 1))
+
+
+void msc_disk_init(MSCDisk_t *disk, const MSCDiskOps_t *ops, void *context, uint32_t sectors) {
+    memset(disk, 0, sizeof(MSCDisk_t));
+    disk->ops = ops;
+    disk->context = context;
+    disk->sectors = sectors - sectors % MSC_BLOCK_SECTORS;
+    disk->prefetch = -1;
+    disk->writing = -1;
+    for (int i = 0; i < MSC_CACHE_LINES; i++)
+        disk->lines[i].block = -1;
+}
+
+static MSCCacheLine_t *msc_disk_lookup(MSCDisk_t *disk, int32_t block) {
+    for (int i = 0; i < MSC_CACHE_LINES; i++)
+        if (disk->lines[i].block == block)
+            return &disk->lines[i];
+    return NULL;
+}
+
+/*Reads the sectors the line does not have yet, in runs*/
+static int msc_disk_fill(MSCDisk_t *disk, MSCCacheLine_t *line) {
+    uint32_t offset = line->block * MSC_BLOCK_SIZE;
+    int start, end;
+
+    for (start = 0; start < MSC_BLOCK_SECTORS; start = end) {
+        if (line->valid & (1 << start)) {
+            end = start + 1;
+            continue;
+        }
+        for (end = start; end < MSC_BLOCK_SECTORS && !(line->valid & (1 << end)); end++);
+
+        if (disk->ops->read(disk->context, offset + start * MSC_SECTOR_SIZE, &line->data[start * MSC_SECTOR_SIZE], (end - start) * MSC_SECTOR_SIZE)) {
+            disk->errors++;
+            return -1;
+        }
+    }
+
+    line->valid = MSC_BLOCK_FULL;
+    disk->block_reads++;
+    return 0;
+}
+
+/*Partially written blocks are completed from the backend first, the erase
+takes the whole block*/
+static int msc_disk_flush_line(MSCDisk_t *disk, MSCCacheLine_t *line) {
+    if (!line->dirty)
+        return 0;
+
+    if (line->valid != MSC_BLOCK_FULL && msc_disk_fill(disk, line))
+        return -1;
+
+    if (disk->ops->write_block(disk->context, line->block * MSC_BLOCK_SIZE, line->data)) {
+        DEBUG("Failed to write block %i", (int) line->block);
+        disk->errors++;
+        return -1;
+    }
+    line->dirty = 0;
+    disk->block_writes++;
+    return 0;
+}
+
+/*Least recently used line, flushed and emptied for block*/
+static MSCCacheLine_t *msc_disk_evict(MSCDisk_t *disk, int32_t block) {
+    MSCCacheLine_t *line = &disk->lines[0];
+
+    for (int i = 1; i < MSC_CACHE_LINES; i++)
+        if (disk->lines[i].used < line->used)
+            line = &disk->lines[i];
+
+    if (msc_disk_flush_line(disk, line))
+        return NULL;
+
+    line->block = block;
+    line->valid = 0;
+    line->dirty = 0;
+    return line;
+}
+
+int msc_disk_read(MSCDisk_t *disk, uint32_t sector, void *data) {
+    int32_t block = sector / MSC_BLOCK_SECTORS;
+    uint32_t index = sector % MSC_BLOCK_SECTORS;
+    MSCCacheLine_t *line;
+
+    if (sector >= disk->sectors)
+        return -1;
+
+    line = msc_disk_lookup(disk, block);
+    if (line && (line->valid & (1 << index))) {
+        disk->hits++;
+    } else {
+        disk->misses++;
+        if (!line)
+            line = msc_disk_evict(disk, block);
+        if (!line || msc_disk_fill(disk, line))
+            return -1;
+    }
+    line->used = ++disk->clock;
+    memcpy(data, &line->data[index * MSC_SECTOR_SIZE], MSC_SECTOR_SIZE);
+
+    //sequential reader: have the next block ready before it gets there
+    if (sector == disk->next_sector && (uint32_t) (block + 1) * MSC_BLOCK_SECTORS < disk->sectors && !msc_disk_lookup(disk, block + 1))
+        disk->prefetch = block + 1;
+    disk->next_sector = sector + 1;
+    return 0;
+}
+
+int msc_disk_write(MSCDisk_t *disk, uint32_t sector, const void *data) {
+    int32_t block = sector / MSC_BLOCK_SECTORS;
+    uint32_t index = sector % MSC_BLOCK_SECTORS;
+    MSCCacheLine_t *line;
+
+    if (sector >= disk->sectors)
+        return -1;
+
+    //nothing is read here, the rest of the block is only needed at flush time
+    line = msc_disk_lookup(disk, block);
+    if (!line)
+        line = msc_disk_evict(disk, block);
+    if (!line)
+        return -1;
+
+    line->used = ++disk->clock;
+    memcpy(&line->data[index * MSC_SECTOR_SIZE], data, MSC_SECTOR_SIZE);
+    line->valid |= 1 << index;
+    line->dirty |= 1 << index;
+
+    disk->writing = block;
+    disk->written = true;
+    return 0;
+}
+
+int msc_disk_flush(MSCDisk_t *disk) {
+    int ret = 0;
+
+    for (int i = 0; i < MSC_CACHE_LINES; i++)
+        if (msc_disk_flush_line(disk, &disk->lines[i]))
+            ret = -1;
+    disk->writing = -1;
+    return ret;
+}
+
+void msc_disk_idle(MSCDisk_t *disk, uint64_t now) {
+    MSCCacheLine_t *line;
+
+    if (disk->written) {
+        disk->written = false;
+        disk->last_write = now;
+    }
+
+    //one backend operation per call, the caller gets back to the link in between
+    for (int i = 0; i < MSC_CACHE_LINES; i++) {
+        line = &disk->lines[i];
+        if (line->dirty && (line->block != disk->writing || now - disk->last_write > MSC_FLUSH_DELAY_US)) {
+            msc_disk_flush_line(disk, line);
+            if (line->block == disk->writing)
+                disk->writing = -1;
+            return;
+        }
+    }
+
+    if (disk->prefetch >= 0) {
+        if (!msc_disk_lookup(disk, disk->prefetch)) {
+            line = msc_disk_evict(disk, disk->prefetch);
+            if (line && !msc_disk_fill(disk, line)) {
+                line->used = ++disk->clock;
+                disk->prefetches++;
+            } else if (line) {
+                line->block = -1;
+            }
+        }
+        disk->prefetch = -1;
+    }
+}
+
+void msc_disk_print_stats(MSCDisk_t *disk) {
+    DEBUG("Disk %u sectors, %u hits, %u misses, %u read-ahead, %u block reads, %u block writes, %u errors",
+          (unsigned) disk->sectors, (unsigned) disk->hits, (unsigned) disk->misses, (unsigned) disk->prefetches,
+          (unsigned) disk->block_reads, (unsigned) disk->block_writes, (unsigned) disk->errors);
+}
+
+
+////////////////////////////////////// RAM backend /////////////////////////////////
+
+static int msc_ram_read(void *context, uint32_t offset, void *data, size_t length) {
+    MSCRamDisk_t *ram = context;
+
+    if (offset + length > ram->size)
+        return -1;
+    memcpy(data, ram->data + offset, length);
+    return 0;
+}
+
+static int msc_ram_write_block(void *context, uint32_t offset, const void *data) {
+    MSCRamDisk_t *ram = context;
+
+    if (offset + MSC_BLOCK_SIZE > ram->size)
+        return -1;
+    memcpy(ram->data + offset, data, MSC_BLOCK_SIZE);
+    return 0;
+}
+
+const MSCDiskOps_t msc_ram_ops = {
+    .read = msc_ram_read,
+    .write_block = msc_ram_write_block,
+};
@@ -0,0 +1,74 @@
+
+
+
+#ifndef MSC_DISK_H_
+#define MSC_DISK_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*Sector cache in front of a block storage backend. The unit of the cache is
+the flash erase block: a miss loads the whole block, so a sequential reader
+finds the next sectors already there, and writes are collected in the block
+until it is flushed with a single erase and program. No platform code here,
+the RAM backend runs the same on the host*/
+
+#define MSC_SECTOR_SIZE 512
+#define MSC_BLOCK_SIZE 4096 //flash erase block
+#define MSC_BLOCK_SECTORS (MSC_BLOCK_SIZE / MSC_SECTOR_SIZE)
+#define MSC_CACHE_LINES 4
+#define MSC_FLUSH_DELAY_US (200 * 1000) //dirty blocks are written once the host stops writing this long
+
+/*Backend storage. read takes any sector aligned range, write_block erases
+and programs one whole block*/
+typedef struct {
+    int (*read)(void *context, uint32_t offset, void *data, size_t length);
+    int (*write_block)(void *context, uint32_t offset, const void *data);
+} MSCDiskOps_t;
+
+typedef struct {
+    int32_t block; //-1 if unused
+    uint32_t valid; //sector mask, loaded or written
+    uint32_t dirty; //sector mask, written and not flushed yet
+    uint32_t used; //lru stamp
+    uint8_t data[MSC_BLOCK_SIZE];
+} MSCCacheLine_t;
+
+typedef struct {
+    const MSCDiskOps_t *ops;
+    void *context;
+    uint32_t sectors;
+
+    MSCCacheLine_t lines[MSC_CACHE_LINES];
+    uint32_t clock;
+    uint32_t next_sector; //where a sequential reader goes next
+    int32_t prefetch; //block to read ahead on the next idle call, -1 if none
+    int32_t writing; //block of the last write, kept open to coalesce the next ones
+    bool written; //writes since the last idle call
+    uint64_t last_write; //us
+
+    uint32_t hits, misses;
+    uint32_t prefetches;
+    uint32_t block_reads, block_writes;
+    uint32_t errors;
+} MSCDisk_t;
+
+void msc_disk_init(MSCDisk_t *disk, const MSCDiskOps_t *ops, void *context, uint32_t sectors);
+int msc_disk_read(MSCDisk_t *disk, uint32_t sector, void *data);
+int msc_disk_write(MSCDisk_t *disk, uint32_t sector, const void *data);
+int msc_disk_flush(MSCDisk_t *disk);
+/*Background work while the link is busy or idle: read-ahead of the next
+block and flush of the blocks the writer moved away from*/
+void msc_disk_idle(MSCDisk_t *disk, uint64_t now);
+void msc_disk_print_stats(MSCDisk_t *disk);
+
+/*RAM backend, a volatile disk that also runs the cache on the host*/
+typedef struct {
+    uint8_t *data;
+    size_t size;
+} MSCRamDisk_t;
+
+extern const MSCDiskOps_t msc_ram_ops;
+
+#endif
@@ -0,0 +1,37 @@
+#include "msc_flash.h"
+#include "util.h"
+
+#define DEBUG_CNTX "msc-flash"
+
+
+int msc_flash_open(MSCFlash_t *flash, const char *label) {
+    flash->partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+    if (!flash->partition) {
+        DEBUG("No partition %s", label);
+        return -1;
+    }
+    if (flash->partition->address % MSC_BLOCK_SIZE) {
+        DEBUG("Partition %s not aligned to the erase block", label);
+        return -1;
+    }
+    return flash->partition->size / MSC_SECTOR_SIZE;
+}
+
+static int msc_flash_read(void *context, uint32_t offset, void *data, size_t length) {
+    MSCFlash_t *flash = context;
+
+    return esp_partition_read(flash->partition, offset, data, length) == ESP_OK ? 0 : -1;
+}
+
+static int msc_flash_write_block(void *context, uint32_t offset, const void *data) {
+    MSCFlash_t *flash = context;
+
+    if (esp_partition_erase_range(flash->partition, offset, MSC_BLOCK_SIZE) != ESP_OK)
+        return -1;
+    return esp_partition_write(flash->partition, offset, data, MSC_BLOCK_SIZE) == ESP_OK ? 0 : -1;
+}
+
+const MSCDiskOps_t msc_flash_ops = {
+    .read = msc_flash_read,
+    .write_block = msc_flash_write_block,
+};
@@ -0,0 +1,19 @@
+
+
+#ifndef MSC_FLASH_H_
+#define MSC_FLASH_H_
+
+#include "esp_partition.h"
+#include "msc_disk.h"
+
+/*Disk backend on a data partition of the SPI flash*/
+typedef struct {
+    const esp_partition_t *partition;
+} MSCFlash_t;
+
+extern const MSCDiskOps_t msc_flash_ops;
+
+/*Finds the partition by label, returns its size in sectors or -1*/
+int msc_flash_open(MSCFlash_t *flash, const char *label);
+
+#endif
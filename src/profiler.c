@@ -0,0 +1,110 @@
+#include "profiler.h"
+#include "usb_port.h"
+#include "util.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+#define DEBUG_CNTX "profiler"
+
+
+static struct {
+    uint64_t times[kProfileStages];
+    volatile ProfileStage_t next;
+    uint32_t dropped;
+    /*stats[i] is the time between stage i - 1 and i, stats[0] is end to end*/
+    LatencyStats_t stats[kProfileStages];
+    USBLock_t lock; //the isr and the keyboard task on the other core
+} g_profiler = {
+    .lock = USB_LOCK_INITIALIZER
+};
+
+static const char *g_stage_names[kProfileStages] = {
+    [kProfileEdge] = "edge to consumed",
+    [kProfileReportChange] = "edge to report change",
+    [kProfileEnqueue] = "change to enqueue",
+    [kProfileSPIStart] = "enqueue to spi start",
+    [kProfileSPIEnd] = "spi transfer",
+    [kProfileConsumed] = "spi end to host poll",
+};
+
+
+void profiler_init(void) {
+    g_profiler.next = kProfileEdge;
+    g_profiler.dropped = 0;
+    for (int i = 0; i < kProfileStages; i++)
+        latency_init(&g_profiler.stats[i], g_stage_names[i]);
+}
+
+void USB_ISR profiler_edge_isr(void *arg) {
+    uint64_t now = usb_port_time_us();
+
+    usb_port_lock(&g_profiler.lock);
+    /*bounces of an event already in flight are ignored*/
+    if (g_profiler.next == kProfileEdge || now - g_profiler.times[kProfileEdge] >= PROFILE_TIMEOUT) {
+        g_profiler.times[kProfileEdge] = now;
+        g_profiler.next = kProfileReportChange;
+    }
+    usb_port_unlock(&g_profiler.lock);
+}
+
+void profiler_mark(ProfileStage_t stage) {
+    uint64_t times[kProfileStages];
+    uint64_t now;
+    ProfileStage_t next;
+    bool finished = false;
+
+    //nothing in flight, the common case in the scan loop
+    if (g_profiler.next == kProfileEdge)
+        return;
+
+    usb_port_lock(&g_profiler.lock);
+    now = usb_port_time_us();
+    next = g_profiler.next;
+
+    //a retried transfer restarts the spi stage
+    if (stage == kProfileSPIStart && next == kProfileSPIEnd)
+        next = kProfileSPIStart;
+
+    if (next == kProfileEdge) {
+        //finished or dropped while waiting for the lock
+    } else if (now - g_profiler.times[kProfileEdge] > PROFILE_TIMEOUT) {
+        g_profiler.dropped++;
+        g_profiler.next = kProfileEdge;
+    } else if (stage == next) {
+        g_profiler.times[stage] = now;
+        g_profiler.next = stage + 1;
+        if (stage == kProfileConsumed) {
+            //the isr may start the next event as soon as the lock is released
+            memcpy(times, g_profiler.times, sizeof(times));
+            g_profiler.next = kProfileEdge;
+            finished = true;
+        }
+    }
+    usb_port_unlock(&g_profiler.lock);
+
+    if (!finished)
+        return;
+
+    for (int i = kProfileReportChange; i < kProfileStages; i++)
+        latency_record(&g_profiler.stats[i], times[i] - times[i - 1]);
+    latency_record(&g_profiler.stats[kProfileEdge], now - times[kProfileEdge]);
+}
+
+ProfileStage_t profiler_pending(void) {
+    return g_profiler.next;
+}
+
+const LatencyStats_t *profiler_stats(ProfileStage_t stage) {
+    return &g_profiler.stats[stage];
+}
+
+uint32_t profiler_dropped(void) {
+    return g_profiler.dropped;
+}
+
+void profiler_print(void) {
+    DEBUG("Keypress to wire, %u events dropped", (unsigned) g_profiler.dropped);
+    for (int i = 0; i < kProfileStages; i++)
+        latency_print(&g_profiler.stats[i]);
+}
@@ -0,0 +1,35 @@
+
+
+#ifndef PROFILER_H_
+#define PROFILER_H_
+
+#include <stdint.h>
+
+#include "latency.h"
+
+/*Keypress to wire profiler. Stages must be marked in order, one key event is
+tracked at a time and events with missing stages are discarded. Times and
+locking come from usb_port.h, so it also runs on the host against the
+simulated core*/
+typedef enum {
+    kProfileEdge, //gpio edge, marked from the isr
+    kProfileReportChange, //scan produced a different report
+    kProfileEnqueue, //report built
+    kProfileSPIStart, //start of the report write on the wire
+    kProfileSPIEnd,
+    kProfileConsumed, //fpga says the host took the report
+    kProfileStages
+} ProfileStage_t;
+
+#define PROFILE_TIMEOUT (500 * 1000) //us, older unfinished events are dropped
+
+void profiler_init(void);
+void profiler_edge_isr(void *arg);
+void profiler_mark(ProfileStage_t stage);
+ProfileStage_t profiler_pending(void);
+/*stats[stage] is the time from the previous stage, kProfileEdge is end to end*/
+const LatencyStats_t *profiler_stats(ProfileStage_t stage);
+uint32_t profiler_dropped(void);
+void profiler_print(void);
+
+#endif
@@ -0,0 +1,55 @@
+#include "timeline.h"
+#include "usb_port.h"
+#include "util.h"
+
+#define DEBUG_CNTX "timeline"
+
+
+static volatile uint64_t g_timeline[kBootPhases];
+static USBLock_t g_timeline_lock = USB_LOCK_INITIALIZER; //marked from every keyboard task
+
+static const char *g_phase_names[kBootPhases] = {
+    [kBootAppMain] = "app_main",
+    [kBootSPIReady] = "spi bus ready",
+    [kBootUSBReady] = "usb stack ready",
+    [kBootFirstPoll] = "first poll",
+    [kBootFirstSetup] = "first setup",
+    [kBootFirstResponse] = "first setup answered",
+    [kBootAddressed] = "address set",
+    [kBootConfigured] = "configured",
+    [kBootInputsReady] = "inputs ready",
+    [kBootFirstReport] = "first report",
+};
+
+
+void timeline_mark(BootPhase_t phase) {
+    if (g_timeline[phase])
+        return;
+
+    usb_port_lock(&g_timeline_lock);
+    if (!g_timeline[phase])
+        g_timeline[phase] = usb_port_time_us();
+    usb_port_unlock(&g_timeline_lock);
+}
+
+uint64_t timeline_get(BootPhase_t phase) {
+    return g_timeline[phase];
+}
+
+void timeline_print(void) {
+    uint64_t last = 0;
+
+    DEBUG("Startup timeline (us since app start)");
+    for (int i = 0; i < kBootPhases; i++) {
+        if (!g_timeline[i]) {
+            DEBUG("  %-22s -", g_phase_names[i]);
+            continue;
+        }
+        DEBUG("  %-22s %8u  +%u", g_phase_names[i], (unsigned) g_timeline[i],
+              (unsigned) (g_timeline[i] > last ? g_timeline[i] - last : 0));
+        if (g_timeline[i] > last)
+            last = g_timeline[i];
+    }
+    if (g_timeline[kBootFirstResponse])
+        DEBUG("Time to first setup response: %u us", (unsigned) g_timeline[kBootFirstResponse]);
+}
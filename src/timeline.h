@@ -0,0 +1,29 @@
+
+
+#ifndef TIMELINE_H_
+#define TIMELINE_H_
+
+#include <stdint.h>
+
+/*Startup timeline, each phase keeps the time it was first reached. Times are
+usb_port_time_us, on the esp the esp_timer that starts counting after the
+bootloader hands over*/
+typedef enum {
+    kBootAppMain,
+    kBootSPIReady,
+    kBootUSBReady, //descriptors registered, control endpoint can be served
+    kBootFirstPoll,
+    kBootFirstSetup,
+    kBootFirstResponse, //first setup packet answered
+    kBootAddressed,
+    kBootConfigured, //class running, host asked for reports
+    kBootInputsReady,
+    kBootFirstReport,
+    kBootPhases
+} BootPhase_t;
+
+void timeline_mark(BootPhase_t phase);
+uint64_t timeline_get(BootPhase_t phase); //0 if not reached yet
+void timeline_print(void);
+
+#endif
@@ -2,42 +2,160 @@
 #include "usb.h"
 #include "usb_fpga.h"
 #include "util.h"
+#include "usb_capture.h"
 
 #include <string.h>
 
 #define DEBUG_CNTX "usb"
 
-#define MAX_CONFIGURATION 1
-#define MAX_INTERFACES 5
+//config, then association, interface, class and endpoints of every interface
+#define CONFIG_SEGMENTS (1 + MAX_INTERFACES * (3 + FPGA_ENDPOINTS))
 
 
+void usb_device_init(USBDevice_t *dev, USBFpga_t *fpga, void *context) {
+    memset(dev, 0, sizeof(USBDevice_t));
+    dev->fpga = fpga;
+    dev->context = context;
+    fpga->context = dev;
+}
+
+/*Another descriptor set takes over the fpga core, the host sees it on the next enumeration*/
+void usb_device_attach(USBDevice_t *dev) {
+    dev->fpga->context = dev;
+}
+
+//a new configuration or a bus reset starts every interface on its default setting
+static void usb_default_alternates(USBDevice_t *dev) {
+    for (int i = 0; i < MAX_INTERFACES; i++) {
+        if (dev->alternate[i]) {
+            dev->alternate[i] = 0;
+            if (dev->interface_handler)
+                dev->interface_handler(dev, i, 0);
+        }
+    }
+}
 
+/*Back to the default state, the fpga core already dropped the address. A
+control transfer cut by the reset is forgotten, the next setup starts anew*/
+void usb_bus_event(USBFpga_t *fpga, USBBusEvent_t event) {
+    USBDevice_t *dev = fpga->context;
 
-DeviceDescriptor_t *g_device_descriptor = NULL;
+    if (event != kBusReset)
+        return;
 
-struct {
-    ConfigurationDescriptor_t *descriptor;
-    struct {
-        InterfaceDescriptor_t *descriptor;
-        EndpointDescriptor_t *endpoints[FPGA_ENDPOINTS];
-        uint8_t *class_descriptor;
-        size_t class_size;
-        ControlHandler_t class_handler;
-    } interface_tree[MAX_INTERFACES];
-    
-} g_config_tree[MAX_CONFIGURATION] = {0};
-uint8_t g_config_used = 0;
-uint8_t g_config_selected = 0;
+    dev->data_stage.handler = NULL;
+    dev->configured = false;
+    dev->config_selected = 0;
+    usb_default_alternates(dev);
+}
+
+//descriptor tree entry for interface id + alternate setting of the selected config, -1 if unknown
+static int usb_find_interface(USBDevice_t *dev, uint8_t interface, uint8_t alternate) {
+    uint8_t config_index = dev->config_selected < dev->config_used ? dev->config_selected : 0;
+
+    for (int i = 0; i < dev->config_tree[config_index].interfaces_used; i++) {
+        InterfaceDescriptor_t *descriptor = dev->config_tree[config_index].interface_tree[i].descriptor;
+        if (descriptor->interface_id == interface && descriptor->alternate_settings == alternate)
+            return i;
+    }
+    return -1;
+}
+
+//interface entry owning an endpoint address, -1 if none
+static int usb_find_endpoint_interface(USBDevice_t *dev, uint8_t endp_address) {
+    uint8_t config_index = dev->config_selected < dev->config_used ? dev->config_selected : 0;
+
+    for (int i = 0; i < dev->config_tree[config_index].interfaces_used; i++)
+        for (int j = 0; j < dev->config_tree[config_index].interface_tree[i].descriptor->endpoints_count; j++)
+            if (dev->config_tree[config_index].interface_tree[i].endpoints[j]->endp_address == endp_address)
+                return i;
+    return -1;
+}
+
+/*Requests addressed to an interface or endpoint go to that interface only,
+device requests to every class*/
+static void usb_forward_request(USBDevice_t *dev, USBControlRequest_t *control, uint8_t endp) {
+    uint8_t config_index = dev->config_selected < dev->config_used ? dev->config_selected : 0;
+    int target = -1;
+    ControlHandler_t handler;
+    bool handled = false;
+
+    if (control->request_type.recipient == kRecipientInterface) {
+        target = usb_find_interface(dev, control->generic.index & 0xff, 0);
+        if (target < 0) {
+            usb_control_deny_request(dev, endp);
+            return;
+        }
+    } else if (control->request_type.recipient == kRecipientEndpoint) {
+        target = usb_find_endpoint_interface(dev, control->generic.index & 0xff);
+        if (target < 0) {
+            usb_control_deny_request(dev, endp);
+            return;
+        }
+        //class handlers are registered on the first alternate setting
+        target = usb_find_interface(dev, dev->config_tree[config_index].interface_tree[target].descriptor->interface_id, 0);
+    }
+
+    for (int i = 0; i < dev->config_tree[config_index].interfaces_used; i++) {
+        handler = dev->config_tree[config_index].interface_tree[i].class_handler;
+        if (handler && (target < 0 || target == i)) {
+            dev->class_context = dev->config_tree[config_index].interface_tree[i].class_context;
+            handler(dev, control, dev->device_descriptor->packet_size, endp);
+            dev->class_context = NULL;
+            handled = true;
+        }
+    }
+
+    if (!handled)
+        usb_control_deny_request(dev, endp);
+}
+
+static void USB_HOT usb_control_data_stage(USBDevice_t *dev, uint8_t *buffer, size_t len, uint8_t endp) {
+    uint16_t expected = dev->data_stage.request.generic.length;
+    ControlDataHandler_t handler;
+    int ret;
+
+    if (len > expected - dev->data_stage.received)
+        len = expected - dev->data_stage.received;
+    memcpy(dev->data_stage.buffer + dev->data_stage.received, buffer, len);
+    dev->data_stage.received += len;
+
+    if (dev->data_stage.received < expected)
+        return;
+
+    handler = dev->data_stage.handler;
+    dev->data_stage.handler = NULL;
 
-void usb_control_deny_request(uint8_t endp);
-void usb_control_accept_request(uint8_t endp);
+    dev->class_context = dev->data_stage.class_context;
+    ret = handler(dev, &dev->data_stage.request, dev->data_stage.buffer, expected);
+    dev->class_context = NULL;
 
+    if (ret)
+        usb_control_deny_request(dev, endp);
+    else
+        usb_control_accept_request(dev, endp);
+}
 
-void usb_control_endp(uint8_t endp, uint8_t *buffer, size_t len) {
+void USB_HOT usb_control_endp(USBFpga_t *fpga, uint8_t endp, uint8_t *buffer, size_t len) {
+    USBDevice_t *dev = fpga->context;
     USBControlRequest_t *control = (USBControlRequest_t *) buffer;
     int ret;
+
+    if (dev->data_stage.handler) {
+        //an 8 byte packet nobody waits for is the host giving up on the transfer with a new setup
+        if (len != sizeof(USBControlRequest_t) || dev->data_stage.request.generic.length - dev->data_stage.received == len) {
+            usb_capture_packet(fpga->bus, fpga->address, kCaptureUSBOut, endp, buffer, len);
+            usb_control_data_stage(dev, buffer, len, endp);
+            return;
+        }
+        USB_TRACE("Data stage aborted");
+        dev->data_stage.handler = NULL;
+    }
+
+    usb_capture_packet(fpga->bus, fpga->address, len == sizeof(USBControlRequest_t) ? kCaptureUSBSetup : kCaptureUSBOut, endp, buffer, len);
+
     if (len <= 2) {
-        DEBUG("Got 0 packet rx");
+        USB_TRACE("Got 0 packet rx");
         return;
     }
 
@@ -51,87 +169,69 @@ void usb_control_endp(uint8_t endp, uint8_t *buffer, size_t len) {
         switch (control->descriptor.type) {
             case kDescriptorDevice:
                 if (control->descriptor.index != 0) {
-                    DEBUG("Requested descriptor != 0");
+                    USB_TRACE("Requested descriptor != 0");
                     goto deny_request; 
                 }
-                ret = usb_write_data((uint8_t *)g_device_descriptor, sizeof(DeviceDescriptor_t), g_device_descriptor->packet_size, endp);
+                ret = usb_write_data(fpga, (uint8_t *)dev->device_descriptor, sizeof(DeviceDescriptor_t), dev->device_descriptor->packet_size, endp);
                 if (ret) {
                     DEBUG("Failed to send device descriptor");
                     return;
                 }
-                DEBUG("Device descriptor sent");
+                USB_TRACE("Device descriptor sent");
             break;
 
             case kDescriptorConfiguration: {
-                uint16_t xfer_len, config_length, build_size, copy_size;
-                uint8_t *buffer, *build;
+                USBSegment_t segments[CONFIG_SEGMENTS];
+                int used = 0;
+                uint16_t xfer_len, config_length;
                 ConfigurationDescriptor_t *config;
+                InterfaceAssociationDescriptor_t *association;
                 InterfaceDescriptor_t *interface;
                 EndpointDescriptor_t *endpoint;
-                uint8_t *class;
                 
-                if (control->descriptor.index > g_config_used) {
-                    DEBUG("Requested configuration unknown %i, configured %i", control->descriptor.index, g_config_used);
+                if (control->descriptor.index > dev->config_used) {
+                    USB_TRACE("Requested configuration unknown %i, configured %i", control->descriptor.index, dev->config_used);
                     goto deny_request; 
                 }
 
-                config = g_config_tree[control->descriptor.index].descriptor;
+                config = dev->config_tree[control->descriptor.index].descriptor;
                 xfer_len = control->descriptor.length;
-                config_length = g_config_tree[control->descriptor.index].descriptor->total_length;
+                config_length = dev->config_tree[control->descriptor.index].descriptor->total_length;
                 if (xfer_len > config_length) {
                     xfer_len = config_length;
                 }
 
-                buffer = malloc(xfer_len);
-                if (!buffer) {
-                    DEBUG("Failed to alloc memory to xfer descriptor");
-                    goto deny_request;
-                }
-                build = buffer;
-                build_size = xfer_len;
-
-                //copy the config itself
-                copy_size = sizeof(ConfigurationDescriptor_t);
-                if (copy_size > build_size) copy_size = build_size;
+                //the descriptors are sent in place, usb_write_datav cuts them into packets
+                segments[used++] = (USBSegment_t) {(uint8_t *)config, sizeof(ConfigurationDescriptor_t)};
 
-                memcpy(build, config, copy_size);
-                build += copy_size; build_size -= copy_size;
+                for (int i = 0; i < dev->config_tree[control->descriptor.index].interfaces_used; i++) {
+                    interface = dev->config_tree[control->descriptor.index].interface_tree[i].descriptor;
 
-                for (int i = 0; i < config->interfaces_count; i++) {
-                    interface = g_config_tree[control->descriptor.index].interface_tree[i].descriptor;
+                    association = dev->config_tree[control->descriptor.index].interface_tree[i].association;
+                    if (association)
+                        segments[used++] = (USBSegment_t) {(uint8_t *)association, sizeof(InterfaceAssociationDescriptor_t)};
                    
-                    copy_size = sizeof(InterfaceDescriptor_t);
-                    if (copy_size > build_size) copy_size = build_size;
-
-                    memcpy(build, interface, copy_size);
-                    build += copy_size; build_size -= copy_size;
+                    segments[used++] = (USBSegment_t) {(uint8_t *)interface, sizeof(InterfaceDescriptor_t)};
                     
                     //class descriptor shall go before endpoints descriptors 
-                    class = g_config_tree[control->descriptor.index].interface_tree[i].class_descriptor;
-                    copy_size = g_config_tree[control->descriptor.index].interface_tree[i].class_size;
-                    if (copy_size > build_size) copy_size = build_size;
-
-                    memcpy(build, class, copy_size);
-                    build += copy_size; build_size -= copy_size;
+                    segments[used++] = (USBSegment_t) {
+                        dev->config_tree[control->descriptor.index].interface_tree[i].class_descriptor,
+                        dev->config_tree[control->descriptor.index].interface_tree[i].class_size
+                    };
 
                     for (int j = 0; j < interface->endpoints_count; j++) {
-                        endpoint = g_config_tree[control->descriptor.index].interface_tree[i].endpoints[j];
-                        copy_size = sizeof(EndpointDescriptor_t);
-                        if (copy_size > build_size) copy_size = build_size;
-
-                        memcpy(build, endpoint, copy_size);
-                        build += copy_size; build_size -= copy_size;
+                        endpoint = dev->config_tree[control->descriptor.index].interface_tree[i].endpoints[j];
+                        segments[used++] = (USBSegment_t) {(uint8_t *)endpoint, sizeof(EndpointDescriptor_t)};
                     }
 
                 }
 
-                ret = usb_write_data(buffer, xfer_len, g_device_descriptor->packet_size, endp);
-                free(buffer);
+                ret = usb_write_datav(fpga, segments, used, xfer_len, dev->device_descriptor->packet_size, endp);
                 if (ret) {
                     DEBUG("Failed to send config descriptor");
                     return;
                 }
-                DEBUG("Device config sent");
+                USB_TRACE("Device config sent");
 
 
 
@@ -143,31 +243,65 @@ void usb_control_endp(uint8_t endp, uint8_t *buffer, size_t len) {
                     goto foward_request;
                 }
 
-                DEBUG("Requested descriptor %u not supported", control->descriptor.type);
+                USB_TRACE("Requested descriptor %u not supported", control->descriptor.type);
                 goto deny_request; 
             break;
         }
     break;
 
     case kRequestSetAddress:
-        usb_control_accept_request(endp);
-        usb_set_address(control->address.value);
-        DEBUG("New USB address %u", control->address.value);
+        usb_control_accept_request(dev, endp);
+        usb_set_address(fpga, control->address.value);
+        USB_TRACE("New USB address %u", control->address.value);
     break;
 
     case kRequestSetConfiguration:
-        if (control->configuration.id > g_config_used) {
-            DEBUG("Requested an invalid configuration");
+        if (control->configuration.id > dev->config_used) {
+            USB_TRACE("Requested an invalid configuration");
             goto deny_request;
         }
-        g_config_selected = control->configuration.id - 1; //id start from 0
-        usb_control_accept_request(endp);
-        DEBUG("Configuration %i set", g_config_selected);
+        //id start from 1, 0 goes back to the address state
+        dev->configured = control->configuration.id != 0;
+        dev->config_selected = dev->configured ? control->configuration.id - 1 : 0;
+        usb_control_accept_request(dev, endp);
+        USB_TRACE("Configuration %i set", control->configuration.id);
+
+        usb_default_alternates(dev);
     break;
 
+    case kRequestSetInterface: {
+        uint8_t interface = control->generic.index & 0xff;
+        uint8_t alternate = control->generic.value & 0xff;
+
+        if (interface >= MAX_INTERFACES || usb_find_interface(dev, interface, alternate) < 0) {
+            USB_TRACE("Unknown interface %u alternate %u", interface, alternate);
+            goto deny_request;
+        }
+        dev->alternate[interface] = alternate;
+        usb_control_accept_request(dev, endp);
+        USB_TRACE("Interface %u alternate %u set", interface, alternate);
+
+        if (dev->interface_handler)
+            dev->interface_handler(dev, interface, alternate);
+    } break;
+
+    case kRequestGetInterface: {
+        uint8_t interface = control->generic.index & 0xff;
+
+        if (interface >= MAX_INTERFACES || usb_find_interface(dev, interface, 0) < 0) {
+            USB_TRACE("Unknown interface %u", interface);
+            goto deny_request;
+        }
+        ret = usb_write_data(fpga, &dev->alternate[interface], 1, dev->device_descriptor->packet_size, endp);
+        if (ret) {
+            DEBUG("Failed to send alternate setting");
+            return;
+        }
+    } break;
+
     case kRequestSetFeature:
-        usb_control_accept_request(endp);
-        DEBUG("Set feature request. This is a dummy!!");
+        usb_control_accept_request(dev, endp);
+        USB_TRACE("Set feature request. This is a dummy!!");
     break;
 
     default:
@@ -178,117 +312,177 @@ void usb_control_endp(uint8_t endp, uint8_t *buffer, size_t len) {
     return;
 
     deny_request:
-    usb_control_deny_request(endp);
+    usb_control_deny_request(dev, endp);
     return;
 
     foward_request:
-    DEBUG("Request forwarded");
-    ConfigurationDescriptor_t *config = g_config_tree[g_config_selected].descriptor;
-    for (int i = 0; i < config->interfaces_count; i++) {
-        ControlHandler_t handler = g_config_tree[g_config_selected].interface_tree[i].class_handler;
-        if (handler) {
-            handler(control, g_device_descriptor->packet_size, endp);
-        }
-    }
+    USB_TRACE("Request forwarded");
+    usb_forward_request(dev, control, endp);
+
+    //the fifo may already hold the data stage behind the setup
+    if (dev->data_stage.handler && len > sizeof(USBControlRequest_t))
+        usb_control_data_stage(dev, buffer + sizeof(USBControlRequest_t), len - sizeof(USBControlRequest_t), endp);
 }
 
-void usb_set_device_descriptor(DeviceDescriptor_t *descriptor) {
+void usb_set_device_descriptor(USBDevice_t *dev, DeviceDescriptor_t *descriptor) {
     ASSERT(descriptor != NULL);
-    g_device_descriptor = descriptor;
-    g_device_descriptor->type = kDescriptorDevice;
-    g_device_descriptor->length = sizeof(DeviceDescriptor_t);
-    g_device_descriptor->configurations = 0;
-    g_device_descriptor->usb_version = 0x200;
+    dev->device_descriptor = descriptor;
+    dev->device_descriptor->type = kDescriptorDevice;
+    dev->device_descriptor->length = sizeof(DeviceDescriptor_t);
+    dev->device_descriptor->configurations = 0;
+    dev->device_descriptor->usb_version = 0x200;
 }
 
-void usb_add_configuration_descriptor(ConfigurationDescriptor_t *descriptor) {
+void usb_add_configuration_descriptor(USBDevice_t *dev, ConfigurationDescriptor_t *descriptor) {
     ASSERT(descriptor != NULL);
-    ASSERT(g_device_descriptor != NULL);
+    ASSERT(dev->device_descriptor != NULL);
 
-    g_config_tree[g_config_used].descriptor = descriptor;
+    dev->config_tree[dev->config_used].descriptor = descriptor;
     descriptor->length = sizeof(ConfigurationDescriptor_t);
     descriptor->type = kDescriptorConfiguration;
 
     descriptor->total_length = descriptor->length;
     descriptor->interfaces_count = 0;
-    descriptor->config_id = ++g_config_used;
+    descriptor->config_id = ++dev->config_used;
     descriptor->attributes |= kConfigAttributeDefault; //Ensure minimun
 
-    g_device_descriptor->configurations++;
+    dev->device_descriptor->configurations++;
 }
 
 
 
-void usb_add_interface_descriptor(InterfaceDescriptor_t *descriptor) {
+void usb_add_interface_descriptor(USBDevice_t *dev, InterfaceDescriptor_t *descriptor) {
     ASSERT(descriptor != NULL);
-    ASSERT(g_device_descriptor != NULL);
-    ASSERT(g_config_used > 0);
+    ASSERT(dev->device_descriptor != NULL);
+    ASSERT(dev->config_used > 0);
+
+    uint8_t config_index = dev->config_used - 1;
 
-    uint8_t config_index = g_config_used - 1;
+    ASSERT(dev->config_tree[config_index].interfaces_used < MAX_INTERFACES);
+    ASSERT(descriptor->interface_id < MAX_INTERFACES);
 
     descriptor->length = sizeof(InterfaceDescriptor_t);
     descriptor->type = kDescriptorInterface;
 
-    descriptor->alternate_settings = config_index;
+    descriptor->alternate_settings = 0;
     descriptor->endpoints_count = 0;
 
-    uint8_t interface_index = g_config_tree[config_index].descriptor->interfaces_count++;
-    g_config_tree[config_index].interface_tree[interface_index].descriptor = descriptor;
-    g_config_tree[config_index].descriptor->total_length += descriptor->length;
+    uint8_t interface_index = dev->config_tree[config_index].interfaces_used++;
+    InterfaceDescriptor_t *previous = interface_index ? dev->config_tree[config_index].interface_tree[interface_index - 1].descriptor : NULL;
+
+    //same id as the one before: it is another alternate setting of that interface
+    if (previous && previous->interface_id == descriptor->interface_id)
+        descriptor->alternate_settings = previous->alternate_settings + 1;
+    else
+        dev->config_tree[config_index].descriptor->interfaces_count++;
+
+    dev->config_tree[config_index].interface_tree[interface_index].descriptor = descriptor;
+    dev->config_tree[config_index].descriptor->total_length += descriptor->length;
 
 }
 
-void usb_add_endppoint_descriptor(EndpointDescriptor_t *descriptor) {
+void usb_add_endppoint_descriptor(USBDevice_t *dev, EndpointDescriptor_t *descriptor) {
     ASSERT(descriptor != NULL);
-    ASSERT(g_device_descriptor != NULL);
-    ASSERT(g_config_used > 0);
+    ASSERT(dev->device_descriptor != NULL);
+    ASSERT(dev->config_used > 0);
     
-    uint8_t config_index = g_config_used - 1;
-    ASSERT(g_config_tree[config_index].descriptor->interfaces_count > 0);
+    uint8_t config_index = dev->config_used - 1;
+    ASSERT(dev->config_tree[config_index].interfaces_used > 0);
     
-    uint8_t interface_index = g_config_tree[config_index].descriptor->interfaces_count - 1;
-    uint8_t endp_index = g_config_tree[config_index].interface_tree->descriptor->endpoints_count++;
+    uint8_t interface_index = dev->config_tree[config_index].interfaces_used - 1;
+    ASSERT(dev->config_tree[config_index].interface_tree[interface_index].descriptor->endpoints_count < FPGA_ENDPOINTS);
+    uint8_t endp_index = dev->config_tree[config_index].interface_tree[interface_index].descriptor->endpoints_count++;
 
     descriptor->length = sizeof(EndpointDescriptor_t);
     descriptor->type = kDescriptorEnpoint;
 
-    g_config_tree[config_index].interface_tree[interface_index].endpoints[endp_index] = descriptor;
-    g_config_tree[config_index].descriptor->total_length += descriptor->length;
+    dev->config_tree[config_index].interface_tree[interface_index].endpoints[endp_index] = descriptor;
+    dev->config_tree[config_index].descriptor->total_length += descriptor->length;
+
+    //full speed bInterval is in frames
+    usb_set_endp_schedule(dev->fpga, descriptor->endp_address & 0xf, descriptor->attributes & 0x3,
+                          descriptor->interval * USB_FRAME_US, descriptor->max_packet_size);
 
 }
 
-void usb_add_class_descriptor(uint8_t *descriptor, size_t length) {
+void usb_add_class_descriptor(USBDevice_t *dev, uint8_t *descriptor, size_t length) {
     ASSERT(descriptor != NULL);
-    ASSERT(g_device_descriptor != NULL);
-    ASSERT(g_config_used > 0);
+    ASSERT(dev->device_descriptor != NULL);
+    ASSERT(dev->config_used > 0);
 
-    uint8_t config_index = g_config_used - 1;
-    ASSERT(g_config_tree[config_index].descriptor->interfaces_count > 0);
+    uint8_t config_index = dev->config_used - 1;
+    ASSERT(dev->config_tree[config_index].interfaces_used > 0);
     
-    uint8_t interface_index = g_config_tree[config_index].descriptor->interfaces_count - 1;
+    uint8_t interface_index = dev->config_tree[config_index].interfaces_used - 1;
 
-    g_config_tree[config_index].interface_tree[interface_index].class_descriptor = descriptor;
-    g_config_tree[config_index].interface_tree[interface_index].class_size = length;
+    dev->config_tree[config_index].interface_tree[interface_index].class_descriptor = descriptor;
+    dev->config_tree[config_index].interface_tree[interface_index].class_size = length;
 
-    g_config_tree[config_index].descriptor->total_length += length;
+    dev->config_tree[config_index].descriptor->total_length += length;
 }
 
-void usb_add_class_control_handler(ControlHandler_t handler) {
+void usb_add_class_control_handler(USBDevice_t *dev, ControlHandler_t handler) {
     ASSERT(handler != NULL);
-    ASSERT(g_device_descriptor != NULL);
-    ASSERT(g_config_used > 0);
+    ASSERT(dev->device_descriptor != NULL);
+    ASSERT(dev->config_used > 0);
     
-    uint8_t config_index = g_config_used - 1;
-    ASSERT(g_config_tree[config_index].descriptor->interfaces_count > 0);
+    uint8_t config_index = dev->config_used - 1;
+    ASSERT(dev->config_tree[config_index].interfaces_used > 0);
     
-    uint8_t interface_index = g_config_tree[config_index].descriptor->interfaces_count - 1;
-    g_config_tree[config_index].interface_tree[interface_index].class_handler = handler;
+    uint8_t interface_index = dev->config_tree[config_index].interfaces_used - 1;
+    dev->config_tree[config_index].interface_tree[interface_index].class_handler = handler;
+}
+
+
+void usb_add_class_context(USBDevice_t *dev, void *context) {
+    ASSERT(dev->device_descriptor != NULL);
+    ASSERT(dev->config_used > 0);
+
+    uint8_t config_index = dev->config_used - 1;
+    ASSERT(dev->config_tree[config_index].interfaces_used > 0);
+
+    uint8_t interface_index = dev->config_tree[config_index].interfaces_used - 1;
+    dev->config_tree[config_index].interface_tree[interface_index].class_context = context;
 }
 
+//attached to the next interface added
+void usb_add_interface_association(USBDevice_t *dev, InterfaceAssociationDescriptor_t *descriptor) {
+    ASSERT(descriptor != NULL);
+    ASSERT(dev->device_descriptor != NULL);
+    ASSERT(dev->config_used > 0);
+
+    uint8_t config_index = dev->config_used - 1;
+    ASSERT(dev->config_tree[config_index].interfaces_used < MAX_INTERFACES);
+
+    descriptor->length = sizeof(InterfaceAssociationDescriptor_t);
+    descriptor->type = kDescriptorInterfaceAssociation;
+
+    dev->config_tree[config_index].interface_tree[dev->config_tree[config_index].interfaces_used].association = descriptor;
+    dev->config_tree[config_index].descriptor->total_length += descriptor->length;
+}
+
+void usb_set_interface_handler(USBDevice_t *dev, InterfaceHandler_t handler) {
+    dev->interface_handler = handler;
+}
+
+
+void USB_HOT usb_control_deny_request(USBDevice_t *dev, uint8_t endp) {
+    usb_set_cmd(dev->fpga, kUSBCMDSendStall, endp);
+}
+void USB_HOT usb_control_accept_request(USBDevice_t *dev, uint8_t endp){
+    usb_set_cmd(dev->fpga, kUSBCMDSend0DataLength, endp);
+}
+
+int usb_control_receive(USBDevice_t *dev, USBControlRequest_t *control, uint8_t *buffer, size_t size, ControlDataHandler_t handler) {
+    if (control->request_type.direction != kHost2Device || !control->generic.length || control->generic.length > size) {
+        DEBUG("Can't receive %u bytes data stage", control->generic.length);
+        return -1;
+    }
 
-void usb_control_deny_request(uint8_t endp) {
-    usb_set_cmd(kUSBCMDSendStall, endp);
+    dev->data_stage.request = *control;
+    dev->data_stage.buffer = buffer;
+    dev->data_stage.received = 0;
+    dev->data_stage.handler = handler;
+    dev->data_stage.class_context = dev->class_context;
+    return 0;
 }
-void usb_control_accept_request(uint8_t endp){
-    usb_set_cmd(kUSBCMDSend0DataLength, endp);
-}
\ No newline at end of file
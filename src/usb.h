@@ -7,6 +7,8 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include "usb_fpga.h"
+
 #define PACKED __attribute__((packed))
 
 typedef enum {
@@ -17,7 +19,8 @@ typedef enum {
     kDescriptorEnpoint,
     kDescriptorDeviceQualifier,
     kDescriptorOtherSpeedConfiguration,
-    kDescriptorInterfacePower
+    kDescriptorInterfacePower,
+    kDescriptorInterfaceAssociation = 11
 } DescriptorTypes_t;
 
 typedef struct {
@@ -64,7 +67,7 @@ typedef struct {
     DescriptorTypes_t type:8;
 
     uint8_t interface_id;
-    uint8_t alternate_settings; //to which config its realted to
+    uint8_t alternate_settings; //filled by the stack, consecutive descriptors with the same id are alternates
     uint8_t endpoints_count;
     uint8_t class; 
     uint8_t sub_class; 
@@ -73,6 +76,21 @@ typedef struct {
 } PACKED InterfaceDescriptor_t;
 
 
+/*Groups the interfaces of one function in a composite device, goes right
+before the first of them*/
+typedef struct {
+    uint8_t length;
+    DescriptorTypes_t type:8;
+
+    uint8_t first_interface;
+    uint8_t interface_count;
+    uint8_t function_class;
+    uint8_t function_sub_class;
+    uint8_t function_protocol;
+    uint8_t str_index_function;
+} PACKED InterfaceAssociationDescriptor_t;
+
+
 enum {
     kEndpointDirectionOut,
     kEndpointDirectionIn = 0b10000000
@@ -98,8 +116,8 @@ typedef struct {
 
 
 typedef enum {
-    kDevice2Host,
     kHost2Device,
+    kDevice2Host,
 } RequestDirection_t;
 
 typedef enum {
@@ -174,20 +192,74 @@ typedef struct {
 } PACKED USBControlRequest_t;
 
 
-typedef void (*ControlHandler_t)(USBControlRequest_t *, uint16_t chunk_size, uint8_t endp);
+#define MAX_CONFIGURATION 1
+#define MAX_INTERFACES 5 //interface descriptors, alternate settings included
 
-void usb_add_class_control_handler(ControlHandler_t handler);
-void usb_add_class_descriptor(uint8_t *descriptor, size_t length);
-void usb_add_endppoint_descriptor(EndpointDescriptor_t *descriptor);
-void usb_add_interface_descriptor(InterfaceDescriptor_t *descriptor);
-void usb_add_configuration_descriptor(ConfigurationDescriptor_t *descriptor);
-void usb_set_device_descriptor(DeviceDescriptor_t *decriptor); 
-void usb_control_endp(uint8_t endp, uint8_t *buffer, size_t len);
+typedef struct USBDevice USBDevice_t;
 
+typedef void (*ControlHandler_t)(USBDevice_t *dev, USBControlRequest_t *, uint16_t chunk_size, uint8_t endp);
+/*SET_INTERFACE already accepted, the class moves its endpoints to the new alternate setting*/
+typedef void (*InterfaceHandler_t)(USBDevice_t *dev, uint8_t interface, uint8_t alternate);
+/*Whole OUT data stage received, return 0 to ack the status stage or -1 to stall*/
+typedef int (*ControlDataHandler_t)(USBDevice_t *dev, USBControlRequest_t *control, uint8_t *data, uint16_t length);
 
+/*Control stack state of one device, bound to the fpga core serving it*/
+struct USBDevice {
+    USBFpga_t *fpga;
+    DeviceDescriptor_t *device_descriptor;
+    struct {
+        ConfigurationDescriptor_t *descriptor;
+        struct {
+            InterfaceAssociationDescriptor_t *association;
+            InterfaceDescriptor_t *descriptor;
+            EndpointDescriptor_t *endpoints[FPGA_ENDPOINTS];
+            uint8_t *class_descriptor;
+            size_t class_size;
+            ControlHandler_t class_handler;
+            void *class_context;
+        } interface_tree[MAX_INTERFACES];
+        uint8_t interfaces_used;
+    } config_tree[MAX_CONFIGURATION];
+    uint8_t config_used;
+    uint8_t config_selected;
+    bool configured; //SET_CONFIGURATION with a non zero id since the last bus reset
+    uint8_t alternate[MAX_INTERFACES]; //selected alternate setting by interface id
+    InterfaceHandler_t interface_handler;
+    void *context; //application data for the class handlers
+    void *class_context; //context of the class handler being called
+
+    //OUT data stage of the current control transfer
+    struct {
+        USBControlRequest_t request;
+        uint8_t *buffer;
+        uint16_t received;
+        ControlDataHandler_t handler;
+        void *class_context;
+    } data_stage;
+};
 
-void usb_control_deny_request(uint8_t endp);
-void usb_control_accept_request(uint8_t endp);
+void usb_device_init(USBDevice_t *dev, USBFpga_t *fpga, void *context);
+void usb_device_attach(USBDevice_t *dev);
+void usb_add_class_control_handler(USBDevice_t *dev, ControlHandler_t handler);
+void usb_add_class_context(USBDevice_t *dev, void *context);
+void usb_set_interface_handler(USBDevice_t *dev, InterfaceHandler_t handler);
+void usb_add_interface_association(USBDevice_t *dev, InterfaceAssociationDescriptor_t *descriptor);
+void usb_add_class_descriptor(USBDevice_t *dev, uint8_t *descriptor, size_t length);
+void usb_add_endppoint_descriptor(USBDevice_t *dev, EndpointDescriptor_t *descriptor);
+void usb_add_interface_descriptor(USBDevice_t *dev, InterfaceDescriptor_t *descriptor);
+void usb_add_configuration_descriptor(USBDevice_t *dev, ConfigurationDescriptor_t *descriptor);
+void usb_set_device_descriptor(USBDevice_t *dev, DeviceDescriptor_t *decriptor); 
+void usb_control_endp(USBFpga_t *fpga, uint8_t endp, uint8_t *buffer, size_t len);
+/*Bus handler of the control stack, call it from the application one*/
+void usb_bus_event(USBFpga_t *fpga, USBBusEvent_t event);
+
+
+
+void usb_control_deny_request(USBDevice_t *dev, uint8_t endp);
+void usb_control_accept_request(USBDevice_t *dev, uint8_t endp);
+/*From a class handler: collect the OUT data stage of a host to device request
+into buffer (size bytes at most) and call handler once complete*/
+int usb_control_receive(USBDevice_t *dev, USBControlRequest_t *control, uint8_t *buffer, size_t size, ControlDataHandler_t handler);
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,351 @@
+#include "usb_capture.h"
+#include "util.h"
+
+#if USB_CAPTURE
+
+#include "usb_port.h"
+
+#include <string.h>
+
+#define DEBUG_CNTX "usb-capture"
+
+/*pcapng block types*/
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_MAGIC 0x1A2B3C4D
+
+#define LINKTYPE_USB_LINUX_MMAPPED 220
+#define LINKTYPE_USER0 147
+
+#define PCAPNG_BLOCK_MAX 128 //largest block we write, bigger ones are not ours
+
+enum {
+    kInterfaceUSB,
+    kInterfaceSPI
+};
+
+/*usbmon binary header, see linux Documentation/usb/usbmon.rst*/
+typedef struct {
+    uint64_t id;
+    uint8_t type; //'S' submit, 'C' complete
+    uint8_t xfer_type; //0 iso, 1 intr, 2 control, 3 bulk
+    uint8_t epnum; //bit 7 set for IN
+    uint8_t devnum;
+    uint16_t busnum;
+    char flag_setup; //0 if setup is valid
+    char flag_data; //'=' if data follows
+    int64_t ts_sec;
+    int32_t ts_usec;
+    int32_t status;
+    uint32_t length;
+    uint32_t len_cap;
+    uint8_t setup[8];
+    int32_t interval;
+    int32_t start_frame;
+    uint32_t xfer_flags;
+    uint32_t ndesc;
+} __attribute__((packed)) UsbmonPacket_t;
+
+/*Enhanced packet block body, the payload follows*/
+typedef struct {
+    uint32_t interface;
+    uint32_t ts_high;
+    uint32_t ts_low;
+    uint32_t captured;
+    uint32_t original;
+} __attribute__((packed)) PcapngPacket_t;
+
+struct {
+    CaptureRecord_t records[CAPTURE_RECORDS];
+    uint32_t head; //total records written, index is head % CAPTURE_RECORDS
+    bool running;
+    USBLock_t lock;
+} g_capture = {
+    .lock = USB_LOCK_INITIALIZER
+};
+
+
+void usb_capture_start(void) {
+    g_capture.running = true;
+}
+
+void usb_capture_stop(void) {
+    g_capture.running = false;
+}
+
+void usb_capture_clear(void) {
+    usb_port_lock(&g_capture.lock);
+    g_capture.head = 0;
+    usb_port_unlock(&g_capture.lock);
+}
+
+static void usb_capture_record(uint8_t bus, uint8_t address, CaptureType_t type, uint8_t endp, uint8_t cmd, const void *data, size_t length) {
+    CaptureRecord_t *record;
+    size_t copy_size = length > CAPTURE_DATA_SIZE ? CAPTURE_DATA_SIZE : length;
+
+    if (!g_capture.running)
+        return;
+
+    usb_port_lock(&g_capture.lock);
+    record = &g_capture.records[g_capture.head++ % CAPTURE_RECORDS];
+    record->timestamp = usb_port_time_us();
+    record->type = type;
+    record->endp = endp;
+    record->cmd = cmd;
+    record->bus = bus;
+    record->address = address;
+    record->length = length;
+    if (data)
+        memcpy(record->data, data, copy_size);
+    usb_port_unlock(&g_capture.lock);
+}
+
+void usb_capture_spi(uint8_t bus, uint8_t cmd, const void *data, size_t length, bool write) {
+    usb_capture_record(bus, 0, write ? kCaptureSPIWrite : kCaptureSPIRead, cmd & 0xf, cmd, data, length);
+}
+
+void usb_capture_packet(uint8_t bus, uint8_t address, CaptureType_t type, uint8_t endp, const void *data, size_t length) {
+    usb_capture_record(bus, address, type, endp, 0, data, length);
+}
+
+
+static int pcapng_write_block(FILE *fd, uint32_t type, const void *body, size_t body_size, const void *payload, size_t payload_size) {
+    static const uint8_t padding[4] = {0};
+    size_t pad = (4 - (payload_size & 3)) & 3;
+    uint32_t total = 12 + body_size + payload_size + pad;
+
+    if (fwrite(&type, 4, 1, fd) != 1) return -1;
+    if (fwrite(&total, 4, 1, fd) != 1) return -1;
+    if (body_size && fwrite(body, body_size, 1, fd) != 1) return -1;
+    if (payload_size && fwrite(payload, payload_size, 1, fd) != 1) return -1;
+    if (pad && fwrite(padding, pad, 1, fd) != 1) return -1;
+    if (fwrite(&total, 4, 1, fd) != 1) return -1;
+    return 0;
+}
+
+static int pcapng_write_header(FILE *fd) {
+    struct {
+        uint32_t magic;
+        uint16_t major;
+        uint16_t minor;
+        int64_t section_length;
+    } __attribute__((packed)) shb = {PCAPNG_MAGIC, 1, 0, -1};
+
+    struct {
+        uint16_t link_type;
+        uint16_t reserved;
+        uint32_t snap_len;
+    } __attribute__((packed)) idb[] = {
+        [kInterfaceUSB] = {LINKTYPE_USB_LINUX_MMAPPED, 0, sizeof(UsbmonPacket_t) + CAPTURE_DATA_SIZE},
+        [kInterfaceSPI] = {LINKTYPE_USER0, 0, 1 + CAPTURE_DATA_SIZE},
+    };
+
+    if (pcapng_write_block(fd, PCAPNG_SHB, &shb, sizeof(shb), NULL, 0))
+        return -1;
+
+    for (int i = 0; i < sizeof(idb) / sizeof(idb[0]); i++)
+        if (pcapng_write_block(fd, PCAPNG_IDB, &idb[i], sizeof(idb[i]), NULL, 0))
+            return -1;
+
+    return 0;
+}
+
+static int pcapng_write_record(FILE *fd, uint32_t id, CaptureRecord_t *record) {
+    uint8_t payload[sizeof(UsbmonPacket_t) + CAPTURE_DATA_SIZE];
+    size_t captured = record->length > CAPTURE_DATA_SIZE ? CAPTURE_DATA_SIZE : record->length;
+    size_t payload_size, original_size;
+    PcapngPacket_t epb = {
+        .ts_high = record->timestamp >> 32,
+        .ts_low = record->timestamp & 0xffffffff,
+    };
+
+    switch (record->type) {
+    case kCaptureSPIRead:
+    case kCaptureSPIWrite:
+        epb.interface = kInterfaceSPI;
+        payload[0] = record->cmd;
+        memcpy(&payload[1], record->data, captured);
+        payload_size = 1 + captured;
+        original_size = 1 + record->length;
+        break;
+
+    default: {
+        UsbmonPacket_t *usbmon = (UsbmonPacket_t *) payload;
+        memset(usbmon, 0, sizeof(UsbmonPacket_t));
+
+        usbmon->id = id;
+        usbmon->xfer_type = record->endp ? 1 : 2; //the fpga layer only knows ep0 is control
+        usbmon->epnum = record->endp;
+        usbmon->devnum = record->address;
+        usbmon->busnum = record->bus + 1;
+        usbmon->ts_sec = record->timestamp / 1000000;
+        usbmon->ts_usec = record->timestamp % 1000000;
+        usbmon->flag_setup = '-';
+
+        if (record->type == kCaptureUSBSetup) {
+            /*bmRequestType bit 7 set -> data stage is device to host*/
+            usbmon->type = 'S';
+            usbmon->flag_setup = 0;
+            usbmon->flag_data = '<';
+            usbmon->epnum |= record->data[0] & 0x80;
+            usbmon->length = record->data[6] | (record->data[7] << 8);
+            memcpy(usbmon->setup, record->data, sizeof(usbmon->setup));
+            captured = 0;
+        } else {
+            usbmon->type = 'C';
+            usbmon->flag_data = '=';
+            usbmon->epnum |= record->type == kCaptureUSBIn ? 0x80 : 0;
+            usbmon->length = record->length;
+            usbmon->len_cap = captured;
+            memcpy(payload + sizeof(UsbmonPacket_t), record->data, captured);
+        }
+
+        epb.interface = kInterfaceUSB;
+        payload_size = sizeof(UsbmonPacket_t) + captured;
+        original_size = sizeof(UsbmonPacket_t) + (record->type == kCaptureUSBSetup ? 0 : record->length);
+    } break;
+    }
+
+    epb.captured = payload_size;
+    epb.original = original_size;
+    return pcapng_write_block(fd, PCAPNG_EPB, &epb, sizeof(epb), payload, payload_size);
+}
+
+int usb_capture_export_pcapng(FILE *fd) {
+    CaptureRecord_t record;
+    uint32_t head, first;
+    bool running = g_capture.running;
+
+    //freeze the ring while exporting, fwrite may be slow
+    g_capture.running = false;
+
+    head = g_capture.head;
+    first = head > CAPTURE_RECORDS ? head - CAPTURE_RECORDS : 0;
+
+    if (pcapng_write_header(fd)) {
+        DEBUG("Failed to write pcapng header");
+        g_capture.running = running;
+        return -1;
+    }
+
+    for (uint32_t i = first; i < head; i++) {
+        record = g_capture.records[i % CAPTURE_RECORDS];
+        if (pcapng_write_record(fd, i, &record)) {
+            DEBUG("Failed to write record %u", (unsigned) i);
+            g_capture.running = running;
+            return -1;
+        }
+    }
+
+    DEBUG("Exported %u records", (unsigned) (head - first));
+    g_capture.running = running;
+    return 0;
+}
+
+static int pcapng_read_record(const uint8_t *body, size_t body_size, uint16_t link_type, CaptureRecord_t *record) {
+    const uint8_t *payload = body + sizeof(PcapngPacket_t);
+    PcapngPacket_t epb;
+    UsbmonPacket_t usbmon;
+    size_t captured;
+
+    if (body_size < sizeof(epb))
+        return -1;
+    memcpy(&epb, body, sizeof(epb));
+    if (epb.captured > body_size - sizeof(epb))
+        return -1;
+
+    memset(record, 0, sizeof(CaptureRecord_t));
+    record->timestamp = ((uint64_t) epb.ts_high << 32) | epb.ts_low;
+
+    if (link_type == LINKTYPE_USER0) {
+        if (!epb.captured || !epb.original)
+            return -1;
+        record->cmd = payload[0];
+        //bit 7 of the command is the direction, see BUILD_CMD
+        record->type = record->cmd & 0x80 ? kCaptureSPIRead : kCaptureSPIWrite;
+        record->endp = record->cmd & 0xf;
+        record->length = epb.original - 1;
+        captured = epb.captured - 1;
+        memcpy(record->data, payload + 1, captured > CAPTURE_DATA_SIZE ? CAPTURE_DATA_SIZE : captured);
+        return 0;
+    }
+
+    if (link_type != LINKTYPE_USB_LINUX_MMAPPED || epb.captured < sizeof(usbmon))
+        return -1;
+    memcpy(&usbmon, payload, sizeof(usbmon));
+    record->endp = usbmon.epnum & 0x7f;
+    record->address = usbmon.devnum;
+    record->bus = usbmon.busnum - 1;
+
+    if (!usbmon.flag_setup) {
+        record->type = kCaptureUSBSetup;
+        record->length = sizeof(usbmon.setup);
+        memcpy(record->data, usbmon.setup, sizeof(usbmon.setup));
+    } else {
+        record->type = usbmon.epnum & 0x80 ? kCaptureUSBIn : kCaptureUSBOut;
+        record->length = usbmon.length;
+        captured = epb.captured - sizeof(usbmon);
+        if (captured > usbmon.len_cap)
+            captured = usbmon.len_cap;
+        memcpy(record->data, payload + sizeof(usbmon), captured > CAPTURE_DATA_SIZE ? CAPTURE_DATA_SIZE : captured);
+    }
+    return 0;
+}
+
+int usb_capture_import_pcapng(FILE *fd, CaptureRecord_t *records, size_t max) {
+    struct {
+        uint32_t type;
+        uint32_t total;
+    } header;
+    uint8_t body[PCAPNG_BLOCK_MAX + 4]; //and the trailing length
+    uint16_t link_types[2];
+    uint32_t interfaces = 0, magic, interface;
+    size_t count = 0, body_size;
+    bool section = false;
+
+    while (count < max && fread(&header, sizeof(header), 1, fd) == 1) {
+        if (header.total < 12 || header.total > PCAPNG_BLOCK_MAX + 12 || header.total & 3)
+            return -1;
+        //the trailing length is read with the body
+        body_size = header.total - 12;
+        if (fread(body, body_size + 4, 1, fd) != 1)
+            return -1;
+
+        if (!section && header.type != PCAPNG_SHB)
+            return -1;
+
+        switch (header.type) {
+        case PCAPNG_SHB:
+            if (body_size < sizeof(magic))
+                return -1;
+            memcpy(&magic, body, sizeof(magic));
+            if (magic != PCAPNG_MAGIC)
+                return -1;
+            section = true;
+            interfaces = 0;
+            break;
+
+        case PCAPNG_IDB:
+            if (body_size < sizeof(uint16_t))
+                return -1;
+            if (interfaces < sizeof(link_types) / sizeof(link_types[0]))
+                memcpy(&link_types[interfaces++], body, sizeof(uint16_t));
+            break;
+
+        case PCAPNG_EPB:
+            if (body_size < sizeof(interface))
+                return -1;
+            memcpy(&interface, body, sizeof(interface));
+            if (interface >= interfaces)
+                return -1;
+            if (pcapng_read_record(body, body_size, link_types[interface], &records[count]))
+                return -1;
+            count++;
+            break;
+        }
+    }
+    return section ? (int) count : -1;
+}
+
+#endif
@@ -0,0 +1,66 @@
+
+
+#ifndef USB_CAPTURE_H_
+#define USB_CAPTURE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#ifndef USB_CAPTURE
+#define USB_CAPTURE 0 //record every spi transaction and usb packet, on per environment in platformio.ini
+#endif
+
+#define CAPTURE_RECORDS 256
+#define CAPTURE_DATA_SIZE 16 //bytes kept per record, longer payloads are truncated
+
+typedef enum {
+    kCaptureSPIRead,
+    kCaptureSPIWrite,
+    kCaptureUSBSetup,
+    kCaptureUSBIn,
+    kCaptureUSBOut
+} CaptureType_t;
+
+typedef struct {
+    uint64_t timestamp; //us since boot
+    CaptureType_t type:8;
+    uint8_t endp;
+    uint8_t cmd; //spi command byte, only for spi records
+    uint8_t bus; //fpga instance, exported as the usbmon bus number
+    uint8_t address;
+    uint16_t length; //original length
+    uint8_t data[CAPTURE_DATA_SIZE];
+} CaptureRecord_t;
+
+#if USB_CAPTURE
+
+void usb_capture_start(void);
+void usb_capture_stop(void);
+void usb_capture_clear(void);
+void usb_capture_spi(uint8_t bus, uint8_t cmd, const void *data, size_t length, bool write);
+void usb_capture_packet(uint8_t bus, uint8_t address, CaptureType_t type, uint8_t endp, const void *data, size_t length);
+
+/*Writes the ring buffer as a pcapng file. USB packets use the usbmon (mmapped)
+link type so wireshark dissects them, spi transactions go on a second USER0
+interface as [cmd][data...]*/
+int usb_capture_export_pcapng(FILE *fd);
+/*Reads back a file written by usb_capture_export_pcapng, for replay on the
+simulator. Returns the records read, at most max, or -1 if the file is not
+one of ours*/
+int usb_capture_import_pcapng(FILE *fd, CaptureRecord_t *records, size_t max);
+
+#else
+
+#define usb_capture_start()
+#define usb_capture_stop()
+#define usb_capture_clear()
+#define usb_capture_spi(bus, cmd, data, length, write) ((void) (data))
+#define usb_capture_packet(bus, address, type, endp, data, length) ((void) (data))
+#define usb_capture_export_pcapng(fd) (-1)
+#define usb_capture_import_pcapng(fd, records, max) (-1)
+
+#endif
+
+#endif
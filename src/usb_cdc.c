@@ -0,0 +1,249 @@
+#define _GNU_SOURCE //fopencookie
+#include "usb_cdc.h"
+#include "util.h"
+
+#include <string.h>
+
+#define DEBUG_CNTX "usb-cdc"
+
+#define CDC_NOTIFY_SIZE 16
+
+
+static int usb_cdc_line_coding_received(USBDevice_t *dev, USBControlRequest_t *control, uint8_t *data, uint16_t length) {
+    USBCDC_t *cdc = dev->class_context;
+
+    memcpy(&cdc->line_coding, data, sizeof(CDCLineCoding_t));
+    return 0;
+}
+
+static void usb_cdc_control_handler(USBDevice_t *dev, USBControlRequest_t *control, uint16_t chunk_size, uint8_t endp) {
+    USBCDC_t *cdc = dev->class_context;
+
+    if (control->request_type.type != kTypeClass)
+        goto deny_request;
+
+    switch ((CDCRequest_t) control->request) {
+    case kCDCRequestSetLineCoding:
+        if (usb_control_receive(dev, control, cdc->line_coding_buffer, sizeof(cdc->line_coding_buffer), usb_cdc_line_coding_received))
+            goto deny_request;
+        break;
+    case kCDCRequestGetLineCoding:
+        if (usb_write_data(dev->fpga, (uint8_t *) &cdc->line_coding, sizeof(CDCLineCoding_t), chunk_size, endp))
+            DEBUG("Failed to send line coding");
+        break;
+    case kCDCRequestSetControlLineState:
+        cdc->dtr = control->generic.value & 1;
+        usb_control_accept_request(dev, endp);
+        break;
+    default:
+        goto deny_request;
+    }
+    return;
+
+deny_request:
+    usb_control_deny_request(dev, endp);
+}
+
+static void usb_cdc_data_endp(USBFpga_t *fpga, uint8_t endp, uint8_t *buffer, size_t size) {
+    USBCDC_t *cdc = usb_get_endp_context(fpga, endp);
+    size_t copy;
+
+    usb_port_lock(&cdc->lock);
+    copy = CDC_RX_RING - (cdc->rx_head - cdc->rx_tail);
+    if (copy > size)
+        copy = size;
+    for (size_t i = 0; i < copy; i++)
+        cdc->rx[(cdc->rx_head + i) % CDC_RX_RING] = buffer[i];
+    cdc->rx_head += copy;
+    cdc->rx_dropped += size - copy;
+    usb_port_unlock(&cdc->lock);
+}
+
+void usb_cdc_init(USBCDC_t *cdc, USBDevice_t *dev, uint8_t first_interface, uint8_t notify_endp, uint8_t data_endp) {
+    memset(cdc, 0, sizeof(USBCDC_t));
+    usb_port_lock_init(&cdc->lock);
+    cdc->usb = dev;
+    cdc->data_endp = data_endp;
+    cdc->line_coding = (CDCLineCoding_t) {.baudrate = 115200, .data_bits = 8};
+
+    cdc->association = (InterfaceAssociationDescriptor_t) {
+        .first_interface = first_interface,
+        .interface_count = 2,
+        .function_class = 0x02, //communications
+        .function_sub_class = 0x02, //abstract control model
+    };
+    cdc->comm_interface = (InterfaceDescriptor_t) {
+        .interface_id = first_interface,
+        .class = 0x02,
+        .sub_class = 0x02,
+    };
+    cdc->functional = (CDCFunctionalDescriptors_t) {
+        .header = {sizeof(cdc->functional.header), 0x24, 0x00, 0x0110},
+        .call_management = {sizeof(cdc->functional.call_management), 0x24, 0x01, 0x00, first_interface + 1},
+        .acm = {sizeof(cdc->functional.acm), 0x24, 0x02, 0x02}, //line coding and control line state
+        .union_interfaces = {sizeof(cdc->functional.union_interfaces), 0x24, 0x06, first_interface, first_interface + 1},
+    };
+    cdc->notify_endpoint = (EndpointDescriptor_t) {
+        .endp_address = notify_endp | kEndpointDirectionIn,
+        .attributes = kEndpointAttributeInterrupt,
+        .max_packet_size = CDC_NOTIFY_SIZE,
+        .interval = 16,
+    };
+    cdc->data_interface = (InterfaceDescriptor_t) {
+        .interface_id = first_interface + 1,
+        .class = 0x0a, //cdc data
+    };
+    cdc->out_endpoint = (EndpointDescriptor_t) {
+        .endp_address = data_endp | kEndpointDirectionOut,
+        .attributes = kEndpointAttributeBulk,
+        .max_packet_size = CDC_PACKET_SIZE,
+    };
+    cdc->in_endpoint = (EndpointDescriptor_t) {
+        .endp_address = data_endp | kEndpointDirectionIn,
+        .attributes = kEndpointAttributeBulk,
+        .max_packet_size = CDC_PACKET_SIZE,
+    };
+
+    usb_add_interface_association(dev, &cdc->association);
+    usb_add_interface_descriptor(dev, &cdc->comm_interface);
+    usb_add_class_descriptor(dev, (uint8_t *) &cdc->functional, sizeof(cdc->functional));
+    usb_add_endppoint_descriptor(dev, &cdc->notify_endpoint);
+    usb_add_class_control_handler(dev, usb_cdc_control_handler);
+    usb_add_class_context(dev, cdc);
+
+    usb_add_interface_descriptor(dev, &cdc->data_interface);
+    usb_add_endppoint_descriptor(dev, &cdc->out_endpoint);
+    usb_add_endppoint_descriptor(dev, &cdc->in_endpoint);
+
+    usb_set_endp_handler(dev->fpga, usb_cdc_data_endp, data_endp);
+    usb_set_endp_context(dev->fpga, data_endp, cdc);
+}
+
+//what fits of data into the tx ring, with the lock held
+static size_t usb_cdc_push(USBCDC_t *cdc, const uint8_t *bytes, size_t length) {
+    size_t copy, first;
+
+    copy = CDC_TX_RING - (cdc->tx_head - cdc->tx_tail);
+    if (copy > length)
+        copy = length;
+
+    first = CDC_TX_RING - cdc->tx_head % CDC_TX_RING;
+    if (first > copy)
+        first = copy;
+    memcpy(&cdc->tx[cdc->tx_head % CDC_TX_RING], bytes, first);
+    memcpy(cdc->tx, bytes + first, copy - first);
+
+    cdc->tx_head += copy;
+    return copy;
+}
+
+size_t usb_cdc_write(USBCDC_t *cdc, const void *data, size_t length) {
+    size_t copy;
+
+    usb_port_lock(&cdc->lock);
+    copy = usb_cdc_push(cdc, data, length);
+    cdc->tx_dropped += length - copy;
+    usb_port_unlock(&cdc->lock);
+    return copy;
+}
+
+size_t usb_cdc_write_blocking(USBCDC_t *cdc, const void *data, size_t length) {
+    const uint8_t *bytes = data;
+    uint64_t progress = usb_port_time_us();
+    size_t done = 0, copy;
+
+    while (done < length && cdc->dtr) {
+        usb_port_lock(&cdc->lock);
+        copy = usb_cdc_push(cdc, bytes + done, length - done);
+        usb_port_unlock(&cdc->lock);
+
+        done += copy;
+        if (copy)
+            progress = usb_port_time_us();
+        else if (usb_port_time_us() - progress > CDC_WRITE_TIMEOUT)
+            break;
+        usb_cdc_service(cdc);
+    }
+    return done;
+}
+
+size_t usb_cdc_read(USBCDC_t *cdc, void *data, size_t max) {
+    uint8_t *bytes = data;
+    size_t copy;
+
+    usb_port_lock(&cdc->lock);
+    copy = cdc->rx_head - cdc->rx_tail;
+    if (copy > max)
+        copy = max;
+    for (size_t i = 0; i < copy; i++)
+        bytes[i] = cdc->rx[(cdc->rx_tail + i) % CDC_RX_RING];
+    cdc->rx_tail += copy;
+    usb_port_unlock(&cdc->lock);
+    return copy;
+}
+
+void usb_cdc_service(USBCDC_t *cdc) {
+    uint8_t packet[CDC_PACKET_SIZE];
+    size_t count, first;
+
+    //nobody reading, keep the data until the ring overflows
+    if (!cdc->dtr || cdc->tx_head == cdc->tx_tail)
+        return;
+
+    usb_port_lock(&cdc->lock);
+    count = cdc->tx_head - cdc->tx_tail;
+    if (count > CDC_PACKET_SIZE)
+        count = CDC_PACKET_SIZE;
+    first = CDC_TX_RING - cdc->tx_tail % CDC_TX_RING;
+    if (first > count)
+        first = count;
+    memcpy(packet, &cdc->tx[cdc->tx_tail % CDC_TX_RING], first);
+    memcpy(packet + first, cdc->tx, count - first);
+    usb_port_unlock(&cdc->lock);
+
+    //only this function consumes, the bytes stay queued until the fpga takes them
+    if (usb_try_write_data(cdc->usb->fpga, packet, count, cdc->data_endp))
+        return;
+
+    usb_port_lock(&cdc->lock);
+    cdc->tx_tail += count;
+    cdc->tx_bytes += count;
+    usb_port_unlock(&cdc->lock);
+}
+
+void usb_cdc_reset(USBCDC_t *cdc) {
+    usb_port_lock(&cdc->lock);
+    cdc->dtr = false;
+    cdc->tx_dropped += cdc->tx_head - cdc->tx_tail;
+    cdc->tx_tail = cdc->tx_head;
+    cdc->rx_tail = cdc->rx_head;
+    usb_port_unlock(&cdc->lock);
+}
+
+static ssize_t usb_cdc_stream_write(void *cookie, const char *buffer, size_t size) {
+    usb_cdc_write(cookie, buffer, size);
+    //what did not fit is already counted, stdio must not see an error
+    return size;
+}
+
+FILE *usb_cdc_stream(USBCDC_t *cdc) {
+    cookie_io_functions_t functions = {
+        .write = usb_cdc_stream_write,
+    };
+
+    if (cdc->stream)
+        return cdc->stream;
+
+    cdc->stream = fopencookie(cdc, "w", functions);
+    if (!cdc->stream) {
+        DEBUG("Failed to open cdc stream");
+        return NULL;
+    }
+    setvbuf(cdc->stream, NULL, _IOLBF, CDC_PACKET_SIZE);
+    return cdc->stream;
+}
+
+void usb_cdc_print_stats(USBCDC_t *cdc) {
+    DEBUG("CDC port %s, %u bytes sent, %u tx bytes dropped, %u rx bytes dropped", cdc->dtr ? "open" : "closed",
+          (unsigned) cdc->tx_bytes, (unsigned) cdc->tx_dropped, (unsigned) cdc->rx_dropped);
+}
@@ -0,0 +1,111 @@
+
+
+#ifndef USB_CDC_H_
+#define USB_CDC_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "usb.h"
+#include "usb_port.h"
+
+#define CDC_TX_RING 4096 //must be a power of two
+#define CDC_RX_RING 256
+#define CDC_PACKET_SIZE 64
+#define CDC_WRITE_TIMEOUT (1000 * 1000) //us a blocking write waits for the host to read
+
+typedef enum {
+    kCDCRequestSetLineCoding = 0x20,
+    kCDCRequestGetLineCoding = 0x21,
+    kCDCRequestSetControlLineState = 0x22
+} CDCRequest_t;
+
+typedef struct {
+    uint32_t baudrate; //meaningless over usb, kept for the host
+    uint8_t stop_bits;
+    uint8_t parity;
+    uint8_t data_bits;
+} PACKED CDCLineCoding_t;
+
+/*Header, call management, ACM and union functional descriptors*/
+typedef struct {
+    struct {
+        uint8_t length;
+        uint8_t type;
+        uint8_t sub_type;
+        uint16_t cdc_version;
+    } PACKED header;
+    struct {
+        uint8_t length;
+        uint8_t type;
+        uint8_t sub_type;
+        uint8_t capabilities;
+        uint8_t data_interface;
+    } PACKED call_management;
+    struct {
+        uint8_t length;
+        uint8_t type;
+        uint8_t sub_type;
+        uint8_t capabilities;
+    } PACKED acm;
+    struct {
+        uint8_t length;
+        uint8_t type;
+        uint8_t sub_type;
+        uint8_t control_interface;
+        uint8_t data_interface;
+    } PACKED union_interfaces;
+} PACKED CDCFunctionalDescriptors_t;
+
+/*CDC-ACM serial port: a communication interface with its notification
+endpoint plus a data interface using one fpga endpoint for bulk IN and OUT.
+Writes go to a ring buffer drained by usb_cdc_service, so they never block
+and bytes that don't fit are counted as dropped*/
+typedef struct {
+    USBDevice_t *usb;
+    uint8_t data_endp;
+
+    InterfaceAssociationDescriptor_t association;
+    InterfaceDescriptor_t comm_interface, data_interface;
+    CDCFunctionalDescriptors_t functional;
+    EndpointDescriptor_t notify_endpoint, out_endpoint, in_endpoint;
+
+    CDCLineCoding_t line_coding;
+    uint8_t line_coding_buffer[sizeof(CDCLineCoding_t)];
+    bool dtr; //host has the port open
+
+    USBLock_t lock;
+    uint8_t tx[CDC_TX_RING];
+    uint32_t tx_head, tx_tail; //free running
+    uint8_t rx[CDC_RX_RING];
+    uint32_t rx_head, rx_tail;
+
+    uint32_t tx_dropped; //bytes
+    uint32_t rx_dropped;
+    uint32_t tx_bytes;
+    FILE *stream;
+} USBCDC_t;
+
+/*Adds both interfaces to the configuration being built, numbered from
+first_interface. The device descriptor should use the IAD class triple
+(0xef, 0x02, 0x01) so hosts bind the association*/
+void usb_cdc_init(USBCDC_t *cdc, USBDevice_t *dev, uint8_t first_interface, uint8_t notify_endp, uint8_t data_endp);
+size_t usb_cdc_write(USBCDC_t *cdc, const void *data, size_t length);
+/*For bulk output such as a capture file: waits for room in the ring instead
+of dropping, sending the packets itself, so call it only from the task that
+runs usb_cdc_service. Gives up when the port closes or the host stops reading
+for CDC_WRITE_TIMEOUT, returns the bytes queued*/
+size_t usb_cdc_write_blocking(USBCDC_t *cdc, const void *data, size_t length);
+size_t usb_cdc_read(USBCDC_t *cdc, void *data, size_t max);
+/*Moves the next packet of the ring to the fpga if the endpoint is free,
+call it from the poll loop*/
+void usb_cdc_service(USBCDC_t *cdc);
+/*After a bus reset: the port is closed and both rings emptied, what was
+waiting to be sent counts as dropped*/
+void usb_cdc_reset(USBCDC_t *cdc);
+/*Line buffered stdio stream writing to the port, never blocks*/
+FILE *usb_cdc_stream(USBCDC_t *cdc);
+void usb_cdc_print_stats(USBCDC_t *cdc);
+
+#endif
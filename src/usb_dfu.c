@@ -0,0 +1,330 @@
+#include "usb_dfu.h"
+#include "util.h"
+
+#include <string.h>
+
+#define DEBUG_CNTX "usb-dfu"
+
+
+static void usb_dfu_reply_status(USBDevice_t *dev, DFUStatus_t status, uint32_t poll_timeout, DFUState_t state, uint16_t chunk_size, uint8_t endp) {
+    DFUStatusReply_t reply = {
+        .status = status,
+        .poll_timeout = {poll_timeout, poll_timeout >> 8, poll_timeout >> 16},
+        .state = state,
+    };
+
+    if (usb_write_data(dev->fpga, (uint8_t *) &reply, sizeof(reply), chunk_size, endp))
+        DEBUG("Failed to send status");
+}
+
+/*GETSTATUS moves the download and the manifestation along, with the writer
+progress. Returns the poll timeout in ms*/
+static uint32_t usb_dfu_advance(USBDFU_t *dfu) {
+    uint32_t poll_timeout = 0;
+    uint64_t elapsed;
+
+    usb_port_lock(&dfu->lock);
+    if (dfu->write_status != kDFUStatusOk &&
+        dfu->state >= kDFUStateDnloadSync && dfu->state <= kDFUStateManifest) {
+        dfu->status = dfu->write_status;
+        dfu->state = kDFUStateError;
+    }
+
+    switch (dfu->state) {
+    case kDFUStateDnloadSync:
+    case kDFUStateDnbusy:
+        if (dfu->head - dfu->tail < DFU_BUFFERS) {
+            dfu->state = kDFUStateDnloadIdle;
+            break;
+        }
+        //both buffers taken: come back when the block being written should be done
+        elapsed = usb_port_time_us() - dfu->write_start;
+        poll_timeout = dfu->writing && elapsed < dfu->write_time ? (dfu->write_time - elapsed + 999) / 1000 : 1;
+        dfu->state = kDFUStateDnbusy;
+        dfu->busy_replies++;
+        break;
+    case kDFUStateManifestSync:
+    case kDFUStateManifest:
+        if (dfu->manifested) {
+            dfu->state = kDFUStateIdle;
+        } else {
+            dfu->state = kDFUStateManifest;
+            poll_timeout = DFU_MANIFEST_POLL_MS;
+        }
+        break;
+    default:
+        break;
+    }
+    usb_port_unlock(&dfu->lock);
+    return poll_timeout;
+}
+
+static int usb_dfu_block_received(USBDevice_t *dev, USBControlRequest_t *control, uint8_t *data, uint16_t length) {
+    USBDFU_t *dfu = dev->class_context;
+    DFUBlock_t *block = &dfu->blocks[dfu->head % DFU_BUFFERS];
+
+    block->offset = dfu->offset;
+    block->length = length;
+    dfu->offset += length;
+
+    usb_port_lock(&dfu->lock);
+    dfu->head++;
+    usb_port_unlock(&dfu->lock);
+    usb_port_event_signal(&dfu->event);
+
+    dfu->state = kDFUStateDnloadSync;
+    return 0;
+}
+
+static int usb_dfu_download(USBDFU_t *dfu, USBDevice_t *dev, USBControlRequest_t *control, uint8_t endp) {
+    bool free;
+
+    if (dfu->state != kDFUStateIdle && dfu->state != kDFUStateDnloadIdle)
+        return -1;
+
+    //zero length download: the image is complete
+    if (!control->generic.length) {
+        if (dfu->state != kDFUStateDnloadIdle)
+            return -1;
+        usb_port_lock(&dfu->lock);
+        dfu->finish = true;
+        usb_port_unlock(&dfu->lock);
+        usb_port_event_signal(&dfu->event);
+        dfu->state = kDFUStateManifestSync;
+        usb_control_accept_request(dev, endp);
+        return 0;
+    }
+
+    usb_port_lock(&dfu->lock);
+    free = dfu->head - dfu->tail < DFU_BUFFERS;
+    if (free && dfu->state == kDFUStateIdle) {
+        dfu->write_status = kDFUStatusOk;
+        dfu->manifested = false;
+        dfu->finish = false;
+    }
+    usb_port_unlock(&dfu->lock);
+
+    //the host was told to wait for a free buffer
+    if (!free)
+        return -1;
+    if (dfu->state == kDFUStateIdle)
+        dfu->offset = 0;
+
+    //received in place, the writer takes the buffer from there
+    return usb_control_receive(dev, control, dfu->blocks[dfu->head % DFU_BUFFERS].data, DFU_TRANSFER_SIZE, usb_dfu_block_received);
+}
+
+static void usb_dfu_handler(USBDevice_t *dev, USBControlRequest_t *control, uint16_t chunk_size, uint8_t endp) {
+    USBDFU_t *dfu = dev->class_context;
+    DFURequest_t request = (DFURequest_t) control->request;
+    uint32_t poll_timeout;
+    uint8_t state;
+
+    if (control->request_type.type != kTypeClass)
+        goto stall;
+
+    switch (request) {
+    case kDFURequestDnload:
+        if (usb_dfu_download(dfu, dev, control, endp))
+            goto stall;
+        break;
+    case kDFURequestGetStatus:
+        poll_timeout = usb_dfu_advance(dfu);
+        usb_dfu_reply_status(dev, dfu->status, poll_timeout, dfu->state, chunk_size, endp);
+        break;
+    case kDFURequestGetState:
+        state = dfu->state;
+        if (usb_write_data(dev->fpga, &state, 1, chunk_size, endp))
+            DEBUG("Failed to send state");
+        break;
+    case kDFURequestClrStatus:
+        if (dfu->state != kDFUStateError)
+            goto stall;
+        dfu->status = kDFUStatusOk;
+        dfu->state = kDFUStateIdle;
+        usb_control_accept_request(dev, endp);
+        break;
+    case kDFURequestAbort:
+        //blocks already queued are still written, the next download begins a new image
+        if (dfu->state != kDFUStateIdle && dfu->state != kDFUStateDnloadIdle)
+            goto stall;
+        dfu->state = kDFUStateIdle;
+        usb_control_accept_request(dev, endp);
+        break;
+    default:
+        goto stall;
+    }
+    return;
+
+stall:
+    //a request that does not fit the state is an error the host has to clear
+    if (request != kDFURequestGetStatus && request != kDFURequestGetState) {
+        dfu->status = kDFUStatusErrStalledPacket;
+        dfu->state = kDFUStateError;
+    }
+    usb_control_deny_request(dev, endp);
+}
+
+static void usb_dfu_runtime_handler(USBDevice_t *dev, USBControlRequest_t *control, uint16_t chunk_size, uint8_t endp) {
+    USBDFU_t *dfu = dev->class_context;
+    uint8_t state = kDFUStateAppIdle;
+
+    if (control->request_type.type != kTypeClass)
+        goto deny_request;
+
+    switch ((DFURequest_t) control->request) {
+    case kDFURequestDetach:
+        //no detach of our own, the host resets the bus and enumerates the dfu mode descriptors
+        usb_control_accept_request(dev, endp);
+        dfu->state = kDFUStateIdle;
+        dfu->status = kDFUStatusOk;
+        dfu->detached = true;
+        usb_device_attach(&dfu->device);
+        DEBUG("Detached, dfu mode on the next enumeration");
+        break;
+    case kDFURequestGetStatus:
+        usb_dfu_reply_status(dev, kDFUStatusOk, 0, kDFUStateAppIdle, chunk_size, endp);
+        break;
+    case kDFURequestGetState:
+        if (usb_write_data(dev->fpga, &state, 1, chunk_size, endp))
+            DEBUG("Failed to send state");
+        break;
+    default:
+        goto deny_request;
+    }
+    return;
+
+deny_request:
+    usb_control_deny_request(dev, endp);
+}
+
+void usb_dfu_init(USBDFU_t *dfu, USBDevice_t *dev, uint8_t interface, const DFUFlashOps_t *ops, void *ops_context) {
+    ASSERT(dev->device_descriptor != NULL);
+
+    memset(dfu, 0, sizeof(USBDFU_t));
+    dfu->runtime = dev;
+    dfu->ops = ops;
+    dfu->ops_context = ops_context;
+    dfu->state = kDFUStateAppIdle;
+    usb_port_lock_init(&dfu->lock);
+    usb_port_event_init(&dfu->event);
+
+    dfu->functional = (DFUFunctionalDescriptor_t) {
+        .length = sizeof(DFUFunctionalDescriptor_t),
+        .type = 0x21, //dfu functional
+        .attributes = kDFUAttributeCanDnload | kDFUAttributeManifestationTolerant,
+        .detach_timeout = 1000,
+        .transfer_size = DFU_TRANSFER_SIZE,
+        .dfu_version = 0x0110,
+    };
+
+    dfu->runtime_interface = (InterfaceDescriptor_t) {
+        .interface_id = interface,
+        .class = 0xfe, //application specific
+        .sub_class = 0x01, //device firmware upgrade
+        .protocol = 0x01, //runtime
+    };
+    usb_add_interface_descriptor(dev, &dfu->runtime_interface);
+    usb_add_class_descriptor(dev, (uint8_t *) &dfu->functional, sizeof(dfu->functional));
+    usb_add_class_control_handler(dev, usb_dfu_runtime_handler);
+    usb_add_class_context(dev, dfu);
+
+    //dfu mode: same ids, a single interface and no other endpoints than the control one
+    dfu->device_descriptor = *dev->device_descriptor;
+    dfu->device_descriptor.class = 0;
+    dfu->device_descriptor.sub_class = 0;
+    dfu->device_descriptor.protocol = 0;
+    dfu->config = (ConfigurationDescriptor_t) {
+        .attributes = kConfigAttributeDefault,
+        .max_power = 50,
+    };
+    dfu->interface = (InterfaceDescriptor_t) {
+        .interface_id = 0,
+        .class = 0xfe,
+        .sub_class = 0x01,
+        .protocol = 0x02, //dfu mode
+    };
+
+    usb_device_init(&dfu->device, dev->fpga, dev->context);
+    usb_set_device_descriptor(&dfu->device, &dfu->device_descriptor);
+    usb_add_configuration_descriptor(&dfu->device, &dfu->config);
+    usb_add_interface_descriptor(&dfu->device, &dfu->interface);
+    usb_add_class_descriptor(&dfu->device, (uint8_t *) &dfu->functional, sizeof(dfu->functional));
+    usb_add_class_control_handler(&dfu->device, usb_dfu_handler);
+    usb_add_class_context(&dfu->device, dfu);
+
+    //the application keeps the core until the host detaches it
+    usb_device_attach(dev);
+}
+
+void usb_dfu_write_next(USBDFU_t *dfu) {
+    DFUBlock_t *block = NULL;
+    DFUStatus_t status = kDFUStatusOk;
+    bool finish = false;
+    uint64_t start;
+
+    usb_port_event_wait(&dfu->event);
+
+    start = usb_port_time_us();
+    usb_port_lock(&dfu->lock);
+    if (dfu->tail != dfu->head) {
+        block = &dfu->blocks[dfu->tail % DFU_BUFFERS];
+        dfu->writing = true;
+        dfu->write_start = start;
+    } else if (dfu->finish) {
+        finish = true;
+        dfu->finish = false;
+        status = dfu->write_status;
+    }
+    usb_port_unlock(&dfu->lock);
+
+    if (block) {
+        if (!block->offset && dfu->ops->begin(dfu->ops_context))
+            status = kDFUStatusErrErase;
+        else if (dfu->ops->write(dfu->ops_context, block->offset, block->data, block->length))
+            status = kDFUStatusErrWrite;
+        if (status != kDFUStatusOk)
+            DEBUG("Failed to write block at %u", (unsigned) block->offset);
+
+        usb_port_lock(&dfu->lock);
+        dfu->tail++;
+        dfu->writing = false;
+        dfu->write_time = usb_port_time_us() - start;
+        dfu->blocks_written++;
+        if (status != kDFUStatusOk && dfu->write_status == kDFUStatusOk)
+            dfu->write_status = status;
+        usb_port_unlock(&dfu->lock);
+        return;
+    }
+
+    if (!finish || status != kDFUStatusOk)
+        return;
+
+    if (dfu->ops->end(dfu->ops_context)) {
+        DEBUG("Image rejected");
+        status = kDFUStatusErrFirmware;
+    }
+
+    usb_port_lock(&dfu->lock);
+    if (status != kDFUStatusOk)
+        dfu->write_status = status;
+    else
+        dfu->manifested = true;
+    usb_port_unlock(&dfu->lock);
+    if (status == kDFUStatusOk)
+        DEBUG("Image of %u bytes manifested", (unsigned) dfu->offset);
+}
+
+bool usb_dfu_manifested(USBDFU_t *dfu) {
+    bool manifested;
+
+    usb_port_lock(&dfu->lock);
+    manifested = dfu->manifested;
+    usb_port_unlock(&dfu->lock);
+    return manifested;
+}
+
+void usb_dfu_print_stats(USBDFU_t *dfu) {
+    DEBUG("DFU state %i, %u blocks written, last in %u us, %u busy replies", dfu->state,
+          (unsigned) dfu->blocks_written, (unsigned) dfu->write_time, (unsigned) dfu->busy_replies);
+}
@@ -0,0 +1,144 @@
+
+
+
+#ifndef USB_DFU_H_
+#define USB_DFU_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "usb.h"
+#include "usb_port.h"
+
+#define DFU_TRANSFER_SIZE 4096 //wTransferSize, one flash erase block per download request
+#define DFU_BUFFERS 2 //one block being written while the next one arrives
+#define DFU_MANIFEST_POLL_MS 100
+
+typedef enum {
+    kDFURequestDetach,
+    kDFURequestDnload,
+    kDFURequestUpload,
+    kDFURequestGetStatus,
+    kDFURequestClrStatus,
+    kDFURequestGetState,
+    kDFURequestAbort
+} DFURequest_t;
+
+typedef enum {
+    kDFUStateAppIdle,
+    kDFUStateAppDetach,
+    kDFUStateIdle,
+    kDFUStateDnloadSync,
+    kDFUStateDnbusy,
+    kDFUStateDnloadIdle,
+    kDFUStateManifestSync,
+    kDFUStateManifest,
+    kDFUStateManifestWaitReset,
+    kDFUStateUploadIdle,
+    kDFUStateError
+} DFUState_t;
+
+typedef enum {
+    kDFUStatusOk,
+    kDFUStatusErrTarget,
+    kDFUStatusErrFile,
+    kDFUStatusErrWrite,
+    kDFUStatusErrErase,
+    kDFUStatusErrCheckErased,
+    kDFUStatusErrProg,
+    kDFUStatusErrVerify,
+    kDFUStatusErrAddress,
+    kDFUStatusErrNotDone,
+    kDFUStatusErrFirmware,
+    kDFUStatusErrVendor,
+    kDFUStatusErrUsbReset,
+    kDFUStatusErrPowerOnReset,
+    kDFUStatusErrUnknown,
+    kDFUStatusErrStalledPacket
+} DFUStatus_t;
+
+enum {
+    kDFUAttributeCanDnload = 0b0001,
+    kDFUAttributeCanUpload = 0b0010,
+    kDFUAttributeManifestationTolerant = 0b0100,
+    kDFUAttributeWillDetach = 0b1000
+};
+
+typedef struct {
+    uint8_t length;
+    uint8_t type;
+    uint8_t attributes;
+    uint16_t detach_timeout; //ms
+    uint16_t transfer_size;
+    uint16_t dfu_version;
+} PACKED DFUFunctionalDescriptor_t;
+
+typedef struct {
+    uint8_t status;
+    uint8_t poll_timeout[3]; //ms, little endian
+    uint8_t state;
+    uint8_t str_index;
+} PACKED DFUStatusReply_t;
+
+/*Firmware image storage. Blocks come in order from offset 0, begin runs
+before the first one and end validates and selects the image*/
+typedef struct {
+    int (*begin)(void *context);
+    int (*write)(void *context, uint32_t offset, const uint8_t *data, size_t length);
+    int (*end)(void *context);
+} DFUFlashOps_t;
+
+typedef struct {
+    uint8_t data[DFU_TRANSFER_SIZE];
+    uint32_t offset;
+    uint16_t length;
+} DFUBlock_t;
+
+/*DFU 1.1 download. The runtime interface goes in the application
+configuration, DFU_DETACH hands the fpga core to a DFU mode descriptor set
+the host finds after its reset. Downloaded blocks land straight from
+endpoint 0 in a ring of DFU_BUFFERS and usb_dfu_write_next, on its own task,
+programs them: the host is told to send the next block as soon as a buffer
+is free, so the flash writes overlap the control transfers*/
+typedef struct {
+    USBDevice_t *runtime;
+    const DFUFlashOps_t *ops;
+    void *ops_context;
+
+    InterfaceDescriptor_t runtime_interface;
+    DFUFunctionalDescriptor_t functional;
+
+    //dfu mode
+    USBDevice_t device;
+    DeviceDescriptor_t device_descriptor;
+    ConfigurationDescriptor_t config;
+    InterfaceDescriptor_t interface;
+    bool detached;
+
+    DFUState_t state;
+    DFUStatus_t status;
+    uint32_t offset; //of the next block
+
+    USBLock_t lock;
+    USBEvent_t event;
+    DFUBlock_t blocks[DFU_BUFFERS];
+    uint32_t head, tail; //free running, received and written blocks
+    bool finish; //all blocks received, end the image once written
+    bool writing;
+    bool manifested;
+    DFUStatus_t write_status;
+    uint64_t write_start; //us
+    uint32_t write_time; //us, last block
+
+    uint32_t blocks_written, busy_replies;
+} USBDFU_t;
+
+/*Adds the runtime interface to the configuration being built*/
+void usb_dfu_init(USBDFU_t *dfu, USBDevice_t *dev, uint8_t interface, const DFUFlashOps_t *ops, void *ops_context);
+/*Waits for the next downloaded block and programs it, loop on it from the writer task*/
+void usb_dfu_write_next(USBDFU_t *dfu);
+/*New image programmed and selected, the application may restart*/
+bool usb_dfu_manifested(USBDFU_t *dfu);
+void usb_dfu_print_stats(USBDFU_t *dfu);
+
+#endif
@@ -1,63 +1,17 @@
 #include "usb_fpga.h"
 #include "util.h"
-
-#include "esp_timer.h"
+#include "usb_capture.h"
 
 #include <string.h>
 
 #include <stdint.h>
-#include "driver/spi_master.h"
 
 #define DEBUG_CNTX "usb-fpga"
-#define USB_DEBUG 1
 
 #define MAX_WRITE_TIME (1000 * 1000) //us
 
-enum {
-    kCMDWrite,
-    kCMDRead
-};
-
-enum {
-    kCMDData,
-    kCMDRxCount,
-    kCMDFlags,
-    kCMDAddress,
-    kCMDSetCMD
-};
-
-#define BUILD_CMD(r, cmd, args) (r << 7) | (cmd << 4) | (args & 0xf)
-
-
-int usb_internal_read_flags(spi_device_handle_t spi, USBFlags_t *flags, size_t count, uint8_t start_endp) {
-    uint8_t cmd = BUILD_CMD(kCMDRead, kCMDFlags, start_endp);
-    esp_err_t ret;
-    spi_transaction_t transaction = {
-        .tx_buffer = &cmd,
-        .rx_buffer = NULL,
-        .length = 8,
-        .flags = SPI_TRANS_CS_KEEP_ACTIVE
-    };
-
-    spi_device_acquire_bus(spi, portMAX_DELAY);
-    ret = spi_device_transmit(spi, &transaction);
-    if(ret != ESP_OK) {
-        spi_device_release_bus(spi);
-        return -1;
-    }
-
-    memset(&transaction, 0, sizeof(spi_transaction_t));
-    transaction.rx_buffer = flags;
-    transaction.length = count * 8;
 
-    ret = spi_device_transmit(spi, &transaction);
-    if(ret != ESP_OK) {
-        spi_device_release_bus(spi);
-        return -1;
-    }
-
-    spi_device_release_bus(spi);
-    
+static int USB_HOT usb_internal_check_flags(USBFlags_t *flags, size_t count) {
     //check flags consistensy
     /*
     empty   full    consistent
@@ -76,276 +30,999 @@ int usb_internal_read_flags(spi_device_handle_t spi, USBFlags_t *flags, size_t c
     return 0;
 }
 
-int usb_internal_read_rx_count(spi_device_handle_t spi, uint16_t *count, uint8_t endp) {
+/*The transport only moves bytes, captures and sanity checks live here so
+every backend gets them. Each command holds the bus alone, captures have
+their own lock and are taken after releasing it*/
 
-    uint8_t cmd = BUILD_CMD(kCMDRead, kCMDRxCount, endp);
-    esp_err_t ret;
-    spi_transaction_t transaction = {
-        .tx_buffer = &cmd,
-        .rx_buffer = NULL,
-        .length = 8,
-        .flags = SPI_TRANS_CS_KEEP_ACTIVE
-    };
+static int USB_HOT usb_internal_read_flags(USBFpga_t *fpga, USBFlags_t *flags, size_t count, uint8_t start_endp) {
+    int ret;
 
-    spi_device_acquire_bus(spi, portMAX_DELAY);
-    ret = spi_device_transmit(spi, &transaction);
-    if(ret != ESP_OK) {
-        spi_device_release_bus(spi);
+    usb_port_mutex_lock(&fpga->bus_lock);
+    ret = usb_transport_read_flags(fpga->transport, flags, count, start_endp);
+    usb_port_mutex_unlock(&fpga->bus_lock);
+    if (ret)
         return -1;
-    }
+    usb_capture_spi(fpga->bus, BUILD_CMD(kCMDRead, kCMDFlags, start_endp), flags, count, false);
+    return usb_internal_check_flags(flags, count);
+}
 
-    memset(&transaction, 0, sizeof(spi_transaction_t));
-    transaction.rx_buffer = count;
-    transaction.length = 2 * 8;
+static int USB_HOT usb_internal_read_data(USBFpga_t *fpga, uint8_t *buffer, size_t count, uint8_t endp) {
+    int ret;
 
-    ret = spi_device_transmit(spi, &transaction);
-    if(ret != ESP_OK) {
-        spi_device_release_bus(spi);
+    usb_port_mutex_lock(&fpga->bus_lock);
+    ret = usb_transport_read_data(fpga->transport, buffer, count, endp);
+    usb_port_mutex_unlock(&fpga->bus_lock);
+    if (ret)
         return -1;
-    }
+    usb_capture_spi(fpga->bus, BUILD_CMD(kCMDRead, kCMDData, endp), buffer, count, false);
+    return 0;
+}
+
+static int USB_HOT usb_internal_write_data(USBFpga_t *fpga, uint8_t *buffer, size_t count, uint8_t endp) {
+    int ret;
 
-    spi_device_release_bus(spi);
+    usb_port_mutex_lock(&fpga->bus_lock);
+    ret = usb_transport_write_data(fpga->transport, buffer, count, endp);
+    usb_port_mutex_unlock(&fpga->bus_lock);
+    if (ret)
+        return -1;
+    usb_capture_spi(fpga->bus, BUILD_CMD(kCMDWrite, kCMDData, endp), buffer, count, true);
     return 0;
 }
 
-#define MAX_XFER_SIZE 16
+static int USB_HOT usb_internal_write_datav(USBFpga_t *fpga, const USBSegment_t *segments, int segments_count, size_t count, uint8_t endp) {
+    int ret;
 
+    usb_port_mutex_lock(&fpga->bus_lock);
+    ret = usb_transport_write_datav(fpga->transport, &fpga->writev, segments, segments_count, endp);
+    usb_port_mutex_unlock(&fpga->bus_lock);
+    if (ret)
+        return -1;
 
-int usb_internal_read_data(spi_device_handle_t spi, uint8_t *buffer, size_t count , uint8_t endp) {
+#if USB_CAPTURE
+    //records only keep the first bytes, gather just those
+    uint8_t head[CAPTURE_DATA_SIZE];
+    size_t head_size = 0, copy_size;
+
+    for (int i = 0; i < segments_count && head_size < sizeof(head); i++) {
+        copy_size = sizeof(head) - head_size;
+        if (copy_size > segments[i].length)
+            copy_size = segments[i].length;
+        memcpy(&head[head_size], segments[i].data, copy_size);
+        head_size += copy_size;
+    }
+    usb_capture_spi(fpga->bus, BUILD_CMD(kCMDWrite, kCMDData, endp), head, count, true);
+    usb_capture_packet(fpga->bus, fpga->address, kCaptureUSBIn, endp, head, count);
+#endif
+    return 0;
+}
 
-    uint8_t cmd = BUILD_CMD(kCMDRead, kCMDData, endp);
-    esp_err_t ret;
-    spi_transaction_t transaction = {
-        .tx_buffer = &cmd,
-        .rx_buffer = NULL,
-        .length = 8,
-        .flags = SPI_TRANS_CS_KEEP_ACTIVE
-    };
+static int USB_HOT usb_internal_set_cmd(USBFpga_t *fpga, USBCMDs_t cmd, uint8_t endp) {
+    uint8_t arg = cmd;
+    int ret;
 
-    spi_device_acquire_bus(spi, portMAX_DELAY);
-    ret = spi_device_transmit(spi, &transaction);
-    if(ret != ESP_OK) {
-        spi_device_release_bus(spi);
+    usb_port_mutex_lock(&fpga->bus_lock);
+    ret = usb_transport_set_cmd(fpga->transport, cmd, endp);
+    usb_port_mutex_unlock(&fpga->bus_lock);
+    if (ret)
         return -1;
-    }
+    usb_capture_spi(fpga->bus, BUILD_CMD(kCMDWrite, kCMDSetCMD, endp), &arg, 1, true);
+    return 0;
+}
 
+static int usb_internal_read_caps(USBFpga_t *fpga, USBCaps_t *caps) {
+    int ret;
 
-    int xfer_size = MAX_XFER_SIZE;
+    usb_port_mutex_lock(&fpga->bus_lock);
+    ret = usb_transport_read_caps(fpga->transport, caps);
+    usb_port_mutex_unlock(&fpga->bus_lock);
+    if (ret)
+        return -1;
+    usb_capture_spi(fpga->bus, BUILD_CMD(kCMDRead, kCMDCaps, 0), caps, sizeof(USBCaps_t), false);
+    return 0;
+}
 
-    while (count) {
-        if (xfer_size > count) 
-            xfer_size = count;
+static int usb_internal_set_fifo_size(USBFpga_t *fpga, uint16_t size, uint8_t endp) {
+    uint8_t arg[2] = {size & 0xff, size >> 8};
+    int ret;
 
-        memset(&transaction, 0, sizeof(spi_transaction_t));
-        transaction.rx_buffer = buffer;
-        transaction.length = xfer_size * 8;
-        transaction.flags = xfer_size == MAX_XFER_SIZE ? SPI_TRANS_CS_KEEP_ACTIVE : 0;
+    usb_port_mutex_lock(&fpga->bus_lock);
+    ret = usb_transport_set_fifo_size(fpga->transport, size, endp);
+    usb_port_mutex_unlock(&fpga->bus_lock);
+    if (ret)
+        return -1;
+    usb_capture_spi(fpga->bus, BUILD_CMD(kCMDWrite, kCMDFifoSize, endp), arg, sizeof(arg), true);
+    return 0;
+}
 
-        ret = spi_device_transmit(spi, &transaction);
-        if(ret != ESP_OK) {
-            spi_device_release_bus(spi);
-            return -1;
-        }
+#if USB_QUAD
+static int usb_internal_set_link(USBFpga_t *fpga, USBLinkMode_t mode) {
+    uint8_t arg = mode;
+    int ret;
 
-        count -= xfer_size;
-        buffer += xfer_size;
-    }
+    usb_port_mutex_lock(&fpga->bus_lock);
+    ret = usb_transport_set_link(fpga->transport, mode);
+    usb_port_mutex_unlock(&fpga->bus_lock);
+    if (ret)
+        return -1;
+    usb_capture_spi(fpga->bus, BUILD_CMD(kCMDWrite, kCMDLinkMode, 0), &arg, 1, true);
+    return 0;
+}
+#endif
 
-    spi_device_release_bus(spi);
+static int usb_internal_set_address(USBFpga_t *fpga, uint8_t address) {
+    int ret;
+
+    usb_port_mutex_lock(&fpga->bus_lock);
+    ret = usb_transport_set_address(fpga->transport, address);
+    usb_port_mutex_unlock(&fpga->bus_lock);
+    if (ret)
+        return -1;
+    usb_capture_spi(fpga->bus, BUILD_CMD(kCMDWrite, kCMDAddress, 0), &address, 1, true);
     return 0;
 }
 
-int usb_internal_set_cmd(spi_device_handle_t spi, USBCMDs_t usb_cmd, uint8_t endp) {
-    uint8_t cmd[2] = {BUILD_CMD(kCMDWrite, kCMDSetCMD, endp), usb_cmd};
-    esp_err_t ret;
-    spi_transaction_t transaction = {
-        .tx_buffer = &cmd,
-        .rx_buffer = NULL,
-        .length = sizeof(cmd) * 8
-    };
 
-    ret = spi_device_transmit(spi, &transaction);
-    if(ret != ESP_OK) {
+////////////////////////////////////// batched transactions /////////////////////////////////
+
+void usb_batch_init(USBBatch_t *batch) {
+    batch->ops_used = 0;
+}
+
+static int USB_HOT usb_batch_add(USBBatch_t *batch, uint8_t cmd, uint8_t arg, uint8_t *data, size_t count, bool write, bool flags) {
+    if (batch->ops_used >= USB_BATCH_OPS) {
+        DEBUG("Batch full");
         return -1;
     }
+
+    batch->ops[batch->ops_used].cmd = cmd;
+    batch->ops[batch->ops_used].arg = arg;
+    batch->ops[batch->ops_used].data = data;
+    batch->ops[batch->ops_used].length = count;
+    batch->ops[batch->ops_used].write = write;
+    batch->ops[batch->ops_used].flags = flags;
+    batch->ops_used++;
     return 0;
 }
 
-static int usb_internal_write_data(spi_device_handle_t spi, uint8_t *buffer, size_t count , uint8_t endp) {
-    uint8_t cmd = BUILD_CMD(kCMDWrite, kCMDData, endp);
-    esp_err_t ret;
-    spi_transaction_t transaction = {
-        .tx_buffer = &cmd,
-        .rx_buffer = NULL,
-        .length = 8,
-        .flags = SPI_TRANS_CS_KEEP_ACTIVE
-    };
+int usb_batch_read_flags(USBBatch_t *batch, USBFlags_t *flags, size_t count, uint8_t start_endp) {
+    return usb_batch_add(batch, BUILD_CMD(kCMDRead, kCMDFlags, start_endp), 0, (uint8_t *) flags, count, false, true);
+}
+
+int USB_HOT usb_batch_read_rx_count(USBBatch_t *batch, uint16_t *count, uint8_t endp) {
+    return usb_batch_add(batch, BUILD_CMD(kCMDRead, kCMDRxCount, endp), 0, (uint8_t *) count, 2, false, false);
+}
+
+int usb_batch_read_data(USBBatch_t *batch, uint8_t *buffer, size_t count, uint8_t endp) {
+    return usb_batch_add(batch, BUILD_CMD(kCMDRead, kCMDData, endp), 0, buffer, count, false, false);
+}
+
+int usb_batch_write_data(USBBatch_t *batch, uint8_t *buffer, size_t count, uint8_t endp) {
+    return usb_batch_add(batch, BUILD_CMD(kCMDWrite, kCMDData, endp), 0, buffer, count, true, false);
+}
 
-    spi_device_acquire_bus(spi, portMAX_DELAY);
-    ret = spi_device_transmit(spi, &transaction);
-    if(ret != ESP_OK) {
-        spi_device_release_bus(spi);
+int usb_batch_set_cmd(USBBatch_t *batch, USBCMDs_t cmd, uint8_t endp) {
+    return usb_batch_add(batch, BUILD_CMD(kCMDWrite, kCMDSetCMD, endp), cmd, NULL, 0, true, false);
+}
+
+int usb_batch_set_address(USBBatch_t *batch, uint8_t address) {
+    return usb_batch_add(batch, BUILD_CMD(kCMDWrite, kCMDAddress, 0), address, NULL, 0, true, false);
+}
+
+static int USB_HOT usb_internal_batch_submit(USBFpga_t *fpga, USBBatch_t *batch) {
+    int ret;
+
+    usb_port_mutex_lock(&fpga->bus_lock);
+    ret = usb_transport_submit(fpga->transport, batch);
+    usb_port_mutex_unlock(&fpga->bus_lock);
+    if (ret)
         return -1;
+
+    for (int i = 0; i < batch->ops_used; i++) {
+        if (batch->ops[i].data)
+            usb_capture_spi(fpga->bus, batch->ops[i].cmd, batch->ops[i].data, batch->ops[i].length, batch->ops[i].write);
+        else
+            usb_capture_spi(fpga->bus, batch->ops[i].cmd, &batch->ops[i].arg, 1, true);
+
+        if (batch->ops[i].flags && usb_internal_check_flags((USBFlags_t *) batch->ops[i].data, batch->ops[i].length))
+            ret = -1;
     }
 
-    int xfer_size = MAX_XFER_SIZE;
-    while (count) {
+    return ret;
+}
 
-        if (xfer_size > count)
-            xfer_size = count;
 
+////////////////////////////////////// top level implmentation of fpga driver /////////////////////////////////
 
-        memset(&transaction, 0, sizeof(spi_transaction_t));
-        transaction.tx_buffer = buffer;
-        transaction.length = xfer_size * 8;
-        transaction.flags = xfer_size == MAX_XFER_SIZE ? xfer_size == count ? 0: SPI_TRANS_CS_KEEP_ACTIVE : 0;
 
-        ret = spi_device_transmit(spi, &transaction);
-        if(ret != ESP_OK) {
-            spi_device_release_bus(spi);
-            return -1;
+static uint8_t g_fpga_count = 0;
+static USBLock_t g_fpga_count_lock = USB_LOCK_INITIALIZER;
+
+
+#if USB_QUAD
+/*Quad data phases when the core offers them. The caps are read back over the
+new link: with WP and HD not routed they come back as garbage and both ends
+return to single*/
+static void usb_link_negotiate(USBFpga_t *fpga) {
+    USBCaps_t caps;
+
+    if (fpga->caps.features == 0xff || !(fpga->caps.features & kFPGAFeatureQuad))
+        return;
+
+    if (usb_internal_set_link(fpga, kLinkQuad)) {
+        DEBUG("Host can not drive a quad link");
+        return;
+    }
+    if (!usb_internal_read_caps(fpga, &caps) && !memcmp(&caps, &fpga->caps, sizeof(USBCaps_t))) {
+        fpga->link = kLinkQuad;
+        DEBUG("Quad link");
+        return;
+    }
+
+    DEBUG("Quad link check failed, back to single");
+    usb_internal_set_link(fpga, kLinkSingle);
+}
+#endif
+
+void usb_init(USBFpga_t *fpga, USBTransportHandle_t transport) {
+    memset(fpga, 0, sizeof(USBFpga_t));
+    fpga->transport = transport;
+
+    usb_port_lock(&g_fpga_count_lock);
+    fpga->bus = g_fpga_count++;
+    usb_port_unlock(&g_fpga_count_lock);
+
+    usb_port_mutex_init(&fpga->bus_lock);
+    usb_port_mutex_init(&fpga->poll_lock);
+    for (int i = 0; i < FPGA_ENDPOINTS; i++) {
+        usb_port_mutex_init(&fpga->tx_lock[i]);
+        fpga->fifo_size[i] = FPGA_ENDP_SIZE;
+    }
+    fpga->packet_size[0] = USB_CONTROL_PACKET;
+
+#if USB_QUAD
+    //a core left in quad by a previous run reads garbage until this command
+    usb_internal_set_link(fpga, kLinkSingle);
+#endif
+
+    if (usb_internal_read_caps(fpga, &fpga->caps) || fpga->caps.magic != FPGA_CAPS_MAGIC) {
+        DEBUG("Fixed fifos of %i bytes", FPGA_ENDP_SIZE);
+        fpga->caps.magic = 0;
+    } else {
+        DEBUG("Core with %i endpoints, %u bytes of fifo", fpga->caps.endpoints, fpga->caps.fifo_memory);
+#if USB_QUAD
+        usb_link_negotiate(fpga);
+#endif
+        for (int i = fpga->caps.endpoints; i < FPGA_ENDPOINTS; i++)
+            fpga->fifo_size[i] = 0;
+        //whatever layout the core came up with, free it so the split starts from known sizes
+        for (int i = 1; i < fpga->caps.endpoints && i < FPGA_ENDPOINTS; i++)
+            if (!usb_internal_set_fifo_size(fpga, 0, i))
+                fpga->fifo_size[i] = 0;
+        //the host may send a setup before the first poll, endpoint 0 is sized now and kept
+        if (!usb_internal_set_fifo_size(fpga, USB_CONTROL_PACKET * USB_FIFO_PACKETS, 0))
+            fpga->fifo_size[0] = USB_CONTROL_PACKET * USB_FIFO_PACKETS;
+        fpga->fifo_dirty = true;
+    }
+
+    usb_set_address(fpga, 0);
+}
+
+void usb_set_endp_handler(USBFpga_t *fpga, EndpCallback_t callback, uint8_t endp) {
+    fpga->callbacks[endp] = callback;
+}
+
+void usb_set_bus_handler(USBFpga_t *fpga, BusCallback_t callback) {
+    fpga->bus_handler = callback;
+}
+
+void usb_set_endp_context(USBFpga_t *fpga, uint8_t endp, void *context) {
+    fpga->endp_context[endp] = context;
+}
+
+void *usb_get_endp_context(USBFpga_t *fpga, uint8_t endp) {
+    return fpga->endp_context[endp];
+}
+
+void usb_set_endp_double_buffer(USBFpga_t *fpga, uint8_t endp, bool enable) {
+    fpga->double_buffer[endp] = enable;
+}
+
+void usb_set_endp_schedule(USBFpga_t *fpga, uint8_t endp, USBEndpType_t type, uint32_t interval, uint16_t packet_size) {
+    USBEndpSchedule_t *schedule = &fpga->schedule[endp];
+
+    //endpoint 0 stays control whatever shares its number
+    if (endp == 0)
+        return;
+
+    schedule->type = type;
+    schedule->interval = interval;
+    schedule->budget = type == kEndpTypeBulk ? packet_size * USB_BULK_BUDGET_PACKETS : 0;
+
+    //alternate settings share the fifo, it takes the largest
+    if (packet_size > fpga->packet_size[endp]) {
+        fpga->packet_size[endp] = packet_size;
+        fpga->fifo_dirty = fpga->caps.magic == FPGA_CAPS_MAGIC;
+    }
+}
+
+/*Every used endpoint gets USB_FIFO_PACKETS packets each way, bulk endpoints
+share what is left so the host can stream ahead while the firmware is busy.
+Shrinking endpoints are programmed first, the core never holds more than its
+memory*/
+static void usb_fifo_split(USBFpga_t *fpga) {
+    uint16_t sizes[FPGA_ENDPOINTS] = {0};
+    uint32_t used = 0, share, headroom;
+    int endpoints = fpga->caps.endpoints < FPGA_ENDPOINTS ? fpga->caps.endpoints : FPGA_ENDPOINTS;
+    int bulk = 0, packets;
+
+    fpga->fifo_dirty = false;
+    fpga->fifo_missing = 0;
+
+    //USB_FIFO_PACKETS each when the memory allows, one packet each otherwise
+    for (packets = USB_FIFO_PACKETS; packets; packets--) {
+        used = 0;
+        bulk = 0;
+        for (int i = 0; i < endpoints; i++) {
+            sizes[i] = fpga->packet_size[i] * packets;
+            used += 2 * sizes[i];
+            if (sizes[i] && i != 0 && fpga->schedule[i].type == kEndpTypeBulk)
+                bulk++;
         }
-        count-= xfer_size;
-        buffer += xfer_size;
+        if (used <= fpga->caps.fifo_memory)
+            break;
     }
 
-    spi_device_release_bus(spi);
-    
-    #if 0
-    /*send 0 packet length to nofity end*/
-    if (transaction.flags)
-        usb_internal_set_cmd(spi, kUSBCMDSend0DataLength, endp);
-    #endif
+    if (!packets) {
+        //not even that: a packet each in endpoint order while they fit, the rest go without
+        DEBUG("Endpoints need %u bytes of fifo, the core has %u", (unsigned) used, fpga->caps.fifo_memory);
+        used = 0;
+        bulk = 0;
+        for (int i = 0; i < endpoints; i++) {
+            sizes[i] = fpga->packet_size[i];
+            if (used + 2 * sizes[i] > fpga->caps.fifo_memory) {
+                DEBUG("Endp %i left without fifo", i);
+                fpga->fifo_missing |= 1 << i;
+                sizes[i] = 0;
+            }
+            used += 2 * sizes[i];
+        }
+    } else if (packets < USB_FIFO_PACKETS) {
+        DEBUG("Endpoints single buffered in %u bytes of fifo", fpga->caps.fifo_memory);
+    }
 
-    return 0;
+    share = bulk ? (fpga->caps.fifo_memory - used) / bulk / 2 : 0;
+    for (int i = 1; i < endpoints; i++) {
+        if (!sizes[i] || fpga->schedule[i].type != kEndpTypeBulk)
+            continue;
+        headroom = sizes[i] < FPGA_FIFO_MAX ? FPGA_FIFO_MAX - (uint32_t) sizes[i] : 0;
+        sizes[i] += share > headroom ? headroom : share;
+        sizes[i] -= sizes[i] % fpga->packet_size[i];
+    }
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < endpoints; i++) {
+            if (sizes[i] == fpga->fifo_size[i] || (sizes[i] > fpga->fifo_size[i]) != pass)
+                continue;
+            if (usb_internal_set_fifo_size(fpga, sizes[i], i)) {
+                DEBUG("Failed to set fifo of endp %i", i);
+                continue;
+            }
+            fpga->fifo_size[i] = sizes[i];
+        }
+    }
+
+    for (int i = 0; i < endpoints; i++)
+        if (fpga->fifo_size[i])
+            DEBUG("Endp %i: fifo %u bytes each way", i, fpga->fifo_size[i]);
 }
 
-static int usb_internal_set_address(spi_device_handle_t spi, uint8_t address) {
-    uint8_t cmd[2] = {BUILD_CMD(kCMDWrite, kCMDAddress, 0), address};
-    esp_err_t ret;
-    spi_transaction_t transaction = {
-        .tx_buffer = &cmd,
-        .rx_buffer = NULL,
-        .length = sizeof(cmd) * 8
-    };
+void usb_print_endp_stats(USBFpga_t *fpga) {
+    DEBUG("%u bus resets", (unsigned) fpga->bus_resets);
+    for (int i = 0; i < FPGA_ENDPOINTS; i++) {
+        USBEndpSchedule_t *schedule = &fpga->schedule[i];
+        if (fpga->stage[i])
+            DEBUG("Endp %i: %u reports staged, %u unchanged", i, (unsigned) fpga->stage[i]->refills, (unsigned) fpga->stage[i]->repeats);
+        if (!schedule->services)
+            continue;
+        DEBUG("Endp %i: %u services, %u bytes, %u deferred, wait mean %u us max %u us", i, (unsigned) schedule->services,
+              (unsigned) schedule->bytes, (unsigned) schedule->deferred,
+              (unsigned) (schedule->total_wait / schedule->services), (unsigned) schedule->max_wait);
+    }
+}
 
-    ret = spi_device_transmit(spi, &transaction);
-    if(ret != ESP_OK) {
+/*with double buffering the spi write of this chunk overlaps the
+usb transmission of the previous one*/
+static bool USB_HOT usb_internal_tx_free(USBFpga_t *fpga, USBFlags_t flags, uint8_t endp) {
+    return fpga->double_buffer[endp] ? !flags.tx_full : flags.tx_empty;
+}
+
+/*1 when the endpoint can take a new chunk, 0 when busy and -1 on error.
+The fifo a bus reset just emptied is not free, the write belongs to the
+previous session*/
+static int USB_HOT usb_internal_tx_ready(USBFpga_t *fpga, uint8_t endp) {
+    USBFlags_t flags;
+
+    if (usb_internal_read_flags(fpga, &flags, 1, endp)) {
+        DEBUG("Failed to read flags from endp %i", endp);
         return -1;
     }
-    return 0;
-}
+    if (flags.bus_reset)
+        return -1;
 
+    return usb_internal_tx_free(fpga, flags, endp);
+}
 
-////////////////////////////////////// top level implmentation of fpga driver /////////////////////////////////
+/*Waits up to MAX_WRITE_TIME for room in the tx fifo*/
+static int USB_HOT usb_internal_wait_tx(USBFpga_t *fpga, uint8_t endp) {
+    int ret;
+    uint64_t start;
 
+    start = usb_port_time_us();
 
-struct {
-    spi_device_handle_t spi;
-    EndpCallback_t callbacks[FPGA_ENDPOINTS];
-} g_fpga_config = {0};
+    while (usb_port_time_us() - start < MAX_WRITE_TIME) {
 
+        ret = usb_internal_tx_ready(fpga, endp);
+        if (ret < 0)
+            return ret;
 
-void usb_init(spi_device_handle_t spi) {
-    memset(&g_fpga_config, 0, sizeof(g_fpga_config));
-    g_fpga_config.spi = spi;
+        if (ret)
+            return 0;
+        
+        usb_port_sleep();
+    }
 
-    usb_set_address(0);
+    DEBUG("Send timeout");
+    //timeout
+    return -2;
 }
 
-void usb_set_endp_handler(EndpCallback_t callback, uint8_t endp) {
-    g_fpga_config.callbacks[endp] = callback;
+static int USB_HOT usb_internal_write_chunks(USBFpga_t *fpga, uint8_t *buffer, size_t count, uint16_t chunk_size, uint8_t endp) {
+    uint32_t resets = fpga->bus_resets;
+    int ret;
+
+    while (count) {
+
+        ret = usb_internal_wait_tx(fpga, endp);
+        if (ret)
+            return ret;
+        if (fpga->bus_resets != resets) {
+            USB_TRACE("Bus reset, write on endp %i dropped", endp);
+            return -1;
+        }
+        
+        if (chunk_size > count)
+            chunk_size = count;
+        
+        ret = usb_internal_write_data(fpga, buffer, chunk_size, endp);
+        if (ret) {
+            DEBUG("Failed to xfer chunk");
+            return ret;
+        }
+        usb_capture_packet(fpga->bus, fpga->address, kCaptureUSBIn, endp, buffer, chunk_size);
+
+        buffer += chunk_size;
+        count -= chunk_size;
+    }
+
+    return 0;
 }
 
-int usb_write_data(uint8_t *buffer, size_t count, uint16_t chunk_size, uint8_t endp) {
+/*The endpoint stays locked for the whole transfer so the chunks of two
+writers never interleave, other endpoints keep going in between chunks*/
+int USB_HOT usb_write_data(USBFpga_t *fpga, uint8_t *buffer, size_t count, uint16_t chunk_size, uint8_t endp) {
     int ret;
-    USBFlags_t flags;
-    uint32_t start;
-    
+
     #if USB_DEBUG
     DEBUG("Send on endp %i", endp);
     hexdump(stdout, buffer, count, 16, 8);
     #endif
-    
-    while (count) {
-
-        start = esp_timer_get_time();
 
-        while (esp_timer_get_time() - start < MAX_WRITE_TIME) {
+    usb_port_mutex_lock(&fpga->tx_lock[endp]);
+    ret = usb_internal_write_chunks(fpga, buffer, count, chunk_size, endp);
+    usb_port_mutex_unlock(&fpga->tx_lock[endp]);
+    return ret;
+}
 
-            ret = usb_internal_read_flags(g_fpga_config.spi, &flags, 1, endp);
+/*Packets are cut at chunk_size regardless of the segment edges, each one
+goes down as the list of segment pieces it spans*/
+static int USB_HOT usb_internal_write_chunksv(USBFpga_t *fpga, const USBSegment_t *segments, int segments_count, size_t count, uint16_t chunk_size, uint8_t endp) {
+    USBSegment_t pieces[USB_SEGMENTS_MAX];
+    size_t offset = 0, left, take;
+    int segment = 0, used, ret;
+    uint32_t resets = fpga->bus_resets;
 
-            if (ret) {
-                DEBUG("Failed to read flags from endp %i", endp);
-                return ret;
-            }
+    while (count) {
 
-            if (flags.tx_empty)
-                goto xfer_chunk;
-            
-            vTaskDelay(1);
+        ret = usb_internal_wait_tx(fpga, endp);
+        if (ret)
+            return ret;
+        if (fpga->bus_resets != resets) {
+            USB_TRACE("Bus reset, write on endp %i dropped", endp);
+            return -1;
         }
 
-        DEBUG("Send timeout");
-        //timeout
-        return -2;
-
-        xfer_chunk:
-        
         if (chunk_size > count)
             chunk_size = count;
-        
-        ret = usb_internal_write_data(g_fpga_config.spi, buffer, chunk_size, endp);
+
+        used = 0;
+        left = chunk_size;
+        while (left && segment < segments_count) {
+            take = segments[segment].length - offset;
+            if (take > left)
+                take = left;
+            if (take) {
+                if (used == USB_SEGMENTS_MAX) {
+                    DEBUG("Packet spans more than %i segments", USB_SEGMENTS_MAX);
+                    return -1;
+                }
+                pieces[used].data = segments[segment].data + offset;
+                pieces[used].length = take;
+                used++;
+            }
+            offset += take;
+            left -= take;
+            if (offset == segments[segment].length) {
+                segment++;
+                offset = 0;
+            }
+        }
+        if (left) {
+            DEBUG("Write of %u bytes past the end of the segments", (unsigned) count);
+            return -1;
+        }
+
+        ret = usb_internal_write_datav(fpga, pieces, used, chunk_size, endp);
         if (ret) {
             DEBUG("Failed to xfer chunk");
             return ret;
         }
 
-        buffer += chunk_size;
         count -= chunk_size;
     }
 
     return 0;
 }
 
-int usb_set_cmd(USBCMDs_t cmd, uint8_t endp) {
-    return usb_internal_set_cmd(g_fpga_config.spi, cmd, endp);
+/*usb_write_data over the concatenation of the segments, count bytes at most*/
+int USB_HOT usb_write_datav(USBFpga_t *fpga, const USBSegment_t *segments, int segments_count, size_t count, uint16_t chunk_size, uint8_t endp) {
+    size_t total = 0;
+    int ret;
+
+    for (int i = 0; i < segments_count; i++)
+        total += segments[i].length;
+    if (count > total)
+        count = total;
+
+    #if USB_DEBUG
+    DEBUG("Send on endp %i", endp);
+    for (int i = 0; i < segments_count; i++)
+        hexdump(stdout, segments[i].data, segments[i].length, 16, 8);
+    #endif
+
+    usb_port_mutex_lock(&fpga->tx_lock[endp]);
+    ret = usb_internal_write_chunksv(fpga, segments, segments_count, count, chunk_size, endp);
+    usb_port_mutex_unlock(&fpga->tx_lock[endp]);
+    return ret;
+}
+
+static int USB_HOT usb_internal_try_write(USBFpga_t *fpga, uint8_t *buffer, size_t count, uint8_t endp) {
+    int ret;
+
+    ret = usb_internal_tx_ready(fpga, endp);
+    if (ret < 0)
+        return ret;
+    if (!ret)
+        return -2;
+
+    ret = usb_internal_write_data(fpga, buffer, count, endp);
+    if (ret) {
+        DEBUG("Failed to xfer packet");
+        return ret;
+    }
+    usb_capture_packet(fpga->bus, fpga->address, kCaptureUSBIn, endp, buffer, count);
+    return 0;
+}
+
+int USB_HOT usb_try_write_data(USBFpga_t *fpga, uint8_t *buffer, size_t count, uint8_t endp) {
+    int ret;
+
+    usb_port_mutex_lock(&fpga->tx_lock[endp]);
+    ret = usb_internal_try_write(fpga, buffer, count, endp);
+    usb_port_mutex_unlock(&fpga->tx_lock[endp]);
+    return ret;
+}
+
+USBFlags_t usb_get_flags(USBFpga_t *fpga, uint8_t endp) {
+    return fpga->flags[endp];
 }
 
-int usb_set_address(uint8_t address) {
-    return usb_internal_set_address(g_fpga_config.spi, address);
+int usb_batch_submit(USBFpga_t *fpga, USBBatch_t *batch) {
+    return usb_internal_batch_submit(fpga, batch);
 }
 
-void usb_poll(void) {
+int USB_HOT usb_set_cmd(USBFpga_t *fpga, USBCMDs_t cmd, uint8_t endp) {
+    return usb_internal_set_cmd(fpga, cmd, endp);
+}
+
+int usb_set_address(USBFpga_t *fpga, uint8_t address) {
+    fpga->address = address;
+    return usb_internal_set_address(fpga, address);
+}
+
+
+////////////////////////////////////// isochronous endpoints /////////////////////////////////
+
+void usb_iso_init(USBIso_t *iso, USBFpga_t *fpga, uint8_t endp, bool in, IsoHandler_t handler, void *context) {
+    memset(iso, 0, sizeof(USBIso_t));
+    iso->fpga = fpga;
+    iso->endp = endp;
+    iso->in = in;
+    iso->handler = handler;
+    iso->context = context;
+    fpga->iso[endp] = iso;
+}
+
+void usb_iso_set_bandwidth(USBIso_t *iso, uint16_t packet_size) {
+    if (packet_size > iso->fpga->fifo_size[iso->endp])
+        packet_size = iso->fpga->fifo_size[iso->endp];
+
+    //start on the next poll
+    iso->next_frame = usb_port_time_us();
+    iso->received = true;
+    iso->packet_size = packet_size;
+    DEBUG("Iso endp %i %s, %u bytes per frame", iso->endp, packet_size ? "streaming" : "idle", packet_size);
+}
+
+void usb_iso_print_stats(USBIso_t *iso) {
+    DEBUG("Iso endp %i: %u frames, %u packets, %u underruns, %u overruns", iso->endp, (unsigned) iso->frames,
+          (unsigned) iso->packets, (unsigned) iso->underruns, (unsigned) iso->overruns);
+}
+
+/*Runs once per frame boundary. IN keeps exactly one packet queued per frame,
+if the host did not take the previous one the new one is dropped so the fifo
+never falls more than a frame behind*/
+static void USB_HOT usb_iso_frame(USBFpga_t *fpga, USBIso_t *iso, uint8_t *buffer, uint64_t now) {
+    uint32_t missed;
+    int len, ret;
+
+    if (!iso->packet_size || (int64_t) (now - iso->next_frame) < 0)
+        return;
+
+    missed = (now - iso->next_frame) / USB_FRAME_US;
+    iso->next_frame += (uint64_t) (missed + 1) * USB_FRAME_US;
+    iso->frames += missed + 1;
+
+    if (!iso->in) {
+        if (!iso->received)
+            iso->underruns++;
+        iso->received = false;
+        return;
+    }
+
+    //poll loop was too slow, those frames went out empty
+    iso->underruns += missed;
+
+    if (!usb_internal_tx_free(fpga, fpga->flags[iso->endp], iso->endp)) {
+        iso->overruns++;
+        return;
+    }
+
+    len = iso->handler(iso, buffer, iso->packet_size);
+    if (len < 0) {
+        iso->underruns++;
+        return;
+    }
+
+    usb_port_mutex_lock(&fpga->tx_lock[iso->endp]);
+    ret = usb_internal_write_data(fpga, buffer, len, iso->endp);
+    usb_port_mutex_unlock(&fpga->tx_lock[iso->endp]);
+    if (ret) {
+        DEBUG("Failed to queue iso packet");
+        return;
+    }
+    usb_capture_packet(fpga->bus, fpga->address, kCaptureUSBIn, iso->endp, buffer, len);
+    iso->packets++;
+}
+
+static void USB_HOT usb_iso_receive(USBIso_t *iso, USBFlags_t flags, uint8_t *buffer, size_t len) {
+    if (!iso->packet_size)
+        return;
+
+    //a full fifo or more than one packet means the poll loop fell behind the host
+    if (flags.rx_full || iso->received || len > iso->packet_size)
+        iso->overruns++;
+
+    iso->received = true;
+    iso->packets++;
+    iso->handler(iso, buffer, len);
+}
+
+
+////////////////////////////////////// latest-state IN endpoints /////////////////////////////////
+
+void usb_stage_init(USBStage_t *stage, USBFpga_t *fpga, uint8_t endp) {
+    memset(stage, 0, sizeof(USBStage_t));
+    stage->fpga = fpga;
+    stage->endp = endp;
+    stage->in_fifo = -1;
+    usb_port_lock_init(&stage->lock);
+    fpga->stage[endp] = stage;
+}
+
+uint32_t usb_stage_write(USBStage_t *stage, uint8_t slot, const uint8_t *data, size_t length) {
+    uint32_t sequence;
+
+    ASSERT(slot < USB_STAGE_SLOTS && length && length <= USB_STAGE_SIZE);
+
+    usb_port_lock(&stage->lock);
+    memcpy(stage->slots[slot].data, data, length);
+    stage->slots[slot].length = length;
+    sequence = ++stage->slots[slot].sequence;
+    usb_port_unlock(&stage->lock);
+    return sequence;
+}
+
+uint32_t usb_stage_taken(USBStage_t *stage, uint8_t slot) {
+    uint32_t taken;
+
+    usb_port_lock(&stage->lock);
+    taken = stage->slots[slot].taken;
+    usb_port_unlock(&stage->lock);
+    return taken;
+}
+
+/*Runs on every poll with the flags just read: an empty tx buffer means the
+host took the queued report, queue the newest one right away. Changed slots
+go first, otherwise they take turns so every report id stays fresh*/
+static void USB_HOT usb_stage_refill(USBFpga_t *fpga, USBStage_t *stage, uint8_t *buffer) {
+    USBStageSlot_t *slot;
+    uint32_t sequence = 0;
+    size_t length = 0;
+    int index = -1;
+    int ret;
+
+    if (!fpga->flags[stage->endp].tx_empty)
+        return;
+
+    usb_port_lock(&stage->lock);
+    if (stage->in_fifo >= 0)
+        stage->slots[stage->in_fifo].taken = stage->slots[stage->in_fifo].queued;
+    stage->in_fifo = -1;
+
+    for (int i = 0; i < USB_STAGE_SLOTS; i++) {
+        int k = (stage->next + i) % USB_STAGE_SLOTS;
+        slot = &stage->slots[k];
+        if (!slot->length)
+            continue;
+        if (slot->sequence != slot->queued) {
+            index = k;
+            break;
+        }
+        if (index < 0)
+            index = k;
+    }
+
+    if (index >= 0) {
+        slot = &stage->slots[index];
+        memcpy(buffer, slot->data, slot->length);
+        length = slot->length;
+        sequence = slot->sequence;
+        if (sequence == slot->queued)
+            stage->repeats++;
+        stage->next = (index + 1) % USB_STAGE_SLOTS;
+    }
+    usb_port_unlock(&stage->lock);
+
+    if (index < 0)
+        return;
+
+    usb_port_mutex_lock(&fpga->tx_lock[stage->endp]);
+    ret = usb_internal_write_data(fpga, buffer, length, stage->endp);
+    usb_port_mutex_unlock(&fpga->tx_lock[stage->endp]);
+    if (ret) {
+        DEBUG("Failed to stage report on endp %i", stage->endp);
+        return;
+    }
+    usb_capture_packet(fpga->bus, fpga->address, kCaptureUSBIn, stage->endp, buffer, length);
+
+    usb_port_lock(&stage->lock);
+    stage->slots[index].queued = sequence;
+    stage->in_fifo = index;
+    stage->refills++;
+    usb_port_unlock(&stage->lock);
+}
+
+
+////////////////////////////////////// endpoint scheduling /////////////////////////////////
+
+static int USB_HOT usb_schedule_rank(USBEndpType_t type) {
+    static const int ranks[] = {
+        [kEndpTypeControl] = 0,
+        [kEndpTypeIsochronous] = 1,
+        [kEndpTypeInterrupt] = 2,
+        [kEndpTypeBulk] = 3,
+    };
+    return ranks[type];
+}
+
+//true if endpoint a has to be serviced before b
+static bool USB_HOT usb_schedule_before(USBFpga_t *fpga, uint8_t a, uint8_t b) {
+    USBEndpSchedule_t *sa = &fpga->schedule[a], *sb = &fpga->schedule[b];
+
+    if (usb_schedule_rank(sa->type) != usb_schedule_rank(sb->type))
+        return usb_schedule_rank(sa->type) < usb_schedule_rank(sb->type);
+
+    if (sa->type == kEndpTypeInterrupt)
+        return sa->ready_since + sa->interval < sb->ready_since + sb->interval;
+
+    //bulk and the rest: longest waiting first
+    return sa->ready_since < sb->ready_since;
+}
+
+/*Ready endpoints in service order, returns how many*/
+static int USB_HOT usb_schedule(USBFpga_t *fpga, USBFlags_t *flags, uint8_t *order, uint64_t now) {
+    int used = 0;
+
+    for (int i = 0; i < FPGA_ENDPOINTS; i++) {
+        if (flags[i].rx_empty) {
+            fpga->schedule[i].ready_since = 0;
+            continue;
+        }
+        if (!fpga->schedule[i].ready_since)
+            fpga->schedule[i].ready_since = now;
+
+        //insertion sort, there are only a handful of endpoints
+        int j = used++;
+        for (; j > 0 && usb_schedule_before(fpga, i, order[j - 1]); j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+
+    return used;
+}
+
+static void USB_HOT usb_schedule_serviced(USBEndpSchedule_t *schedule, size_t len, bool drained) {
+    uint32_t wait = usb_port_time_us() - schedule->ready_since;
+
+    schedule->services++;
+    schedule->bytes += len;
+    schedule->total_wait += wait;
+    if (wait > schedule->max_wait)
+        schedule->max_wait = wait;
+
+    //data left behind keeps its age so it moves up the bulk queue
+    if (drained)
+        schedule->ready_since = 0;
+    else
+        schedule->deferred++;
+}
+
+
+////////////////////////////////////// bus events /////////////////////////////////
+
+/*The core already dropped its address, fifos and pending commands, forget
+what was queued on this side too and ack so the latch is clear for the next
+reset. The stack resets its own state from the handler*/
+static void usb_bus_reset(USBFpga_t *fpga) {
+    USBStage_t *stage;
+
+    fpga->address = 0;
+    fpga->bus_resets++;
+    fpga->suspended = false;
+
+    for (int i = 0; i < FPGA_ENDPOINTS; i++) {
+        fpga->schedule[i].ready_since = 0;
+        stage = fpga->stage[i];
+        if (!stage)
+            continue;
+        //the report in the fifo never reached the host, it is sent again
+        usb_port_lock(&stage->lock);
+        stage->in_fifo = -1;
+        for (int k = 0; k < USB_STAGE_SLOTS; k++)
+            stage->slots[k].queued = stage->slots[k].taken;
+        usb_port_unlock(&stage->lock);
+    }
+
+    if (usb_internal_set_cmd(fpga, kUSBCMDAckBusReset, 0))
+        DEBUG("Failed to ack bus reset");
+
+    if (fpga->bus_handler)
+        fpga->bus_handler(fpga, kBusReset);
+}
+
+static void usb_bus_events(USBFpga_t *fpga, USBFlags_t flags) {
+    if (flags.bus_reset) {
+        usb_bus_reset(fpga);
+        return;
+    }
+
+    if (flags.suspended == fpga->suspended)
+        return;
+    fpga->suspended = flags.suspended;
+    if (fpga->bus_handler)
+        fpga->bus_handler(fpga, flags.suspended ? kBusSuspend : kBusResume);
+}
+
+static void USB_HOT usb_internal_poll(USBFpga_t *fpga) {
     USBFlags_t flags[FPGA_ENDPOINTS] = {0};
-    uint8_t buffer[FPGA_ENDP_SIZE];
+    uint16_t lens[FPGA_ENDPOINTS] = {0};
+    uint8_t *buffer = fpga->buffer;
+    uint8_t order[FPGA_ENDPOINTS];
+    int ready;
+    USBBatch_t *batch = &fpga->batch;
 
-    if (usb_internal_read_flags(g_fpga_config.spi, flags, FPGA_ENDPOINTS, 0)) { 
+    if (fpga->fifo_dirty)
+        usb_fifo_split(fpga);
+
+    if (usb_internal_read_flags(fpga, flags, FPGA_ENDPOINTS, 0)) { 
         DEBUG("Failed to read USB flags");
         return;
     }
 
+    memcpy(fpga->flags, flags, sizeof(flags));
+
+    //before the endpoints, a setup right after a reset is served in this same poll
+    if (flags[0].bus_reset || flags[0].suspended != fpga->suspended)
+        usb_bus_events(fpga, flags[0]);
+
     for (int i = 0; i < FPGA_ENDPOINTS; i++) {
+        if (fpga->iso[i])
+            usb_iso_frame(fpga, fpga->iso[i], buffer, usb_port_time_us());
+        if (fpga->stage[i])
+            usb_stage_refill(fpga, fpga->stage[i], buffer);
+    }
 
-        if(!flags[i].rx_empty) {
-            uint16_t len = 0;
-            usb_internal_read_rx_count(g_fpga_config.spi, &len, i);
-            /*This may happen on a communication error*/
-            if (!len) {
-                DEBUG("Inconsistent len!");
-                continue;
-            }
-            if (usb_internal_read_data(g_fpga_config.spi, buffer, len, i)) {
-                DEBUG("Failed to read data in endpoint %i", i);
-                continue;
-            }
-            #if USB_DEBUG
-            DEBUG("Data on endp %i", i);
-            hexdump(stdout, buffer, len, 16, 8);
-            #endif
-            if (g_fpga_config.callbacks[i]) {
-                g_fpga_config.callbacks[i](i, buffer, len);
-            }
+    ready = usb_schedule(fpga, flags, order, usb_port_time_us());
+    if (!ready)
+        return;
+
+    //fetch the rx count of every ready endpoint in one go
+    usb_batch_init(batch);
+    for (int k = 0; k < ready; k++)
+        usb_batch_read_rx_count(batch, &lens[order[k]], order[k]);
+
+    if (usb_internal_batch_submit(fpga, batch)) {
+        DEBUG("Failed to read rx counts");
+        return;
+    }
+
+    for (int k = 0; k < ready; k++) {
+        int i = order[k];
+        USBEndpSchedule_t *schedule = &fpga->schedule[i];
+        uint16_t len = lens[i];
+
+        /*This may happen on a communication error*/
+        if (!len || len > fpga->fifo_size[i]) {
+            DEBUG("Inconsistent len!");
+            continue;
+        }
+        if (schedule->budget && len > schedule->budget)
+            len = schedule->budget;
+        if (usb_internal_read_data(fpga, buffer, len, i)) {
+            DEBUG("Failed to read data in endpoint %i", i);
+            continue;
+        }
+        usb_schedule_serviced(schedule, len, len == lens[i]);
+        /*control packets are recorded by the control stack, which knows about setups*/
+        if (i != 0)
+            usb_capture_packet(fpga->bus, fpga->address, kCaptureUSBOut, i, buffer, len);
+        if (fpga->iso[i]) {
+            usb_iso_receive(fpga->iso[i], flags[i], buffer, len);
+            continue;
+        }
+        #if USB_DEBUG
+        DEBUG("Data on endp %i", i);
+        hexdump(stdout, buffer, len, 16, 8);
+        #endif
+        if (fpga->callbacks[i]) {
+            fpga->callbacks[i](fpga, i, buffer, len);
         }
     }
-}
\ No newline at end of file
+}
+
+void USB_HOT usb_poll(USBFpga_t *fpga) {
+    usb_port_mutex_lock(&fpga->poll_lock);
+    usb_internal_poll(fpga);
+    usb_port_mutex_unlock(&fpga->poll_lock);
+}
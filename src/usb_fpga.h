@@ -5,33 +5,204 @@
 
 #include <stdlib.h>
 #include <stdint.h>
-#include "driver/spi_master.h"
+#include <stdbool.h>
+#include "usb_transport.h"
+#include "usb_port.h"
 
 
-#define FPGA_ENDPOINTS 5
-#define FPGA_ENDP_SIZE 1024
+#ifndef USB_DEBUG
+#define USB_DEBUG 1 //dump every packet on the console
+#endif
 
+/*Per packet and per request messages, gone with USB_DEBUG=0. Errors and the
+stats dumps keep using DEBUG*/
+#if USB_DEBUG
+#define USB_TRACE(fmt, ...) DEBUG(fmt, ##__VA_ARGS__)
+#else
+#define USB_TRACE(fmt, ...) do {} while (0)
+#endif
+
+#define USB_FRAME_US 1000 //full speed frame
+
+#define USB_BULK_BUDGET_PACKETS 2 //bulk OUT packets read per endpoint and poll round
+
+#define USB_CONTROL_PACKET 64
+#define USB_FIFO_PACKETS 2 //smallest fifo: the packet on the wire and the next one
+
+#define USB_STAGE_SLOTS 2 //staged reports per endpoint, one per report id
+#define USB_STAGE_SIZE 64
+
+typedef struct USBFpga USBFpga_t;
+typedef struct USBIso USBIso_t;
+
+/*Same encoding as the endpoint descriptor attributes*/
+typedef enum {
+    kEndpTypeControl,
+    kEndpTypeIsochronous,
+    kEndpTypeBulk,
+    kEndpTypeInterrupt
+} USBEndpType_t;
+
+/*How usb_poll orders ready endpoints: control first, then interrupt by
+deadline, then bulk oldest first with a byte budget per round so a long OUT
+transfer can't hold back a setup for more than one round*/
 typedef struct {
-    uint8_t rx_full:1;
-    uint8_t rx_empty:1;
-    uint8_t tx_full:1;
-    uint8_t tx_empty:1;
-    uint8_t :4;
-} __attribute__((packed)) USBFlags_t;
+    USBEndpType_t type;
+    uint32_t interval; //us, interrupt deadline after the data shows up
+    uint16_t budget; //bytes per round for bulk, 0 reads everything
+    uint64_t ready_since; //first poll that saw data waiting, 0 when idle
+
+    //fairness statistics
+    uint32_t services;
+    uint32_t deferred; //rounds that left data behind because of the budget
+    uint64_t bytes;
+    uint32_t max_wait; //us from data seen to data read
+    uint64_t total_wait;
+} USBEndpSchedule_t;
+
+typedef void (*EndpCallback_t)(USBFpga_t *fpga, uint8_t endp, uint8_t *buffer, size_t size);
 
 typedef enum {
-    kUSBCMDNone,
-    kUSBCMDSendStall,
-    kUSBCMDSend0DataLength
-} USBCMDs_t;
-
-typedef void (*EndpCallback_t)(uint8_t endp, uint8_t *buffer, size_t size);
-
-void usb_init(spi_device_handle_t spi);
-void usb_set_endp_handler(EndpCallback_t callback, uint8_t endp);
-int usb_write_data(uint8_t *buffer, size_t count, uint16_t chunk_size, uint8_t endp);
-int usb_set_cmd(USBCMDs_t cmd, uint8_t endp);
-int usb_set_address(uint8_t address);
-void usb_poll(void);
+    kBusReset,
+    kBusSuspend,
+    kBusResume
+} USBBusEvent_t;
+
+/*Called from usb_poll before any endpoint of the same round is serviced*/
+typedef void (*BusCallback_t)(USBFpga_t *fpga, USBBusEvent_t event);
+
+/*IN: fill buffer with the packet for the next frame and return its length, or
+-1 if the source has nothing ready. OUT: consume a received packet, returns 0*/
+typedef int (*IsoHandler_t)(USBIso_t *iso, uint8_t *buffer, size_t size);
+
+/*Isochronous endpoint. The fpga does not report SOF, so frames are paced by
+the local clock from usb_poll, one packet per frame*/
+struct USBIso {
+    USBFpga_t *fpga;
+    uint8_t endp;
+    bool in;
+    uint16_t packet_size; //bandwidth of the selected alternate setting, 0 while idle
+    IsoHandler_t handler;
+    void *context;
+    uint64_t next_frame; //us
+    bool received; //OUT packet seen in the current frame
+
+    uint32_t frames;
+    uint32_t packets;
+    uint32_t underruns; //IN: no data for a frame, OUT: frame without a packet
+    uint32_t overruns; //IN: host left the previous packet, OUT: packets piled up in the fifo
+};
+
+typedef struct {
+    uint8_t data[USB_STAGE_SIZE];
+    uint16_t length; //0 while the slot is unused
+    uint32_t sequence; //bumped by every usb_stage_write
+    uint32_t queued; //sequence sitting in the fpga buffer
+    uint32_t taken; //last sequence the host read
+} USBStageSlot_t;
+
+/*Latest-state interrupt IN endpoint: a report is always waiting in the fpga
+tx buffer so host IN tokens are answered with no spi traffic in between.
+Writers only replace the slot, usb_poll queues the newest one as soon as the
+host took the previous. The fpga can't drop a queued packet, so a change
+waits at most for the report already queued (one host poll). Don't mix with
+usb_write_data on the same endpoint, nor with double buffering*/
+typedef struct {
+    USBFpga_t *fpga;
+    uint8_t endp;
+    USBLock_t lock;
+    USBStageSlot_t slots[USB_STAGE_SLOTS];
+    int8_t in_fifo; //slot queued in the fpga, -1 if none
+    uint8_t next; //round robin between unchanged slots
+
+    uint32_t refills;
+    uint32_t repeats; //refills with an unchanged report
+} USBStage_t;
+
+/*One FPGA USB core. Several can be driven at once, each on its own
+transport (chip select, spi host or spidev node).
+Any task may write to any endpoint and call usb_poll: bus_lock is only held
+for a single spi command or batch, tx_lock keeps the flags check and every
+chunk of one write together so writers of different endpoints only contend
+for the bus, poll_lock serializes usb_poll. Order: poll, tx, bus.
+On cores that answer the capability query the fifo memory is split from the
+registered endpoints on the first poll, register them all before polling.
+A core too small for USB_FIFO_PACKETS each gets one packet each, one too
+small for that leaves the last endpoints out and flags them in fifo_missing.
+A bus reset reported by the core is handled within the poll that sees it:
+the local endpoint state is dropped, writes in progress give up and the
+bus handler runs before the setup that may already wait on endpoint 0*/
+struct USBFpga {
+    USBTransportHandle_t transport;
+    uint8_t bus; //instance number, used to tell captures apart
+    uint8_t address;
+    EndpCallback_t callbacks[FPGA_ENDPOINTS];
+    void *endp_context[FPGA_ENDPOINTS]; //owner of the endpoint, for the callbacks
+    bool double_buffer[FPGA_ENDPOINTS];
+    USBFlags_t flags[FPGA_ENDPOINTS]; //as read by the last poll
+    USBIso_t *iso[FPGA_ENDPOINTS];
+    USBStage_t *stage[FPGA_ENDPOINTS];
+    USBEndpSchedule_t schedule[FPGA_ENDPOINTS];
+    USBBatch_t batch; //too big for the poll stack, under poll_lock
+    USBBatch_t writev; //transactions of the vectored writes, under bus_lock
+    uint8_t buffer[FPGA_FIFO_MAX]; //poll reads, same
+    USBCaps_t caps; //magic 0 on cores without the capability query
+    uint16_t fifo_size[FPGA_ENDPOINTS]; //bytes each way
+    uint16_t packet_size[FPGA_ENDPOINTS]; //largest registered, 0 if unused
+    bool fifo_dirty; //endpoints registered since the fifos were split
+    uint8_t fifo_missing; //endpoints the last split found no memory for, a bit each
+    USBLinkMode_t link; //width of the spi data phases
+    USBMutex_t bus_lock;
+    USBMutex_t tx_lock[FPGA_ENDPOINTS];
+    USBMutex_t poll_lock;
+    BusCallback_t bus_handler;
+    volatile uint32_t bus_resets; //writes started before a reset see it change and stop
+    bool suspended;
+    void *context; //owner of the core, usually the usb device stack
+};
+
+void usb_init(USBFpga_t *fpga, USBTransportHandle_t transport);
+void usb_set_endp_handler(USBFpga_t *fpga, EndpCallback_t callback, uint8_t endp);
+void usb_set_endp_context(USBFpga_t *fpga, uint8_t endp, void *context);
+void usb_set_bus_handler(USBFpga_t *fpga, BusCallback_t callback);
+void *usb_get_endp_context(USBFpga_t *fpga, uint8_t endp);
+/*Ping-pong mode: next chunk is written as soon as the tx fifo is not full
+instead of waiting for it to be empty. The FPGA must double buffer the endp*/
+void usb_set_endp_double_buffer(USBFpga_t *fpga, uint8_t endp, bool enable);
+/*interval in us for interrupt endpoints, packet size sets the bulk budget
+and the fifo depth*/
+void usb_set_endp_schedule(USBFpga_t *fpga, uint8_t endp, USBEndpType_t type, uint32_t interval, uint16_t packet_size);
+void usb_print_endp_stats(USBFpga_t *fpga);
+int usb_write_data(USBFpga_t *fpga, uint8_t *buffer, size_t count, uint16_t chunk_size, uint8_t endp);
+int usb_write_datav(USBFpga_t *fpga, const USBSegment_t *segments, int segments_count, size_t count, uint16_t chunk_size, uint8_t endp);
+/*Single packet write that never waits: returns -2 if the endpoint is still busy*/
+int usb_try_write_data(USBFpga_t *fpga, uint8_t *buffer, size_t count, uint8_t endp);
+USBFlags_t usb_get_flags(USBFpga_t *fpga, uint8_t endp); //flags seen by the last usb_poll
+int usb_set_cmd(USBFpga_t *fpga, USBCMDs_t cmd, uint8_t endp);
+int usb_set_address(USBFpga_t *fpga, uint8_t address);
+
+void usb_batch_init(USBBatch_t *batch);
+int usb_batch_read_flags(USBBatch_t *batch, USBFlags_t *flags, size_t count, uint8_t start_endp);
+int usb_batch_read_rx_count(USBBatch_t *batch, uint16_t *count, uint8_t endp);
+int usb_batch_read_data(USBBatch_t *batch, uint8_t *buffer, size_t count, uint8_t endp);
+int usb_batch_write_data(USBBatch_t *batch, uint8_t *buffer, size_t count, uint8_t endp);
+int usb_batch_set_cmd(USBBatch_t *batch, USBCMDs_t cmd, uint8_t endp);
+int usb_batch_set_address(USBBatch_t *batch, uint8_t address);
+int usb_batch_submit(USBFpga_t *fpga, USBBatch_t *batch);
+
+void usb_iso_init(USBIso_t *iso, USBFpga_t *fpga, uint8_t endp, bool in, IsoHandler_t handler, void *context);
+/*Called on SET_INTERFACE with the max packet size of the selected alternate
+setting, 0 stops the stream*/
+void usb_iso_set_bandwidth(USBIso_t *iso, uint16_t packet_size);
+void usb_iso_print_stats(USBIso_t *iso);
+
+void usb_stage_init(USBStage_t *stage, USBFpga_t *fpga, uint8_t endp);
+/*Replaces the report of a slot, returns its sequence number*/
+uint32_t usb_stage_write(USBStage_t *stage, uint8_t slot, const uint8_t *data, size_t length);
+/*Sequence of the last report of the slot the host picked up, wait for it
+before staging something that must not be skipped (a tap, a macro key)*/
+uint32_t usb_stage_taken(USBStage_t *stage, uint8_t slot);
+
+void usb_poll(USBFpga_t *fpga);
 
 #endif
\ No newline at end of file
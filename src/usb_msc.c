@@ -0,0 +1,396 @@
+#include "usb_msc.h"
+#include "usb_port.h"
+#include "util.h"
+
+#include <string.h>
+
+#define DEBUG_CNTX "usb-msc"
+
+#define MSC_DIRECTION_IN 0x80 //command block flags
+
+//sense keys and additional sense codes
+#define SENSE_NONE 0x00
+#define SENSE_NOT_READY 0x02
+#define SENSE_MEDIUM_ERROR 0x03
+#define SENSE_ILLEGAL_REQUEST 0x05
+#define ASC_NONE 0x00
+#define ASC_WRITE_FAULT 0x03
+#define ASC_READ_ERROR 0x11
+#define ASC_INVALID_COMMAND 0x20
+#define ASC_LBA_OUT_OF_RANGE 0x21
+#define ASC_MEDIUM_NOT_PRESENT 0x3a
+
+static const uint8_t g_msc_inquiry[36] = {
+    0x00, //direct access block device
+    0x80, //removable
+    0x04, //spc-2
+    0x02, //response data format
+    sizeof(g_msc_inquiry) - 5,
+    0x00, 0x00, 0x00,
+    'E', 'S', 'P', '3', '2', ' ', ' ', ' ', //vendor
+    'U', 'S', 'B', ' ', 'T', 'e', 'c', 'l', 'a', 'd', 'o', ' ', 'D', 'i', 's', 'k', //product
+    '1', '.', '0', '0', //revision
+};
+
+
+static uint32_t msc_get_be32(const uint8_t *data) {
+    return ((uint32_t) data[0] << 24) | ((uint32_t) data[1] << 16) | ((uint32_t) data[2] << 8) | data[3];
+}
+
+static void msc_put_be32(uint8_t *data, uint32_t value) {
+    data[0] = value >> 24;
+    data[1] = value >> 16;
+    data[2] = value >> 8;
+    data[3] = value;
+}
+
+static void usb_msc_fail(USBMSC_t *msc, uint8_t sense_key, uint8_t asc) {
+    msc->sense_key = sense_key;
+    msc->asc = asc;
+    msc->status.status = kMSCStatusFailed;
+    msc->failures++;
+}
+
+/*Command response, zero padded up to what the host asked for within the first sector*/
+static void usb_msc_reply(USBMSC_t *msc, const void *data, size_t length) {
+    uint32_t window = msc->command.data_length < MSC_SECTOR_SIZE ? msc->command.data_length : MSC_SECTOR_SIZE;
+
+    if (length > window)
+        length = window;
+    memcpy(msc->buffer, data, length);
+    memset(msc->buffer + length, 0, window - length);
+    msc->buffer_used = window;
+    msc->length = length;
+}
+
+/*READ(10) and WRITE(10), 0 if the data stage goes ahead*/
+static int usb_msc_check_rw(USBMSC_t *msc, uint32_t lba, uint32_t count) {
+    if (!msc->ready) {
+        usb_msc_fail(msc, SENSE_NOT_READY, ASC_MEDIUM_NOT_PRESENT);
+        return -1;
+    }
+    if (lba + count > msc->disk->sectors || lba + count < lba) {
+        usb_msc_fail(msc, SENSE_ILLEGAL_REQUEST, ASC_LBA_OUT_OF_RANGE);
+        return -1;
+    }
+    msc->sector = lba;
+    msc->length = count * MSC_SECTOR_SIZE;
+    return 0;
+}
+
+/*A disk inserted from another task goes live between two commands*/
+static void usb_msc_check_medium(USBMSC_t *msc) {
+    if (msc->disk)
+        return;
+    msc->disk = atomic_load_explicit(&msc->inserted, memory_order_acquire);
+    msc->ready = msc->disk != NULL;
+}
+
+static void usb_msc_command(USBMSC_t *msc) {
+    uint8_t *cb = msc->command.cb;
+    uint8_t response[12];
+    bool to_host = msc->command.flags & MSC_DIRECTION_IN;
+    bool data_in = true; //direction of the command's own data
+
+    usb_msc_check_medium(msc);
+    msc->commands++;
+    msc->transferred = 0;
+    msc->length = 0;
+    msc->buffer_used = 0;
+    msc->buffer_sent = 0;
+    msc->status = (MSCCommandStatus_t) {
+        .signature = MSC_CSW_SIGNATURE,
+        .tag = msc->command.tag,
+        .status = kMSCStatusPassed,
+    };
+
+    switch ((SCSICommand_t) cb[0]) {
+    case kSCSITestUnitReady:
+        if (!msc->ready)
+            usb_msc_fail(msc, SENSE_NOT_READY, ASC_MEDIUM_NOT_PRESENT);
+        break;
+    case kSCSIRequestSense: {
+        uint8_t sense[18] = {0x70, 0, msc->sense_key, 0, 0, 0, 0, sizeof(sense) - 8, 0, 0, 0, 0, msc->asc};
+
+        usb_msc_reply(msc, sense, sizeof(sense));
+        msc->sense_key = SENSE_NONE;
+        msc->asc = ASC_NONE;
+    } break;
+    case kSCSIInquiry:
+        usb_msc_reply(msc, g_msc_inquiry, sizeof(g_msc_inquiry));
+        break;
+    case kSCSIReadCapacity10:
+        if (!msc->disk) {
+            usb_msc_fail(msc, SENSE_NOT_READY, ASC_MEDIUM_NOT_PRESENT);
+            break;
+        }
+        msc_put_be32(&response[0], msc->disk->sectors - 1);
+        msc_put_be32(&response[4], MSC_SECTOR_SIZE);
+        usb_msc_reply(msc, response, 8);
+        break;
+    case kSCSIReadFormatCapacities:
+        if (!msc->disk) {
+            usb_msc_fail(msc, SENSE_NOT_READY, ASC_MEDIUM_NOT_PRESENT);
+            break;
+        }
+        msc_put_be32(&response[0], 8); //capacity list length
+        msc_put_be32(&response[4], msc->disk->sectors);
+        msc_put_be32(&response[8], MSC_SECTOR_SIZE);
+        response[8] = 0x02; //formatted media
+        usb_msc_reply(msc, response, 12);
+        break;
+    case kSCSIModeSense6:
+        //no mode pages, not write protected
+        memset(response, 0, 4);
+        response[0] = 3;
+        usb_msc_reply(msc, response, 4);
+        break;
+    case kSCSIModeSense10:
+        memset(response, 0, 8);
+        response[1] = 6;
+        usb_msc_reply(msc, response, 8);
+        break;
+    case kSCSIStartStopUnit:
+        //eject flushes and reports the medium gone, load brings it back
+        if ((cb[4] & 3) == 2) {
+            if (msc->disk)
+                msc_disk_flush(msc->disk);
+            msc->ready = false;
+        } else if ((cb[4] & 3) == 3) {
+            msc->ready = msc->disk != NULL;
+        }
+        break;
+    case kSCSIPreventAllowRemoval:
+    case kSCSIVerify10:
+        break;
+    case kSCSISynchronizeCache10:
+        if (msc->disk && msc_disk_flush(msc->disk))
+            usb_msc_fail(msc, SENSE_MEDIUM_ERROR, ASC_WRITE_FAULT);
+        break;
+    case kSCSIRead10:
+        usb_msc_check_rw(msc, msc_get_be32(&cb[2]), (cb[7] << 8) | cb[8]);
+        break;
+    case kSCSIWrite10:
+        data_in = false;
+        usb_msc_check_rw(msc, msc_get_be32(&cb[2]), (cb[7] << 8) | cb[8]);
+        break;
+    default:
+        USB_TRACE("Unsupported command 0x%02x", cb[0]);
+        usb_msc_fail(msc, SENSE_ILLEGAL_REQUEST, ASC_INVALID_COMMAND);
+    }
+
+    //the host expects less data or the other direction: no data, the host resets
+    if (msc->length && (msc->length > msc->command.data_length || to_host != data_in)) {
+        DEBUG("Phase error on command 0x%02x", cb[0]);
+        msc->status.status = kMSCStatusPhaseError;
+        msc->length = 0;
+        msc->buffer_used = 0;
+    }
+
+    //whatever the command does not use is padded or discarded, the status reports it as residue
+    if (!msc->command.data_length)
+        msc->state = kMSCStateStatus;
+    else if (to_host)
+        msc->state = kMSCStateDataIn;
+    else
+        msc->state = kMSCStateDataOut;
+}
+
+static void usb_msc_data_out(USBMSC_t *msc, uint8_t *data, size_t size) {
+    size_t copy;
+
+    while (size && msc->transferred < msc->command.data_length) {
+        copy = msc->command.data_length - msc->transferred;
+        if (copy > size)
+            copy = size;
+
+        if (msc->transferred < msc->length) {
+            if (copy > MSC_SECTOR_SIZE - msc->buffer_used)
+                copy = MSC_SECTOR_SIZE - msc->buffer_used;
+            memcpy(msc->buffer + msc->buffer_used, data, copy);
+            msc->buffer_used += copy;
+
+            if (msc->buffer_used == MSC_SECTOR_SIZE) {
+                msc->buffer_used = 0;
+                if (msc_disk_write(msc->disk, msc->sector, msc->buffer)) {
+                    //the rest of the data is discarded
+                    usb_msc_fail(msc, SENSE_MEDIUM_ERROR, ASC_WRITE_FAULT);
+                    msc->length = msc->transferred + copy - MSC_SECTOR_SIZE;
+                } else {
+                    msc->sector++;
+                    msc->sectors_written++;
+                }
+            }
+        }
+
+        msc->transferred += copy;
+        data += copy;
+        size -= copy;
+    }
+
+    if (msc->transferred == msc->command.data_length)
+        msc->state = kMSCStateStatus;
+}
+
+/*The fpga rx fifo holds bytes, not packets: a command block may come with
+the start of its data*/
+static void usb_msc_data_endp(USBFpga_t *fpga, uint8_t endp, uint8_t *buffer, size_t size) {
+    USBMSC_t *msc = usb_get_endp_context(fpga, endp);
+
+    if (msc->state == kMSCStateCommand) {
+        if (size < sizeof(MSCCommandBlock_t)) {
+            DEBUG("Invalid command block size %i", (int) size);
+            return;
+        }
+        memcpy(&msc->command, buffer, sizeof(MSCCommandBlock_t));
+        if (msc->command.signature != MSC_CBW_SIGNATURE) {
+            DEBUG("Invalid command block signature");
+            return;
+        }
+        usb_msc_command(msc);
+        buffer += sizeof(MSCCommandBlock_t);
+        size -= sizeof(MSCCommandBlock_t);
+    }
+
+    if (!size)
+        return;
+    if (msc->state == kMSCStateDataOut)
+        usb_msc_data_out(msc, buffer, size);
+    else
+        DEBUG("Unexpected %i bytes in state %i", (int) size, msc->state);
+}
+
+static void usb_msc_control_handler(USBDevice_t *dev, USBControlRequest_t *control, uint16_t chunk_size, uint8_t endp) {
+    USBMSC_t *msc = dev->class_context;
+    uint8_t max_lun = 0;
+
+    if (control->request_type.type != kTypeClass)
+        goto deny_request;
+
+    switch ((MSCRequest_t) control->request) {
+    case kMSCRequestGetMaxLun:
+        if (usb_write_data(dev->fpga, &max_lun, 1, chunk_size, endp))
+            DEBUG("Failed to send max lun");
+        break;
+    case kMSCRequestReset:
+        msc->state = kMSCStateCommand;
+        usb_control_accept_request(dev, endp);
+        break;
+    default:
+        goto deny_request;
+    }
+    return;
+
+deny_request:
+    usb_control_deny_request(dev, endp);
+}
+
+void usb_msc_init(USBMSC_t *msc, USBDevice_t *dev, uint8_t interface, uint8_t endp, MSCDisk_t *disk) {
+    memset(msc, 0, sizeof(USBMSC_t));
+    msc->usb = dev;
+    msc->disk = disk;
+    msc->endp = endp;
+    msc->ready = disk != NULL;
+
+    msc->interface = (InterfaceDescriptor_t) {
+        .interface_id = interface,
+        .class = 0x08, //mass storage
+        .sub_class = 0x06, //scsi transparent command set
+        .protocol = 0x50, //bulk-only transport
+    };
+    msc->out_endpoint = (EndpointDescriptor_t) {
+        .endp_address = endp | kEndpointDirectionOut,
+        .attributes = kEndpointAttributeBulk,
+        .max_packet_size = MSC_PACKET_SIZE,
+    };
+    msc->in_endpoint = (EndpointDescriptor_t) {
+        .endp_address = endp | kEndpointDirectionIn,
+        .attributes = kEndpointAttributeBulk,
+        .max_packet_size = MSC_PACKET_SIZE,
+    };
+
+    usb_add_interface_descriptor(dev, &msc->interface);
+    usb_add_endppoint_descriptor(dev, &msc->out_endpoint);
+    usb_add_endppoint_descriptor(dev, &msc->in_endpoint);
+    usb_add_class_control_handler(dev, usb_msc_control_handler);
+    usb_add_class_context(dev, msc);
+
+    usb_set_endp_handler(dev->fpga, usb_msc_data_endp, endp);
+    usb_set_endp_context(dev->fpga, endp, msc);
+}
+
+void usb_msc_insert(USBMSC_t *msc, MSCDisk_t *disk) {
+    atomic_store_explicit(&msc->inserted, disk, memory_order_release);
+}
+
+void usb_msc_reset(USBMSC_t *msc) {
+    msc->state = kMSCStateCommand;
+    msc->transferred = 0;
+    msc->length = 0;
+    msc->buffer_used = 0;
+    msc->buffer_sent = 0;
+}
+
+/*Next window of the data IN stage: the next sector of a read, zeros past
+the data the command provides*/
+static void usb_msc_refill(USBMSC_t *msc) {
+    uint32_t left = msc->command.data_length - msc->transferred;
+    uint16_t window = left < MSC_SECTOR_SIZE ? left : MSC_SECTOR_SIZE;
+
+    msc->buffer_sent = 0;
+    msc->buffer_used = window;
+
+    if (msc->transferred < msc->length) {
+        if (!msc_disk_read(msc->disk, msc->sector, msc->buffer)) {
+            msc->sector++;
+            msc->sectors_read++;
+            return;
+        }
+        usb_msc_fail(msc, SENSE_MEDIUM_ERROR, ASC_READ_ERROR);
+        msc->length = msc->transferred;
+    }
+    memset(msc->buffer, 0, window);
+}
+
+void usb_msc_service(USBMSC_t *msc) {
+    USBFpga_t *fpga = msc->usb->fpga;
+    uint16_t count;
+    bool sent = false;
+
+    //the fpga holds two packets, keep it full while the host reads
+    while (msc->state == kMSCStateDataIn) {
+        if (msc->buffer_sent == msc->buffer_used)
+            usb_msc_refill(msc);
+
+        count = msc->buffer_used - msc->buffer_sent;
+        if (count > MSC_PACKET_SIZE)
+            count = MSC_PACKET_SIZE;
+        if (usb_try_write_data(fpga, msc->buffer + msc->buffer_sent, count, msc->endp))
+            break;
+        sent = true;
+
+        msc->buffer_sent += count;
+        msc->transferred += count;
+        if (msc->transferred == msc->command.data_length)
+            msc->state = kMSCStateStatus;
+    }
+
+    if (msc->state == kMSCStateStatus) {
+        msc->status.residue = msc->command.data_length - msc->length;
+        if (!usb_try_write_data(fpga, (uint8_t *) &msc->status, sizeof(MSCCommandStatus_t), msc->endp)) {
+            msc->state = kMSCStateCommand;
+            sent = true;
+        }
+    }
+
+    //waiting on the host: time for one read-ahead or flush
+    if (!sent && msc->disk)
+        msc_disk_idle(msc->disk, usb_port_time_us());
+}
+
+void usb_msc_print_stats(USBMSC_t *msc) {
+    DEBUG("MSC %u commands, %u failed, %u sectors read, %u sectors written", (unsigned) msc->commands,
+          (unsigned) msc->failures, (unsigned) msc->sectors_read, (unsigned) msc->sectors_written);
+    if (msc->disk)
+        msc_disk_print_stats(msc->disk);
+}
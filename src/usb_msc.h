@@ -0,0 +1,114 @@
+
+
+
+#ifndef USB_MSC_H_
+#define USB_MSC_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "usb.h"
+#include "msc_disk.h"
+
+#define MSC_PACKET_SIZE 64
+
+#define MSC_CBW_SIGNATURE 0x43425355
+#define MSC_CSW_SIGNATURE 0x53425355
+
+typedef enum {
+    kMSCRequestGetMaxLun = 0xfe,
+    kMSCRequestReset = 0xff
+} MSCRequest_t;
+
+typedef enum {
+    kSCSITestUnitReady = 0x00,
+    kSCSIRequestSense = 0x03,
+    kSCSIInquiry = 0x12,
+    kSCSIModeSense6 = 0x1a,
+    kSCSIStartStopUnit = 0x1b,
+    kSCSIPreventAllowRemoval = 0x1e,
+    kSCSIReadFormatCapacities = 0x23,
+    kSCSIReadCapacity10 = 0x25,
+    kSCSIRead10 = 0x28,
+    kSCSIWrite10 = 0x2a,
+    kSCSIVerify10 = 0x2f,
+    kSCSISynchronizeCache10 = 0x35,
+    kSCSIModeSense10 = 0x5a
+} SCSICommand_t;
+
+typedef enum {
+    kMSCStatusPassed,
+    kMSCStatusFailed,
+    kMSCStatusPhaseError
+} MSCStatus_t;
+
+/*Bulk-only transport wrappers, little endian*/
+typedef struct {
+    uint32_t signature;
+    uint32_t tag;
+    uint32_t data_length;
+    uint8_t flags; //bit 7 set: data goes to the host
+    uint8_t lun;
+    uint8_t cb_length;
+    uint8_t cb[16]; //scsi command, big endian fields
+} PACKED MSCCommandBlock_t;
+
+typedef struct {
+    uint32_t signature;
+    uint32_t tag;
+    uint32_t residue;
+    uint8_t status;
+} PACKED MSCCommandStatus_t;
+
+typedef enum {
+    kMSCStateCommand,
+    kMSCStateDataIn,
+    kMSCStateDataOut,
+    kMSCStateStatus
+} MSCState_t;
+
+/*Mass storage bulk-only transport over one fpga endpoint for bulk IN and
+OUT, with a single LUN on a cached disk. Commands and data OUT arrive on the
+endpoint handler inside usb_poll, data IN and the status go out from
+usb_msc_service so the poll loop never blocks on the host. Both must run on
+the same task*/
+typedef struct {
+    USBDevice_t *usb;
+    MSCDisk_t *disk; //NULL until a medium is inserted
+    _Atomic(MSCDisk_t *) inserted; //handed over by usb_msc_insert
+    uint8_t endp;
+
+    InterfaceDescriptor_t interface;
+    EndpointDescriptor_t out_endpoint, in_endpoint;
+
+    MSCState_t state;
+    MSCCommandBlock_t command;
+    MSCCommandStatus_t status;
+    uint32_t transferred; //data stage bytes so far
+    uint32_t length; //data stage bytes the command provides or takes
+    uint32_t sector; //next sector of a read or write
+    uint8_t sense_key, asc; //reported by the next REQUEST SENSE
+    bool ready; //medium present, cleared by an eject
+
+    uint8_t buffer[MSC_SECTOR_SIZE]; //one sector or a command response
+    uint16_t buffer_used, buffer_sent;
+
+    uint32_t commands, sectors_read, sectors_written, failures;
+} USBMSC_t;
+
+/*Adds the interface to the configuration being built. With a NULL disk the
+host sees no medium until usb_msc_insert*/
+void usb_msc_init(USBMSC_t *msc, USBDevice_t *dev, uint8_t interface, uint8_t endp, MSCDisk_t *disk);
+/*Disk opened after the device enumerated, may be called from any task. The
+poll task picks it up with the next command*/
+void usb_msc_insert(USBMSC_t *msc, MSCDisk_t *disk);
+/*Sends the pending data IN packets or the status, and gives the disk its
+idle time for read-ahead and flushes. Call it from the poll loop*/
+void usb_msc_service(USBMSC_t *msc);
+/*After a bus reset: the command in progress is dropped, call it from the
+poll task*/
+void usb_msc_reset(USBMSC_t *msc);
+void usb_msc_print_stats(USBMSC_t *msc);
+
+#endif
@@ -0,0 +1,171 @@
+
+
+#ifndef USB_PORT_H_
+#define USB_PORT_H_
+
+#include <stdint.h>
+#include "usb_transport.h"
+
+/*The few os services the stack needs, inline so the embedded build calls
+straight into FreeRTOS/esp_timer.
+USBLock_t guards a few instructions and never sleeps (a critical section on
+the esp), USBMutex_t may block and can be held across spi transfers.
+USBEvent_t counts signals from one task to a worker task waiting on it.
+USB_HOT marks the poll, write and transport paths, built with -DUSB_IRAM=1
+they run from IRAM and never wait on a flash cache miss. USB_ISR marks
+interrupt handlers, always in IRAM*/
+
+#ifndef USB_IRAM
+#define USB_IRAM 0
+#endif
+
+#if USB_TRANSPORT == USB_TRANSPORT_ESP
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "esp_attr.h"
+
+#if USB_IRAM
+#define USB_HOT IRAM_ATTR
+#else
+#define USB_HOT
+#endif
+#define USB_ISR IRAM_ATTR
+
+typedef portMUX_TYPE USBLock_t;
+#define USB_LOCK_INITIALIZER portMUX_INITIALIZER_UNLOCKED
+
+static inline uint64_t usb_port_time_us(void) {
+    return esp_timer_get_time();
+}
+
+static inline void usb_port_sleep(void) {
+    vTaskDelay(1);
+}
+
+static inline void usb_port_lock_init(USBLock_t *lock) {
+    portMUX_INITIALIZE(lock);
+}
+
+static inline void usb_port_lock(USBLock_t *lock) {
+    portENTER_CRITICAL(lock);
+}
+
+static inline void usb_port_unlock(USBLock_t *lock) {
+    portEXIT_CRITICAL(lock);
+}
+
+typedef struct {
+    StaticSemaphore_t buffer;
+    SemaphoreHandle_t handle;
+} USBMutex_t;
+
+static inline void usb_port_mutex_init(USBMutex_t *mutex) {
+    mutex->handle = xSemaphoreCreateMutexStatic(&mutex->buffer);
+}
+
+static inline void usb_port_mutex_lock(USBMutex_t *mutex) {
+    xSemaphoreTake(mutex->handle, portMAX_DELAY);
+}
+
+static inline void usb_port_mutex_unlock(USBMutex_t *mutex) {
+    xSemaphoreGive(mutex->handle);
+}
+
+typedef struct {
+    StaticSemaphore_t buffer;
+    SemaphoreHandle_t handle;
+} USBEvent_t;
+
+static inline void usb_port_event_init(USBEvent_t *event) {
+    event->handle = xSemaphoreCreateCountingStatic(UINT16_MAX, 0, &event->buffer);
+}
+
+static inline void usb_port_event_signal(USBEvent_t *event) {
+    xSemaphoreGive(event->handle);
+}
+
+static inline void usb_port_event_wait(USBEvent_t *event) {
+    xSemaphoreTake(event->handle, portMAX_DELAY);
+}
+
+#else
+
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define USB_HOT
+#define USB_ISR
+
+typedef pthread_mutex_t USBLock_t;
+#define USB_LOCK_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+
+static inline uint64_t usb_port_time_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static inline void usb_port_sleep(void) {
+    usleep(1000);
+}
+
+static inline void usb_port_lock_init(USBLock_t *lock) {
+    pthread_mutex_init(lock, NULL);
+}
+
+static inline void usb_port_lock(USBLock_t *lock) {
+    pthread_mutex_lock(lock);
+}
+
+static inline void usb_port_unlock(USBLock_t *lock) {
+    pthread_mutex_unlock(lock);
+}
+
+typedef pthread_mutex_t USBMutex_t;
+
+static inline void usb_port_mutex_init(USBMutex_t *mutex) {
+    pthread_mutex_init(mutex, NULL);
+}
+
+static inline void usb_port_mutex_lock(USBMutex_t *mutex) {
+    pthread_mutex_lock(mutex);
+}
+
+static inline void usb_port_mutex_unlock(USBMutex_t *mutex) {
+    pthread_mutex_unlock(mutex);
+}
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t count;
+} USBEvent_t;
+
+static inline void usb_port_event_init(USBEvent_t *event) {
+    pthread_mutex_init(&event->lock, NULL);
+    pthread_cond_init(&event->cond, NULL);
+    event->count = 0;
+}
+
+static inline void usb_port_event_signal(USBEvent_t *event) {
+    pthread_mutex_lock(&event->lock);
+    event->count++;
+    pthread_cond_signal(&event->cond);
+    pthread_mutex_unlock(&event->lock);
+}
+
+static inline void usb_port_event_wait(USBEvent_t *event) {
+    pthread_mutex_lock(&event->lock);
+    while (!event->count)
+        pthread_cond_wait(&event->cond, &event->lock);
+    event->count--;
+    pthread_mutex_unlock(&event->lock);
+}
+
+#endif
+
+#endif
@@ -0,0 +1,159 @@
+
+
+#ifndef USB_TRANSPORT_H_
+#define USB_TRANSPORT_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*Link to the FPGA USB core. Exactly one backend is built, picked with
+USB_TRANSPORT, and the stack calls it directly so there is no indirection
+on the embedded build*/
+#define USB_TRANSPORT_ESP 0 //esp-idf spi master
+#define USB_TRANSPORT_SPIDEV 1 //linux /dev/spidevX.Y
+#define USB_TRANSPORT_SIM 2 //in-process fpga model
+
+#ifndef USB_TRANSPORT
+#define USB_TRANSPORT USB_TRANSPORT_ESP
+#endif
+
+#if USB_TRANSPORT == USB_TRANSPORT_ESP
+#include "driver/spi_master.h"
+typedef spi_device_handle_t USBTransportHandle_t;
+#elif USB_TRANSPORT == USB_TRANSPORT_SPIDEV
+typedef int USBTransportHandle_t; //from usb_transport_spidev_open
+#elif USB_TRANSPORT == USB_TRANSPORT_SIM
+typedef struct USBSimFpga *USBTransportHandle_t; //see usb_transport_sim.h
+#else
+#error "Unknown USB_TRANSPORT"
+#endif
+
+
+#define FPGA_ENDPOINTS 5 //endpoints the stack handles, the core may have fewer
+#define FPGA_ENDP_SIZE 1024 //fifo of every endpoint on cores without the capability query
+#define FPGA_FIFO_MAX 2048 //deepest endpoint fifo the stack reads
+
+#define FPGA_CAPS_MAGIC 0xc5
+
+/*Data phases on four lines, needs WP and HD wired to the fpga and a
+half duplex spi device*/
+#ifndef USB_QUAD
+#define USB_QUAD 0
+#endif
+
+enum {
+    kFPGAFeatureQuad = 0x01
+};
+
+typedef struct {
+    uint8_t magic; //FPGA_CAPS_MAGIC, older cores answer 0x00 or 0xff
+    uint8_t endpoints;
+    uint16_t fifo_memory; //bytes shared by the rx and tx fifos of every endpoint
+    uint8_t features; //kFPGAFeature*, 0xff on cores that predate it
+} __attribute__((packed)) USBCaps_t;
+
+typedef enum {
+    kLinkSingle,
+    kLinkQuad
+} USBLinkMode_t;
+
+/*bus_reset and suspended are bus wide, every endpoint reports them, and read
+as 0 on cores that predate them. A bus reset sets the address back to 0,
+empties every fifo and drops pending commands, then stays latched until
+kUSBCMDAckBusReset so whoever reads the flags first can't hide it*/
+typedef struct {
+    uint8_t rx_full:1;
+    uint8_t rx_empty:1;
+    uint8_t tx_full:1;
+    uint8_t tx_empty:1;
+    uint8_t bus_reset:1;
+    uint8_t suspended:1; //no SOF for 3 ms, cleared by the host resume
+    uint8_t :2;
+} __attribute__((packed)) USBFlags_t;
+
+typedef enum {
+    kUSBCMDNone,
+    kUSBCMDSendStall,
+    kUSBCMDSend0DataLength,
+    kUSBCMDAckBusReset //endpoint 0 only
+} USBCMDs_t;
+
+/*spi protocol: one command byte [r:1][cmd:3][endp:4] followed by the data.
+kCMDCaps reads a USBCaps_t, kCMDFifoSize writes the 2 byte depth of the
+endpoint rx and tx fifos and drops whatever they held.
+kCMDLinkMode writes a USBLinkMode_t: the argument still travels in the old
+mode, every data phase after CS rises uses the new one. The command byte is
+always on one line and any argument other than kLinkQuad, garbage from
+floating lines included, means single, so a host can always get back*/
+enum {
+    kCMDWrite,
+    kCMDRead
+};
+
+enum {
+    kCMDData,
+    kCMDRxCount,
+    kCMDFlags,
+    kCMDAddress,
+    kCMDSetCMD,
+    kCMDCaps,
+    kCMDFifoSize,
+    kCMDLinkMode
+};
+
+#define BUILD_CMD(r, cmd, args) (r << 7) | (cmd << 4) | (args & 0xf)
+#define CMD_READ(cmd) ((cmd) >> 7)
+#define CMD_TYPE(cmd) (((cmd) >> 4) & 0x7)
+#define CMD_ENDP(cmd) ((cmd) & 0xf)
+
+
+#define USB_SEGMENTS_MAX 16 //pieces of one packet in a vectored write
+
+/*One piece of a vectored write, the fpga sees the concatenation*/
+typedef struct {
+    const uint8_t *data;
+    size_t length;
+} USBSegment_t;
+
+
+#define USB_BATCH_TRANSACTIONS 32 //must not exceed the spi device queue_size
+#define USB_BATCH_OPS 8
+
+/*Pre-built list of fpga commands submitted under one bus acquisition.
+Buffers must stay valid until usb_batch_submit returns*/
+typedef struct {
+    struct {
+        uint8_t cmd;
+        uint8_t arg;
+        uint8_t *data; //NULL for the two byte [cmd][arg] commands
+        uint16_t length;
+        bool write;
+        bool flags; //validate as USBFlags_t once done
+    } ops[USB_BATCH_OPS];
+    uint8_t ops_used;
+#if USB_TRANSPORT == USB_TRANSPORT_ESP
+    spi_transaction_t transactions[USB_BATCH_TRANSACTIONS];
+#endif
+} USBBatch_t;
+
+
+int usb_transport_read_flags(USBTransportHandle_t transport, USBFlags_t *flags, size_t count, uint8_t start_endp);
+int usb_transport_read_rx_count(USBTransportHandle_t transport, uint16_t *count, uint8_t endp);
+int usb_transport_read_data(USBTransportHandle_t transport, uint8_t *buffer, size_t count, uint8_t endp);
+int usb_transport_write_data(USBTransportHandle_t transport, uint8_t *buffer, size_t count, uint8_t endp);
+int usb_transport_set_cmd(USBTransportHandle_t transport, USBCMDs_t cmd, uint8_t endp);
+int usb_transport_set_address(USBTransportHandle_t transport, uint8_t address);
+int usb_transport_submit(USBTransportHandle_t transport, USBBatch_t *batch);
+/*batch only lends its transactions, the ops are left alone*/
+int usb_transport_write_datav(USBTransportHandle_t transport, USBBatch_t *batch, const USBSegment_t *segments, int count, uint8_t endp);
+int usb_transport_read_caps(USBTransportHandle_t transport, USBCaps_t *caps);
+int usb_transport_set_fifo_size(USBTransportHandle_t transport, uint16_t size, uint8_t endp);
+/*Switches the fpga and then the host side, -1 if the host can not drive quad*/
+int usb_transport_set_link(USBTransportHandle_t transport, USBLinkMode_t mode);
+
+#if USB_TRANSPORT == USB_TRANSPORT_SPIDEV
+int usb_transport_spidev_open(const char *path, uint32_t speed_hz);
+#endif
+
+#endif
@@ -0,0 +1,487 @@
+#include "usb_transport.h"
+#include "usb_port.h"
+
+#if USB_TRANSPORT == USB_TRANSPORT_ESP
+
+#include "util.h"
+
+#include <string.h>
+
+#include <stdint.h>
+#include "driver/spi_master.h"
+
+#define DEBUG_CNTX "usb-transport"
+
+#define MAX_XFER_SIZE 16
+
+#if USB_QUAD
+#define QUAD_DEVICES 4
+
+static spi_device_handle_t g_quad_devices[QUAD_DEVICES]; //switched to quad by usb_transport_set_link
+#endif
+
+/*Flags of the data phases. The command byte always goes in a transaction of
+its own, so it stays on one line whatever the mode*/
+static uint32_t USB_HOT usb_transport_data_mode(spi_device_handle_t spi) {
+#if USB_QUAD
+    for (int i = 0; i < QUAD_DEVICES; i++)
+        if (g_quad_devices[i] == spi)
+            return SPI_TRANS_MODE_QIO;
+#endif
+    return 0;
+}
+
+/*[cmd][args] commands: a single transaction on one line, or the command and
+then the arguments on the data lines*/
+static int USB_HOT usb_transport_write_command(spi_device_handle_t spi, const uint8_t *cmd, size_t length) {
+    uint32_t mode = usb_transport_data_mode(spi);
+    esp_err_t ret;
+    spi_transaction_t transaction = {
+        .tx_buffer = cmd,
+        .rx_buffer = NULL,
+        .length = length * 8
+    };
+
+    if (!mode)
+        return spi_device_transmit(spi, &transaction) == ESP_OK ? 0 : -1;
+
+    transaction.length = 8;
+    transaction.flags = SPI_TRANS_CS_KEEP_ACTIVE;
+
+    spi_device_acquire_bus(spi, portMAX_DELAY);
+    ret = spi_device_transmit(spi, &transaction);
+    if (ret == ESP_OK) {
+        memset(&transaction, 0, sizeof(spi_transaction_t));
+        transaction.tx_buffer = cmd + 1;
+        transaction.length = (length - 1) * 8;
+        transaction.flags = mode;
+        ret = spi_device_transmit(spi, &transaction);
+    }
+    spi_device_release_bus(spi);
+    return ret == ESP_OK ? 0 : -1;
+}
+
+
+int USB_HOT usb_transport_read_flags(USBTransportHandle_t spi, USBFlags_t *flags, size_t count, uint8_t start_endp) {
+    uint8_t cmd = BUILD_CMD(kCMDRead, kCMDFlags, start_endp);
+    esp_err_t ret;
+    spi_transaction_t transaction = {
+        .tx_buffer = &cmd,
+        .rx_buffer = NULL,
+        .length = 8,
+        .flags = SPI_TRANS_CS_KEEP_ACTIVE
+    };
+
+    spi_device_acquire_bus(spi, portMAX_DELAY);
+    ret = spi_device_transmit(spi, &transaction);
+    if(ret != ESP_OK) {
+        spi_device_release_bus(spi);
+        return -1;
+    }
+
+    memset(&transaction, 0, sizeof(spi_transaction_t));
+    transaction.rx_buffer = flags;
+    transaction.length = count * 8;
+    transaction.rxlength = transaction.length;
+    transaction.flags = usb_transport_data_mode(spi);
+
+    ret = spi_device_transmit(spi, &transaction);
+    if(ret != ESP_OK) {
+        spi_device_release_bus(spi);
+        return -1;
+    }
+
+    spi_device_release_bus(spi);
+    return 0;
+}
+
+int USB_HOT usb_transport_read_rx_count(USBTransportHandle_t spi, uint16_t *count, uint8_t endp) {
+
+    uint8_t cmd = BUILD_CMD(kCMDRead, kCMDRxCount, endp);
+    esp_err_t ret;
+    spi_transaction_t transaction = {
+        .tx_buffer = &cmd,
+        .rx_buffer = NULL,
+        .length = 8,
+        .flags = SPI_TRANS_CS_KEEP_ACTIVE
+    };
+
+    spi_device_acquire_bus(spi, portMAX_DELAY);
+    ret = spi_device_transmit(spi, &transaction);
+    if(ret != ESP_OK) {
+        spi_device_release_bus(spi);
+        return -1;
+    }
+
+    memset(&transaction, 0, sizeof(spi_transaction_t));
+    transaction.rx_buffer = count;
+    transaction.length = 2 * 8;
+    transaction.rxlength = transaction.length;
+    transaction.flags = usb_transport_data_mode(spi);
+
+    ret = spi_device_transmit(spi, &transaction);
+    if(ret != ESP_OK) {
+        spi_device_release_bus(spi);
+        return -1;
+    }
+
+    spi_device_release_bus(spi);
+    return 0;
+}
+
+int USB_HOT usb_transport_read_data(USBTransportHandle_t spi, uint8_t *buffer, size_t count , uint8_t endp) {
+
+    uint8_t cmd = BUILD_CMD(kCMDRead, kCMDData, endp);
+    uint32_t mode = usb_transport_data_mode(spi);
+    esp_err_t ret;
+    spi_transaction_t transaction = {
+        .tx_buffer = &cmd,
+        .rx_buffer = NULL,
+        .length = 8,
+        .flags = SPI_TRANS_CS_KEEP_ACTIVE
+    };
+
+    spi_device_acquire_bus(spi, portMAX_DELAY);
+    ret = spi_device_transmit(spi, &transaction);
+    if(ret != ESP_OK) {
+        spi_device_release_bus(spi);
+        return -1;
+    }
+
+
+    int xfer_size = MAX_XFER_SIZE;
+
+    while (count) {
+        if (xfer_size > count) 
+            xfer_size = count;
+
+        memset(&transaction, 0, sizeof(spi_transaction_t));
+        transaction.rx_buffer = buffer;
+        transaction.length = xfer_size * 8;
+        transaction.rxlength = transaction.length;
+        transaction.flags = mode | (xfer_size == MAX_XFER_SIZE ? SPI_TRANS_CS_KEEP_ACTIVE : 0);
+
+        ret = spi_device_transmit(spi, &transaction);
+        if(ret != ESP_OK) {
+            spi_device_release_bus(spi);
+            return -1;
+        }
+
+        count -= xfer_size;
+        buffer += xfer_size;
+    }
+
+    spi_device_release_bus(spi);
+    return 0;
+}
+
+int USB_HOT usb_transport_set_cmd(USBTransportHandle_t spi, USBCMDs_t usb_cmd, uint8_t endp) {
+    uint8_t cmd[2] = {BUILD_CMD(kCMDWrite, kCMDSetCMD, endp), usb_cmd};
+    return usb_transport_write_command(spi, cmd, sizeof(cmd));
+}
+
+int USB_HOT usb_transport_write_data(USBTransportHandle_t spi, uint8_t *buffer, size_t count , uint8_t endp) {
+    uint8_t cmd = BUILD_CMD(kCMDWrite, kCMDData, endp);
+    uint32_t mode = usb_transport_data_mode(spi);
+    esp_err_t ret;
+    spi_transaction_t transaction = {
+        .tx_buffer = &cmd,
+        .rx_buffer = NULL,
+        .length = 8,
+        .flags = SPI_TRANS_CS_KEEP_ACTIVE
+    };
+
+    spi_device_acquire_bus(spi, portMAX_DELAY);
+    ret = spi_device_transmit(spi, &transaction);
+    if(ret != ESP_OK) {
+        spi_device_release_bus(spi);
+        return -1;
+    }
+
+    int xfer_size = MAX_XFER_SIZE;
+    while (count) {
+
+        if (xfer_size > count)
+            xfer_size = count;
+
+
+        memset(&transaction, 0, sizeof(spi_transaction_t));
+        transaction.tx_buffer = buffer;
+        transaction.length = xfer_size * 8;
+        transaction.flags = mode | (xfer_size == MAX_XFER_SIZE ? xfer_size == count ? 0: SPI_TRANS_CS_KEEP_ACTIVE : 0);
+
+        ret = spi_device_transmit(spi, &transaction);
+        if(ret != ESP_OK) {
+            spi_device_release_bus(spi);
+            return -1;
+        }
+        count-= xfer_size;
+        buffer += xfer_size;
+    }
+
+    spi_device_release_bus(spi);
+    
+    #if 0
+    /*send 0 packet length to nofity end*/
+    if (transaction.flags)
+        usb_transport_set_cmd(spi, kUSBCMDSend0DataLength, endp);
+    #endif
+
+    return 0;
+}
+
+/*Same wire sequence as usb_transport_write_data, but the pieces of every
+segment are queued back to back under one CS assertion so the dma moves
+from one buffer to the next with no staging copy. The transactions of the
+batch are the ring, refilled as results come back, so any number of pieces
+fits*/
+int USB_HOT usb_transport_write_datav(USBTransportHandle_t spi, USBBatch_t *batch, const USBSegment_t *segments, int count, uint8_t endp) {
+    spi_transaction_t *ring = batch->transactions;
+    spi_transaction_t *transaction, *done;
+    const uint8_t *data;
+    size_t left, xfer_size;
+    uint32_t mode = usb_transport_data_mode(spi);
+    int queued = 0, finished = 0, last = count - 1, ret = 0;
+
+    while (last >= 0 && !segments[last].length)
+        last--;
+
+    spi_device_acquire_bus(spi, portMAX_DELAY);
+
+    transaction = &ring[0];
+    memset(transaction, 0, sizeof(spi_transaction_t));
+    transaction->tx_data[0] = BUILD_CMD(kCMDWrite, kCMDData, endp);
+    transaction->length = 8;
+    transaction->flags = SPI_TRANS_USE_TXDATA | (last >= 0 ? SPI_TRANS_CS_KEEP_ACTIVE : 0);
+    if (spi_device_queue_trans(spi, transaction, portMAX_DELAY) != ESP_OK)
+        ret = -1;
+    else
+        queued++;
+
+    for (int i = 0; i <= last && !ret; i++) {
+        data = segments[i].data;
+        left = segments[i].length;
+        while (left) {
+            xfer_size = left > MAX_XFER_SIZE ? MAX_XFER_SIZE : left;
+
+            if (queued - finished == USB_BATCH_TRANSACTIONS) {
+                if (spi_device_get_trans_result(spi, &done, portMAX_DELAY) != ESP_OK)
+                    ret = -1;
+                finished++;
+            }
+
+            transaction = &ring[queued % USB_BATCH_TRANSACTIONS];
+            memset(transaction, 0, sizeof(spi_transaction_t));
+            transaction->tx_buffer = data;
+            transaction->length = xfer_size * 8;
+            transaction->flags = mode;
+            if (i != last || left > xfer_size)
+                transaction->flags |= SPI_TRANS_CS_KEEP_ACTIVE;
+
+            if (ret || spi_device_queue_trans(spi, transaction, portMAX_DELAY) != ESP_OK) {
+                ret = -1;
+                break;
+            }
+            queued++;
+            left -= xfer_size;
+            data += xfer_size;
+        }
+    }
+
+    while (finished < queued) {
+        if (spi_device_get_trans_result(spi, &done, portMAX_DELAY) != ESP_OK)
+            ret = -1;
+        finished++;
+    }
+
+    spi_device_release_bus(spi);
+    return ret;
+}
+
+int usb_transport_set_address(USBTransportHandle_t spi, uint8_t address) {
+    uint8_t cmd[2] = {BUILD_CMD(kCMDWrite, kCMDAddress, 0), address};
+    return usb_transport_write_command(spi, cmd, sizeof(cmd));
+}
+
+int usb_transport_read_caps(USBTransportHandle_t spi, USBCaps_t *caps) {
+    uint8_t cmd = BUILD_CMD(kCMDRead, kCMDCaps, 0);
+    esp_err_t ret;
+    spi_transaction_t transaction = {
+        .tx_buffer = &cmd,
+        .rx_buffer = NULL,
+        .length = 8,
+        .flags = SPI_TRANS_CS_KEEP_ACTIVE
+    };
+
+    spi_device_acquire_bus(spi, portMAX_DELAY);
+    ret = spi_device_transmit(spi, &transaction);
+    if(ret != ESP_OK) {
+        spi_device_release_bus(spi);
+        return -1;
+    }
+
+    memset(&transaction, 0, sizeof(spi_transaction_t));
+    transaction.rx_buffer = caps;
+    transaction.length = sizeof(USBCaps_t) * 8;
+    transaction.rxlength = transaction.length;
+    transaction.flags = usb_transport_data_mode(spi);
+
+    ret = spi_device_transmit(spi, &transaction);
+    if(ret != ESP_OK) {
+        spi_device_release_bus(spi);
+        return -1;
+    }
+
+    spi_device_release_bus(spi);
+    return 0;
+}
+
+int usb_transport_set_fifo_size(USBTransportHandle_t spi, uint16_t size, uint8_t endp) {
+    uint8_t cmd[3] = {BUILD_CMD(kCMDWrite, kCMDFifoSize, endp), size & 0xff, size >> 8};
+    return usb_transport_write_command(spi, cmd, sizeof(cmd));
+}
+
+int usb_transport_set_link(USBTransportHandle_t spi, USBLinkMode_t mode) {
+    uint8_t cmd[2] = {BUILD_CMD(kCMDWrite, kCMDLinkMode, 0), mode};
+#if USB_QUAD
+    int slot = -1;
+
+    for (int i = 0; i < QUAD_DEVICES && slot < 0; i++)
+        if (g_quad_devices[i] == spi)
+            slot = i;
+    for (int i = 0; i < QUAD_DEVICES && slot < 0; i++)
+        if (!g_quad_devices[i])
+            slot = i;
+    if (slot < 0) {
+        DEBUG("More than %i quad devices", QUAD_DEVICES);
+        return -1;
+    }
+
+    //sent in the current mode, the host follows once it is through
+    if (usb_transport_write_command(spi, cmd, sizeof(cmd)))
+        return -1;
+    g_quad_devices[slot] = mode == kLinkQuad ? spi : NULL;
+    return 0;
+#else
+    if (mode != kLinkSingle)
+        return -1;
+    return usb_transport_write_command(spi, cmd, sizeof(cmd));
+#endif
+}
+
+
+static spi_transaction_t *usb_transport_next(USBBatch_t *batch, int *used) {
+    spi_transaction_t *transaction;
+
+    if (*used >= USB_BATCH_TRANSACTIONS)
+        return NULL;
+
+    transaction = &batch->transactions[(*used)++];
+    memset(transaction, 0, sizeof(spi_transaction_t));
+    return transaction;
+}
+
+/*Same wire sequence as the single helpers: command byte with CS kept
+active, then the data in MAX_XFER_SIZE pieces. In quad the argument of the
+two byte commands gets a data phase of its own*/
+static int USB_HOT usb_transport_build(spi_device_handle_t spi, USBBatch_t *batch) {
+    uint32_t mode = usb_transport_data_mode(spi);
+    spi_transaction_t *transaction;
+    size_t count, xfer_size;
+    uint8_t *data;
+    int used = 0;
+
+    for (int i = 0; i < batch->ops_used; i++) {
+        transaction = usb_transport_next(batch, &used);
+        if (!transaction)
+            return -1;
+
+        transaction->tx_data[0] = batch->ops[i].cmd;
+        transaction->flags = SPI_TRANS_USE_TXDATA;
+
+        if (!batch->ops[i].data && !mode) {
+            transaction->tx_data[1] = batch->ops[i].arg;
+            transaction->length = 16;
+            continue;
+        }
+
+        transaction->length = 8;
+        transaction->flags |= SPI_TRANS_CS_KEEP_ACTIVE;
+
+        if (!batch->ops[i].data) {
+            transaction = usb_transport_next(batch, &used);
+            if (!transaction)
+                return -1;
+            transaction->tx_data[0] = batch->ops[i].arg;
+            transaction->length = 8;
+            transaction->flags = SPI_TRANS_USE_TXDATA | mode;
+            continue;
+        }
+
+        data = batch->ops[i].data;
+        count = batch->ops[i].length;
+        while (count) {
+            xfer_size = count > MAX_XFER_SIZE ? MAX_XFER_SIZE : count;
+
+            transaction = usb_transport_next(batch, &used);
+            if (!transaction)
+                return -1;
+
+            transaction->length = xfer_size * 8;
+            transaction->flags = mode;
+            if (batch->ops[i].write) {
+                transaction->tx_buffer = data;
+            } else if (xfer_size <= sizeof(transaction->rx_data)) {
+                //small reads land in the transaction itself and are copied on completion
+                transaction->flags |= SPI_TRANS_USE_RXDATA;
+                transaction->user = data;
+            } else {
+                transaction->rx_buffer = data;
+            }
+            if (!batch->ops[i].write)
+                transaction->rxlength = transaction->length;
+            if (count > xfer_size)
+                transaction->flags |= SPI_TRANS_CS_KEEP_ACTIVE;
+
+            count -= xfer_size;
+            data += xfer_size;
+        }
+    }
+
+    return used;
+}
+
+/*Queues the whole list under a single bus acquisition and gathers the results*/
+int USB_HOT usb_transport_submit(USBTransportHandle_t spi, USBBatch_t *batch) {
+    spi_transaction_t *done;
+    int queued, used, ret = 0;
+
+    used = usb_transport_build(spi, batch);
+    if (used < 0) {
+        DEBUG("Batch does not fit in %i transactions", USB_BATCH_TRANSACTIONS);
+        return -1;
+    }
+
+    spi_device_acquire_bus(spi, portMAX_DELAY);
+
+    for (queued = 0; queued < used; queued++) {
+        if (spi_device_queue_trans(spi, &batch->transactions[queued], portMAX_DELAY) != ESP_OK) {
+            ret = -1;
+            break;
+        }
+    }
+
+    while (queued--) {
+        if (spi_device_get_trans_result(spi, &done, portMAX_DELAY) != ESP_OK) {
+            ret = -1;
+            continue;
+        }
+        if ((done->flags & SPI_TRANS_USE_RXDATA) && done->user)
+            memcpy(done->user, done->rx_data, done->length / 8);
+    }
+
+    spi_device_release_bus(spi);
+    return ret;
+}
+
+#endif
@@ -0,0 +1,336 @@
+#include "usb_transport_sim.h"
+
+#if USB_TRANSPORT == USB_TRANSPORT_SIM
+
+#include "util.h"
+
+#include <string.h>
+
+#define DEBUG_CNTX "usb-sim"
+
+
+void usb_sim_init(USBSimFpga_t *sim) {
+    memset(sim, 0, sizeof(USBSimFpga_t));
+    pthread_mutex_init(&sim->lock, NULL);
+    usb_sim_set_caps(sim, FPGA_ENDPOINTS, SIM_FIFO_MEMORY);
+    usb_sim_set_quad(sim, true, true);
+}
+
+/*The core comes up with its memory split evenly, FPGA_ENDP_SIZE each when it fits*/
+void usb_sim_set_caps(USBSimFpga_t *sim, uint8_t endpoints, uint16_t fifo_memory) {
+    uint16_t size = FPGA_ENDP_SIZE;
+
+    if (fifo_memory && endpoints && fifo_memory / endpoints / 2 < size)
+        size = fifo_memory / endpoints / 2;
+
+    pthread_mutex_lock(&sim->lock);
+    sim->caps.magic = fifo_memory ? FPGA_CAPS_MAGIC : 0;
+    sim->caps.endpoints = fifo_memory ? endpoints : 0;
+    sim->caps.fifo_memory = fifo_memory;
+    for (int i = 0; i < FPGA_ENDPOINTS; i++)
+        sim->endpoints[i].fifo_size = i < endpoints ? size : 0;
+    pthread_mutex_unlock(&sim->lock);
+}
+
+void usb_sim_set_quad(USBSimFpga_t *sim, bool supported, bool wired) {
+    pthread_mutex_lock(&sim->lock);
+    sim->quad_supported = supported;
+    sim->quad_wired = wired;
+    sim->caps.features = supported ? kFPGAFeatureQuad : 0;
+    pthread_mutex_unlock(&sim->lock);
+}
+
+static void usb_sim_account(USBSimFpga_t *sim, size_t count) {
+    sim->transactions++;
+    sim->bytes += 1 + count; //command byte + data
+    sim->clocks += 8 + count * (sim->host_link == kLinkQuad ? 2 : 8);
+}
+
+/*Data phases the core can not make sense of: ends in different modes, or
+quad over missing lines. Reads see the pull-ups, writes are lost*/
+static bool usb_sim_garbled(USBSimFpga_t *sim) {
+    return sim->host_link != sim->core_link || (sim->host_link == kLinkQuad && !sim->quad_wired);
+}
+
+int usb_transport_read_flags(USBTransportHandle_t sim, USBFlags_t *flags, size_t count, uint8_t start_endp) {
+    pthread_mutex_lock(&sim->lock);
+    for (int i = 0; i < count; i++) {
+        uint8_t endp = start_endp + i;
+        memset(&flags[i], 0, sizeof(USBFlags_t));
+        if (endp >= FPGA_ENDPOINTS)
+            continue;
+        flags[i].rx_empty = sim->endpoints[endp].rx.count == 0;
+        flags[i].rx_full = sim->endpoints[endp].fifo_size && sim->endpoints[endp].rx.count >= sim->endpoints[endp].fifo_size;
+        flags[i].tx_empty = sim->endpoints[endp].tx_used == 0;
+        flags[i].tx_full = sim->endpoints[endp].tx_used == SIM_TX_SLOTS;
+        flags[i].bus_reset = sim->bus_reset;
+        flags[i].suspended = sim->suspended;
+    }
+    if (usb_sim_garbled(sim))
+        memset(flags, 0xff, count * sizeof(USBFlags_t));
+    usb_sim_account(sim, count);
+    pthread_mutex_unlock(&sim->lock);
+    return 0;
+}
+
+int usb_transport_read_rx_count(USBTransportHandle_t sim, uint16_t *count, uint8_t endp) {
+    pthread_mutex_lock(&sim->lock);
+    *count = usb_sim_garbled(sim) ? 0xffff : sim->endpoints[endp].rx.count;
+    usb_sim_account(sim, 2);
+    pthread_mutex_unlock(&sim->lock);
+    return 0;
+}
+
+int usb_transport_read_data(USBTransportHandle_t sim, uint8_t *buffer, size_t count, uint8_t endp) {
+    USBSimPacket_t *rx = &sim->endpoints[endp].rx;
+
+    pthread_mutex_lock(&sim->lock);
+    if (count > rx->count) {
+        DEBUG("Read of %u bytes on endp %i with %u pending", (unsigned) count, endp, rx->count);
+        pthread_mutex_unlock(&sim->lock);
+        return -1;
+    }
+    memcpy(buffer, rx->data, count);
+    if (usb_sim_garbled(sim))
+        memset(buffer, 0xff, count);
+    //reading drains the fifo
+    memmove(rx->data, rx->data + count, rx->count - count);
+    rx->count -= count;
+    usb_sim_account(sim, count);
+    pthread_mutex_unlock(&sim->lock);
+    return 0;
+}
+
+int usb_transport_write_data(USBTransportHandle_t sim, uint8_t *buffer, size_t count, uint8_t endp) {
+    USBSimPacket_t *slot;
+
+    pthread_mutex_lock(&sim->lock);
+    if (usb_sim_garbled(sim)) {
+        usb_sim_account(sim, count);
+        pthread_mutex_unlock(&sim->lock);
+        return 0;
+    }
+    if (sim->endpoints[endp].tx_used == SIM_TX_SLOTS || count > sim->endpoints[endp].fifo_size) {
+        DEBUG("Tx overflow on endp %i", endp);
+        pthread_mutex_unlock(&sim->lock);
+        return -1;
+    }
+    slot = &sim->endpoints[endp].tx[(sim->endpoints[endp].tx_head + sim->endpoints[endp].tx_used) % SIM_TX_SLOTS];
+    memcpy(slot->data, buffer, count);
+    slot->count = count;
+    sim->endpoints[endp].tx_used++;
+    usb_sim_account(sim, count);
+    pthread_mutex_unlock(&sim->lock);
+    return 0;
+}
+
+int usb_transport_write_datav(USBTransportHandle_t sim, USBBatch_t *batch, const USBSegment_t *segments, int count, uint8_t endp) {
+    USBSimPacket_t *slot;
+    size_t total = 0;
+
+    for (int i = 0; i < count; i++)
+        total += segments[i].length;
+
+    pthread_mutex_lock(&sim->lock);
+    if (usb_sim_garbled(sim)) {
+        usb_sim_account(sim, total);
+        pthread_mutex_unlock(&sim->lock);
+        return 0;
+    }
+    if (sim->endpoints[endp].tx_used == SIM_TX_SLOTS || total > sim->endpoints[endp].fifo_size) {
+        DEBUG("Tx overflow on endp %i", endp);
+        pthread_mutex_unlock(&sim->lock);
+        return -1;
+    }
+    slot = &sim->endpoints[endp].tx[(sim->endpoints[endp].tx_head + sim->endpoints[endp].tx_used) % SIM_TX_SLOTS];
+    slot->count = 0;
+    for (int i = 0; i < count; i++) {
+        memcpy(&slot->data[slot->count], segments[i].data, segments[i].length);
+        slot->count += segments[i].length;
+    }
+    sim->endpoints[endp].tx_used++;
+    usb_sim_account(sim, total);
+    pthread_mutex_unlock(&sim->lock);
+    return 0;
+}
+
+int usb_transport_set_cmd(USBTransportHandle_t sim, USBCMDs_t cmd, uint8_t endp) {
+    pthread_mutex_lock(&sim->lock);
+    if (!usb_sim_garbled(sim)) {
+        if (cmd == kUSBCMDAckBusReset)
+            sim->bus_reset = false;
+        else
+            sim->endpoints[endp].cmd = cmd;
+    }
+    usb_sim_account(sim, 1);
+    pthread_mutex_unlock(&sim->lock);
+    return 0;
+}
+
+int usb_transport_set_address(USBTransportHandle_t sim, uint8_t address) {
+    pthread_mutex_lock(&sim->lock);
+    if (!usb_sim_garbled(sim))
+        sim->address = address;
+    usb_sim_account(sim, 1);
+    pthread_mutex_unlock(&sim->lock);
+    return 0;
+}
+
+int usb_transport_read_caps(USBTransportHandle_t sim, USBCaps_t *caps) {
+    pthread_mutex_lock(&sim->lock);
+    *caps = sim->caps;
+    if (usb_sim_garbled(sim))
+        memset(caps, 0xff, sizeof(USBCaps_t));
+    usb_sim_account(sim, sizeof(USBCaps_t));
+    pthread_mutex_unlock(&sim->lock);
+    return 0;
+}
+
+/*Like the core, the fifos are carved from one memory: a size that does not
+fit next to the other endpoints is refused*/
+int usb_transport_set_fifo_size(USBTransportHandle_t sim, uint16_t size, uint8_t endp) {
+    uint32_t used = 2 * size;
+    int ret = 0;
+
+    pthread_mutex_lock(&sim->lock);
+    for (int i = 0; i < FPGA_ENDPOINTS; i++)
+        if (i != endp)
+            used += 2 * sim->endpoints[i].fifo_size;
+
+    if (usb_sim_garbled(sim) || sim->caps.magic != FPGA_CAPS_MAGIC || endp >= sim->caps.endpoints || size > FPGA_FIFO_MAX || used > sim->caps.fifo_memory) {
+        DEBUG("Fifo of %u bytes on endp %i refused", size, endp);
+        ret = -1;
+    } else {
+        sim->endpoints[endp].fifo_size = size;
+        sim->endpoints[endp].rx.count = 0;
+        sim->endpoints[endp].tx_used = 0;
+    }
+    usb_sim_account(sim, 2);
+    pthread_mutex_unlock(&sim->lock);
+    return ret;
+}
+
+/*The core only goes quad on an argument it read whole, anything else
+(floating lines included) puts it back to single*/
+int usb_transport_set_link(USBTransportHandle_t sim, USBLinkMode_t mode) {
+#if !USB_QUAD
+    if (mode != kLinkSingle)
+        return -1;
+#endif
+    pthread_mutex_lock(&sim->lock);
+    if (sim->quad_supported)
+        sim->core_link = mode == kLinkQuad && !usb_sim_garbled(sim) ? kLinkQuad : kLinkSingle;
+    usb_sim_account(sim, 1);
+    sim->host_link = mode;
+    pthread_mutex_unlock(&sim->lock);
+    return 0;
+}
+
+int usb_transport_submit(USBTransportHandle_t sim, USBBatch_t *batch) {
+    int ret = 0;
+
+    for (int i = 0; i < batch->ops_used && !ret; i++) {
+        uint8_t cmd = batch->ops[i].cmd;
+        uint8_t endp = CMD_ENDP(cmd);
+
+        switch (CMD_TYPE(cmd)) {
+        case kCMDData:
+            if (CMD_READ(cmd))
+                ret = usb_transport_read_data(sim, batch->ops[i].data, batch->ops[i].length, endp);
+            else
+                ret = usb_transport_write_data(sim, batch->ops[i].data, batch->ops[i].length, endp);
+            break;
+        case kCMDRxCount:
+            ret = usb_transport_read_rx_count(sim, (uint16_t *) batch->ops[i].data, endp);
+            break;
+        case kCMDFlags:
+            ret = usb_transport_read_flags(sim, (USBFlags_t *) batch->ops[i].data, batch->ops[i].length, endp);
+            break;
+        case kCMDAddress:
+            ret = usb_transport_set_address(sim, batch->ops[i].arg);
+            break;
+        case kCMDSetCMD:
+            ret = usb_transport_set_cmd(sim, batch->ops[i].arg, endp);
+            break;
+        default:
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+
+int usb_sim_host_out(USBSimFpga_t *sim, uint8_t endp, const void *data, size_t count) {
+    USBSimPacket_t *rx = &sim->endpoints[endp].rx;
+    int ret = 0;
+
+    pthread_mutex_lock(&sim->lock);
+    if (sim->endpoints[endp].iso && rx->count) {
+        sim->endpoints[endp].iso_lost++;
+    } else if (rx->count + count > sim->endpoints[endp].fifo_size) {
+        ret = -1;
+    } else {
+        memcpy(rx->data + rx->count, data, count);
+        rx->count += count;
+    }
+    pthread_mutex_unlock(&sim->lock);
+    return ret;
+}
+
+int usb_sim_host_in(USBSimFpga_t *sim, uint8_t endp, void *data, size_t max) {
+    USBSimPacket_t *slot;
+    int ret = -1;
+
+    pthread_mutex_lock(&sim->lock);
+    if (sim->endpoints[endp].tx_used) {
+        slot = &sim->endpoints[endp].tx[sim->endpoints[endp].tx_head];
+        ret = slot->count > max ? max : slot->count;
+        memcpy(data, slot->data, ret);
+        sim->endpoints[endp].tx_head = (sim->endpoints[endp].tx_head + 1) % SIM_TX_SLOTS;
+        sim->endpoints[endp].tx_used--;
+    } else if (sim->endpoints[endp].iso) {
+        sim->endpoints[endp].iso_empty++;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&sim->lock);
+    return ret;
+}
+
+USBCMDs_t usb_sim_host_take_cmd(USBSimFpga_t *sim, uint8_t endp) {
+    USBCMDs_t cmd;
+
+    pthread_mutex_lock(&sim->lock);
+    cmd = sim->endpoints[endp].cmd;
+    sim->endpoints[endp].cmd = kUSBCMDNone;
+    pthread_mutex_unlock(&sim->lock);
+    return cmd;
+}
+
+void usb_sim_host_reset(USBSimFpga_t *sim) {
+    pthread_mutex_lock(&sim->lock);
+    sim->address = 0;
+    for (int i = 0; i < FPGA_ENDPOINTS; i++) {
+        sim->endpoints[i].rx.count = 0;
+        sim->endpoints[i].tx_head = 0;
+        sim->endpoints[i].tx_used = 0;
+        sim->endpoints[i].cmd = kUSBCMDNone;
+    }
+    sim->bus_reset = true;
+    sim->suspended = false;
+    pthread_mutex_unlock(&sim->lock);
+}
+
+void usb_sim_host_suspend(USBSimFpga_t *sim, bool suspended) {
+    pthread_mutex_lock(&sim->lock);
+    sim->suspended = suspended;
+    pthread_mutex_unlock(&sim->lock);
+}
+
+void usb_sim_set_iso(USBSimFpga_t *sim, uint8_t endp, bool iso) {
+    pthread_mutex_lock(&sim->lock);
+    sim->endpoints[endp].iso = iso;
+    pthread_mutex_unlock(&sim->lock);
+}
+
+#endif
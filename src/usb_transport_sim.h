@@ -0,0 +1,71 @@
+
+
+#ifndef USB_TRANSPORT_SIM_H_
+#define USB_TRANSPORT_SIM_H_
+
+#include "usb_transport.h"
+
+#if USB_TRANSPORT == USB_TRANSPORT_SIM
+
+#include <pthread.h>
+
+#define SIM_TX_SLOTS 2 //the fpga tx fifo holds two packets (ping-pong)
+#define SIM_FIFO_MEMORY (FPGA_ENDPOINTS * 2 * FPGA_ENDP_SIZE) //same memory as the fixed layout
+
+typedef struct {
+    uint8_t data[FPGA_FIFO_MAX];
+    uint16_t count;
+} USBSimPacket_t;
+
+/*Behavioural model of the FPGA USB core. The stack talks to it through the
+usb_transport_* calls, tests play the host through usb_sim_host_*/
+typedef struct USBSimFpga {
+    pthread_mutex_t lock;
+    uint8_t address;
+    USBCaps_t caps;
+    struct {
+        uint16_t fifo_size; //bytes each way, FPGA_ENDP_SIZE until programmed
+        USBSimPacket_t rx; //host to device
+        USBSimPacket_t tx[SIM_TX_SLOTS]; //device to host
+        uint8_t tx_head;
+        uint8_t tx_used;
+        USBCMDs_t cmd; //stall or zero length packet pending for the host
+        bool iso; //no handshake: empty IN sends a zero length packet, OUT on a busy fifo is lost
+        uint32_t iso_empty; //IN frames that found nothing queued
+        uint32_t iso_lost; //OUT packets dropped
+    } endpoints[FPGA_ENDPOINTS];
+
+    bool bus_reset; //latched until acked
+    bool suspended;
+
+    //link mode, both ends must agree and quad needs the WP and HD lines
+    bool quad_supported;
+    bool quad_wired;
+    USBLinkMode_t core_link;
+    USBLinkMode_t host_link;
+
+    //link statistics
+    uint32_t transactions;
+    uint64_t bytes;
+    uint64_t clocks; //8 for the command, 8 or 2 per data byte
+} USBSimFpga_t;
+
+void usb_sim_init(USBSimFpga_t *sim);
+/*Core to model, fifo_memory 0 for one without the capability query*/
+void usb_sim_set_caps(USBSimFpga_t *sim, uint8_t endpoints, uint16_t fifo_memory);
+/*Quad offered in the caps, and whether the board routes the two extra lines*/
+void usb_sim_set_quad(USBSimFpga_t *sim, bool supported, bool wired);
+
+/*Host side. out returns -1 when the endpoint would NAK, in returns the
+packet length or -1 when there is nothing to send*/
+int usb_sim_host_out(USBSimFpga_t *sim, uint8_t endp, const void *data, size_t count);
+int usb_sim_host_in(USBSimFpga_t *sim, uint8_t endp, void *data, size_t max);
+USBCMDs_t usb_sim_host_take_cmd(USBSimFpga_t *sim, uint8_t endp);
+/*Bus reset as the core sees it: address 0, every fifo and command dropped*/
+void usb_sim_host_reset(USBSimFpga_t *sim);
+void usb_sim_host_suspend(USBSimFpga_t *sim, bool suspended);
+void usb_sim_set_iso(USBSimFpga_t *sim, uint8_t endp, bool iso);
+
+#endif
+
+#endif
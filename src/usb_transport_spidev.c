@@ -0,0 +1,203 @@
+#include "usb_transport.h"
+
+#if USB_TRANSPORT == USB_TRANSPORT_SPIDEV
+
+#include "util.h"
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
+
+#define DEBUG_CNTX "usb-spidev"
+
+#define QUAD_DEVICES 4
+
+/*Chip select stays asserted across all the transfers of one message, so a
+command plus its data is a single SPI_IOC_MESSAGE. The command transfer is
+always single line, data transfers take the width of the link*/
+
+static struct {
+    int fd;
+    bool capable; //controller accepted the quad mode bits
+    bool quad;
+} g_links[QUAD_DEVICES];
+
+static int usb_transport_link(int fd) {
+    for (int i = 0; i < QUAD_DEVICES; i++)
+        if (g_links[i].capable && g_links[i].fd == fd)
+            return i;
+    return -1;
+}
+
+static uint8_t usb_transport_data_nbits(int fd) {
+    int link = usb_transport_link(fd);
+    return link >= 0 && g_links[link].quad ? 4 : 1;
+}
+
+int usb_transport_spidev_open(const char *path, uint32_t speed_hz) {
+    uint8_t mode = SPI_MODE_3;
+    uint8_t bits = 8;
+    int fd;
+
+    fd = open(path, O_RDWR);
+    if (fd < 0) {
+        DEBUG("Failed to open %s", path);
+        return -1;
+    }
+
+    if (ioctl(fd, SPI_IOC_WR_MODE, &mode) < 0 ||
+        ioctl(fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0 ||
+        ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed_hz) < 0) {
+        DEBUG("Failed to configure %s", path);
+        close(fd);
+        return -1;
+    }
+
+#if USB_QUAD
+    //transfers may then ask for 4 lines, without it the link stays single
+    uint32_t mode32 = SPI_MODE_3 | SPI_TX_QUAD | SPI_RX_QUAD;
+    for (int i = 0; i < QUAD_DEVICES; i++) {
+        if (g_links[i].capable)
+            continue;
+        if (ioctl(fd, SPI_IOC_WR_MODE32, &mode32) < 0) {
+            DEBUG("%s has no quad mode", path);
+        } else {
+            g_links[i].fd = fd;
+            g_links[i].capable = true;
+            g_links[i].quad = false;
+        }
+        break;
+    }
+#endif
+
+    return fd;
+}
+
+static int usb_transport_command(int fd, uint8_t cmd, void *rx, const void *tx, size_t count) {
+    struct spi_ioc_transfer xfer[2];
+
+    memset(xfer, 0, sizeof(xfer));
+    xfer[0].tx_buf = (unsigned long) &cmd;
+    xfer[0].len = 1;
+    xfer[1].tx_buf = (unsigned long) tx;
+    xfer[1].rx_buf = (unsigned long) rx;
+    xfer[1].len = count;
+    xfer[1].tx_nbits = xfer[1].rx_nbits = usb_transport_data_nbits(fd);
+
+    if (ioctl(fd, SPI_IOC_MESSAGE(count ? 2 : 1), xfer) < 0)
+        return -1;
+    return 0;
+}
+
+int usb_transport_read_flags(USBTransportHandle_t fd, USBFlags_t *flags, size_t count, uint8_t start_endp) {
+    return usb_transport_command(fd, BUILD_CMD(kCMDRead, kCMDFlags, start_endp), flags, NULL, count);
+}
+
+int usb_transport_read_rx_count(USBTransportHandle_t fd, uint16_t *count, uint8_t endp) {
+    return usb_transport_command(fd, BUILD_CMD(kCMDRead, kCMDRxCount, endp), count, NULL, 2);
+}
+
+int usb_transport_read_data(USBTransportHandle_t fd, uint8_t *buffer, size_t count, uint8_t endp) {
+    return usb_transport_command(fd, BUILD_CMD(kCMDRead, kCMDData, endp), buffer, NULL, count);
+}
+
+int usb_transport_write_data(USBTransportHandle_t fd, uint8_t *buffer, size_t count, uint8_t endp) {
+    return usb_transport_command(fd, BUILD_CMD(kCMDWrite, kCMDData, endp), NULL, buffer, count);
+}
+
+int usb_transport_set_cmd(USBTransportHandle_t fd, USBCMDs_t cmd, uint8_t endp) {
+    uint8_t arg = cmd;
+    return usb_transport_command(fd, BUILD_CMD(kCMDWrite, kCMDSetCMD, endp), NULL, &arg, 1);
+}
+
+int usb_transport_set_address(USBTransportHandle_t fd, uint8_t address) {
+    return usb_transport_command(fd, BUILD_CMD(kCMDWrite, kCMDAddress, 0), NULL, &address, 1);
+}
+
+int usb_transport_read_caps(USBTransportHandle_t fd, USBCaps_t *caps) {
+    return usb_transport_command(fd, BUILD_CMD(kCMDRead, kCMDCaps, 0), caps, NULL, sizeof(USBCaps_t));
+}
+
+int usb_transport_set_fifo_size(USBTransportHandle_t fd, uint16_t size, uint8_t endp) {
+    uint8_t arg[2] = {size & 0xff, size >> 8};
+    return usb_transport_command(fd, BUILD_CMD(kCMDWrite, kCMDFifoSize, endp), NULL, arg, sizeof(arg));
+}
+
+int usb_transport_set_link(USBTransportHandle_t fd, USBLinkMode_t mode) {
+    int link = usb_transport_link(fd);
+    uint8_t arg = mode;
+
+    if (mode == kLinkQuad && link < 0)
+        return -1;
+    //sent in the current mode, the host follows once it is through
+    if (usb_transport_command(fd, BUILD_CMD(kCMDWrite, kCMDLinkMode, 0), NULL, &arg, 1))
+        return -1;
+    if (link >= 0)
+        g_links[link].quad = mode == kLinkQuad;
+    return 0;
+}
+
+/*Command plus every segment as one message, CS stays asserted throughout*/
+int usb_transport_write_datav(USBTransportHandle_t fd, USBBatch_t *batch, const USBSegment_t *segments, int count, uint8_t endp) {
+    struct spi_ioc_transfer xfer[1 + USB_SEGMENTS_MAX];
+    uint8_t cmd = BUILD_CMD(kCMDWrite, kCMDData, endp);
+    uint8_t nbits = usb_transport_data_nbits(fd);
+    int used = 0;
+
+    if (count > USB_SEGMENTS_MAX)
+        return -1;
+
+    memset(xfer, 0, sizeof(xfer));
+    xfer[used].tx_buf = (unsigned long) &cmd;
+    xfer[used].len = 1;
+    used++;
+
+    for (int i = 0; i < count; i++) {
+        if (!segments[i].length)
+            continue;
+        xfer[used].tx_buf = (unsigned long) segments[i].data;
+        xfer[used].len = segments[i].length;
+        xfer[used].tx_nbits = nbits;
+        used++;
+    }
+
+    if (ioctl(fd, SPI_IOC_MESSAGE(used), xfer) < 0)
+        return -1;
+    return 0;
+}
+
+/*The whole batch goes down in one ioctl, cs_change releases CS between commands*/
+int usb_transport_submit(USBTransportHandle_t fd, USBBatch_t *batch) {
+    struct spi_ioc_transfer xfer[USB_BATCH_OPS * 2];
+    uint8_t nbits = usb_transport_data_nbits(fd);
+    int used = 0;
+
+    memset(xfer, 0, sizeof(xfer));
+    for (int i = 0; i < batch->ops_used; i++) {
+        xfer[used].tx_buf = (unsigned long) &batch->ops[i].cmd;
+        xfer[used].len = 1;
+        used++;
+
+        if (batch->ops[i].data) {
+            if (batch->ops[i].write)
+                xfer[used].tx_buf = (unsigned long) batch->ops[i].data;
+            else
+                xfer[used].rx_buf = (unsigned long) batch->ops[i].data;
+            xfer[used].len = batch->ops[i].length;
+        } else {
+            xfer[used].tx_buf = (unsigned long) &batch->ops[i].arg;
+            xfer[used].len = 1;
+        }
+        xfer[used].tx_nbits = xfer[used].rx_nbits = nbits;
+        xfer[used].cs_change = i != batch->ops_used - 1;
+        used++;
+    }
+
+    if (used && ioctl(fd, SPI_IOC_MESSAGE(used), xfer) < 0)
+        return -1;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,15 @@
+
+
+
+#ifndef CHECK_H_
+#define CHECK_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/*Host tests stop at the first failed check with a non zero exit, ctest
+reports it. Numbers worth comparing between runs go out with BENCH*/
+#define CHECK(x) do { if (!(x)) { printf("%s:%i: check failed: %s\n", __FILE__, __LINE__, #x); exit(1); } } while (0)
+#define BENCH(fmt, ...) printf("bench: " fmt "\n", ##__VA_ARGS__)
+
+#endif
@@ -0,0 +1,174 @@
+#include "sim_host.h"
+#include "check.h"
+#include "usb_port.h"
+
+#include <sched.h>
+#include <string.h>
+
+#define CONTROL_PACKET 64
+
+
+void sim_host_init(SimHost_t *host, USBSimFpga_t *sim, USBFpga_t *fpga) {
+    memset(host, 0, sizeof(SimHost_t));
+    host->sim = sim;
+    host->fpga = fpga;
+}
+
+void sim_host_set_service(SimHost_t *host, void (*service)(void *context), void *context) {
+    host->service = service;
+    host->context = context;
+}
+
+void sim_host_step(SimHost_t *host) {
+    if (host->fpga) {
+        usb_poll(host->fpga);
+        if (host->service)
+            host->service(host->context);
+        host->polls++;
+    } else {
+        sched_yield();
+    }
+}
+
+static void sim_host_wait(SimHost_t *host, uint64_t start, const char *what) {
+    if (usb_port_time_us() - start > SIM_HOST_TIMEOUT) {
+        printf("sim host: device did not answer %s\n", what);
+        exit(1);
+    }
+    sim_host_step(host);
+}
+
+void sim_host_out(SimHost_t *host, uint8_t endp, const void *data, size_t count) {
+    uint64_t start = usb_port_time_us();
+
+    while (usb_sim_host_out(host->sim, endp, data, count))
+        sim_host_wait(host, start, "an OUT");
+}
+
+int sim_host_in(SimHost_t *host, uint8_t endp, void *data, size_t max) {
+    uint64_t start = usb_port_time_us();
+    int ret;
+
+    while ((ret = usb_sim_host_in(host->sim, endp, data, max)) < 0)
+        sim_host_wait(host, start, "an IN");
+    return ret;
+}
+
+USBCMDs_t sim_host_handshake(SimHost_t *host, uint8_t endp) {
+    uint64_t start = usb_port_time_us();
+    USBCMDs_t cmd;
+
+    while ((cmd = usb_sim_host_take_cmd(host->sim, endp)) == kUSBCMDNone)
+        sim_host_wait(host, start, "the status stage");
+    return cmd;
+}
+
+void sim_host_setup(SimHost_t *host, uint8_t type, uint8_t request, uint16_t value, uint16_t index, uint16_t length) {
+    uint8_t setup[8] = {type, request, value, value >> 8, index, index >> 8, length, length >> 8};
+
+    sim_host_out(host, 0, setup, sizeof(setup));
+}
+
+int sim_host_control_in(SimHost_t *host, uint8_t type, uint8_t request, uint16_t value, uint16_t index, void *data, uint16_t length) {
+    uint8_t packet[CONTROL_PACKET];
+    int received = 0, ret;
+
+    sim_host_setup(host, type, request, value, index, length);
+    do {
+        ret = sim_host_in(host, 0, packet, sizeof(packet));
+        if (ret > length - received)
+            ret = length - received;
+        memcpy((uint8_t *) data + received, packet, ret);
+        received += ret;
+    } while (ret == CONTROL_PACKET && received < length);
+    return received;
+}
+
+//until the device read everything sent on the endpoint
+static void sim_host_drain(SimHost_t *host, uint8_t endp) {
+    uint64_t start = usb_port_time_us();
+    uint16_t pending;
+
+    for (;;) {
+        pthread_mutex_lock(&host->sim->lock);
+        pending = host->sim->endpoints[endp].rx.count;
+        pthread_mutex_unlock(&host->sim->lock);
+        if (!pending)
+            return;
+        sim_host_wait(host, start, "an OUT");
+    }
+}
+
+USBCMDs_t sim_host_control_out(SimHost_t *host, uint8_t type, uint8_t request, uint16_t value, uint16_t index, const void *data, uint16_t length) {
+    uint16_t sent = 0, packet;
+    USBCMDs_t cmd;
+
+    sim_host_setup(host, type, request, value, index, length);
+    while (sent < length) {
+        //a request refused at the setup stalls the data stage
+        sim_host_drain(host, 0);
+        cmd = usb_sim_host_take_cmd(host->sim, 0);
+        if (cmd != kUSBCMDNone)
+            return cmd;
+        packet = length - sent > CONTROL_PACKET ? CONTROL_PACKET : length - sent;
+        sim_host_out(host, 0, (const uint8_t *) data + sent, packet);
+        sent += packet;
+    }
+    return sim_host_handshake(host, 0);
+}
+
+void sim_host_enumerate(SimHost_t *host, uint8_t address) {
+    DeviceDescriptor_t device;
+
+    CHECK(sim_host_control_in(host, 0x80, kRequestGetDescriptor, kDescriptorDevice << 8, 0, &device, sizeof(device)) == sizeof(device));
+    CHECK(device.type == kDescriptorDevice);
+    CHECK(sim_host_control_out(host, 0x00, kRequestSetAddress, address, 0, NULL, 0) == kUSBCMDSend0DataLength);
+    CHECK(sim_host_control_out(host, 0x00, kRequestSetConfiguration, 1, 0, NULL, 0) == kUSBCMDSend0DataLength);
+}
+
+uint32_t sim_host_replay(SimHost_t *host, const CaptureRecord_t *records, size_t count, uint8_t bus) {
+    uint8_t packet[FPGA_ENDP_SIZE];
+    const CaptureRecord_t *record;
+    uint32_t mismatches = 0;
+    uint64_t start;
+    int ret;
+
+    for (size_t i = 0; i < count; i++) {
+        record = &records[i];
+        if (record->bus != bus || record->endp >= FPGA_ENDPOINTS || record->length > sizeof(packet))
+            continue;
+
+        switch (record->type) {
+        case kCaptureUSBSetup:
+            //the status stage of the previous transfer is not in the capture
+            sim_host_drain(host, 0);
+            usb_sim_host_take_cmd(host->sim, 0);
+            sim_host_out(host, 0, record->data, record->length);
+            break;
+
+        case kCaptureUSBOut:
+            if (!record->length)
+                break;
+            memset(packet, 0, record->length);
+            memcpy(packet, record->data, record->length > CAPTURE_DATA_SIZE ? CAPTURE_DATA_SIZE : record->length);
+            //one packet at a time, as on the wire
+            sim_host_drain(host, record->endp);
+            sim_host_out(host, record->endp, packet, record->length);
+            break;
+
+        case kCaptureUSBIn:
+            start = usb_port_time_us();
+            while ((ret = usb_sim_host_in(host->sim, record->endp, packet, sizeof(packet))) < 0 &&
+                   usb_port_time_us() - start < SIM_HOST_REPLAY_WAIT)
+                sim_host_step(host);
+            if (ret != record->length ||
+                memcmp(packet, record->data, record->length > CAPTURE_DATA_SIZE ? CAPTURE_DATA_SIZE : record->length))
+                mismatches++;
+            break;
+
+        default:
+            break;
+        }
+    }
+    return mismatches;
+}
@@ -0,0 +1,52 @@
+
+
+
+#ifndef SIM_HOST_H_
+#define SIM_HOST_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "usb.h"
+#include "usb_transport_sim.h"
+#include "usb_capture.h"
+
+#define SIM_HOST_TIMEOUT (2 * 1000 * 1000) //us a host call waits for the device before the test fails
+#define SIM_HOST_REPLAY_WAIT (100 * 1000) //us a replayed IN waits before it counts as missing
+
+/*The USB host side of a test: transfers against a simulated core, retried
+while the core NAKs. With fpga set the host polls the device itself between
+retries (single threaded tests), with NULL a device task is expected to*/
+typedef struct {
+    USBSimFpga_t *sim;
+    USBFpga_t *fpga;
+    void (*service)(void *context); //rest of the device loop, after each poll
+    void *context;
+    uint32_t polls;
+} SimHost_t;
+
+void sim_host_init(SimHost_t *host, USBSimFpga_t *sim, USBFpga_t *fpga);
+void sim_host_set_service(SimHost_t *host, void (*service)(void *context), void *context);
+void sim_host_step(SimHost_t *host);
+
+void sim_host_out(SimHost_t *host, uint8_t endp, const void *data, size_t count);
+int sim_host_in(SimHost_t *host, uint8_t endp, void *data, size_t max);
+USBCMDs_t sim_host_handshake(SimHost_t *host, uint8_t endp);
+
+void sim_host_setup(SimHost_t *host, uint8_t type, uint8_t request, uint16_t value, uint16_t index, uint16_t length);
+/*Whole control transfers on endpoint 0 with 64 byte packets. In returns the
+bytes of the data stage, out the handshake of the status stage*/
+int sim_host_control_in(SimHost_t *host, uint8_t type, uint8_t request, uint16_t value, uint16_t index, void *data, uint16_t length);
+USBCMDs_t sim_host_control_out(SimHost_t *host, uint8_t type, uint8_t request, uint16_t value, uint16_t index, const void *data, uint16_t length);
+
+/*Device descriptor, address and configuration 1, as a host does on attach*/
+void sim_host_enumerate(SimHost_t *host, uint8_t address);
+
+/*Plays the host side of the USB records of one bus from a capture: setups
+and OUT data are sent, payloads longer than the captured bytes padded with
+zeros, and each IN waits for the device and is compared with the capture.
+Zero length OUTs are dropped, the simulated fifo has no packet boundaries.
+Returns the INs that were missing or differ*/
+uint32_t sim_host_replay(SimHost_t *host, const CaptureRecord_t *records, size_t count, uint8_t bus);
+
+#endif
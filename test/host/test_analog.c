@@ -0,0 +1,248 @@
+#include "check.h"
+#include "analog.h"
+#include "usb_port.h"
+
+#include <endian.h>
+#include <math.h>
+#include <string.h>
+
+/*Analog axis conditioning on the host, with the calibration, shift and
+rates of main.c. Unit checks of the calibration curve, the filter step
+response and chunking, then a sample stream run through the filter in the
+chunks the firmware sees, one per 1 ms report: a synthetic joystick
+recording by default (noisy rest with spikes, a push to the end, a hold and
+a release that rings), or a recorded stream of little endian 16 bit samples
+of one channel given as argument. At rest the reported value must not
+jitter, at the end of travel it must stay within 1% of full*/
+
+#define SHIFT 6 //ANALOG_FILTER_SHIFT
+#define CHANNEL_HZ 10000 //ANALOG_SAMPLE_HZ over two channels
+#define CHUNK (CHANNEL_HZ / 1000) //samples per channel between reports
+#define SETTLE (10 << SHIFT) //samples until a full scale step is within half a count
+#define STREAM_MAX (60 * CHANNEL_HZ)
+#define BENCH_SAMPLES 10000000
+
+static const AnalogCalibration_t g_calibration = {.min = 0, .center = 2048, .max = 4095, .deadzone = 64};
+
+static uint16_t g_stream[STREAM_MAX];
+static uint8_t g_phase[STREAM_MAX]; //what the synthetic stream is doing, kPhaseAny for recordings
+
+typedef enum {
+    kPhaseAny,
+    kPhaseRest,
+    kPhaseFull,
+} Phase_t;
+
+//axis primed straight to a raw value
+static int16_t value_at(uint16_t raw) {
+    AnalogAxis_t axis;
+
+    analog_axis_init(&axis, &g_calibration, SHIFT);
+    analog_axis_filter(&axis, &raw, 1);
+    CHECK(analog_axis_raw(&axis) == raw);
+    return analog_axis_value(&axis);
+}
+
+static void test_calibration(void) {
+    int16_t value, last = -ANALOG_AXIS_MAX;
+
+    CHECK(value_at(g_calibration.min) == -ANALOG_AXIS_MAX);
+    CHECK(value_at(g_calibration.max) == ANALOG_AXIS_MAX);
+    CHECK(value_at(g_calibration.center) == 0);
+    CHECK(value_at(g_calibration.center + g_calibration.deadzone) == 0);
+    CHECK(value_at(g_calibration.center - g_calibration.deadzone) == 0);
+    CHECK(value_at(g_calibration.center + g_calibration.deadzone + 1) == 1);
+    CHECK(value_at(g_calibration.center - g_calibration.deadzone - 1) == -1);
+
+    //monotonic over the whole range, no steps bigger than the scale
+    for (uint32_t raw = 0; raw <= 4095; raw++) {
+        value = value_at(raw);
+        CHECK(value >= last && value - last <= 2);
+        last = value;
+    }
+}
+
+static void test_filter(void) {
+    AnalogAxis_t axis, chunked;
+    uint16_t low = 100, high = 4000, samples[SETTLE];
+    int tau = -1;
+
+    //a step: 63% after about 2^shift samples, the exact value once settled, either way
+    analog_axis_init(&axis, &g_calibration, SHIFT);
+    analog_axis_filter(&axis, &low, 1);
+    for (int i = 0; i < SETTLE; i++) {
+        analog_axis_filter(&axis, &high, 1);
+        if (tau < 0 && analog_axis_raw(&axis) >= low + (high - low) * 0.632)
+            tau = i + 1;
+    }
+    CHECK(tau >= (1 << SHIFT) * 9 / 10 && tau <= (1 << SHIFT) * 11 / 10);
+    CHECK(analog_axis_raw(&axis) == high);
+    for (int i = 0; i < SETTLE; i++)
+        analog_axis_filter(&axis, &low, 1);
+    CHECK(analog_axis_raw(&axis) == low);
+
+    //the chunks the dma hands over don't change the result
+    for (int i = 0; i < SETTLE; i++)
+        samples[i] = (i * 7919) % 4096;
+    analog_axis_init(&axis, &g_calibration, SHIFT);
+    analog_axis_init(&chunked, &g_calibration, SHIFT);
+    analog_axis_filter(&axis, samples, SETTLE);
+    for (int i = 0, n = 1; i < SETTLE; i += n, n = n % 13 + 1)
+        analog_axis_filter(&chunked, samples + i, i + n > SETTLE ? SETTLE - i : n);
+    CHECK(axis.state == chunked.state && chunked.samples == SETTLE);
+}
+
+static uint32_t g_seed = 40;
+
+static double noise(void) {
+    //sum of uniforms, close enough to the adc's gaussian noise
+    double sum = 0;
+
+    for (int i = 0; i < 4; i++) {
+        g_seed = g_seed * 1103515245 + 12345;
+        sum += (g_seed >> 16 & 0x7fff) / 32768.0 - 0.5;
+    }
+    return sum;
+}
+
+static void put(size_t *count, double raw, Phase_t phase) {
+    if (*count >= STREAM_MAX)
+        return;
+    if (raw < 0)
+        raw = 0;
+    if (raw > 4095)
+        raw = 4095;
+    g_phase[*count] = phase;
+    g_stream[(*count)++] = lround(raw);
+}
+
+/*2 s of a stick at 10 kHz: 14 counts rms of noise and a 300 count spike
+every ~50 ms, ramps at the speed of a thumb*/
+static size_t synthetic(void) {
+    size_t count = 0;
+    double t, spike;
+
+    for (int i = 0; i < 2 * CHANNEL_HZ; i++) {
+        t = (double) i / CHANNEL_HZ;
+        spike = i % 487 == 0 ? 300 : 0;
+        if (t < 0.5) {
+            put(&count, 2048 + 24 * noise() + spike, kPhaseRest);
+        } else if (t < 0.7) {
+            put(&count, 2048 + (t - 0.5) / 0.2 * 2300 + 24 * noise() + spike, kPhaseAny);
+        } else if (t < 1.2) {
+            put(&count, 4095 + 24 * noise() - spike, t < 0.75 ? kPhaseAny : kPhaseFull);
+        } else {
+            //released, the spring overshoots and rings down
+            double ring = 2047 * exp(-(t - 1.2) / 0.03) * cos(2 * M_PI * 25 * (t - 1.2));
+            put(&count, 2048 + ring + 24 * noise() + spike, t < 1.5 ? kPhaseAny : kPhaseRest);
+        }
+    }
+    return count;
+}
+
+static size_t recorded(const char *path) {
+    FILE *fd = fopen(path, "rb");
+    size_t count;
+
+    CHECK(fd);
+    count = fread(g_stream, sizeof(uint16_t), STREAM_MAX, fd);
+    fclose(fd);
+    for (size_t i = 0; i < count; i++) {
+        g_stream[i] = le16toh(g_stream[i]) & 0xfff;
+        g_phase[i] = kPhaseAny;
+    }
+    return count;
+}
+
+//the raw deviation from the mean over a phase, before and after the filter
+static void stream_run(size_t count) {
+    AnalogAxis_t axis;
+    int16_t value, rest_value = 0, full_min = ANALOG_AXIS_MAX, full_max = 0;
+    uint32_t reports = 0, settled = 0, rest_changes = 0, rest_reports = 0;
+    double raw_sum = 0, raw_squares = 0, filtered_sum = 0, filtered_squares = 0;
+    int rest_samples = 0;
+
+    analog_axis_init(&axis, &g_calibration, SHIFT);
+    for (size_t i = 0; i < count; i += CHUNK) {
+        size_t n = i + CHUNK > count ? count - i : CHUNK;
+
+        analog_axis_filter(&axis, g_stream + i, n);
+        value = analog_axis_value(&axis);
+        CHECK(value >= -ANALOG_AXIS_MAX && value <= ANALOG_AXIS_MAX);
+        reports++;
+
+        //a phase counts once the filter has had time to settle into it
+        if (i < SETTLE || g_phase[i - SETTLE] != g_phase[i + n - 1])
+            continue;
+        if (g_phase[i] == kPhaseRest) {
+            CHECK(value == 0);
+            for (size_t j = i; j < i + n; j++) {
+                raw_sum += g_stream[j];
+                raw_squares += (double) g_stream[j] * g_stream[j];
+            }
+            filtered_sum += analog_axis_raw(&axis) * n;
+            filtered_squares += (double) analog_axis_raw(&axis) * analog_axis_raw(&axis) * n;
+            rest_samples += n;
+            rest_changes += value != rest_value;
+            rest_reports++;
+            rest_value = value;
+        } else if (g_phase[i] == kPhaseFull) {
+            //noise only pulls down from the rail, close to the end and steady
+            CHECK(value >= ANALOG_AXIS_MAX * 99 / 100);
+            full_min = value < full_min ? value : full_min;
+            full_max = value > full_max ? value : full_max;
+        }
+        settled++;
+    }
+
+    BENCH("stream %.2f s, %u reports, %u in settled phases, %u at rest with %u value changes", (double) count / CHANNEL_HZ,
+          (unsigned) reports, (unsigned) settled, (unsigned) rest_reports, (unsigned) rest_changes);
+    if (full_max)
+        BENCH("at the end of travel: value %i..%i", full_min, full_max);
+    if (rest_samples)
+        BENCH("at rest: raw %.1f counts rms, filtered %.1f counts rms", sqrt(raw_squares / rest_samples - pow(raw_sum / rest_samples, 2)),
+              sqrt(fmax(0, filtered_squares / rest_samples - pow(filtered_sum / rest_samples, 2))));
+}
+
+static void bench(size_t count) {
+    AnalogAxis_t axis;
+    uint64_t start;
+    int32_t sink = 0;
+    size_t done = 0;
+    double filter_ns, value_ns;
+
+    analog_axis_init(&axis, &g_calibration, SHIFT);
+    start = usb_port_time_us();
+    while (done < BENCH_SAMPLES) {
+        for (size_t i = 0; i + CHUNK <= count; i += CHUNK) {
+            analog_axis_filter(&axis, g_stream + i, CHUNK);
+            sink += analog_axis_value(&axis);
+        }
+        done += count - count % CHUNK;
+    }
+    filter_ns = (usb_port_time_us() - start) * 1e3 / done;
+
+    start = usb_port_time_us();
+    for (int i = 0; i < BENCH_SAMPLES / CHUNK; i++) {
+        axis.state = (uint32_t) g_stream[i % count] << ANALOG_FRACTION;
+        sink += analog_axis_value(&axis);
+    }
+    value_ns = (usb_port_time_us() - start) * 1e3 / (BENCH_SAMPLES / CHUNK);
+
+    BENCH("filter %.2f ns per sample in %u sample chunks with a value per chunk, value %.2f ns (sink %i)", filter_ns,
+          CHUNK, value_ns, (int) (sink & 1));
+    BENCH("two axes at %u Hz: %.3f%% of a core", CHANNEL_HZ, 2 * CHANNEL_HZ * filter_ns / 1e7);
+}
+
+int main(int argc, char **argv) {
+    size_t count;
+
+    test_calibration();
+    test_filter();
+
+    count = argc > 1 ? recorded(argv[1]) : synthetic();
+    CHECK(count >= CHUNK);
+    stream_run(count);
+    bench(count);
+    return 0;
+}
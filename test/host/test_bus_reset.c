@@ -0,0 +1,137 @@
+#include "sim_host.h"
+#include "check.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+
+/*Bus reset in the middle of a session: a control data stage and a long IN
+write are cut, and the host sends its next setup right after the reset.
+The poll that sees the reset must also answer that setup, with the device
+back in the default state. Reset-to-ready time is measured over many resets*/
+
+#define RESETS 1000
+#define WRITE_SIZE 4096
+
+static USBSimFpga_t g_sim;
+static USBFpga_t g_fpga;
+static USBDevice_t g_dev;
+static int g_events[3];
+static uint8_t g_report[64];
+static atomic_int g_writer_ret = 1; //1 while the write is in progress
+
+static DeviceDescriptor_t g_device = {
+    .packet_size = 64,
+    .vendor_id = 0x16c0,
+    .product_id = 0x27db,
+};
+static ConfigurationDescriptor_t g_config = {
+    .attributes = kConfigAttributeDefault,
+    .max_power = 50,
+};
+static InterfaceDescriptor_t g_interface = {
+    .class = 3,
+};
+static EndpointDescriptor_t g_endpoint = {
+    .endp_address = 0x81,
+    .attributes = kEndpointAttributeInterrupt,
+    .max_packet_size = 64,
+    .interval = 1,
+};
+
+static int report_received(USBDevice_t *dev, USBControlRequest_t *control, uint8_t *data, uint16_t length) {
+    return 0;
+}
+
+//SET_REPORT takes a data stage, the reset cuts it
+static void class_handler(USBDevice_t *dev, USBControlRequest_t *control, uint16_t chunk_size, uint8_t endp) {
+    if (control->request == 0x09 && !usb_control_receive(dev, control, g_report, sizeof(g_report), report_received))
+        return;
+    usb_control_deny_request(dev, endp);
+}
+
+static void bus_handler(USBFpga_t *fpga, USBBusEvent_t event) {
+    g_events[event]++;
+    usb_bus_event(fpga, event);
+}
+
+//the host stopped reading endpoint 1, this write waits until the reset ends it
+static void *writer_task(void *arg) {
+    static uint8_t data[WRITE_SIZE];
+
+    atomic_store(&g_writer_ret, usb_write_data(&g_fpga, data, sizeof(data), 64, 1));
+    return NULL;
+}
+
+int main(void) {
+    static const uint8_t get_device[8] = {0x80, kRequestGetDescriptor, 0, kDescriptorDevice, 0, 0, sizeof(DeviceDescriptor_t), 0};
+    SimHost_t host;
+    pthread_t writer;
+    uint8_t buffer[64];
+    uint64_t start, took, total = 0, worst = 0, clocks = 0;
+    uint32_t polls, worst_polls = 0;
+
+    usb_sim_init(&g_sim);
+    usb_init(&g_fpga, &g_sim);
+    usb_device_init(&g_dev, &g_fpga, NULL);
+    usb_set_device_descriptor(&g_dev, &g_device);
+    usb_add_configuration_descriptor(&g_dev, &g_config);
+    usb_add_interface_descriptor(&g_dev, &g_interface);
+    usb_add_endppoint_descriptor(&g_dev, &g_endpoint);
+    usb_add_class_control_handler(&g_dev, class_handler);
+    usb_set_endp_handler(&g_fpga, usb_control_endp, 0);
+    usb_set_bus_handler(&g_fpga, bus_handler);
+    sim_host_init(&host, &g_sim, &g_fpga);
+    sim_host_enumerate(&host, 7);
+    CHECK(g_dev.configured);
+
+    //cut a control data stage and a long write
+    sim_host_setup(&host, 0x21, 0x09, 0x0200, 0, sizeof(g_report));
+    sim_host_step(&host);
+    CHECK(g_dev.data_stage.handler);
+    pthread_create(&writer, NULL, writer_task, NULL);
+    while (!g_sim.endpoints[1].tx_used)
+        usleep(1000);
+
+    for (int i = 0; i < RESETS; i++) {
+        if (i)
+            CHECK(sim_host_control_out(&host, 0x00, kRequestSetConfiguration, 1, 0, NULL, 0) == kUSBCMDSend0DataLength);
+
+        polls = host.polls;
+        clocks -= g_sim.clocks;
+        start = usb_port_time_us();
+        usb_sim_host_reset(&g_sim);
+        CHECK(usb_sim_host_out(&g_sim, 0, get_device, sizeof(get_device)) == 0);
+        CHECK(sim_host_in(&host, 0, buffer, sizeof(buffer)) == sizeof(DeviceDescriptor_t));
+        took = usb_port_time_us() - start;
+        clocks += g_sim.clocks;
+        polls = host.polls - polls;
+
+        //one poll: the reset handled, the setup answered, the stack back to default
+        CHECK(polls == 1);
+        CHECK(!memcmp(buffer, &g_device, sizeof(DeviceDescriptor_t)));
+        CHECK(!g_sim.bus_reset);
+        CHECK(g_fpga.address == 0 && !g_dev.configured && !g_dev.data_stage.handler);
+        total += took;
+        if (took > worst)
+            worst = took;
+        if (polls > worst_polls)
+            worst_polls = polls;
+    }
+
+    pthread_join(writer, NULL);
+    CHECK(g_writer_ret == -1);
+    CHECK(g_fpga.bus_resets == RESETS && g_events[kBusReset] == RESETS);
+
+    usb_sim_host_suspend(&g_sim, true);
+    sim_host_step(&host);
+    sim_host_step(&host);
+    usb_sim_host_suspend(&g_sim, false);
+    sim_host_step(&host);
+    CHECK(g_events[kBusSuspend] == 1 && g_events[kBusResume] == 1);
+
+    BENCH("reset to descriptor sent: %.1f us mean, %u us max, %u poll, %.0f spi clocks", (double) total / RESETS,
+          (unsigned) worst, (unsigned) worst_polls, (double) clocks / RESETS);
+    return 0;
+}
@@ -0,0 +1,215 @@
+#include "sim_host.h"
+#include "check.h"
+
+#include <string.h>
+
+/*Capture and replay: a session is recorded on one simulated device, exported
+as pcapng, read back and played against a fresh device, which must answer
+every IN the same way. Malformed files, blocks too big for the reader or
+shorter than their fixed fields, must be refused. Run with a pcapng file as argument it replays that
+file instead, e.g. one taken from the board with the "capture" console
+command, and reports the INs that differ and the time it took*/
+
+#define BULK_ENDP 2
+#define ECHO_ENDP 1
+#define ECHO_SIZE 8
+#define BULK_PACKET 32 //longer than what a record keeps, the replay pads it
+#define PACKETS 8
+
+typedef struct {
+    USBSimFpga_t sim;
+    USBFpga_t fpga;
+    USBDevice_t dev;
+    DeviceDescriptor_t device;
+    ConfigurationDescriptor_t config;
+    InterfaceDescriptor_t interface;
+    EndpointDescriptor_t in_endpoint, out_endpoint;
+    uint32_t bulk_bytes;
+} TestDevice_t;
+
+static TestDevice_t g_recorded, g_replayed;
+static CaptureRecord_t g_records[CAPTURE_RECORDS];
+
+//the first bytes of each bulk packet come back on the interrupt endpoint
+static void bulk_handler(USBFpga_t *fpga, uint8_t endp, uint8_t *buffer, size_t size) {
+    TestDevice_t *test = fpga->endp_context[endp];
+
+    test->bulk_bytes += size;
+    CHECK(!usb_try_write_data(fpga, buffer, ECHO_SIZE, ECHO_ENDP));
+}
+
+static void device_init(TestDevice_t *test) {
+    test->device = (DeviceDescriptor_t) {
+        .packet_size = 64,
+        .vendor_id = 0x16c0,
+        .product_id = 0x27db,
+    };
+    test->config = (ConfigurationDescriptor_t) {
+        .attributes = kConfigAttributeDefault,
+        .max_power = 50,
+    };
+    test->interface = (InterfaceDescriptor_t) {
+        .class = 0xff,
+    };
+    test->in_endpoint = (EndpointDescriptor_t) {
+        .endp_address = 0x80 | ECHO_ENDP,
+        .attributes = kEndpointAttributeInterrupt,
+        .max_packet_size = ECHO_SIZE,
+        .interval = 1,
+    };
+    test->out_endpoint = (EndpointDescriptor_t) {
+        .endp_address = BULK_ENDP,
+        .attributes = kEndpointAttributeBulk,
+        .max_packet_size = 64,
+    };
+
+    usb_sim_init(&test->sim);
+    usb_init(&test->fpga, &test->sim);
+    usb_device_init(&test->dev, &test->fpga, NULL);
+    usb_set_device_descriptor(&test->dev, &test->device);
+    usb_add_configuration_descriptor(&test->dev, &test->config);
+    usb_add_interface_descriptor(&test->dev, &test->interface);
+    usb_add_endppoint_descriptor(&test->dev, &test->in_endpoint);
+    usb_add_endppoint_descriptor(&test->dev, &test->out_endpoint);
+    usb_set_endp_handler(&test->fpga, usb_control_endp, 0);
+    usb_set_endp_handler(&test->fpga, bulk_handler, BULK_ENDP);
+    test->fpga.endp_context[BULK_ENDP] = test;
+}
+
+static uint64_t session_span(const CaptureRecord_t *records, int count) {
+    return count ? records[count - 1].timestamp - records[0].timestamp : 0;
+}
+
+static int replay_file(const char *path) {
+    SimHost_t host;
+    FILE *fd = fopen(path, "rb");
+    uint64_t start, took;
+    uint32_t mismatches;
+    int count;
+
+    if (!fd) {
+        printf("Can't open %s\n", path);
+        return 1;
+    }
+    count = usb_capture_import_pcapng(fd, g_records, CAPTURE_RECORDS);
+    fclose(fd);
+    if (count < 0) {
+        printf("%s is not a capture exported by the firmware\n", path);
+        return 1;
+    }
+
+    device_init(&g_replayed);
+    sim_host_init(&host, &g_replayed.sim, &g_replayed.fpga);
+    start = usb_port_time_us();
+    mismatches = sim_host_replay(&host, g_records, count, 0);
+    took = usb_port_time_us() - start;
+    printf("%i records, %u INs differ, captured over %u us, replayed in %u us and %u polls\n", count,
+           (unsigned) mismatches, (unsigned) session_span(g_records, count), (unsigned) took, (unsigned) host.polls);
+    return 0;
+}
+
+//a pcapng block with a body of size bytes, the body zero past what is given
+static void write_block(FILE *fd, uint32_t type, const void *body, size_t given, uint32_t size) {
+    uint32_t total = size + 12;
+    uint8_t padded[256] = {0};
+
+    memcpy(padded, body, given);
+    fwrite(&type, sizeof(type), 1, fd);
+    fwrite(&total, sizeof(total), 1, fd);
+    fwrite(padded, size, 1, fd);
+    fwrite(&total, sizeof(total), 1, fd);
+}
+
+//a section with one usbmon interface, then a block that is the only thing that changes
+static int import_with(uint32_t type, uint32_t size) {
+    static const uint32_t shb[4] = {0x1A2B3C4D, 1, 0xffffffff, 0xffffffff};
+    static const uint32_t idb[2] = {220, 0};
+    FILE *fd = tmpfile();
+    int count;
+
+    CHECK(fd);
+    write_block(fd, 0x0A0D0D0A, shb, sizeof(shb), sizeof(shb));
+    write_block(fd, 0x00000001, idb, sizeof(idb), sizeof(idb));
+    write_block(fd, type, NULL, 0, size);
+    rewind(fd);
+    count = usb_capture_import_pcapng(fd, g_records, CAPTURE_RECORDS);
+    fclose(fd);
+    return count;
+}
+
+static void test_malformed(void) {
+    //blocks of types the reader skips, up to the biggest one it takes
+    CHECK(import_with(0x00000004, 0) == 0);
+    CHECK(import_with(0x00000004, 128) == 0);
+    CHECK(import_with(0x00000004, 132) == -1);
+    CHECK(import_with(0x00000004, 240) == -1);
+    //the fields read out of a section, an interface and a packet must be there
+    CHECK(import_with(0x0A0D0D0A, 0) == -1);
+    CHECK(import_with(0x00000001, 0) == -1);
+    CHECK(import_with(0x00000006, 0) == -1);
+    CHECK(import_with(0x00000006, 4) == -1);
+}
+
+int main(int argc, char **argv) {
+    SimHost_t host;
+    uint8_t packet[BULK_PACKET], buffer[255];
+    uint32_t setups = 0, ins = 0, outs = 0;
+    uint64_t start, took;
+    FILE *fd;
+    int count;
+
+    if (argc > 1)
+        return replay_file(argv[1]);
+    test_malformed();
+
+    //the session: enumeration, the whole configuration and bulk packets echoed back
+    device_init(&g_recorded);
+    sim_host_init(&host, &g_recorded.sim, &g_recorded.fpga);
+    usb_capture_clear();
+    usb_capture_start();
+    sim_host_enumerate(&host, 5);
+    CHECK(sim_host_control_in(&host, 0x80, kRequestGetDescriptor, kDescriptorConfiguration << 8, 0, buffer, sizeof(buffer)) > 0);
+    for (int i = 0; i < PACKETS; i++) {
+        for (int j = 0; j < BULK_PACKET; j++)
+            packet[j] = i * BULK_PACKET + j;
+        sim_host_out(&host, BULK_ENDP, packet, sizeof(packet));
+        CHECK(sim_host_in(&host, ECHO_ENDP, buffer, sizeof(buffer)) == ECHO_SIZE);
+        CHECK(!memcmp(buffer, packet, ECHO_SIZE));
+    }
+    usb_capture_stop();
+
+    fd = tmpfile();
+    CHECK(fd);
+    CHECK(!usb_capture_export_pcapng(fd));
+    rewind(fd);
+    count = usb_capture_import_pcapng(fd, g_records, CAPTURE_RECORDS);
+    fclose(fd);
+
+    //nothing lost to the ring wrapping, the first packet is the first setup
+    CHECK(count > 0 && count < CAPTURE_RECORDS);
+    for (int i = 0; i < count; i++) {
+        if (g_records[i].type == kCaptureUSBSetup && !setups++)
+            CHECK(g_records[i].data[1] == kRequestGetDescriptor && g_records[i].data[3] == kDescriptorDevice);
+        CHECK(setups || g_records[i].type == kCaptureSPIRead || g_records[i].type == kCaptureSPIWrite);
+        ins += g_records[i].type == kCaptureUSBIn;
+        if (g_records[i].type == kCaptureUSBOut && g_records[i].endp == BULK_ENDP) {
+            CHECK(g_records[i].length == BULK_PACKET);
+            outs++;
+        }
+    }
+    CHECK(setups == 4 && outs == PACKETS);
+
+    //played on a fresh device it goes the same way
+    device_init(&g_replayed);
+    sim_host_init(&host, &g_replayed.sim, &g_replayed.fpga);
+    start = usb_port_time_us();
+    CHECK(sim_host_replay(&host, g_records, count, 0) == 0);
+    took = usb_port_time_us() - start;
+    CHECK(g_replayed.dev.configured && g_replayed.fpga.address == 5);
+    CHECK(g_replayed.bulk_bytes == g_recorded.bulk_bytes);
+
+    BENCH("%i records, %u setups, %u INs, %u bulk OUTs", count, (unsigned) setups, (unsigned) ins, (unsigned) outs);
+    BENCH("session captured over %u us, replayed in %u us and %u polls", (unsigned) session_span(g_records, count),
+          (unsigned) took, (unsigned) host.polls);
+    return 0;
+}
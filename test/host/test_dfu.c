@@ -0,0 +1,210 @@
+#include "sim_host.h"
+#include "check.h"
+#include "usb_dfu.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+/*DFU download against the simulated core and a RAM flash that takes as long
+as the esp flash to erase and program a block. The writer runs on its own
+thread like the firmware's dfu task. First the flash is held so both
+buffers fill and the host gets DnBusy, then a whole image goes through and
+its throughput is reported*/
+
+#define IMAGE_SIZE (128 * 1024)
+#define FLASH_BLOCK_US 25000 //erase and program of 4 KiB
+#define DFU_INTERFACE 1
+
+typedef struct {
+    uint8_t data[IMAGE_SIZE];
+    uint32_t written; //next offset the writer must program
+    uint32_t begins, ends;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool held; //writes wait until released
+} RamFlash_t;
+
+static USBSimFpga_t g_sim;
+static USBFpga_t g_fpga;
+static USBDevice_t g_dev;
+static USBDFU_t g_dfu;
+static RamFlash_t g_flash = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+static uint8_t g_image[IMAGE_SIZE];
+
+static DeviceDescriptor_t g_device = {
+    .packet_size = 64,
+    .vendor_id = 0x16c0,
+    .product_id = 0x27db,
+};
+static ConfigurationDescriptor_t g_config = {
+    .attributes = kConfigAttributeDefault,
+    .max_power = 50,
+};
+static InterfaceDescriptor_t g_interface = {
+    .class = 3,
+};
+
+static int flash_begin(void *context) {
+    RamFlash_t *flash = context;
+
+    memset(flash->data, 0xff, sizeof(flash->data));
+    flash->written = 0;
+    flash->begins++;
+    return 0;
+}
+
+static int flash_write(void *context, uint32_t offset, const uint8_t *data, size_t length) {
+    RamFlash_t *flash = context;
+
+    pthread_mutex_lock(&flash->lock);
+    while (flash->held)
+        pthread_cond_wait(&flash->cond, &flash->lock);
+    pthread_mutex_unlock(&flash->lock);
+
+    usleep(FLASH_BLOCK_US * length / DFU_TRANSFER_SIZE);
+    if (offset != flash->written || offset + length > sizeof(flash->data))
+        return -1;
+    memcpy(flash->data + offset, data, length);
+    flash->written += length;
+    return 0;
+}
+
+static int flash_end(void *context) {
+    RamFlash_t *flash = context;
+
+    flash->ends++;
+    return flash->written == IMAGE_SIZE && !memcmp(flash->data, g_image, IMAGE_SIZE) ? 0 : -1;
+}
+
+static const DFUFlashOps_t g_flash_ops = {
+    .begin = flash_begin,
+    .write = flash_write,
+    .end = flash_end,
+};
+
+static void flash_hold(bool held) {
+    pthread_mutex_lock(&g_flash.lock);
+    g_flash.held = held;
+    pthread_cond_broadcast(&g_flash.cond);
+    pthread_mutex_unlock(&g_flash.lock);
+}
+
+static void *writer_task(void *arg) {
+    while (1)
+        usb_dfu_write_next(&g_dfu);
+    return NULL;
+}
+
+//keeps the device polled for the time the host was told to wait
+static void host_wait_ms(SimHost_t *host, uint32_t ms) {
+    uint64_t until = usb_port_time_us() + ms * 1000;
+
+    while (usb_port_time_us() < until) {
+        sim_host_step(host);
+        usleep(100);
+    }
+}
+
+static void get_status(SimHost_t *host, DFUStatusReply_t *status) {
+    CHECK(sim_host_control_in(host, 0xa1, kDFURequestGetStatus, 0, 0, status, sizeof(*status)) == sizeof(*status));
+}
+
+static uint32_t poll_timeout(DFUStatusReply_t *status) {
+    return status->poll_timeout[0] | (status->poll_timeout[1] << 8) | (status->poll_timeout[2] << 16);
+}
+
+static USBCMDs_t download(SimHost_t *host, uint16_t block, const uint8_t *data, uint16_t length) {
+    return sim_host_control_out(host, 0x21, kDFURequestDnload, block, 0, data, length);
+}
+
+/*GET_STATUS until the device leaves DnBusy, as dfu-util does. Returns the busy replies*/
+static uint32_t wait_idle(SimHost_t *host) {
+    DFUStatusReply_t status;
+    uint32_t busy = 0;
+
+    for (;;) {
+        get_status(host, &status);
+        if (status.state != kDFUStateDnbusy)
+            break;
+        CHECK(poll_timeout(&status) > 0);
+        busy++;
+        host_wait_ms(host, poll_timeout(&status));
+    }
+    CHECK(status.state == kDFUStateDnloadIdle && status.status == kDFUStatusOk);
+    return busy;
+}
+
+int main(void) {
+    SimHost_t host;
+    DFUStatusReply_t status;
+    pthread_t writer;
+    uint32_t busy = 0;
+    uint16_t block = 0;
+    uint64_t start, elapsed;
+
+    srand(3);
+    for (int i = 0; i < IMAGE_SIZE; i++)
+        g_image[i] = rand();
+
+    usb_sim_init(&g_sim);
+    usb_init(&g_fpga, &g_sim);
+    usb_device_init(&g_dev, &g_fpga, NULL);
+    usb_set_device_descriptor(&g_dev, &g_device);
+    usb_add_configuration_descriptor(&g_dev, &g_config);
+    usb_add_interface_descriptor(&g_dev, &g_interface);
+    usb_dfu_init(&g_dfu, &g_dev, DFU_INTERFACE, &g_flash_ops, &g_flash);
+    usb_set_endp_handler(&g_fpga, usb_control_endp, 0);
+    sim_host_init(&host, &g_sim, &g_fpga);
+    pthread_create(&writer, NULL, writer_task, NULL);
+    sim_host_enumerate(&host, 4);
+
+    //the application interface refuses downloads until the host detaches it
+    CHECK(sim_host_control_out(&host, 0x21, kDFURequestDnload, 0, DFU_INTERFACE, g_image, 64) == kUSBCMDSendStall);
+    CHECK(sim_host_control_out(&host, 0x21, kDFURequestDetach, 1000, DFU_INTERFACE, NULL, 0) == kUSBCMDSend0DataLength);
+    sim_host_enumerate(&host, 4);
+    get_status(&host, &status);
+    CHECK(status.state == kDFUStateIdle);
+
+    //flash held: the first block is being written, the second waits, both buffers are taken
+    flash_hold(true);
+    for (; block < DFU_BUFFERS; block++) {
+        CHECK(download(&host, block, g_image + block * DFU_TRANSFER_SIZE, DFU_TRANSFER_SIZE) == kUSBCMDSend0DataLength);
+        if (block < DFU_BUFFERS - 1)
+            CHECK(wait_idle(&host) == 0);
+    }
+    get_status(&host, &status);
+    CHECK(status.state == kDFUStateDnbusy && poll_timeout(&status) > 0);
+    CHECK(g_dfu.head - g_dfu.tail == DFU_BUFFERS);
+    //still busy while the flash is held, the host keeps asking
+    host_wait_ms(&host, poll_timeout(&status));
+    get_status(&host, &status);
+    CHECK(status.state == kDFUStateDnbusy);
+    flash_hold(false);
+    busy += wait_idle(&host);
+
+    //the rest of the image at flash speed
+    start = usb_port_time_us();
+    for (; block < IMAGE_SIZE / DFU_TRANSFER_SIZE; block++) {
+        CHECK(download(&host, block, g_image + block * DFU_TRANSFER_SIZE, DFU_TRANSFER_SIZE) == kUSBCMDSend0DataLength);
+        busy += wait_idle(&host);
+    }
+    CHECK(download(&host, block, NULL, 0) == kUSBCMDSend0DataLength);
+    do {
+        get_status(&host, &status);
+        if (status.state == kDFUStateManifest)
+            host_wait_ms(&host, poll_timeout(&status));
+    } while (status.state == kDFUStateManifest || status.state == kDFUStateManifestSync);
+    elapsed = usb_port_time_us() - start;
+
+    CHECK(status.state == kDFUStateIdle && status.status == kDFUStatusOk);
+    CHECK(usb_dfu_manifested(&g_dfu));
+    CHECK(g_flash.begins == 1 && g_flash.ends == 1);
+    CHECK(!memcmp(g_flash.data, g_image, IMAGE_SIZE));
+    CHECK(g_dfu.blocks_written == IMAGE_SIZE / DFU_TRANSFER_SIZE);
+
+    BENCH("%u KiB image in %.2f s: %.0f KiB/s, flash alone %.0f KiB/s", IMAGE_SIZE / 1024, elapsed / 1e6,
+          (IMAGE_SIZE - DFU_BUFFERS * DFU_TRANSFER_SIZE) / 1024.0 / (elapsed / 1e6), DFU_TRANSFER_SIZE / 1024.0 / (FLASH_BLOCK_US / 1e6));
+    BENCH("%u DnBusy replies, %u seen by the host after a wait", (unsigned) g_dfu.busy_replies, (unsigned) busy);
+    return 0;
+}
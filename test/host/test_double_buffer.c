@@ -0,0 +1,105 @@
+#include "sim_host.h"
+#include "check.h"
+
+#include <string.h>
+
+/*Single against double buffered IN writes on the simulated core, in virtual
+time: the spi side costs the clocks the simulator counts at a given spi
+clock, the wire takes WIRE_US per full speed packet and frees the fifo slot
+when the host has the packet, and a writer that finds the fifo busy sleeps
+one tick as usb_internal_wait_tx does. Reports the throughput for the spi
+clock main.c uses and faster ones, with the 100 Hz tick of the sdkconfigs
+and a 1 kHz one*/
+
+#define ENDP 1
+#define PACKET 64
+#define PACKETS 1024 //64 KiB
+#define WIRE_US 50.0 //64 byte bulk packet at full speed with token and handshake
+
+typedef struct {
+    USBSimFpga_t sim;
+    USBFpga_t fpga;
+    double now; //us, the writer's time
+    double wire_free; //when the wire is done with the packet on it
+    double ready[SIM_TX_SLOTS]; //when each queued packet was fully written
+    int head, used;
+    uint32_t received, waits;
+} Bench_t;
+
+static Bench_t g_bench;
+
+//the host takes every packet it is done with by the time the writer looks again
+static void host_until(Bench_t *bench, double until) {
+    uint8_t packet[PACKET];
+    uint32_t sequence;
+    double start;
+
+    while (bench->used) {
+        start = bench->ready[bench->head] > bench->wire_free ? bench->ready[bench->head] : bench->wire_free;
+        if (start + WIRE_US > until)
+            return;
+        CHECK(usb_sim_host_in(&bench->sim, ENDP, packet, sizeof(packet)) == PACKET);
+        memcpy(&sequence, packet, sizeof(sequence));
+        CHECK(sequence == bench->received++);
+        bench->wire_free = start + WIRE_US;
+        bench->head = (bench->head + 1) % SIM_TX_SLOTS;
+        bench->used--;
+    }
+}
+
+/*Returns the us until the host has the last packet*/
+static double run(bool double_buffer, double spi_mhz, uint32_t tick_us) {
+    Bench_t *bench = &g_bench;
+    uint8_t packet[PACKET] = {0};
+    uint64_t clocks;
+    int ret;
+
+    memset(bench, 0, sizeof(Bench_t));
+    usb_sim_init(&bench->sim);
+    usb_init(&bench->fpga, &bench->sim);
+    usb_set_endp_schedule(&bench->fpga, ENDP, kEndpTypeBulk, 0, PACKET);
+    usb_set_endp_double_buffer(&bench->fpga, ENDP, double_buffer);
+    usb_poll(&bench->fpga);
+
+    for (uint32_t sequence = 0; sequence < PACKETS;) {
+        host_until(bench, bench->now);
+        memcpy(packet, &sequence, sizeof(sequence));
+
+        clocks = bench->sim.clocks;
+        ret = usb_try_write_data(&bench->fpga, packet, sizeof(packet), ENDP);
+        bench->now += (bench->sim.clocks - clocks) / spi_mhz;
+        if (ret == -2) {
+            bench->now += tick_us;
+            bench->waits++;
+            continue;
+        }
+        CHECK(!ret);
+        bench->ready[(bench->head + bench->used) % SIM_TX_SLOTS] = bench->now;
+        bench->used++;
+        sequence++;
+    }
+    host_until(bench, 1e18);
+    CHECK(bench->received == PACKETS);
+    return bench->wire_free;
+}
+
+int main(void) {
+    static const double clocks_mhz[] = {1, 10, 40};
+    static const uint32_t ticks_us[] = {10000, 1000};
+    double single, dual;
+    uint32_t single_waits;
+
+    for (int i = 0; i < sizeof(clocks_mhz) / sizeof(clocks_mhz[0]); i++) {
+        for (int j = 0; j < sizeof(ticks_us) / sizeof(ticks_us[0]); j++) {
+            single = run(false, clocks_mhz[i], ticks_us[j]);
+            single_waits = g_bench.waits;
+            dual = run(true, clocks_mhz[i], ticks_us[j]);
+            CHECK(dual <= single);
+            BENCH("spi %2.0f MHz, tick %5u us: single %7.1f KiB/s (%u sleeps), double %7.1f KiB/s (%u sleeps), x%.2f",
+                  clocks_mhz[i], (unsigned) ticks_us[j], PACKETS * PACKET / 1024.0 / (single / 1e6), (unsigned) single_waits,
+                  PACKETS * PACKET / 1024.0 / (dual / 1e6), (unsigned) g_bench.waits, single / dual);
+        }
+    }
+    BENCH("wire limit %.1f KiB/s", PACKET / 1024.0 / (WIRE_US / 1e6));
+    return 0;
+}
@@ -0,0 +1,95 @@
+#include "sim_host.h"
+#include "check.h"
+
+#include <string.h>
+
+/*Enumeration of a one interface device against the simulated core, the
+way a host does it after attach*/
+
+static USBSimFpga_t g_sim;
+static USBFpga_t g_fpga;
+static USBDevice_t g_dev;
+static int g_class_requests;
+
+static DeviceDescriptor_t g_device = {
+    .packet_size = 64,
+    .vendor_id = 0x16c0,
+    .product_id = 0x27db,
+};
+static ConfigurationDescriptor_t g_config = {
+    .attributes = kConfigAttributeDefault,
+    .max_power = 50,
+};
+static InterfaceDescriptor_t g_interface = {
+    .class = 3,
+};
+static EndpointDescriptor_t g_endpoint = {
+    .endp_address = 0x81,
+    .attributes = kEndpointAttributeInterrupt,
+    .max_packet_size = 8,
+    .interval = 10,
+};
+static uint8_t g_class_descriptor[] = {9, 0x21, 0x11, 0x01, 0, 1, 0x22, 38, 0};
+
+static void class_handler(USBDevice_t *dev, USBControlRequest_t *control, uint16_t chunk_size, uint8_t endp) {
+    g_class_requests++;
+    usb_control_accept_request(dev, endp);
+}
+
+int main(void) {
+    SimHost_t host;
+    uint8_t buffer[256];
+    ConfigurationDescriptor_t *config = (ConfigurationDescriptor_t *) buffer;
+    InterfaceDescriptor_t *interface;
+    EndpointDescriptor_t *endpoint;
+    uint16_t total;
+
+    usb_sim_init(&g_sim);
+    usb_init(&g_fpga, &g_sim);
+    usb_device_init(&g_dev, &g_fpga, NULL);
+    usb_set_device_descriptor(&g_dev, &g_device);
+    usb_add_configuration_descriptor(&g_dev, &g_config);
+    usb_add_interface_descriptor(&g_dev, &g_interface);
+    usb_add_class_descriptor(&g_dev, g_class_descriptor, sizeof(g_class_descriptor));
+    usb_add_endppoint_descriptor(&g_dev, &g_endpoint);
+    usb_add_class_control_handler(&g_dev, class_handler);
+    usb_set_endp_handler(&g_fpga, usb_control_endp, 0);
+    sim_host_init(&host, &g_sim, &g_fpga);
+
+    //device descriptor, first with the 8 bytes a host asks for before the address
+    CHECK(sim_host_control_in(&host, 0x80, kRequestGetDescriptor, kDescriptorDevice << 8, 0, buffer, 8) == 8);
+    CHECK(buffer[7] == 64);
+    CHECK(sim_host_control_in(&host, 0x80, kRequestGetDescriptor, kDescriptorDevice << 8, 0, buffer, 255) == sizeof(DeviceDescriptor_t));
+    CHECK(!memcmp(buffer, &g_device, sizeof(DeviceDescriptor_t)));
+    CHECK(((DeviceDescriptor_t *) buffer)->configurations == 1);
+
+    CHECK(sim_host_control_out(&host, 0x00, kRequestSetAddress, 9, 0, NULL, 0) == kUSBCMDSend0DataLength);
+    CHECK(g_fpga.address == 9);
+    CHECK(g_sim.address == 9);
+
+    //configuration header, then the whole tree it announces
+    CHECK(sim_host_control_in(&host, 0x80, kRequestGetDescriptor, kDescriptorConfiguration << 8, 0, buffer, 9) == 9);
+    total = config->total_length;
+    CHECK(total == sizeof(ConfigurationDescriptor_t) + sizeof(InterfaceDescriptor_t) + sizeof(g_class_descriptor) + sizeof(EndpointDescriptor_t));
+    CHECK(sim_host_control_in(&host, 0x80, kRequestGetDescriptor, kDescriptorConfiguration << 8, 0, buffer, sizeof(buffer)) == total);
+    CHECK(config->interfaces_count == 1);
+    interface = (InterfaceDescriptor_t *) (buffer + sizeof(ConfigurationDescriptor_t));
+    CHECK(interface->type == kDescriptorInterface && interface->class == 3 && interface->endpoints_count == 1);
+    CHECK(!memcmp(buffer + sizeof(ConfigurationDescriptor_t) + sizeof(InterfaceDescriptor_t), g_class_descriptor, sizeof(g_class_descriptor)));
+    endpoint = (EndpointDescriptor_t *) (buffer + total - sizeof(EndpointDescriptor_t));
+    CHECK(endpoint->type == kDescriptorEnpoint && endpoint->endp_address == 0x81 && endpoint->max_packet_size == 8);
+
+    CHECK(!g_dev.configured);
+    CHECK(sim_host_control_out(&host, 0x00, kRequestSetConfiguration, 1, 0, NULL, 0) == kUSBCMDSend0DataLength);
+    CHECK(g_dev.configured);
+
+    //class requests reach the interface handler, unknown ones stall
+    CHECK(sim_host_control_out(&host, 0x21, 0x0a, 0, 0, NULL, 0) == kUSBCMDSend0DataLength);
+    CHECK(g_class_requests == 1);
+    CHECK(sim_host_control_out(&host, 0x00, kRequestSetConfiguration, 2, 0, NULL, 0) == kUSBCMDSendStall);
+    CHECK(sim_host_control_out(&host, 0x01, kRequestSetInterface, 1, 0, NULL, 0) == kUSBCMDSendStall);
+    CHECK(g_dev.configured);
+
+    printf("enumerated in %u polls, %u spi transactions\n", (unsigned) host.polls, (unsigned) g_sim.transactions);
+    return 0;
+}
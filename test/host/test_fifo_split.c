@@ -0,0 +1,136 @@
+#include "sim_host.h"
+#include "check.h"
+
+#include <string.h>
+
+/*Fifo split against the simulated core's memory. A keyboard with a CDC
+and a mass storage interface: control, an 8 byte interrupt IN and two 64
+byte bulk endpoints. On a core that answers the capability query every
+endpoint gets USB_FIFO_PACKETS packets and the bulk ones share the rest in
+whole packets, within the memory; a bigger alternate setting resplits
+shrinking first. A small core leaves nothing to share, one without room
+for the layout gets a packet per endpoint and shares the rest, one too
+small even for that leaves the last endpoint out and says so in
+fifo_missing, and one without the query (magic 0) keeps the fixed
+FPGA_ENDP_SIZE fifos. The host streams OUT packets until
+the core NAKs and the device must get them all*/
+
+#define KEY_ENDP 1
+#define CDC_ENDP 2
+#define MSC_ENDP 3
+#define KEY_PACKET 8
+#define BULK_PACKET 64
+
+static USBSimFpga_t g_sim;
+static USBFpga_t g_fpga;
+static uint32_t g_received[FPGA_ENDPOINTS];
+
+static void bulk_handler(USBFpga_t *fpga, uint8_t endp, uint8_t *buffer, size_t size) {
+    g_received[endp] += size;
+}
+
+static void device_init(uint8_t endpoints, uint16_t fifo_memory) {
+    usb_sim_init(&g_sim);
+    usb_sim_set_caps(&g_sim, endpoints, fifo_memory);
+    usb_init(&g_fpga, &g_sim);
+    usb_set_endp_schedule(&g_fpga, KEY_ENDP, kEndpTypeInterrupt, 1000, KEY_PACKET);
+    usb_set_endp_schedule(&g_fpga, CDC_ENDP, kEndpTypeBulk, 0, BULK_PACKET);
+    usb_set_endp_schedule(&g_fpga, MSC_ENDP, kEndpTypeBulk, 0, BULK_PACKET);
+    usb_set_endp_handler(&g_fpga, bulk_handler, CDC_ENDP);
+    usb_set_endp_handler(&g_fpga, bulk_handler, MSC_ENDP);
+    usb_poll(&g_fpga);
+}
+
+//the stack and the core agree, and the core holds no more than its memory
+static uint32_t check_sizes(void) {
+    uint32_t used = 0;
+
+    for (int i = 0; i < FPGA_ENDPOINTS; i++) {
+        CHECK(g_fpga.fifo_size[i] == g_sim.endpoints[i].fifo_size);
+        used += 2 * g_sim.endpoints[i].fifo_size;
+    }
+    if (g_sim.caps.magic == FPGA_CAPS_MAGIC)
+        CHECK(used <= g_sim.caps.fifo_memory);
+    return used;
+}
+
+//OUT packets the host gets in before a NAK, all of them delivered after
+static int stream(uint8_t endp) {
+    uint8_t packet[BULK_PACKET] = {0};
+    int packets = 0;
+
+    g_received[endp] = 0;
+    while (!usb_sim_host_out(&g_sim, endp, packet, sizeof(packet)))
+        packets++;
+    for (int i = 0; i < 2 * packets + 2; i++)
+        usb_poll(&g_fpga);
+    CHECK(g_received[endp] == packets * BULK_PACKET);
+    return packets;
+}
+
+static void report(const char *name) {
+    uint32_t used = check_sizes();
+
+    BENCH("%-10s fifos %4u %4u %4u %4u %4u, %5u of %5u bytes, bulk OUT takes %2i packets ahead", name,
+          g_fpga.fifo_size[0], g_fpga.fifo_size[1], g_fpga.fifo_size[2], g_fpga.fifo_size[3], g_fpga.fifo_size[4],
+          (unsigned) used, g_sim.caps.magic ? g_sim.caps.fifo_memory : FPGA_ENDPOINTS * 2 * FPGA_ENDP_SIZE, stream(CDC_ENDP));
+}
+
+int main(void) {
+    uint32_t fixed = USB_FIFO_PACKETS * (USB_CONTROL_PACKET + KEY_PACKET + 2 * BULK_PACKET);
+    uint16_t share;
+
+    //the full core: the bulk endpoints split what the others leave, capped at FPGA_FIFO_MAX
+    device_init(FPGA_ENDPOINTS, SIM_FIFO_MEMORY);
+    CHECK(!g_fpga.fifo_dirty);
+    CHECK(g_fpga.fifo_size[0] == USB_FIFO_PACKETS * USB_CONTROL_PACKET);
+    CHECK(g_fpga.fifo_size[KEY_ENDP] == USB_FIFO_PACKETS * KEY_PACKET);
+    CHECK(g_fpga.fifo_size[CDC_ENDP] == g_fpga.fifo_size[MSC_ENDP]);
+    share = USB_FIFO_PACKETS * BULK_PACKET + (SIM_FIFO_MEMORY - 2 * fixed) / 2 / 2;
+    if (share > FPGA_FIFO_MAX)
+        share = FPGA_FIFO_MAX;
+    CHECK(g_fpga.fifo_size[CDC_ENDP] == share - share % BULK_PACKET);
+    CHECK(g_fpga.fifo_size[4] == 0);
+    report("full");
+    CHECK(stream(MSC_ENDP) == g_fpga.fifo_size[MSC_ENDP] / BULK_PACKET);
+
+    //an alternate setting with a bigger interrupt packet: the bulk fifos give the room back first
+    usb_set_endp_schedule(&g_fpga, KEY_ENDP, kEndpTypeInterrupt, 1000, BULK_PACKET);
+    CHECK(g_fpga.fifo_dirty);
+    usb_poll(&g_fpga);
+    CHECK(!g_fpga.fifo_dirty && g_fpga.fifo_size[KEY_ENDP] == USB_FIFO_PACKETS * BULK_PACKET);
+    report("alternate");
+
+    //little memory: the share rounds down to whole packets, the fifth endpoint is not there
+    device_init(4, 1024);
+    CHECK(g_fpga.fifo_size[CDC_ENDP] == USB_FIFO_PACKETS * BULK_PACKET);
+    CHECK(g_fpga.fifo_size[4] == 0);
+    report("small");
+    CHECK(stream(MSC_ENDP) == USB_FIFO_PACKETS);
+
+    //not enough for the layout: single buffered, what that frees goes to the bulk endpoints
+    device_init(FPGA_ENDPOINTS, 2 * fixed - 2);
+    CHECK(!g_fpga.fifo_missing);
+    CHECK(g_fpga.fifo_size[0] == USB_CONTROL_PACKET && g_fpga.fifo_size[KEY_ENDP] == KEY_PACKET);
+    share = BULK_PACKET + (2 * fixed - 2 - fixed) / 2 / 2;
+    CHECK(g_fpga.fifo_size[CDC_ENDP] == share - share % BULK_PACKET && g_fpga.fifo_size[MSC_ENDP] == g_fpga.fifo_size[CDC_ENDP]);
+    report("single");
+    CHECK(stream(MSC_ENDP) == g_fpga.fifo_size[MSC_ENDP] / BULK_PACKET);
+
+    //not even a packet each: the last endpoint goes without and is flagged, the others work
+    device_init(FPGA_ENDPOINTS, fixed - 2 * BULK_PACKET);
+    CHECK(g_fpga.fifo_missing == 1 << MSC_ENDP);
+    CHECK(g_fpga.fifo_size[CDC_ENDP] == BULK_PACKET && g_fpga.fifo_size[MSC_ENDP] == 0);
+    report("too small");
+
+    //no capability query: fixed fifos, never resplit
+    device_init(FPGA_ENDPOINTS, 0);
+    CHECK(g_fpga.caps.magic == 0 && !g_fpga.fifo_dirty);
+    for (int i = 0; i < FPGA_ENDPOINTS; i++)
+        CHECK(g_fpga.fifo_size[i] == FPGA_ENDP_SIZE);
+    usb_set_endp_schedule(&g_fpga, KEY_ENDP, kEndpTypeInterrupt, 1000, BULK_PACKET);
+    CHECK(!g_fpga.fifo_dirty);
+    report("no caps");
+    CHECK(stream(MSC_ENDP) == FPGA_ENDP_SIZE / BULK_PACKET);
+    return 0;
+}
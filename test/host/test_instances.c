@@ -0,0 +1,161 @@
+#include "sim_host.h"
+#include "check.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+
+/*Several cores at once, as a board with more than one keyboard: each
+instance has its own simulated core, device and thread playing host and
+device loop. Every instance must only ever see its own traffic, answer with
+its own descriptors and address, and tag its captures with its own bus*/
+
+#define INSTANCES 3
+#define ROUNDS 2000
+#define ECHO_ENDP 1
+#define BULK_ENDP 2
+#define ECHO_SIZE 8
+#define BULK_PACKET 64
+#define DESCRIPTOR_EVERY 64 //rounds between control transfers
+
+typedef struct {
+    int id;
+    USBSimFpga_t sim;
+    USBFpga_t fpga;
+    USBDevice_t dev;
+    DeviceDescriptor_t device;
+    ConfigurationDescriptor_t config;
+    InterfaceDescriptor_t interface;
+    EndpointDescriptor_t in_endpoint, out_endpoint;
+    pthread_t thread;
+    uint32_t echoes;
+    uint64_t elapsed;
+} Instance_t;
+
+static Instance_t g_instances[INSTANCES];
+static pthread_barrier_t g_start;
+static CaptureRecord_t g_records[CAPTURE_RECORDS];
+
+//packets carry the instance id, another instance's data would show here
+static void bulk_handler(USBFpga_t *fpga, uint8_t endp, uint8_t *buffer, size_t size) {
+    Instance_t *instance = fpga->endp_context[endp];
+
+    CHECK(size == BULK_PACKET && buffer[0] == instance->id);
+    CHECK(!usb_try_write_data(fpga, buffer, ECHO_SIZE, ECHO_ENDP));
+}
+
+static void instance_init(Instance_t *instance, int id) {
+    instance->id = id;
+    instance->device = (DeviceDescriptor_t) {
+        .packet_size = 64,
+        .vendor_id = 0x16c0,
+        .product_id = 0x27db + id,
+    };
+    instance->config = (ConfigurationDescriptor_t) {
+        .attributes = kConfigAttributeDefault,
+        .max_power = 50,
+    };
+    instance->interface = (InterfaceDescriptor_t) {
+        .class = 0xff,
+    };
+    instance->in_endpoint = (EndpointDescriptor_t) {
+        .endp_address = 0x80 | ECHO_ENDP,
+        .attributes = kEndpointAttributeInterrupt,
+        .max_packet_size = ECHO_SIZE,
+        .interval = 1,
+    };
+    instance->out_endpoint = (EndpointDescriptor_t) {
+        .endp_address = BULK_ENDP,
+        .attributes = kEndpointAttributeBulk,
+        .max_packet_size = BULK_PACKET,
+    };
+
+    usb_sim_init(&instance->sim);
+    usb_init(&instance->fpga, &instance->sim);
+    usb_device_init(&instance->dev, &instance->fpga, NULL);
+    usb_set_device_descriptor(&instance->dev, &instance->device);
+    usb_add_configuration_descriptor(&instance->dev, &instance->config);
+    usb_add_interface_descriptor(&instance->dev, &instance->interface);
+    usb_add_endppoint_descriptor(&instance->dev, &instance->in_endpoint);
+    usb_add_endppoint_descriptor(&instance->dev, &instance->out_endpoint);
+    usb_set_endp_handler(&instance->fpga, usb_control_endp, 0);
+    usb_set_endp_handler(&instance->fpga, bulk_handler, BULK_ENDP);
+    instance->fpga.endp_context[BULK_ENDP] = instance;
+}
+
+static void *instance_task(void *arg) {
+    Instance_t *instance = arg;
+    DeviceDescriptor_t device;
+    uint8_t packet[BULK_PACKET], echo[ECHO_SIZE];
+    SimHost_t host;
+    uint64_t start;
+
+    pthread_barrier_wait(&g_start);
+    start = usb_port_time_us();
+    sim_host_init(&host, &instance->sim, &instance->fpga);
+    sim_host_enumerate(&host, 10 + instance->id);
+    CHECK(instance->fpga.address == 10 + instance->id && instance->sim.address == 10 + instance->id);
+
+    for (int round = 0; round < ROUNDS; round++) {
+        packet[0] = instance->id;
+        for (int i = 1; i < BULK_PACKET; i++)
+            packet[i] = round + i;
+        sim_host_out(&host, BULK_ENDP, packet, sizeof(packet));
+        CHECK(sim_host_in(&host, ECHO_ENDP, echo, sizeof(echo)) == ECHO_SIZE);
+        CHECK(!memcmp(echo, packet, ECHO_SIZE));
+        instance->echoes++;
+
+        if (round % DESCRIPTOR_EVERY == 0) {
+            CHECK(sim_host_control_in(&host, 0x80, kRequestGetDescriptor, kDescriptorDevice << 8, 0, &device, sizeof(device)) == sizeof(device));
+            CHECK(device.product_id == 0x27db + instance->id);
+        }
+        //the other instances run in between, even on one cpu
+        sched_yield();
+    }
+    instance->elapsed = usb_port_time_us() - start;
+    return NULL;
+}
+
+int main(void) {
+    FILE *fd;
+    int count, seen[INSTANCES] = {0};
+
+    for (int i = 0; i < INSTANCES; i++)
+        instance_init(&g_instances[i], i);
+
+    pthread_barrier_init(&g_start, NULL, INSTANCES);
+    usb_capture_clear();
+    usb_capture_start();
+    for (int i = 0; i < INSTANCES; i++)
+        pthread_create(&g_instances[i].thread, NULL, instance_task, &g_instances[i]);
+    for (int i = 0; i < INSTANCES; i++)
+        pthread_join(g_instances[i].thread, NULL);
+    usb_capture_stop();
+
+    for (int i = 0; i < INSTANCES; i++) {
+        CHECK(g_instances[i].fpga.bus == i);
+        CHECK(g_instances[i].echoes == ROUNDS && g_instances[i].dev.configured);
+    }
+
+    //the tail of the shared capture: each packet under the bus of the instance it belongs to
+    fd = tmpfile();
+    CHECK(fd && !usb_capture_export_pcapng(fd));
+    rewind(fd);
+    count = usb_capture_import_pcapng(fd, g_records, CAPTURE_RECORDS);
+    fclose(fd);
+    CHECK(count == CAPTURE_RECORDS);
+    for (int i = 0; i < count; i++) {
+        if (g_records[i].type != kCaptureUSBIn && g_records[i].type != kCaptureUSBOut)
+            continue;
+        CHECK(g_records[i].bus < INSTANCES);
+        CHECK(g_records[i].address == 10 + g_records[i].bus);
+        if (g_records[i].endp == ECHO_ENDP || g_records[i].endp == BULK_ENDP)
+            CHECK(g_records[i].data[0] == g_records[i].bus);
+        seen[g_records[i].bus]++;
+    }
+
+    for (int i = 0; i < INSTANCES; i++)
+        BENCH("instance %i: %u rounds in %.2f s, %u spi transactions, %u packets in the capture tail", i, ROUNDS,
+              g_instances[i].elapsed / 1e6, (unsigned) g_instances[i].sim.transactions, seen[i]);
+    return 0;
+}
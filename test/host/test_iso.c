@@ -0,0 +1,175 @@
+#include "sim_host.h"
+#include "check.h"
+
+#include <string.h>
+
+/*Isochronous IN and OUT streams on the simulated core. The test owns the
+frame clock: it moves next_frame of both endpoints so exactly one poll per
+frame crosses a boundary, then the host reads the IN packet and sends its
+OUT packets, each followed by a poll. A clean stream must keep every
+counter at zero, then each fault is made for FAULT_FRAMES frames, followed
+by one clean frame that ends it, and must show up exactly in its counter:
+the device with no data (IN underrun), the host not reading (IN overrun),
+the host not sending (OUT underrun) and the host sending twice in a frame
+(OUT overrun)*/
+
+#define IN_ENDP 1
+#define OUT_ENDP 2
+#define PACKET 64
+#define FRAMES 1000
+#define FAULT_FRAMES 10
+#define NO_FRAME (UINT64_MAX >> 1) //next_frame that never comes
+
+typedef struct {
+    bool starve; //the IN handler has nothing to send
+    bool skip_in;
+    int outs; //OUT packets the host sends per frame
+} Faults_t;
+
+static USBSimFpga_t g_sim;
+static USBFpga_t g_fpga;
+static USBIso_t g_in, g_out;
+static Faults_t g_faults;
+static uint32_t g_in_sequence, g_host_sequence, g_host_out, g_out_sequence, g_out_bytes;
+
+static int in_handler(USBIso_t *iso, uint8_t *buffer, size_t size) {
+    if (g_faults.starve)
+        return -1;
+    memset(buffer, 0, size);
+    memcpy(buffer, &g_in_sequence, sizeof(g_in_sequence));
+    g_in_sequence++;
+    return size;
+}
+
+static int out_handler(USBIso_t *iso, uint8_t *buffer, size_t size) {
+    uint32_t sequence;
+
+    memcpy(&sequence, buffer, sizeof(sequence));
+    CHECK(size == PACKET && sequence == g_out_sequence++);
+    g_out_bytes += size;
+    return 0;
+}
+
+//the next poll starts a frame on both endpoints, the ones after it don't
+static void frame_boundary(void) {
+    uint32_t frames = g_in.frames;
+
+    g_in.next_frame = g_out.next_frame = usb_port_time_us();
+    usb_poll(&g_fpga);
+    CHECK(g_in.frames == frames + 1 && g_out.frames == g_in.frames);
+    g_in.next_frame = g_out.next_frame = NO_FRAME;
+}
+
+static void run_frames(uint32_t frames) {
+    uint8_t packet[PACKET] = {0};
+    uint32_t sequence;
+    int ret;
+
+    for (uint32_t frame = 0; frame < frames; frame++) {
+        frame_boundary();
+
+        if (!g_faults.skip_in) {
+            ret = usb_sim_host_in(&g_sim, IN_ENDP, packet, sizeof(packet));
+            if (ret == PACKET) {
+                //a packet the device dropped never got a number, none is missing
+                memcpy(&sequence, packet, sizeof(sequence));
+                CHECK(sequence == g_host_sequence++);
+            } else {
+                CHECK(ret == 0);
+            }
+        }
+        for (int i = 0; i < g_faults.outs; i++) {
+            memcpy(packet, &g_host_out, sizeof(g_host_out));
+            g_host_out++;
+            CHECK(!usb_sim_host_out(&g_sim, OUT_ENDP, packet, sizeof(packet)));
+            usb_poll(&g_fpga);
+        }
+    }
+}
+
+typedef struct {
+    uint32_t in_underruns, in_overruns, out_underruns, out_overruns, empty, lost;
+} Counters_t;
+
+static Counters_t counters(void) {
+    return (Counters_t) {
+        g_in.underruns, g_in.overruns, g_out.underruns, g_out.overruns,
+        g_sim.endpoints[IN_ENDP].iso_empty, g_sim.endpoints[OUT_ENDP].iso_lost,
+    };
+}
+
+/*The counters that must move by exactly expected, the rest stay*/
+static void check_phase(const char *name, Counters_t before, Counters_t expected) {
+    Counters_t after = counters();
+    uint32_t moved[] = {
+        after.in_underruns - before.in_underruns, after.in_overruns - before.in_overruns,
+        after.out_underruns - before.out_underruns, after.out_overruns - before.out_overruns,
+        after.empty - before.empty, after.lost - before.lost,
+    };
+    uint32_t wanted[] = {
+        expected.in_underruns, expected.in_overruns, expected.out_underruns, expected.out_overruns, expected.empty, expected.lost,
+    };
+
+    for (int i = 0; i < sizeof(moved) / sizeof(moved[0]); i++)
+        CHECK(moved[i] == wanted[i]);
+    BENCH("%-12s in %u underruns %u overruns, out %u underruns %u overruns, %u empty INs, %u lost OUTs",
+          name, moved[0], moved[1], moved[2], moved[3], moved[4], moved[5]);
+}
+
+int main(void) {
+    Counters_t before;
+
+    usb_sim_init(&g_sim);
+    usb_init(&g_fpga, &g_sim);
+    usb_set_endp_schedule(&g_fpga, IN_ENDP, kEndpTypeIsochronous, USB_FRAME_US, PACKET);
+    usb_set_endp_schedule(&g_fpga, OUT_ENDP, kEndpTypeIsochronous, USB_FRAME_US, PACKET);
+    usb_sim_set_iso(&g_sim, IN_ENDP, true);
+    usb_sim_set_iso(&g_sim, OUT_ENDP, true);
+    usb_iso_init(&g_in, &g_fpga, IN_ENDP, true, in_handler, NULL);
+    usb_iso_init(&g_out, &g_fpga, OUT_ENDP, false, out_handler, NULL);
+    usb_poll(&g_fpga);
+    usb_iso_set_bandwidth(&g_in, PACKET);
+    usb_iso_set_bandwidth(&g_out, PACKET);
+    g_faults.outs = 1;
+
+    //the first frame has no OUT yet, start counting from a running stream
+    run_frames(2);
+    g_in.underruns = g_in.overruns = g_out.underruns = g_out.overruns = 0;
+
+    before = counters();
+    run_frames(FRAMES);
+    check_phase("clean", before, (Counters_t) {0});
+
+    before = counters();
+    g_faults.starve = true;
+    run_frames(FAULT_FRAMES);
+    g_faults.starve = false;
+    run_frames(1);
+    check_phase("no IN data", before, (Counters_t) {.in_underruns = FAULT_FRAMES, .empty = FAULT_FRAMES});
+
+    before = counters();
+    g_faults.skip_in = true;
+    run_frames(FAULT_FRAMES);
+    g_faults.skip_in = false;
+    run_frames(1);
+    check_phase("IN not read", before, (Counters_t) {.in_overruns = FAULT_FRAMES});
+
+    before = counters();
+    g_faults.outs = 0;
+    run_frames(FAULT_FRAMES);
+    g_faults.outs = 1;
+    run_frames(1);
+    check_phase("no OUT", before, (Counters_t) {.out_underruns = FAULT_FRAMES});
+
+    before = counters();
+    g_faults.outs = 2;
+    run_frames(FAULT_FRAMES);
+    g_faults.outs = 1;
+    run_frames(1);
+    check_phase("two OUTs", before, (Counters_t) {.out_overruns = FAULT_FRAMES});
+
+    CHECK(g_out_sequence == g_host_out && g_out_bytes == g_host_out * PACKET);
+    BENCH("%u IN frames, %u packets; %u OUT frames, %u packets", (unsigned) g_in.frames, (unsigned) g_in.packets,
+          (unsigned) g_out.frames, (unsigned) g_out.packets);
+    return 0;
+}
@@ -0,0 +1,280 @@
+#include "check.h"
+#include "keymap.h"
+#include "usb_port.h"
+
+#include <string.h>
+
+/*Keymap engine on the host: layer keys, transparent keys and tap/hold on a
+small keymap, then random edges on a full size one where the resolved
+table must match a walk down the active layers after every event. The
+benchmark times events and reports on that keymap, and the table read
+against the walk it replaces*/
+
+#define MOD_SHIFT 0x02
+#define TERM 1000
+
+static const KeyAction_t g_small[][16] = {
+    {
+        KEY(0x04), KEY(0x05), KEY(0x06), KEY(0x07), KEY(0x08), KEY(0x09), KEY(0x0a), KEY(0x0b),
+        KEY_MO(1), KEY_TG(2), KEY_LT(3, 0x2c), KEY_MT(MOD_SHIFT, 0x28), KEY_MOD(MOD_SHIFT, 0x1e), KEY_NO, KEY(0x0c), KEY(0x0d),
+    },
+    {
+        KEY(0x3a), KEY_NO, KEY_TRNS, KEY_TRNS, KEY_TRNS, KEY_TRNS, KEY_TRNS, KEY_TRNS,
+        KEY_TRNS, KEY_TRNS, KEY_TRNS, KEY_TRNS, KEY_TRNS, KEY_TRNS, KEY_TRNS, KEY_TRNS,
+    },
+    {
+        KEY(0x59), KEY_TRNS, KEY(0x5a), KEY_TRNS, KEY_TRNS, KEY_TRNS, KEY_TRNS, KEY_TRNS,
+        KEY_TRNS, KEY_TRNS, KEY_TRNS, KEY_TRNS, KEY_TRNS, KEY_TRNS, KEY_TRNS, KEY_TRNS,
+    },
+    {
+        KEY(0x50), KEY(0x4f), KEY_TRNS, KEY_TRNS, KEY_TRNS, KEY_TRNS, KEY_TRNS, KEY_TRNS,
+        KEY_TRNS, KEY_TRNS, KEY_TRNS, KEY_TRNS, KEY_TRNS, KEY_TRNS, KEY_TRNS, KEY_TRNS,
+    },
+};
+
+static const Keymap_t g_small_map = {
+    .actions = &g_small[0][0],
+    .layers = sizeof(g_small) / sizeof(g_small[0]),
+    .keys = 16,
+    .tapping_term = TERM,
+};
+
+static KeymapState_t g_state;
+
+//the report as one number: modifier, then the first two keycodes
+static uint32_t report(KeymapState_t *state) {
+    uint8_t modifier, keycode[6];
+
+    keymap_report(state, &modifier, keycode);
+    return modifier << 16 | keycode[0] << 8 | keycode[1];
+}
+
+static void tap(KeymapState_t *state, uint8_t key, uint64_t *now) {
+    keymap_event(state, key, true, *now);
+    *now += 10;
+    keymap_event(state, key, false, *now);
+    *now += 10;
+}
+
+static void test_layers(void) {
+    KeymapState_t *state = &g_state;
+    uint64_t now = 0;
+
+    keymap_init(state, &g_small_map);
+    keymap_event(state, 0, true, now);
+    CHECK(report(state) == 0x0400);
+    keymap_event(state, 0, false, now);
+    CHECK(report(state) == 0);
+    keymap_event(state, 12, true, now);
+    CHECK(report(state) == (MOD_SHIFT << 16 | 0x1e00));
+    keymap_event(state, 12, false, now);
+
+    //momentary: the top layer, its KEY_NO hides the base key, transparent keys fall through
+    keymap_event(state, 8, true, now);
+    CHECK(state->active == 0x3);
+    keymap_event(state, 0, true, now);
+    keymap_event(state, 1, true, now);
+    keymap_event(state, 2, true, now);
+    CHECK(report(state) == 0x3a06);
+    //a key keeps what it resolved to on press after the layer goes
+    keymap_event(state, 8, false, now);
+    CHECK(state->active == 0x1 && report(state) == 0x3a06);
+    keymap_event(state, 0, false, now);
+    keymap_event(state, 1, false, now);
+    keymap_event(state, 2, false, now);
+    CHECK(!state->pressed && report(state) == 0);
+
+    //toggle stays on after release, the layer below still shows through
+    tap(state, 9, &now);
+    CHECK(state->active == 0x5);
+    keymap_event(state, 2, true, now);
+    keymap_event(state, 3, true, now);
+    CHECK(report(state) == 0x5a07);
+    keymap_event(state, 2, false, now);
+    keymap_event(state, 3, false, now);
+    //two layers up, the higher one wins
+    keymap_event(state, 8, true, now);
+    keymap_event(state, 0, true, now);
+    CHECK(report(state) == 0x5900);
+    keymap_event(state, 0, false, now);
+    keymap_event(state, 8, false, now);
+    tap(state, 9, &now);
+    CHECK(state->active == 0x1 && state->resolved[0].usage == 0x04);
+}
+
+static void test_tap_hold(void) {
+    KeymapState_t *state = &g_state;
+    uint64_t now = 0;
+
+    keymap_init(state, &g_small_map);
+
+    //released inside the tapping term: one report with the tap usage
+    tap(state, 10, &now);
+    CHECK(report(state) == 0x2c00);
+    keymap_report_sent(state);
+    CHECK(report(state) == 0);
+
+    //held past the term: the layer, no tap on release
+    keymap_event(state, 10, true, now);
+    keymap_tick(state, now + TERM - 1);
+    CHECK(state->active == 0x1 && state->undecided);
+    now += TERM;
+    keymap_tick(state, now);
+    CHECK(state->active == 0x9 && !state->undecided);
+    keymap_event(state, 0, true, now);
+    CHECK(report(state) == 0x5000);
+    keymap_event(state, 0, false, now);
+    keymap_event(state, 10, false, now);
+    CHECK(state->active == 0x1 && report(state) == 0);
+
+    //another key going down first decides a hold, before that key resolves
+    keymap_event(state, 10, true, now);
+    keymap_event(state, 1, true, now + 10);
+    CHECK(report(state) == 0x4f00);
+    keymap_event(state, 1, false, now + 20);
+    keymap_event(state, 10, false, now + 30);
+    CHECK(report(state) == 0);
+    now += 100;
+
+    //mod-tap: a modifier on hold, the usage on tap
+    keymap_event(state, 11, true, now);
+    keymap_event(state, 4, true, now + 10);
+    CHECK(report(state) == (MOD_SHIFT << 16 | 0x0800));
+    keymap_event(state, 4, false, now + 20);
+    keymap_event(state, 11, false, now + 30);
+    CHECK(report(state) == 0);
+    now += 100;
+    tap(state, 11, &now);
+    CHECK(report(state) == 0x2800);
+    keymap_report_sent(state);
+}
+
+/*Full size keymap, upper layers mostly transparent with layer keys spread
+over them*/
+
+#define KEYS KEYMAP_MAX_KEYS
+#define LAYERS 8
+#define EVENTS 1000000
+
+static KeyAction_t g_big[LAYERS][KEYS];
+static const Keymap_t g_big_map = {
+    .actions = &g_big[0][0],
+    .layers = LAYERS,
+    .keys = KEYS,
+    .tapping_term = TERM,
+};
+
+static void big_init(void) {
+    for (int layer = 0; layer < LAYERS; layer++) {
+        for (int key = 0; key < KEYS; key++) {
+            int roll = rand() % 16;
+            if (layer && roll < 10)
+                g_big[layer][key] = (KeyAction_t) KEY_TRNS;
+            else if (roll == 10)
+                g_big[layer][key] = (KeyAction_t) KEY_MO(1 + rand() % (LAYERS - 1));
+            else if (roll == 11)
+                g_big[layer][key] = (KeyAction_t) KEY_TG(1 + rand() % (LAYERS - 1));
+            else if (roll == 12)
+                g_big[layer][key] = (KeyAction_t) KEY_LT(1 + rand() % (LAYERS - 1), 0x04 + rand() % 26);
+            else if (roll == 13)
+                g_big[layer][key] = (KeyAction_t) KEY_MT(1 << rand() % 8, 0x04 + rand() % 26);
+            else if (roll == 14 && layer)
+                g_big[layer][key] = (KeyAction_t) KEY_NO;
+            else
+                g_big[layer][key] = (KeyAction_t) KEY(0x04 + rand() % 26);
+        }
+    }
+}
+
+//what the table replaced: walk the active layers on every lookup
+static KeyAction_t walk(uint32_t active, uint8_t key) {
+    while (active) {
+        int layer = 31 - __builtin_clz(active);
+        if (g_big[layer][key].type != kKeyTransparent)
+            return g_big[layer][key];
+        active &= ~(1u << layer);
+    }
+    return (KeyAction_t) KEY_NO;
+}
+
+static void test_random(void) {
+    KeymapState_t *state = &g_state;
+    KeyAction_t expected;
+    uint32_t down = 0;
+    uint64_t now = 0;
+
+    keymap_init(state, &g_big_map);
+    for (int event = 0; event < 100000; event++) {
+        uint8_t key = rand() % KEYS;
+        bool press = !(down & (1u << key));
+
+        //a handful of keys down at a time
+        if (press && __builtin_popcount(down) > 4)
+            continue;
+        now += rand() % (TERM / 2);
+        keymap_event(state, key, press, now);
+        down ^= 1u << key;
+        if (rand() % 4 == 0)
+            keymap_tick(state, now);
+
+        for (int k = 0; k < KEYS; k++) {
+            expected = walk(state->active, k);
+            CHECK(!memcmp(&state->resolved[k], &expected, sizeof(expected)));
+        }
+        CHECK(!(state->pressed & ~down));
+        CHECK(!(state->undecided & ~state->pressed));
+    }
+}
+
+static void bench(void) {
+    KeymapState_t *state = &g_state;
+    uint8_t modifier, keycode[6];
+    uint32_t down = 0, layer_changes = 0, active, sink = 0;
+    uint64_t start, now = 0;
+    double event_ns, table_ns, walk_ns;
+
+    keymap_init(state, &g_big_map);
+    start = usb_port_time_us();
+    for (int event = 0; event < EVENTS; event++) {
+        uint8_t key = rand() % KEYS;
+        bool press = !(down & (1u << key));
+
+        if (press && __builtin_popcount(down) > 4)
+            press = false, key = __builtin_ctz(down);
+        now += rand() % (TERM / 2);
+        active = state->active;
+        keymap_event(state, key, press, now);
+        down ^= 1u << key;
+        keymap_tick(state, now);
+        keymap_report(state, &modifier, keycode);
+        keymap_report_sent(state);
+        layer_changes += state->active != active;
+        sink += keycode[0];
+    }
+    event_ns = (usb_port_time_us() - start) * 1e3 / EVENTS;
+
+    //all layers on, the deepest walk
+    state->active = (1u << LAYERS) - 1;
+    start = usb_port_time_us();
+    for (int i = 0; i < EVENTS; i++)
+        sink += walk(state->active, i % KEYS).usage;
+    walk_ns = (usb_port_time_us() - start) * 1e3 / EVENTS;
+    start = usb_port_time_us();
+    for (int i = 0; i < EVENTS; i++)
+        sink += ((volatile KeyAction_t *) state->resolved)[i % KEYS].usage;
+    table_ns = (usb_port_time_us() - start) * 1e3 / EVENTS;
+
+    BENCH("%u keys, %u layers: %.0f ns per edge with tick and report, %.1f%% of edges change layers",
+          KEYS, LAYERS, event_ns, 100.0 * layer_changes / EVENTS);
+    BENCH("lookup: table %.1f ns, layer walk %.1f ns (sink %u)", table_ns, walk_ns, (unsigned) sink & 1);
+}
+
+int main(void) {
+    srand(34);
+    test_layers();
+    test_tap_hold();
+    big_init();
+    test_random();
+    bench();
+    return 0;
+}
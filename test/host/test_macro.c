@@ -0,0 +1,148 @@
+#include "sim_host.h"
+#include "check.h"
+#include "hid_macro.h"
+
+#include <string.h>
+
+/*Macro typing against host polls of the simulated core. The host reads the
+keyboard endpoint once per 1 ms frame, the device loop runs DEVICE_LOOPS
+times per frame and sends the next macro report as soon as the endpoint is
+free, like hid_macro_service: straight writes or a staged report that only
+advances once the host took it. The host side rebuilds the text from the
+reports it got, a new usage being a keystroke, so every character must
+arrive once and no modifier may change under a held key. Rates are chars
+per second of host frames, for plain text, repeated characters and case
+changes, the last two need a release report per character. The stage
+refills the fifo with the report the host just took before the loop stages
+the next one, so staged macros see that repeat every other frame*/
+
+#define KEY_ENDP 2
+#define REPORT 8 //boot keyboard report
+#define DEVICE_LOOPS 4
+#define FRAME_US 1000
+
+typedef enum {
+    kModeWrite,
+    kModeStage
+} MacroMode_t;
+
+static USBSimFpga_t g_sim;
+static USBFpga_t g_fpga;
+static USBStage_t g_stage;
+static HIDMacro_t g_macro;
+static uint32_t g_staged; //sequence of the macro report waiting in the stage, 0 if none
+
+static void pack(HIDKey_t key, uint8_t *report) {
+    memset(report, 0, REPORT);
+    report[0] = key.modifier;
+    report[2] = key.usage;
+}
+
+static void device_service(MacroMode_t mode) {
+    uint8_t report[REPORT];
+    HIDKey_t key;
+    int ret;
+
+    if (mode == kModeStage && g_staged) {
+        if (usb_stage_taken(&g_stage, 0) < g_staged)
+            return;
+        hid_macro_advance(&g_macro);
+        g_staged = 0;
+    }
+    if (!hid_macro_peek(&g_macro, &key))
+        return;
+    pack(key, report);
+
+    if (mode == kModeStage) {
+        g_staged = usb_stage_write(&g_stage, 0, report, sizeof(report));
+        return;
+    }
+    ret = usb_try_write_data(&g_fpga, report, sizeof(report), KEY_ENDP);
+    if (ret == -2)
+        return;
+    CHECK(!ret);
+    hid_macro_advance(&g_macro);
+}
+
+static char key_char(const HIDLayout_t *layout, uint8_t usage, uint8_t modifier) {
+    for (int c = 0; c < 128; c++)
+        if (layout->ascii[c].usage == usage && layout->ascii[c].modifier == modifier)
+            return c;
+    return 0;
+}
+
+/*Returns the host frames the text took*/
+static uint32_t type(const char *text, MacroMode_t mode, uint32_t *reports) {
+    uint8_t report[REPORT], held[REPORT] = {0};
+    char typed[256];
+    uint32_t frames = 0, length = 0;
+    int ret;
+
+    usb_sim_init(&g_sim);
+    usb_init(&g_fpga, &g_sim);
+    usb_set_endp_schedule(&g_fpga, KEY_ENDP, kEndpTypeInterrupt, FRAME_US, REPORT);
+    if (mode == kModeStage)
+        usb_stage_init(&g_stage, &g_fpga, KEY_ENDP);
+    hid_macro_init(&g_macro, &g_hid_layout_us);
+    g_staged = 0;
+    CHECK(!hid_macro_type_string(&g_macro, text));
+
+    while (hid_macro_busy(&g_macro) || g_staged) {
+        CHECK(frames < 10 * strlen(text) + 10);
+        for (int i = 0; i < DEVICE_LOOPS; i++) {
+            usb_poll(&g_fpga);
+            device_service(mode);
+        }
+
+        frames++;
+        ret = usb_sim_host_in(&g_sim, KEY_ENDP, report, sizeof(report));
+        if (ret < 0)
+            continue;
+        CHECK(ret == REPORT);
+        //a modifier change with the key still down would retype it shifted
+        if (report[2] && report[2] == held[2])
+            CHECK(report[0] == held[0]);
+        if (report[2] && report[2] != held[2]) {
+            CHECK(length < sizeof(typed) - 1);
+            typed[length++] = key_char(&g_hid_layout_us, report[2], report[0]);
+        }
+        memcpy(held, report, sizeof(held));
+    }
+
+    typed[length] = 0;
+    CHECK(!strcmp(typed, text));
+    CHECK(!held[2]);
+    *reports = g_macro.reports;
+    return frames;
+}
+
+int main(void) {
+    static const struct {
+        const char *name;
+        const char *text;
+    } texts[] = {
+        {"plain", "the quick brown fox jumps over the lazy dog"},
+        {"repeated", "aaaa bbbb 1111 0000 zzzz xxxx ...."},
+        {"case", "HeLlO WoRlD, tHiS Is A MiXeD CaSe TeXt"},
+    };
+    static const char *modes[] = {
+        [kModeWrite] = "write",
+        [kModeStage] = "stage",
+    };
+    uint32_t frames, reports;
+    size_t length;
+
+    for (int mode = kModeWrite; mode <= kModeStage; mode++) {
+        for (int i = 0; i < sizeof(texts) / sizeof(texts[0]); i++) {
+            length = strlen(texts[i].text);
+            frames = type(texts[i].text, mode, &reports);
+            //at most one report per frame, a character takes one or two
+            CHECK(reports >= length && reports <= 2 * length + 1);
+            CHECK(frames >= reports);
+            BENCH("%s %-8s %2u chars, %2u reports, %2u frames: %4.0f chars/s, %.2f reports per char", modes[mode],
+                  texts[i].name, (unsigned) length, (unsigned) reports, (unsigned) frames,
+                  length * 1e6 / (frames * FRAME_US), (double) reports / length);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,189 @@
+#include "sim_host.h"
+#include "check.h"
+#include "motion.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+
+/*Pointer motion from several sources at once against host polls of the
+simulated core. Two source threads add synthetic high rate motion while the
+main loop is the mouse service of main.c: peek, pack, write the report and
+commit it once the fifo took it, the host reads and sums every report.
+Steady motion, bursts past the 8 bit fields and a host that stops polling
+while a source runs the backlog into MOTION_BACKLOG_MAX: in every phase each
+report stays within +-MOTION_DELTA_MAX and, once drained, what the host got
+is what the sources added less what saturated*/
+
+#define MOUSE_ENDP 2
+#define SOURCES 2
+#define SAMPLES 200000 //per source and phase
+
+typedef enum {
+    kPhaseSteady, //a few counts per sample, as an optical sensor at rest speed
+    kPhaseBursts, //up to +-400 per sample, most reports split
+    kPhaseStall, //no polls while the backlog fills up, then a drain
+} Phase_t;
+
+typedef struct {
+    pthread_t thread;
+    Phase_t phase;
+    int64_t added[MOTION_AXES];
+    uint32_t seed;
+} Source_t;
+
+static USBSimFpga_t g_sim;
+static USBFpga_t g_fpga;
+static MotionAccumulator_t g_motion;
+static Source_t g_sources[SOURCES];
+static int64_t g_reported[MOTION_AXES];
+static uint32_t g_host_reports;
+static atomic_int g_running; //sources still adding
+
+static int32_t source_delta(Source_t *source, int axis) {
+    source->seed = source->seed * 1103515245 + 12345;
+    int32_t random = source->seed >> 16 & 0x7fff;
+
+    switch (source->phase) {
+    case kPhaseSteady:
+        return random % 7 - 3;
+    case kPhaseBursts:
+        return axis == kMotionWheel ? random % 31 - 15 : random % 801 - 400;
+    default:
+        //one direction only, so what saturates is all of one sign
+        return axis == kMotionX ? 100000 + random % 1000 : random % 7 - 3;
+    }
+}
+
+static void *source_task(void *arg) {
+    Source_t *source = arg;
+    int32_t delta;
+    int samples = source->phase == kPhaseStall ? 16 : SAMPLES;
+
+    for (int i = 0; i < samples; i++) {
+        for (int axis = 0; axis < MOTION_AXES; axis++) {
+            delta = source_delta(source, axis);
+            motion_add(&g_motion, axis, delta);
+            source->added[axis] += delta;
+        }
+        //the report side runs in between, even on one cpu
+        if (i % 64 == 0)
+            sched_yield();
+    }
+    atomic_fetch_sub(&g_running, 1);
+    return NULL;
+}
+
+static void host_read(void) {
+    uint8_t buffer[HID_MOUSE_REPORT_SIZE];
+    HIDMouseReport_t report;
+
+    if (usb_sim_host_in(&g_sim, MOUSE_ENDP, buffer, sizeof(buffer)) != HID_MOUSE_REPORT_SIZE)
+        return;
+    hid_mouse_unpack(&report, buffer);
+    CHECK(report.x >= -MOTION_DELTA_MAX && report.y >= -MOTION_DELTA_MAX && report.wheel >= -MOTION_DELTA_MAX);
+    g_reported[kMotionX] += report.x;
+    g_reported[kMotionY] += report.y;
+    g_reported[kMotionWheel] += report.wheel;
+    g_host_reports++;
+}
+
+//hid_mouse_service, false when there was nothing to send
+static bool mouse_service(void) {
+    uint8_t buffer[HID_MOUSE_REPORT_SIZE];
+    HIDMouseReport_t report;
+    int ret;
+
+    usb_poll(&g_fpga);
+    if (!motion_peek(&g_motion, &report))
+        return false;
+    hid_mouse_pack(&report, buffer);
+    ret = usb_try_write_data(&g_fpga, buffer, sizeof(buffer), MOUSE_ENDP);
+    if (ret == -2)
+        return true;
+    CHECK(!ret);
+    motion_commit(&g_motion, &report);
+    return true;
+}
+
+static void phase_run(Phase_t phase, const char *name) {
+    int64_t added[MOTION_AXES] = {0}, reported[MOTION_AXES];
+    uint32_t saturated = atomic_load(&g_motion.saturated), splits = g_motion.splits, reports = g_host_reports;
+    uint64_t start = usb_port_time_us();
+
+    memcpy(reported, g_reported, sizeof(reported));
+    atomic_store(&g_running, SOURCES);
+    for (int i = 0; i < SOURCES; i++) {
+        g_sources[i].phase = phase;
+        memset(g_sources[i].added, 0, sizeof(g_sources[i].added));
+        pthread_create(&g_sources[i].thread, NULL, source_task, &g_sources[i]);
+    }
+
+    //the host stops polling for the stall, reports keep going out concurrently otherwise
+    while (phase != kPhaseStall && atomic_load(&g_running)) {
+        mouse_service();
+        host_read();
+        sched_yield();
+    }
+    for (int i = 0; i < SOURCES; i++)
+        pthread_join(g_sources[i].thread, NULL);
+
+    //the host keeps polling until the backlog is gone
+    while (mouse_service() || g_sim.endpoints[MOUSE_ENDP].tx_used)
+        host_read();
+
+    for (int i = 0; i < SOURCES; i++)
+        for (int axis = 0; axis < MOTION_AXES; axis++)
+            added[axis] += g_sources[i].added[axis];
+    for (int axis = 0; axis < MOTION_AXES; axis++)
+        reported[axis] = g_reported[axis] - reported[axis];
+    saturated = atomic_load(&g_motion.saturated) - saturated;
+
+    CHECK(reported[kMotionX] == added[kMotionX] - saturated);
+    CHECK(reported[kMotionY] == added[kMotionY] && reported[kMotionWheel] == added[kMotionWheel]);
+    CHECK(phase == kPhaseStall ? saturated > 0 : saturated == 0);
+    if (phase != kPhaseSteady)
+        CHECK(g_motion.splits > splits);
+
+    BENCH("%-7s %u samples from %i sources in %.2f s, %u reports, %u split, x %lld added %lld reported, %u saturated", name,
+          SOURCES * (phase == kPhaseStall ? 16 : SAMPLES), SOURCES, (usb_port_time_us() - start) / 1e6,
+          (unsigned) (g_host_reports - reports), (unsigned) (g_motion.splits - splits), (long long) added[kMotionX],
+          (long long) reported[kMotionX], (unsigned) saturated);
+}
+
+static void test_clicks(void) {
+    HIDMouseReport_t report;
+
+    //a click between two polls still shows, then the release
+    motion_init(&g_motion);
+    motion_set_buttons(&g_motion, 1);
+    motion_set_buttons(&g_motion, 0);
+    CHECK(motion_peek(&g_motion, &report) && report.buttons == 1);
+    motion_commit(&g_motion, &report);
+    CHECK(motion_peek(&g_motion, &report) && report.buttons == 0);
+    motion_commit(&g_motion, &report);
+    CHECK(!motion_peek(&g_motion, &report));
+
+    //a commit only takes what it sent, a split leaves the rest
+    motion_add(&g_motion, kMotionY, -300);
+    CHECK(motion_peek(&g_motion, &report) && report.y == -MOTION_DELTA_MAX);
+    motion_add(&g_motion, kMotionY, -5);
+    motion_commit(&g_motion, &report);
+    CHECK(atomic_load(&g_motion.pending[kMotionY]) == -178 && g_motion.splits == 1);
+}
+
+int main(void) {
+    test_clicks();
+
+    usb_sim_init(&g_sim);
+    usb_init(&g_fpga, &g_sim);
+    usb_set_endp_schedule(&g_fpga, MOUSE_ENDP, kEndpTypeInterrupt, 1000, HID_MOUSE_REPORT_SIZE);
+    motion_init(&g_motion);
+    for (int i = 0; i < SOURCES; i++)
+        g_sources[i].seed = 50 + i;
+
+    phase_run(kPhaseSteady, "steady");
+    phase_run(kPhaseBursts, "bursts");
+    phase_run(kPhaseStall, "stall");
+    return 0;
+}
@@ -0,0 +1,176 @@
+#include "sim_host.h"
+#include "check.h"
+#include "usb_msc.h"
+
+#include <string.h>
+
+/*Mass storage over the simulated core with the RAM backend: the host runs
+bulk-only SCSI commands, stepping the device loop (usb_poll and
+usb_msc_service) while it waits, and measures sequential and random
+read/write throughput. The rate is the cpu cost of the stack, the spi clocks
+per KiB are what bounds it on the device. Every read is checked against
+what was written, and after a SYNCHRONIZE CACHE the backing RAM holds it too*/
+
+#define MSC_ENDP 1
+#define DISK_SECTORS 4096 //2 MiB
+#define SEQUENTIAL_BYTES (1024 * 1024)
+#define SEQUENTIAL_SECTORS 128 //64 KiB per command, what hosts use
+#define RANDOM_OPS 512
+#define RANDOM_SECTORS 8 //4 KiB
+
+static USBSimFpga_t g_sim;
+static USBFpga_t g_fpga;
+static USBDevice_t g_dev;
+static USBMSC_t g_msc;
+static MSCDisk_t g_disk;
+static MSCRamDisk_t g_ram;
+static uint32_t g_tag;
+static uint8_t *g_expected; //what the host wrote, sector by sector
+
+static DeviceDescriptor_t g_device = {
+    .packet_size = 64,
+    .vendor_id = 0x16c0,
+    .product_id = 0x05e2,
+};
+static ConfigurationDescriptor_t g_config = {
+    .attributes = kConfigAttributeDefault,
+    .max_power = 100,
+};
+
+static void msc_service(void *context) {
+    usb_msc_service(context);
+}
+
+/*One command block, its data stage and the status, returns the status*/
+static uint8_t scsi(const uint8_t *cb, uint8_t cb_length, void *data, uint32_t length, bool in, SimHost_t *host) {
+    MSCCommandBlock_t command = {
+        .signature = MSC_CBW_SIGNATURE,
+        .tag = ++g_tag,
+        .data_length = length,
+        .flags = in ? 0x80 : 0,
+        .cb_length = cb_length,
+    };
+    MSCCommandStatus_t status;
+    uint8_t packet[MSC_PACKET_SIZE];
+    uint32_t done = 0, chunk;
+
+    memcpy(command.cb, cb, cb_length);
+    sim_host_out(host, MSC_ENDP, &command, sizeof(command));
+
+    while (done < length) {
+        chunk = length - done > MSC_PACKET_SIZE ? MSC_PACKET_SIZE : length - done;
+        if (in) {
+            CHECK(sim_host_in(host, MSC_ENDP, packet, sizeof(packet)) == (int) chunk);
+            memcpy((uint8_t *) data + done, packet, chunk);
+        } else {
+            sim_host_out(host, MSC_ENDP, (uint8_t *) data + done, chunk);
+        }
+        done += chunk;
+    }
+
+    CHECK(sim_host_in(host, MSC_ENDP, &status, sizeof(status)) == sizeof(status));
+    CHECK(status.signature == MSC_CSW_SIGNATURE && status.tag == command.tag);
+    if (status.status == kMSCStatusPassed)
+        CHECK(status.residue == 0);
+    return status.status;
+}
+
+static uint8_t scsi_rw(SimHost_t *host, bool write, uint32_t lba, uint16_t sectors, void *data) {
+    uint8_t cb[10] = {write ? kSCSIWrite10 : kSCSIRead10, 0, lba >> 24, lba >> 16, lba >> 8, lba, 0, sectors >> 8, sectors};
+
+    return scsi(cb, sizeof(cb), data, sectors * MSC_SECTOR_SIZE, !write, host);
+}
+
+static void fill(uint8_t *data, uint32_t lba, uint16_t sectors, uint32_t pass) {
+    for (uint32_t i = 0; i < sectors * MSC_SECTOR_SIZE; i++)
+        data[i] = (lba * 13 + pass * 101 + i) ^ (i >> 9);
+}
+
+static void write_range(SimHost_t *host, uint32_t lba, uint16_t sectors, uint32_t pass, uint8_t *data) {
+    fill(data, lba, sectors, pass);
+    CHECK(scsi_rw(host, true, lba, sectors, data) == kMSCStatusPassed);
+    memcpy(g_expected + lba * MSC_SECTOR_SIZE, data, sectors * MSC_SECTOR_SIZE);
+}
+
+static void read_range(SimHost_t *host, uint32_t lba, uint16_t sectors, uint8_t *data) {
+    CHECK(scsi_rw(host, false, lba, sectors, data) == kMSCStatusPassed);
+    CHECK(!memcmp(data, g_expected + lba * MSC_SECTOR_SIZE, sectors * MSC_SECTOR_SIZE));
+}
+
+static uint64_t g_start, g_clocks;
+
+static void measure_start(void) {
+    g_start = usb_port_time_us();
+    g_clocks = g_sim.clocks;
+}
+
+static void measure_end(const char *what, uint64_t bytes) {
+    BENCH("%s %.0f KiB/s, %.0f spi clocks per KiB", what, bytes / 1024.0 / ((usb_port_time_us() - g_start) / 1e6),
+          (g_sim.clocks - g_clocks) * 1024.0 / bytes);
+}
+
+int main(void) {
+    static uint8_t data[SEQUENTIAL_SECTORS * MSC_SECTOR_SIZE];
+    uint8_t unit_ready[6] = {kSCSITestUnitReady}, capacity[10] = {kSCSIReadCapacity10}, sync[10] = {kSCSISynchronizeCache10};
+    uint8_t response[8];
+    SimHost_t host;
+    uint32_t lba;
+
+    srand(7);
+    g_ram.size = DISK_SECTORS * MSC_SECTOR_SIZE;
+    g_ram.data = calloc(1, g_ram.size);
+    g_expected = calloc(1, g_ram.size);
+    CHECK(g_ram.data && g_expected);
+    msc_disk_init(&g_disk, &msc_ram_ops, &g_ram, DISK_SECTORS);
+
+    usb_sim_init(&g_sim);
+    usb_init(&g_fpga, &g_sim);
+    usb_device_init(&g_dev, &g_fpga, NULL);
+    usb_set_device_descriptor(&g_dev, &g_device);
+    usb_add_configuration_descriptor(&g_dev, &g_config);
+    //no disk yet, as under FAST_BOOT
+    usb_msc_init(&g_msc, &g_dev, 0, MSC_ENDP, NULL);
+    usb_set_endp_handler(&g_fpga, usb_control_endp, 0);
+    sim_host_init(&host, &g_sim, &g_fpga);
+    sim_host_set_service(&host, msc_service, &g_msc);
+    sim_host_enumerate(&host, 3);
+
+    //the medium shows up once the disk is handed over
+    CHECK(scsi(unit_ready, sizeof(unit_ready), NULL, 0, false, &host) == kMSCStatusFailed);
+    CHECK(scsi(capacity, sizeof(capacity), response, sizeof(response), true, &host) == kMSCStatusFailed);
+    usb_msc_insert(&g_msc, &g_disk);
+    CHECK(scsi(unit_ready, sizeof(unit_ready), NULL, 0, false, &host) == kMSCStatusPassed);
+    CHECK(scsi(capacity, sizeof(capacity), response, sizeof(response), true, &host) == kMSCStatusPassed);
+    CHECK(((response[0] << 24) | (response[1] << 16) | (response[2] << 8) | response[3]) == DISK_SECTORS - 1);
+
+    measure_start();
+    for (lba = 0; lba < SEQUENTIAL_BYTES / MSC_SECTOR_SIZE; lba += SEQUENTIAL_SECTORS)
+        write_range(&host, lba, SEQUENTIAL_SECTORS, 0, data);
+    measure_end("sequential write", SEQUENTIAL_BYTES);
+
+    measure_start();
+    for (lba = 0; lba < SEQUENTIAL_BYTES / MSC_SECTOR_SIZE; lba += SEQUENTIAL_SECTORS)
+        read_range(&host, lba, SEQUENTIAL_SECTORS, data);
+    measure_end("sequential read", SEQUENTIAL_BYTES);
+
+    measure_start();
+    for (int i = 0; i < RANDOM_OPS; i++)
+        write_range(&host, rand() % (DISK_SECTORS - RANDOM_SECTORS), RANDOM_SECTORS, i + 1, data);
+    measure_end("random 4 KiB write", RANDOM_OPS * RANDOM_SECTORS * MSC_SECTOR_SIZE);
+
+    measure_start();
+    for (int i = 0; i < RANDOM_OPS; i++)
+        read_range(&host, rand() % (DISK_SECTORS - RANDOM_SECTORS), RANDOM_SECTORS, data);
+    measure_end("random 4 KiB read", RANDOM_OPS * RANDOM_SECTORS * MSC_SECTOR_SIZE);
+
+    //past the end is refused, the disk stays usable
+    CHECK(scsi_rw(&host, false, DISK_SECTORS - 1, 2, data) == kMSCStatusFailed);
+
+    CHECK(scsi(sync, sizeof(sync), NULL, 0, false, &host) == kMSCStatusPassed);
+    CHECK(!memcmp(g_ram.data, g_expected, g_ram.size));
+
+    BENCH("%u commands, %u sectors read, %u written", (unsigned) g_msc.commands, (unsigned) g_msc.sectors_read, (unsigned) g_msc.sectors_written);
+    BENCH("cache %u hits, %u misses, %u read-ahead, %u block reads, %u block writes", (unsigned) g_disk.hits,
+          (unsigned) g_disk.misses, (unsigned) g_disk.prefetches, (unsigned) g_disk.block_reads, (unsigned) g_disk.block_writes);
+    return 0;
+}
@@ -0,0 +1,116 @@
+#include "sim_host.h"
+#include "check.h"
+#include "profiler.h"
+#include "timeline.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+
+/*Keypress to wire profiler against the simulated core. A gpio thread makes
+synthetic key edges with bounces and calls the edge isr, the main loop is
+the keyboard task: it scans every SCAN_US, marks the stages as the firmware
+does and writes the report, the host reads it a few scans later. Every
+event must come out complete and the stages must add up to the end to end
+time*/
+
+#define EVENTS 1000
+#define SCAN_US 200
+#define KEY_ENDP 2
+#define REPORT 8
+#define BOUNCES_MAX 3
+
+static USBSimFpga_t g_sim;
+static USBFpga_t g_fpga;
+static atomic_uint g_buttons; //the pin state the scan reads, one change per event
+static atomic_bool g_stop;
+
+static void *gpio_task(void *arg) {
+    for (int i = 0; i < EVENTS && !atomic_load(&g_stop); i++) {
+        //one key event at a time, as a finger does
+        while (profiler_pending() != kProfileEdge && !atomic_load(&g_stop))
+            usleep(50);
+        usleep(100 + rand() % 400);
+
+        profiler_edge_isr(NULL);
+        for (int bounce = rand() % (BOUNCES_MAX + 1); bounce; bounce--) {
+            usleep(10);
+            profiler_edge_isr(NULL);
+        }
+        atomic_fetch_add(&g_buttons, 1);
+    }
+    return NULL;
+}
+
+int main(void) {
+    const LatencyStats_t *stats;
+    pthread_t gpio;
+    uint8_t report[REPORT] = {0}, received[REPORT];
+    unsigned buttons, last = 0;
+    uint64_t stages = 0, start;
+    int host_wait = -1;
+
+    srand(29);
+    usb_sim_init(&g_sim);
+    usb_init(&g_fpga, &g_sim);
+    usb_set_endp_schedule(&g_fpga, KEY_ENDP, kEndpTypeInterrupt, 1000, REPORT);
+    profiler_init();
+    pthread_create(&gpio, NULL, gpio_task, NULL);
+
+    start = usb_port_time_us();
+    while (profiler_stats(kProfileEdge)->count < EVENTS) {
+        CHECK(usb_port_time_us() - start < 60 * 1000 * 1000);
+        usb_poll(&g_fpga);
+        timeline_mark(kBootFirstPoll);
+
+        //the fpga empties the tx buffer when the host takes the report
+        if (profiler_pending() == kProfileConsumed && usb_get_flags(&g_fpga, KEY_ENDP).tx_empty)
+            profiler_mark(kProfileConsumed);
+
+        buttons = atomic_load(&g_buttons);
+        if (buttons != last)
+            profiler_mark(kProfileReportChange);
+        profiler_mark(kProfileEnqueue);
+        if (buttons != last) {
+            memcpy(report, &buttons, sizeof(buttons));
+            profiler_mark(kProfileSPIStart);
+            CHECK(!usb_write_data(&g_fpga, report, sizeof(report), 64, KEY_ENDP));
+            profiler_mark(kProfileSPIEnd);
+            host_wait = rand() % 5;
+            last = buttons;
+        }
+
+        //the host polls the interrupt endpoint some scans later
+        if (host_wait >= 0 && !host_wait--) {
+            CHECK(usb_sim_host_in(&g_sim, KEY_ENDP, received, sizeof(received)) == REPORT);
+            CHECK(!memcmp(received, report, REPORT));
+            timeline_mark(kBootFirstReport);
+        }
+        usleep(SCAN_US);
+    }
+    pthread_join(gpio, NULL);
+
+    //every event complete, bounces never started a new one, the stages add up
+    CHECK(profiler_dropped() == 0);
+    CHECK(profiler_pending() == kProfileEdge);
+    for (int i = kProfileReportChange; i < kProfileStages; i++) {
+        CHECK(profiler_stats(i)->count == EVENTS);
+        stages += profiler_stats(i)->sum;
+    }
+    CHECK(stages == profiler_stats(kProfileEdge)->sum);
+    CHECK(timeline_get(kBootFirstPoll) && timeline_get(kBootFirstReport) > timeline_get(kBootFirstPoll));
+
+    //a key with no report is dropped once it is too old
+    profiler_edge_isr(NULL);
+    usleep(PROFILE_TIMEOUT + 10000);
+    profiler_mark(kProfileReportChange);
+    CHECK(profiler_dropped() == 1 && profiler_pending() == kProfileEdge);
+
+    for (int i = 0; i < kProfileStages; i++) {
+        stats = profiler_stats(i);
+        BENCH("%-22s mean %6.1f us, p99 %5u us, max %5u us", stats->name, (double) stats->sum / stats->count,
+              (unsigned) latency_percentile((LatencyStats_t *) stats, 99), (unsigned) stats->max);
+    }
+    return 0;
+}
@@ -0,0 +1,125 @@
+#include "sim_host.h"
+#include "check.h"
+
+#include <string.h>
+
+/*Quad link negotiation and throughput on the simulated core, built with
+USB_QUAD=1. usb_init must end with both ends on the same link: quad when
+the core offers it and WP/HD are routed, single when the lines are not
+there (the caps read back garbled), when the core does not offer quad or
+has no capability query at all, and quad again on a core a previous run
+left in quad. Each case enumerates and moves BULK_BYTES each way through a
+bulk pair with the data checked, the spi clocks per byte give the rate at
+the clock main.c uses and a faster one*/
+
+#define BULK_ENDP 2
+#define BULK_PACKET 64
+#define BULK_BYTES (64 * 1024)
+
+typedef struct {
+    const char *name;
+    bool supported, wired, stale;
+    uint16_t fifo_memory;
+    USBLinkMode_t link;
+} Scenario_t;
+
+static const Scenario_t g_scenarios[] = {
+    {"quad", true, true, false, SIM_FIFO_MEMORY, kLinkQuad},
+    {"unwired", true, false, false, SIM_FIFO_MEMORY, kLinkSingle},
+    {"unsupported", false, true, false, SIM_FIFO_MEMORY, kLinkSingle},
+    {"no caps", true, true, false, 0, kLinkSingle},
+    {"stale quad", true, true, true, SIM_FIFO_MEMORY, kLinkQuad},
+};
+
+static USBSimFpga_t g_sim;
+static USBFpga_t g_fpga;
+static USBDevice_t g_dev;
+static uint32_t g_received;
+
+static DeviceDescriptor_t g_device = {.packet_size = 64, .vendor_id = 0x16c0, .product_id = 0x27db};
+static ConfigurationDescriptor_t g_config = {.attributes = kConfigAttributeDefault, .max_power = 50};
+static InterfaceDescriptor_t g_interface = {.class = 0xff};
+static EndpointDescriptor_t g_in = {.endp_address = 0x80 | BULK_ENDP, .attributes = kEndpointAttributeBulk, .max_packet_size = BULK_PACKET};
+static EndpointDescriptor_t g_out = {.endp_address = BULK_ENDP, .attributes = kEndpointAttributeBulk, .max_packet_size = BULK_PACKET};
+
+static void bulk_handler(USBFpga_t *fpga, uint8_t endp, uint8_t *buffer, size_t size) {
+    for (size_t i = 0; i < size; i++)
+        CHECK(buffer[i] == (uint8_t) (g_received + i));
+    g_received += size;
+}
+
+static void device_init(const Scenario_t *scenario) {
+    usb_sim_init(&g_sim);
+    usb_sim_set_caps(&g_sim, FPGA_ENDPOINTS, scenario->fifo_memory);
+    usb_sim_set_quad(&g_sim, scenario->supported, scenario->wired);
+    //the esp reset, the core kept the link of the last run
+    if (scenario->stale)
+        g_sim.core_link = kLinkQuad;
+
+    usb_init(&g_fpga, &g_sim);
+    usb_device_init(&g_dev, &g_fpga, NULL);
+    usb_set_device_descriptor(&g_dev, &g_device);
+    usb_add_configuration_descriptor(&g_dev, &g_config);
+    usb_add_interface_descriptor(&g_dev, &g_interface);
+    usb_add_endppoint_descriptor(&g_dev, &g_in);
+    usb_add_endppoint_descriptor(&g_dev, &g_out);
+    usb_set_endp_handler(&g_fpga, usb_control_endp, 0);
+    usb_set_endp_handler(&g_fpga, bulk_handler, BULK_ENDP);
+}
+
+//spi clocks per byte for the device sending, then for the host sending
+static void transfer(SimHost_t *host, double *in_clocks, double *out_clocks) {
+    uint8_t packet[BULK_PACKET], received[BULK_PACKET];
+    uint64_t clocks;
+
+    clocks = g_sim.clocks;
+    for (uint32_t sent = 0; sent < BULK_BYTES; sent += BULK_PACKET) {
+        for (int i = 0; i < BULK_PACKET; i++)
+            packet[i] = sent + i;
+        CHECK(!usb_write_data(&g_fpga, packet, sizeof(packet), BULK_PACKET, BULK_ENDP));
+        CHECK(usb_sim_host_in(&g_sim, BULK_ENDP, received, sizeof(received)) == BULK_PACKET);
+        CHECK(!memcmp(received, packet, BULK_PACKET));
+    }
+    *in_clocks = (double) (g_sim.clocks - clocks) / BULK_BYTES;
+
+    g_received = 0;
+    clocks = g_sim.clocks;
+    for (uint32_t sent = 0; sent < BULK_BYTES; sent += BULK_PACKET) {
+        for (int i = 0; i < BULK_PACKET; i++)
+            packet[i] = sent + i;
+        sim_host_out(host, BULK_ENDP, packet, sizeof(packet));
+    }
+    while (g_received < BULK_BYTES)
+        sim_host_step(host);
+    *out_clocks = (double) (g_sim.clocks - clocks) / BULK_BYTES;
+}
+
+int main(void) {
+    static const char *links[] = {[kLinkSingle] = "single", [kLinkQuad] = "quad"};
+    const int scenarios = sizeof(g_scenarios) / sizeof(g_scenarios[0]);
+    double in_clocks[scenarios], out_clocks[scenarios];
+    SimHost_t host;
+
+    for (int i = 0; i < scenarios; i++) {
+        const Scenario_t *scenario = &g_scenarios[i];
+
+        device_init(scenario);
+        CHECK(g_fpga.link == scenario->link);
+        CHECK(g_sim.host_link == scenario->link && g_sim.core_link == scenario->link);
+
+        sim_host_init(&host, &g_sim, &g_fpga);
+        sim_host_enumerate(&host, 5);
+        CHECK(g_dev.configured);
+        transfer(&host, &in_clocks[i], &out_clocks[i]);
+        BENCH("%-11s %-6s IN %5.2f clocks/byte (%4.0f KiB/s at 1 MHz, %5.0f at 40 MHz), OUT %5.2f (%4.0f, %5.0f)", scenario->name,
+              links[g_fpga.link], in_clocks[i], 1e6 / in_clocks[i] / 1024, 40e6 / in_clocks[i] / 1024, out_clocks[i],
+              1e6 / out_clocks[i] / 1024, 40e6 / out_clocks[i] / 1024);
+    }
+
+    //data phases four times as wide, the commands stay single: every quad run well ahead of every single one
+    for (int i = 0; i < scenarios; i++)
+        for (int j = 0; j < scenarios; j++)
+            if (g_scenarios[i].link == kLinkQuad && g_scenarios[j].link == kLinkSingle)
+                CHECK(in_clocks[i] < in_clocks[j] / 2 && out_clocks[i] < out_clocks[j] / 2);
+    return 0;
+}
@@ -0,0 +1,80 @@
+#include "sim_host.h"
+#include "check.h"
+
+#include <string.h>
+
+/*Latest-state endpoint against host IN polls at random intervals. Reports
+are staged at random points between device polls, the host picks one up
+after a random number of polls. Every IN must be answered from the fifo
+with no spi command in between, and carry the newest report staged before
+the poll that followed the previous IN*/
+
+#define STEPS 200000
+#define STAGE_ENDP 1
+#define REPORT 8
+#define HOST_INTERVAL_MAX 8 //polls between host INs
+
+static USBSimFpga_t g_sim;
+static USBFpga_t g_fpga;
+static USBStage_t g_stage;
+
+static uint32_t report_sequence(const uint8_t *report) {
+    uint32_t sequence;
+
+    memcpy(&sequence, report, sizeof(sequence));
+    return sequence;
+}
+
+int main(void) {
+    uint8_t report[REPORT] = {0}, received[REPORT];
+    uint32_t staged = 1, expected = 0, transactions, stale = 0, reads = 0;
+    int polls_left = 1;
+    bool taken = true; //fifo emptied by the host, the next poll refills it
+
+    srand(42);
+    usb_sim_init(&g_sim);
+    usb_init(&g_fpga, &g_sim);
+    usb_set_endp_schedule(&g_fpga, STAGE_ENDP, kEndpTypeInterrupt, 1000, REPORT);
+    usb_stage_init(&g_stage, &g_fpga, STAGE_ENDP);
+
+    memcpy(report, &staged, sizeof(staged));
+    CHECK(usb_stage_write(&g_stage, 0, report, sizeof(report)) == staged);
+
+    for (int step = 0; step < STEPS; step++) {
+        //the firmware changes the report at random, often several times per host poll
+        if (rand() % 3 == 0) {
+            uint32_t next = staged + 1;
+            memcpy(report, &next, sizeof(next));
+            CHECK(usb_stage_write(&g_stage, 0, report, sizeof(report)) == next);
+            staged = next;
+        }
+
+        usb_poll(&g_fpga);
+        if (taken) {
+            expected = staged;
+            taken = false;
+        }
+
+        if (--polls_left)
+            continue;
+        polls_left = 1 + rand() % HOST_INTERVAL_MAX;
+
+        //the IN token: answered from the fifo, the core asks nothing of the spi side
+        transactions = g_sim.transactions;
+        CHECK(usb_sim_host_in(&g_sim, STAGE_ENDP, received, sizeof(received)) == REPORT);
+        CHECK(g_sim.transactions == transactions);
+        CHECK(report_sequence(received) == expected);
+        stale += staged - expected;
+        reads++;
+        taken = true;
+    }
+
+    //once taken the report shows up in usb_stage_taken
+    usb_poll(&g_fpga);
+    CHECK(usb_stage_taken(&g_stage, 0) == expected);
+
+    BENCH("%u host INs, none NAKed, %u reports staged", (unsigned) reads, (unsigned) staged);
+    BENCH("%u refills, %u repeats, %.2f changes behind the newest per IN", (unsigned) g_stage.refills,
+          (unsigned) g_stage.repeats, (double) stale / reads);
+    return 0;
+}
@@ -0,0 +1,219 @@
+#include "sim_host.h"
+#include "check.h"
+#include "usb_port.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <string.h>
+
+/*Many tasks on one core: writers on shared and separate endpoints, a poll
+task whose OUT handler writes too (poll -> tx -> bus) and the host draining
+every IN endpoint. The host checks that the chunks of a transfer arrive
+back to back and intact, a deadlock shows up as a host timeout*/
+
+#define WRITERS_MAX 8
+#define ENDPOINTS 4 //1 to 4, endpoint 0 stays free for control
+#define TRANSFERS 100 //per writer and round
+#define CHUNKS 4
+#define CHUNK 64
+#define ECHO_ID WRITERS_MAX //writer id of the poll handler
+
+typedef struct {
+    uint8_t id;
+    uint8_t endp;
+    bool vectored;
+    uint32_t sent;
+} Writer_t;
+
+typedef struct {
+    uint8_t endp;
+    uint32_t expected;
+    uint32_t packets;
+    int last_id; //writer of the transfer in progress, -1 between transfers
+    int last_chunk;
+    int sequence[WRITERS_MAX + 1];
+} Drain_t;
+
+static USBSimFpga_t g_sim;
+static USBFpga_t g_fpga;
+static atomic_bool g_stop;
+static Writer_t g_echo = {.id = ECHO_ID, .endp = 1};
+
+static void fill_chunk(uint8_t *chunk, uint8_t id, uint8_t sequence, uint8_t index) {
+    chunk[0] = id;
+    chunk[1] = sequence;
+    chunk[2] = index;
+    for (int i = 3; i < CHUNK; i++)
+        chunk[i] = id * 31 + sequence * 7 + index + i;
+}
+
+static int write_transfer(Writer_t *writer) {
+    uint8_t data[CHUNK * CHUNKS];
+    //segment edges that never match the chunk edges
+    USBSegment_t segments[] = {
+        {data, 100},
+        {data + 100, 1},
+        {data + 101, 60},
+        {data + 161, sizeof(data) - 161},
+    };
+
+    for (int k = 0; k < CHUNKS; k++)
+        fill_chunk(data + k * CHUNK, writer->id, writer->sent, k);
+    writer->sent++;
+
+    if (writer->vectored)
+        return usb_write_datav(&g_fpga, segments, 4, sizeof(data), CHUNK, writer->endp);
+    return usb_write_data(&g_fpga, data, sizeof(data), CHUNK, writer->endp);
+}
+
+static void *writer_task(void *arg) {
+    Writer_t *writer = arg;
+
+    for (int i = 0; i < TRANSFERS; i++)
+        CHECK(write_transfer(writer) == 0);
+    return NULL;
+}
+
+//every byte the host sends on endpoint 1 asks for one transfer, written from inside the poll
+static void echo_handler(USBFpga_t *fpga, uint8_t endp, uint8_t *buffer, size_t size) {
+    for (size_t i = 0; i < size; i++)
+        CHECK(write_transfer(&g_echo) == 0);
+}
+
+static void *poll_task(void *arg) {
+    while (!g_stop)
+        usb_poll(&g_fpga);
+    return NULL;
+}
+
+static void *echo_feeder_task(void *arg) {
+    uint8_t request = 0;
+
+    for (int i = 0; i < TRANSFERS; i++)
+        while (usb_sim_host_out(&g_sim, 1, &request, 1))
+            sched_yield();
+    return NULL;
+}
+
+static void drain_check(Drain_t *drain, uint8_t *packet, int len) {
+    uint8_t expected[CHUNK];
+    int id = packet[0], index = packet[2];
+
+    CHECK(len == CHUNK);
+    CHECK(id <= WRITERS_MAX);
+    if (drain->last_id < 0) {
+        //a new transfer starts with its first chunk and follows the writer's previous one
+        CHECK(index == 0);
+        CHECK(packet[1] == (uint8_t) (drain->sequence[id] + 1));
+        drain->sequence[id]++;
+        drain->last_id = id;
+    } else {
+        //nobody else's chunk in the middle of a transfer
+        CHECK(id == drain->last_id);
+        CHECK(index == drain->last_chunk + 1);
+        CHECK(packet[1] == (uint8_t) drain->sequence[id]);
+    }
+    drain->last_chunk = index;
+    if (index == CHUNKS - 1)
+        drain->last_id = -1;
+
+    fill_chunk(expected, id, packet[1], index);
+    CHECK(!memcmp(packet, expected, CHUNK));
+}
+
+static void *drain_task(void *arg) {
+    Drain_t *drain = arg;
+    uint8_t packet[CHUNK];
+    uint64_t last = usb_port_time_us();
+    int len;
+
+    while (drain->packets < drain->expected) {
+        len = usb_sim_host_in(&g_sim, drain->endp, packet, sizeof(packet));
+        if (len < 0) {
+            if (usb_port_time_us() - last > SIM_HOST_TIMEOUT) {
+                printf("endp %i stuck after %u of %u packets\n", drain->endp, (unsigned) drain->packets, (unsigned) drain->expected);
+                exit(1);
+            }
+            sched_yield();
+            continue;
+        }
+        drain_check(drain, packet, len);
+        drain->packets++;
+        last = usb_port_time_us();
+    }
+    return NULL;
+}
+
+/*Returns the transfers per second of the round*/
+static double run(int writers, bool echo) {
+    Writer_t writer[WRITERS_MAX];
+    Drain_t drain[ENDPOINTS];
+    pthread_t writer_threads[WRITERS_MAX], drain_threads[ENDPOINTS], poll_thread, feeder_thread;
+    uint64_t start, elapsed;
+    uint32_t transfers = writers * TRANSFERS + (echo ? TRANSFERS : 0);
+
+    memset(drain, 0, sizeof(drain));
+    for (int e = 0; e < ENDPOINTS; e++) {
+        drain[e].endp = e + 1;
+        drain[e].last_id = -1;
+        for (int i = 0; i <= WRITERS_MAX; i++)
+            drain[e].sequence[i] = -1;
+    }
+    for (int i = 0; i < writers; i++) {
+        writer[i] = (Writer_t) {.id = i, .endp = 1 + i % ENDPOINTS, .vectored = i % 2};
+        drain[i % ENDPOINTS].expected += TRANSFERS * CHUNKS;
+    }
+    g_echo.sent = 0;
+    if (echo)
+        drain[0].expected += TRANSFERS * CHUNKS;
+
+    g_stop = false;
+    start = usb_port_time_us();
+    pthread_create(&poll_thread, NULL, poll_task, NULL);
+    for (int e = 0; e < ENDPOINTS; e++)
+        pthread_create(&drain_threads[e], NULL, drain_task, &drain[e]);
+    for (int i = 0; i < writers; i++)
+        pthread_create(&writer_threads[i], NULL, writer_task, &writer[i]);
+    if (echo)
+        pthread_create(&feeder_thread, NULL, echo_feeder_task, NULL);
+
+    for (int i = 0; i < writers; i++)
+        pthread_join(writer_threads[i], NULL);
+    if (echo)
+        pthread_join(feeder_thread, NULL);
+    for (int e = 0; e < ENDPOINTS; e++)
+        pthread_join(drain_threads[e], NULL);
+    g_stop = true;
+    pthread_join(poll_thread, NULL);
+    elapsed = usb_port_time_us() - start;
+
+    for (int e = 0; e < ENDPOINTS; e++) {
+        CHECK(drain[e].packets == drain[e].expected);
+        CHECK(drain[e].last_id < 0);
+    }
+    return transfers * 1e6 / elapsed;
+}
+
+int main(void) {
+    double rate, single = 0;
+
+    usb_sim_init(&g_sim);
+    usb_init(&g_fpga, &g_sim);
+    for (int e = 1; e <= ENDPOINTS; e++)
+        usb_set_endp_schedule(&g_fpga, e, kEndpTypeBulk, 0, CHUNK);
+    usb_set_endp_handler(&g_fpga, echo_handler, 1);
+    usb_poll(&g_fpga); //splits the fifos before anyone writes
+
+    for (int writers = 1; writers <= WRITERS_MAX; writers *= 2) {
+        rate = run(writers, false);
+        if (writers == 1)
+            single = rate;
+        BENCH("%i writers: %.0f transfers/s, %.2fx one writer", writers, rate, rate / single);
+    }
+
+    rate = run(WRITERS_MAX, true);
+    BENCH("%i writers and the poll handler: %.0f transfers/s", WRITERS_MAX, rate);
+    BENCH("%u spi transactions", (unsigned) g_sim.transactions);
+    return 0;
+}
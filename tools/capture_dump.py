@@ -0,0 +1,77 @@
+#!/usr/bin/env python3
+"""Saves the firmware's USB/SPI capture as a pcapng file.
+
+Sends "capture" on the CDC console (firmware built with USB_CDC=1 and
+USB_CAPTURE=1, the ttgo-lora32-v1-capture environment of platformio.ini)
+and writes the file the board answers with. The console
+replies with a "pcapng <bytes>" line followed by the file, log lines before
+it are skipped. Open the result with Wireshark or replay it on the simulator:
+
+    test/host build: ./test_capture capture.pcapng
+"""
+
+import argparse
+import os
+import sys
+import termios
+import time
+import tty
+
+TIMEOUT = 5 # s without bytes from the board
+
+
+def read_exact(fd, size):
+    data = b''
+    last = time.monotonic()
+    while len(data) < size:
+        chunk = os.read(fd, size - len(data))
+        if chunk:
+            data += chunk
+            last = time.monotonic()
+        elif time.monotonic() - last > TIMEOUT:
+            sys.exit('capture cut after %i of %i bytes' % (len(data), size))
+    return data
+
+
+def read_line(fd):
+    line = b''
+    while not line.endswith(b'\n'):
+        line += read_exact(fd, 1)
+    return line.decode(errors='replace').strip()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('port', help='CDC port of the board, e.g. /dev/ttyACM0')
+    parser.add_argument('output', nargs='?', default='capture.pcapng')
+    args = parser.parse_args()
+
+    fd = os.open(args.port, os.O_RDWR | os.O_NOCTTY | os.O_NONBLOCK)
+    saved = termios.tcgetattr(fd)
+    try:
+        tty.setraw(fd)
+        os.set_blocking(fd, True)
+        attributes = termios.tcgetattr(fd)
+        attributes[6][termios.VMIN] = 0
+        attributes[6][termios.VTIME] = 1 # reads return after 100 ms without data
+        termios.tcsetattr(fd, termios.TCSANOW, attributes)
+        termios.tcflush(fd, termios.TCIFLUSH)
+        os.write(fd, b'capture\n')
+
+        while True:
+            line = read_line(fd)
+            if line.startswith('pcapng '):
+                break
+            print(line)
+        data = read_exact(fd, int(line.split()[1]))
+    finally:
+        termios.tcsetattr(fd, termios.TCSANOW, saved)
+        os.close(fd)
+
+    with open(args.output, 'wb') as f:
+        f.write(data)
+    print('%s: %i bytes' % (args.output, len(data)))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,75 @@
+# HID reports of the keyboard, compiled into src/hid_reports.[ch] by
+# tools/hidgen.py (run on every PlatformIO build)
+{
+    'output': 'hid_reports',
+    'collections': [
+        {
+            'name': 'keyboard',
+            'usage_page': 0x01,  # Generic Desktop
+            'usage': 0x06,       # Keyboard
+            'reports': [
+                {
+                    'name': 'keyboard',
+                    'type': 'input',
+                    'id': 1,
+                    'fields': [
+                        {'name': 'modifier', 'size': 1, 'count': 8, 'bitmap': True,
+                         'usage_page': 0x07, 'usage_min': 0xe0, 'usage_max': 0xe7,  # Left Control .. Right GUI
+                         'logical_min': 0, 'logical_max': 1},
+                        {'name': 'keycode', 'size': 8, 'count': 6, 'array': True,
+                         'usage_page': 0x07, 'usage_min': 0x00, 'usage_max': 0xff,
+                         'logical_min': 0, 'logical_max': 0xff},
+                    ],
+                },
+            ],
+        },
+        {
+            # analog axes from the ADC, see src/analog.h
+            'name': 'gamepad',
+            'when': 'HID_GAMEPAD',
+            'usage_page': 0x01,
+            'usage': 0x05,       # Game Pad
+            'reports': [
+                {
+                    'name': 'gamepad',
+                    'type': 'input',
+                    'id': 2,
+                    'fields': [
+                        {'name': 'axis', 'size': 12, 'count': 4,
+                         'usage_page': 0x01, 'usages': [0x30, 0x31, 0x32, 0x35],  # X, Y, Z, Rz
+                         'logical_min': -2047, 'logical_max': 2047},
+                    ],
+                },
+            ],
+        },
+        {
+            # motion accumulated between host polls, see src/motion.h
+            'name': 'mouse',
+            'when': 'HID_MOUSE',
+            'usage_page': 0x01,
+            'usage': 0x02,       # Mouse
+            'reports': [
+                {
+                    'name': 'mouse',
+                    'type': 'input',
+                    'id': 3,
+                    'fields': [
+                        {'name': 'buttons', 'size': 1, 'count': 3, 'bitmap': True,
+                         'usage_page': 0x09, 'usage_min': 1, 'usage_max': 3,  # left, right, middle
+                         'logical_min': 0, 'logical_max': 1},
+                        {'pad': 5},
+                        {'name': 'x', 'size': 8, 'relative': True,
+                         'usage_page': 0x01, 'usage': 0x30,
+                         'logical_min': -127, 'logical_max': 127},
+                        {'name': 'y', 'size': 8, 'relative': True,
+                         'usage_page': 0x01, 'usage': 0x31,
+                         'logical_min': -127, 'logical_max': 127},
+                        {'name': 'wheel', 'size': 8, 'relative': True,
+                         'usage_page': 0x01, 'usage': 0x38,
+                         'logical_min': -127, 'logical_max': 127},
+                    ],
+                },
+            ],
+        },
+    ],
+}
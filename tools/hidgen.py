@@ -0,0 +1,536 @@
+#!/usr/bin/env python3
+"""HID report compiler.
+
+Reads a report spec and writes a C module with the report descriptor bytes,
+one struct per report and straight-line pack/unpack functions for its bit
+layout, so the firmware never builds or parses reports by hand.
+
+The spec is a Python literal (comments and hex allowed):
+
+    {
+        'output': 'hid_reports',            # src/<output>.h and .c
+        'collections': [{
+            'name': 'keyboard',
+            'usage_page': 0x01, 'usage': 0x06,
+            'reports': [{
+                'name': 'keyboard',
+                'type': 'input',            # input, output or feature
+                'id': 0,                    # 0 means no report ID byte
+                'fields': [
+                    # count elements of size bits each
+                    {'name': 'modifier', 'size': 1, 'count': 8, 'bitmap': True,
+                     'usage_page': 0x07, 'usage_min': 0xe0, 'usage_max': 0xe7,
+                     'logical_min': 0, 'logical_max': 1},
+                    {'pad': 4},             # constant bits
+                    ...
+                ]}]}]}
+
+A collection may carry 'when': 'MACRO', its descriptor bytes are then only
+built with #if MACRO (0 by default) while the pack/unpack code always is.
+
+Field keys: size, count (1), usage_page, usage / usages / usage_min+usage_max,
+logical_min, logical_max, array (False), relative (False) and bitmap (False):
+a bitmap field is a single integer member holding all its elements, bit 0
+first, instead of an array.
+
+The generated descriptor is checked against a reference item parser before
+anything is written, and --selftest also compiles the generated C with the
+host compiler and compares its packing against the parser's layout.
+"""
+
+import argparse
+import ast
+import os
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+
+MAIN_TAGS = {'input': 0x80, 'output': 0x90, 'feature': 0xb0}
+MAIN_NAMES = {v: k for k, v in MAIN_TAGS.items()}
+
+# short item prefixes with the size bits cleared
+ITEM_USAGE_PAGE = 0x04
+ITEM_LOGICAL_MIN = 0x14
+ITEM_LOGICAL_MAX = 0x24
+ITEM_REPORT_SIZE = 0x74
+ITEM_REPORT_ID = 0x84
+ITEM_REPORT_COUNT = 0x94
+ITEM_PUSH = 0xa4
+ITEM_POP = 0xb4
+ITEM_USAGE = 0x08
+ITEM_USAGE_MIN = 0x18
+ITEM_USAGE_MAX = 0x28
+ITEM_COLLECTION = 0xa0
+ITEM_END_COLLECTION = 0xc0
+
+FLAG_CONSTANT = 0x01
+FLAG_VARIABLE = 0x02
+FLAG_RELATIVE = 0x04
+
+
+class SpecError(Exception):
+    pass
+
+
+################################ layout ################################
+
+class Field:
+    def __init__(self, spec, report):
+        self.pad = 'pad' in spec
+        self.name = spec.get('name', '')
+        self.size = spec['pad'] if self.pad else spec['size']
+        self.count = 1 if self.pad else spec.get('count', 1)
+        self.bitmap = spec.get('bitmap', False)
+        self.array = spec.get('array', False)
+        self.relative = spec.get('relative', False)
+        self.usage_page = spec.get('usage_page')
+        self.usages = spec.get('usages', [spec['usage']] if 'usage' in spec else [])
+        self.usage_min = spec.get('usage_min')
+        self.usage_max = spec.get('usage_max')
+        self.logical_min = spec.get('logical_min', 0)
+        self.logical_max = spec.get('logical_max', (1 << self.size) - 1 if not self.pad else 0)
+        self.offset = 0  # bit offset of the first element, report ID included
+
+        where = '%s.%s' % (report, self.name or 'pad')
+        if not self.pad and not self.name:
+            raise SpecError('%s: field without name' % where)
+        if not 1 <= self.size <= 32:
+            raise SpecError('%s: size must be 1..32 bits' % where)
+        if self.bitmap and self.size * self.count > 32:
+            raise SpecError('%s: bitmap wider than 32 bits' % where)
+        if not self.pad and self.usage_page is None:
+            raise SpecError('%s: missing usage_page' % where)
+        if self.signed and self.logical_min < -(1 << (self.size - 1)):
+            raise SpecError('%s: logical_min does not fit in %i bits' % (where, self.size))
+        if self.logical_max >= (1 << (self.size - (1 if self.signed else 0))) and not self.pad:
+            raise SpecError('%s: logical_max does not fit in %i bits' % (where, self.size))
+
+    @property
+    def signed(self):
+        return self.logical_min < 0
+
+    @property
+    def flags(self):
+        if self.pad:
+            return FLAG_CONSTANT
+        return (0 if self.array else FLAG_VARIABLE) | (FLAG_RELATIVE if self.relative else 0)
+
+    def c_type(self, width=None):
+        width = width or (self.size * self.count if self.bitmap else self.size)
+        bits = 8 if width <= 8 else 16 if width <= 16 else 32
+        if self.size == 1 and self.count == 1 and not self.signed:
+            return 'bool'
+        return '%sint%i_t' % ('' if self.signed else 'u', bits)
+
+
+class Report:
+    def __init__(self, spec, collection):
+        self.name = spec['name']
+        self.type = spec.get('type', 'input')
+        self.id = spec.get('id', 0)
+        self.collection = collection['name']
+        self.when = collection.get('when')
+        if self.type not in MAIN_TAGS:
+            raise SpecError('%s: unknown report type %s' % (self.name, self.type))
+        if not 0 <= self.id <= 255:
+            raise SpecError('%s: report id must be 0..255' % self.name)
+
+        self.fields = [Field(f, self.name) for f in spec['fields']]
+        offset = 8 if self.id else 0
+        for field in self.fields:
+            field.offset = offset
+            offset += field.size * field.count
+        if offset % 8:
+            raise SpecError('%s: %i bits, pad it to a whole byte' % (self.name, offset))
+        self.bits = offset
+
+    @property
+    def size(self):
+        return self.bits // 8
+
+
+def load_spec(path):
+    with open(path) as fd:
+        spec = ast.literal_eval(fd.read())
+
+    collections = []
+    for collection in spec['collections']:
+        reports = [Report(r, collection) for r in collection['reports']]
+        collections.append((collection, reports))
+
+    reports = [r for _, rs in collections for r in rs]
+    ids = [r.id for r in reports]
+    if len(reports) > 1 and 0 in ids:
+        raise SpecError('every report needs an id once there is more than one')
+    if len(set((r.id, r.type) for r in reports)) != len(reports):
+        raise SpecError('duplicated report id')
+    return spec, collections, reports
+
+
+################################ descriptor ################################
+
+def item(prefix, value, signed=False):
+    if value is None:
+        return [prefix]
+    for size, code in ((1, 1), (2, 2), (4, 3)):
+        lo, hi = (-(1 << (size * 8 - 1)), (1 << (size * 8 - 1)) - 1) if signed else (0, (1 << (size * 8)) - 1)
+        if lo <= value <= hi:
+            data = value & ((1 << (size * 8)) - 1)
+            return [prefix | code] + [(data >> (8 * i)) & 0xff for i in range(size)]
+    raise SpecError('item value %i out of range' % value)
+
+
+def build_descriptor(collections):
+    """Returns a list of (bytes, comment, condition) lines"""
+    lines = []
+    state = {}
+    when = None
+
+    def add(data, comment):
+        lines.append((data, comment, when))
+
+    def global_item(key, prefix, value, signed=False):
+        if state.get(key) != value:
+            state[key] = value
+            add(item(prefix, value, signed), '%s (%i)' % (key, value))
+
+    for collection, reports in collections:
+        # the globals of a conditional collection may not be there, emit them again
+        if collection.get('when') or when:
+            state.clear()
+        when = collection.get('when')
+        global_item('USAGE_PAGE', ITEM_USAGE_PAGE, collection['usage_page'])
+        add(item(ITEM_USAGE, collection['usage']), 'USAGE (%#04x)' % collection['usage'])
+        add(item(ITEM_COLLECTION, 0x01), 'COLLECTION (Application)')
+        for report in reports:
+            if report.id:
+                global_item('REPORT_ID', ITEM_REPORT_ID, report.id)
+            for field in report.fields:
+                if not field.pad:
+                    global_item('USAGE_PAGE', ITEM_USAGE_PAGE, field.usage_page)
+                    global_item('LOGICAL_MINIMUM', ITEM_LOGICAL_MIN, field.logical_min, True)
+                    global_item('LOGICAL_MAXIMUM', ITEM_LOGICAL_MAX, field.logical_max, True)
+                global_item('REPORT_SIZE', ITEM_REPORT_SIZE, field.size)
+                global_item('REPORT_COUNT', ITEM_REPORT_COUNT, field.count)
+                for usage in field.usages:
+                    add(item(ITEM_USAGE, usage), '  USAGE (%#04x) %s' % (usage, field.name))
+                if field.usage_min is not None:
+                    add(item(ITEM_USAGE_MIN, field.usage_min), '  USAGE_MINIMUM (%#04x)' % field.usage_min)
+                    add(item(ITEM_USAGE_MAX, field.usage_max), '  USAGE_MAXIMUM (%#04x)' % field.usage_max)
+                add(item(MAIN_TAGS[report.type], field.flags),
+                    '%s (%#04x) %s' % (report.type.upper(), field.flags, field.name or 'padding'))
+        add(item(ITEM_END_COLLECTION, None), 'END_COLLECTION')
+    return lines
+
+
+################################ reference parser ################################
+
+def parse_descriptor(data):
+    """Independent item walker: {(report_id, type): [(offset, size, count, flags)]}"""
+    reports = {}
+    globals_ = {'size': 0, 'count': 0, 'id': 0}
+    stack = []
+    i = 0
+    while i < len(data):
+        prefix = data[i]
+        if prefix == 0xfe:
+            raise SpecError('long items are not supported')
+        size = (0, 1, 2, 4)[prefix & 3]
+        value = int.from_bytes(bytes(data[i + 1:i + 1 + size]), 'little')
+        tag = prefix & 0xfc
+        i += 1 + size
+
+        if tag == ITEM_REPORT_SIZE:
+            globals_['size'] = value
+        elif tag == ITEM_REPORT_COUNT:
+            globals_['count'] = value
+        elif tag == ITEM_REPORT_ID:
+            globals_['id'] = value
+        elif tag == ITEM_PUSH:
+            stack.append(dict(globals_))
+        elif tag == ITEM_POP:
+            globals_ = stack.pop()
+        elif tag in MAIN_NAMES:
+            key = (globals_['id'], MAIN_NAMES[tag])
+            fields = reports.setdefault(key, [])
+            offset = sum(s * c for _, s, c, _ in fields) + (8 if globals_['id'] else 0)
+            fields.append((offset, globals_['size'], globals_['count'], value))
+    return reports
+
+
+def conditions(lines):
+    return sorted(set(when for _, _, when in lines if when))
+
+
+def check_descriptor(lines, reports):
+    """Parses every #if combination, returns the layout with all of them on"""
+    macros = conditions(lines)
+    for variant in range(1 << len(macros)):
+        enabled = set(m for i, m in enumerate(macros) if variant & (1 << i))
+        descriptor = [b for data, _, when in lines if not when or when in enabled for b in data]
+        present = [r for r in reports if not r.when or r.when in enabled]
+
+        parsed = parse_descriptor(descriptor)
+        if len(parsed) != len(present):
+            raise SpecError('reference parser found %i reports, expected %i' % (len(parsed), len(present)))
+        for report in present:
+            expected = [(f.offset, f.size, f.count, f.flags) for f in report.fields]
+            if parsed.get((report.id, report.type)) != expected:
+                raise SpecError('%s: layout mismatch with the reference parser' % report.name)
+    return parsed
+
+
+################################ C code ################################
+
+def camel(name):
+    return ''.join(part.capitalize() for part in name.split('_'))
+
+
+def element_expr(field, index):
+    if field.bitmap or field.count == 1:
+        return 'report->%s' % field.name
+    return 'report->%s[%i]' % (field.name, index)
+
+
+def elements(field):
+    """(expression, bit offset, width) of each packed value"""
+    if field.bitmap:
+        return [(element_expr(field, 0), field.offset, field.size * field.count)]
+    return [(element_expr(field, i), field.offset + i * field.size, field.size) for i in range(field.count)]
+
+
+def mask(width):
+    return '%#x' % ((1 << width) - 1)
+
+
+def pack_byte(report, byte):
+    terms = []
+    for field in report.fields:
+        if field.pad:
+            continue
+        for expr, offset, width in elements(field):
+            lo, hi = max(offset, byte * 8), min(offset + width, byte * 8 + 8)
+            if lo >= hi:
+                continue
+            value = '(uint32_t) %s' % expr
+            if width not in (8, 16, 32) or field.signed:
+                value = '(%s & %s)' % (value, mask(width))
+            shift = offset - byte * 8
+            if shift > 0:
+                value = '(%s << %i)' % (value, shift)
+            elif shift < 0:
+                value = '(%s >> %i)' % (value, -shift)
+            terms.append(value)
+    if byte == 0 and report.id:
+        return 'HID_%s_REPORT_ID' % report.name.upper()
+    if not terms:
+        return '0'
+    return '(uint8_t) (%s)' % ' | '.join(terms)
+
+
+def unpack_element(field, expr, offset, width):
+    terms = []
+    for byte in range(offset // 8, (offset + width + 7) // 8):
+        shift = byte * 8 - offset
+        term = '(uint32_t) buffer[%i]' % byte
+        if shift > 0:
+            term = '(%s << %i)' % (term, shift)
+        elif shift < 0:
+            term = '(%s >> %i)' % (term, -shift)
+        terms.append(term)
+    value = ' | '.join(terms)
+    if offset % 8 or width % 8:
+        value = '(%s) & %s' % (value, mask(width))
+    if field.signed:
+        # sign extend without relying on shifts of negative numbers
+        sign = '%#x' % (1 << (width - 1))
+        value = '(int32_t) ((%s) ^ %s) - %s' % (value, sign, sign)
+    if field.c_type(width) == 'bool':
+        return '%s = %s;' % (expr, value)
+    return '%s = (%s) (%s);' % (expr, field.c_type(width), value)
+
+
+def generate(spec, collections, reports, spec_name):
+    output = spec['output']
+    guard = '%s_H_' % output.upper()
+    lines = build_descriptor(collections)
+    macros = conditions(lines)
+    size = ' + '.join(['%i' % sum(len(data) for data, _, when in lines if not when)] +
+                      ['(%s ? %i : 0)' % (m, sum(len(data) for data, _, when in lines if when == m)) for m in macros])
+
+    header = ['/*Generated by tools/hidgen.py from %s, do not edit*/' % spec_name, '',
+              '#ifndef %s' % guard, '#define %s' % guard, '',
+              '#include <stdint.h>', '#include <stdbool.h>', '#include <stddef.h>', '']
+    for macro in macros:
+        header += ['#ifndef %s' % macro, '#define %s 0' % macro, '#endif', '']
+    header += ['#define HID_REPORT_DESCRIPTOR_SIZE (%s)' % size if macros else '#define HID_REPORT_DESCRIPTOR_SIZE %s' % size,
+               'extern const uint8_t hid_report_descriptor[HID_REPORT_DESCRIPTOR_SIZE];', '']
+
+    source = ['/*Generated by tools/hidgen.py from %s, do not edit*/' % spec_name, '',
+              '#include "%s.h"' % output, '',
+              'const uint8_t hid_report_descriptor[HID_REPORT_DESCRIPTOR_SIZE] = {']
+    when = None
+    for data, comment, condition in lines:
+        if condition != when:
+            if when:
+                source.append('#endif')
+            if condition:
+                source.append('#if %s' % condition)
+            when = condition
+        source.append('    %-30s // %s' % (' '.join('0x%02x,' % b for b in data), comment))
+    if when:
+        source.append('#endif')
+    source.append('};')
+
+    for report in reports:
+        name = report.name
+        upper = name.upper()
+        struct = 'HID%sReport_t' % camel(name)
+
+        header.append('/*%s %s report, %i bytes*/' % (name, report.type, report.size))
+        if report.id:
+            header.append('#define HID_%s_REPORT_ID %i' % (upper, report.id))
+        header.append('#define HID_%s_REPORT_SIZE %i' % (upper, report.size))
+        header.append('typedef struct {')
+        for field in report.fields:
+            if field.pad:
+                continue
+            if field.bitmap or field.count == 1:
+                header.append('    %s %s;' % (field.c_type(), field.name))
+            else:
+                header.append('    %s %s[%i];' % (field.c_type(), field.name, field.count))
+        header.append('} %s;' % struct)
+        header.append('')
+        header.append('void hid_%s_pack(const %s *report, uint8_t buffer[HID_%s_REPORT_SIZE]);' % (name, struct, upper))
+        header.append('void hid_%s_unpack(%s *report, const uint8_t buffer[HID_%s_REPORT_SIZE]);' % (name, struct, upper))
+        header.append('')
+
+        source += ['', 'void hid_%s_pack(const %s *report, uint8_t buffer[HID_%s_REPORT_SIZE]) {' % (name, struct, upper)]
+        for byte in range(report.size):
+            source.append('    buffer[%i] = %s;' % (byte, pack_byte(report, byte)))
+        source.append('}')
+
+        source += ['', 'void hid_%s_unpack(%s *report, const uint8_t buffer[HID_%s_REPORT_SIZE]) {' % (name, struct, upper)]
+        for field in report.fields:
+            if not field.pad:
+                for expr, offset, width in elements(field):
+                    source.append('    %s' % unpack_element(field, expr, offset, width))
+        source.append('}')
+
+    header += ['#endif', '']
+    source.append('')
+    return lines, '\n'.join(header), '\n'.join(source)
+
+
+################################ self test ################################
+
+def reference_pack(layout, report_id, values):
+    """Packs element values with the layout from the reference parser"""
+    bits = 0
+    if report_id:
+        bits |= report_id
+    index = 0
+    for offset, size, count, flags in layout:
+        for i in range(count):
+            if not flags & FLAG_CONSTANT:
+                bits |= (values[index] & ((1 << size) - 1)) << (offset + i * size)
+                index += 1
+    return bits
+
+
+def selftest(src_dir, output, reports, parsed, rounds=64):
+    cc = os.environ.get('CC', 'cc')
+    if not shutil.which(cc):
+        print('hidgen: no host compiler, self test skipped')
+        return
+
+    rng = random.Random(1)
+    cases = []
+    main = ['#include <stdio.h>', '#include <string.h>', '#include "%s.h"' % output, 'int main(void) {']
+    for report in reports:
+        upper = report.name.upper()
+        struct = 'HID%sReport_t' % camel(report.name)
+        for n in range(rounds):
+            values = []
+            assigns = []
+            for field in report.fields:
+                if field.pad:
+                    continue
+                per = field.size * field.count if field.bitmap else field.size
+                lo, hi = (field.logical_min, field.logical_max) if not field.bitmap else (0, (1 << per) - 1)
+                for expr, _, _ in elements(field):
+                    v = rng.randint(lo, hi)
+                    assigns.append('r.%s = %i;' % (expr[len('report->'):], v))
+                    if field.bitmap:
+                        values += [(v >> (i * field.size)) & ((1 << field.size) - 1) for i in range(field.count)]
+                    else:
+                        values.append(v)
+            expected = reference_pack(parsed[(report.id, report.type)], report.id, values)
+            cases.append(expected.to_bytes(report.size, 'little'))
+            main += ['    {', '        %s r = {0}, u; uint8_t b[HID_%s_REPORT_SIZE], c[HID_%s_REPORT_SIZE];' % (struct, upper, upper),
+                     '        ' + ' '.join(assigns),
+                     '        hid_%s_pack(&r, b); hid_%s_unpack(&u, b); hid_%s_pack(&u, c);' % ((report.name,) * 3),
+                     '        if (memcmp(b, c, sizeof(b))) return 1;',
+                     '        for (size_t i = 0; i < sizeof(b); i++) printf("%02x", b[i]);',
+                     '        printf("\\n");', '    }']
+    main += ['    return 0;', '}']
+
+    with tempfile.TemporaryDirectory() as tmp:
+        test = os.path.join(tmp, 'test.c')
+        binary = os.path.join(tmp, 'test')
+        with open(test, 'w') as fd:
+            fd.write('\n'.join(main))
+        subprocess.check_call([cc, '-std=c99', '-Wall', '-Werror', '-I', src_dir, test,
+                               os.path.join(src_dir, output + '.c'), '-o', binary])
+        result = subprocess.run([binary], stdout=subprocess.PIPE, universal_newlines=True)
+        if result.returncode:
+            raise SpecError('unpack does not invert pack')
+        got = result.stdout.split()
+
+    for i, expected in enumerate(cases):
+        if got[i] != expected.hex():
+            raise SpecError('case %i: packed %s, reference %s' % (i, got[i], expected.hex()))
+    print('hidgen: %i reports match the reference parser' % len(cases))
+
+
+################################ main ################################
+
+def write_if_changed(path, content):
+    if os.path.exists(path):
+        with open(path) as fd:
+            if fd.read() == content:
+                return
+    with open(path, 'w') as fd:
+        fd.write(content)
+    print('hidgen: wrote %s' % path)
+
+
+def run(spec_path, src_dir, test=False):
+    spec, collections, reports = load_spec(spec_path)
+    lines, header, source = generate(spec, collections, reports, os.path.basename(spec_path))
+    parsed = check_descriptor(lines, reports)
+
+    write_if_changed(os.path.join(src_dir, spec['output'] + '.h'), header)
+    write_if_changed(os.path.join(src_dir, spec['output'] + '.c'), source)
+    if test:
+        selftest(src_dir, spec['output'], reports, parsed)
+
+
+def main():
+    tools = os.path.dirname(os.path.abspath(__file__))
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('spec', nargs='?', default=os.path.join(tools, 'hid_reports.spec'))
+    parser.add_argument('--src', default=os.path.join(tools, '..', 'src'))
+    parser.add_argument('--selftest', action='store_true', help='compile and check the generated code on the host')
+    args = parser.parse_args()
+
+    try:
+        run(args.spec, args.src, args.selftest)
+    except (SpecError, KeyError, subprocess.CalledProcessError) as e:
+        sys.exit('hidgen: %s' % e)
+
+
+if __name__ == '__main__':
+    main()
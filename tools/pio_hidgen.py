@@ -0,0 +1,16 @@
+# PlatformIO pre script: regenerates src/hid_reports.[ch] from the spec
+# before every build, files are only rewritten when they change
+import os
+import sys
+
+Import("env")
+
+tools = os.path.join(env.subst("$PROJECT_DIR"), "tools")
+sys.path.insert(0, tools)
+
+import hidgen
+
+try:
+    hidgen.run(os.path.join(tools, "hid_reports.spec"), env.subst("$PROJECT_SRC_DIR"))
+except hidgen.SpecError as e:
+    sys.exit("hidgen: %s" % e)
@@ -0,0 +1,51 @@
+# PlatformIO post script: once the elf is linked, lists the functions marked
+# USB_HOT in the sources with their size and whether they ended up in IRAM or
+# in flash, to compare the perf build with the debug one
+import os
+import re
+import subprocess
+
+Import("env")
+
+HOT = re.compile(r"\bUSB_HOT\s+\*?(\w+)\s*\(")
+
+IRAM = (0x40070000, 0x400a0000) # esp32 instruction ram, flash code maps at 0x400d0000
+
+
+def hot_functions(src_dir):
+    names = set()
+    for name in os.listdir(src_dir):
+        if name.endswith(".c"):
+            with open(os.path.join(src_dir, name)) as f:
+                names.update(HOT.findall(f.read()))
+    return names
+
+
+def symbols(nm, elf):
+    out = subprocess.run([nm, "-S", "--defined-only", elf], capture_output=True, text=True, check=True).stdout
+    table = {}
+    for line in out.splitlines():
+        fields = line.split()
+        if len(fields) == 4 and fields[2] in "tT":
+            table[fields[3]] = (int(fields[0], 16), int(fields[1], 16))
+    return table
+
+
+def report(source, target, env):
+    nm = env.subst("$CC").replace("gcc", "nm")
+    table = symbols(nm, str(target[0]))
+    sizes = {"iram": 0, "flash": 0}
+
+    print("Hot path (%s):" % env.subst("$PIOENV"))
+    for name in sorted(hot_functions(env.subst("$PROJECT_SRC_DIR"))):
+        if name not in table:
+            print("  %-36s inlined" % name)
+            continue
+        address, size = table[name]
+        region = "iram" if IRAM[0] <= address < IRAM[1] else "flash"
+        sizes[region] += size
+        print("  %-36s %6i %s" % (name, size, region))
+    print("  %i bytes in IRAM, %i bytes in flash" % (sizes["iram"], sizes["flash"]))
+
+
+env.AddPostAction("$BUILD_DIR/${PROGNAME}.elf", report)